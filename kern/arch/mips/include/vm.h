@@ -103,10 +103,14 @@
  * ram_stealmem can be used before ram_getsize is called to allocate
  * memory that cannot be freed later. This is intended for use early
  * in bootup before VM initialization is complete.
+ *
+ * ram_getfreemem returns how much memory ram_stealmem could still
+ * hand out. Like ram_stealmem, it is not synchronized.
  */
 
 void ram_bootstrap(void);
 paddr_t ram_stealmem(unsigned long npages);
+size_t ram_getfreemem(void);
 paddr_t ram_getsize(void);
 paddr_t ram_getfirstfree(void);
 
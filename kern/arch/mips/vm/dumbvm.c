@@ -126,6 +126,22 @@ free_kpages(vaddr_t addr)
 	(void)addr;
 }
 
+/*
+ * Report free memory. Since we never free anything, this only ever
+ * goes down.
+ */
+unsigned long
+vm_freepages(void)
+{
+	size_t freemem;
+
+	spinlock_acquire(&stealmem_lock);
+	freemem = ram_getfreemem();
+	spinlock_release(&stealmem_lock);
+
+	return freemem / PAGE_SIZE;
+}
+
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
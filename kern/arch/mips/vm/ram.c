@@ -109,6 +109,15 @@ ram_stealmem(unsigned long npages)
 	return paddr;
 }
 
+/*
+ * Return the amount of memory ram_stealmem can still allocate.
+ */
+size_t
+ram_getfreemem(void)
+{
+	return lastpaddr - firstpaddr;
+}
+
 /*
  * This function is intended to be called by the VM system when it
  * initializes in order to find out what memory it has available to
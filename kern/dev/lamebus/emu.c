@@ -52,6 +52,7 @@
 #include <lamebus/emu.h>
 #include <platform/bus.h>
 #include <vfs.h>
+#include <namecache.h>
 #include <emufs.h>
 #include "autoconf.h"
 
@@ -478,6 +479,10 @@ emufs_reclaim(struct vnode *v)
 	 */
 
 	lock_acquire(ef->ef_emu->e_lock);
+
+	/* Must come first so the name cache can't add a reference. */
+	namecache_purge(v);
+
 	spinlock_acquire(&ev->ev_v.vn_countlock);
 
 	if (ev->ev_v.vn_refcount > 1) {
@@ -749,6 +754,7 @@ emufs_creat(struct vnode *dir, const char *name, bool excl, mode_t mode,
 		emu_close(ev->ev_emu, handle);
 		return result;
 	}
+	namecache_remove(dir, name);
 
 	*ret = &newguy->ev_v;
 	return 0;
@@ -756,6 +762,12 @@ emufs_creat(struct vnode *dir, const char *name, bool excl, mode_t mode,
 
 /*
  * VOP_LOOKUP
+ *
+ * The emulator resolves the whole path at once, so the name cache
+ * is keyed on the whole (relative) path. Since nothing but creat
+ * changes names on emufs, that's safe for files that exist; misses
+ * are only cached for single names, which creat invalidates. Changes
+ * made on the host behind our back aren't noticed.
  */
 static
 int
@@ -764,13 +776,27 @@ emufs_lookup(struct vnode *dir, char *pathname, struct vnode **ret)
 	struct emufs_vnode *ev = dir->vn_data;
 	struct emufs_fs *ef = dir->vn_fs->fs_data;
 	struct emufs_vnode *newguy;
+	struct vnode *v;
 	uint32_t handle;
+	unsigned seq;
 	int result;
 	int isdir;
 
+	if (namecache_lookup(dir, pathname, &v)) {
+		if (v == NULL) {
+			return ENOENT;
+		}
+		*ret = v;
+		return 0;
+	}
+	seq = namecache_seq();
+
 	result = emu_open(ev->ev_emu, ev->ev_handle, pathname, false, false, 0,
 			  &handle, &isdir);
 	if (result) {
+		if (result == ENOENT && strchr(pathname, '/') == NULL) {
+			namecache_enter(dir, pathname, NULL, seq);
+		}
 		return result;
 	}
 
@@ -779,6 +805,7 @@ emufs_lookup(struct vnode *dir, char *pathname, struct vnode **ret)
 		emu_close(ev->ev_emu, handle);
 		return result;
 	}
+	namecache_enter(dir, pathname, &newguy->ev_v, seq);
 
 	*ret = &newguy->ev_v;
 	return 0;
@@ -1077,6 +1104,7 @@ static const struct vnode_ops emufs_fileops = {
 	.vop_readlink = emufs_readlink_notlink,
 	.vop_getdirentry = emufs_uio_op_notdir,
 	.vop_write = emufs_write,
+	.vop_directio = vnode_directio_passthru,
 	.vop_ioctl = emufs_ioctl,
 	.vop_stat = emufs_stat,
 	.vop_gettype = emufs_file_gettype,
@@ -1111,6 +1139,7 @@ static const struct vnode_ops emufs_dirops = {
 	.vop_readlink = emufs_uio_op_isdir,
 	.vop_getdirentry = emufs_getdirentry,
 	.vop_write = emufs_uio_op_isdir,
+	.vop_directio = emufs_uio_op_isdir,
 	.vop_ioctl = emufs_ioctl,
 	.vop_stat = emufs_stat,
 	.vop_gettype = emufs_dir_gettype,
@@ -36,9 +36,11 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <vm.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
+#include <iosched.h>
 #include <lamebus/lhd.h>
 #include "autoconf.h"
 
@@ -60,6 +62,9 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Largest bounce buffer for I/O to/from user memory, in sectors */
+#define LHD_BOUNCESECT  16
+
 /*
  * Shortcut for reading a register.
  */
@@ -96,15 +101,83 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start the transfer of the next sector of REQ, the request the
+ * scheduler has given us.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh, struct ioreq *req)
+{
+	uint32_t statval = LHD_WORKING;
+	char *data = req->ir_data;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(req->ir_cursect < req->ir_nsect);
+
+	/*
+	 * Are we writing? If so, transfer the data to the on-card
+	 * buffer.
+	 */
+	if (req->ir_write) {
+		memcpy(lh->lh_buf, data + req->ir_cursect*LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, req->ir_sector + req->ir_cursect);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Record that a sector has completed. If the request in progress has
+ * more sectors to go, start the next one; otherwise retire it, wake
+ * its owner, and start whatever the scheduler picks next. Either way
+ * the disk goes straight on without waiting for a thread to run.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct ioreq *req;
+	char *data;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	req = iosched_current(lh->lh_sched);
+	if (req == NULL) {
+		/* Spurious; nothing was in progress. */
+		return;
+	}
+	data = req->ir_data;
+
+	/*
+	 * Are we reading? If so, and if we succeeded, transfer the
+	 * data out of the on-card buffer.
+	 */
+	if (err == 0 && !req->ir_write) {
+		membar_load_load();
+		memcpy(data + req->ir_cursect*LHD_SECTSIZE,
+		       lh->lh_buf, LHD_SECTSIZE);
+	}
+
+	req->ir_cursect++;
+	if (err == 0 && req->ir_cursect < req->ir_nsect) {
+		lhd_start(lh, req);
+		return;
+	}
+
+	req->ir_result = err;
+	req->ir_done = true;
+	wchan_wakeall(lh->lh_wchan, &lh->lh_lock);
+
+	req = iosched_done(lh->lh_sched, req);
+	if (req != NULL) {
+		lhd_start(lh, req);
+	}
 }
 
 /*
@@ -118,6 +191,8 @@ lhd_irq(void *vlh)
 	struct lhd_softc *lh = vlh;
 	uint32_t val;
 
+	spinlock_acquire(&lh->lh_lock);
+
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
@@ -131,6 +206,8 @@ lhd_irq(void *vlh)
 		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
 	}
+
+	spinlock_release(&lh->lh_lock);
 }
 
 /*
@@ -179,8 +256,73 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Queue a request for NSECT sectors starting at SECTOR, to or from
+ * the kernel buffer DATA, and wait for it to finish.
+ */
+static
+int
+lhd_request(struct lhd_softc *lh, void *data, uint32_t sector,
+	    uint32_t nsect, bool write)
+{
+	struct ioreq req, *start;
+
+	req.ir_data = data;
+	req.ir_sector = sector;
+	req.ir_nsect = nsect;
+	req.ir_write = write;
+	req.ir_done = false;
+
+	spinlock_acquire(&lh->lh_lock);
+	start = iosched_add(lh->lh_sched, &req);
+	if (start != NULL) {
+		/* Disk was idle. */
+		lhd_start(lh, start);
+	}
+	while (!req.ir_done) {
+		wchan_sleep(lh->lh_wchan, &lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	return req.ir_result;
+}
+
+/*
+ * Check if the interrupt handler can use UIO's buffers directly: they
+ * have to be in the kernel (not just claimed to be; the handler can't
+ * touch user memory, and a UIO_SYSSPACE uio over a user address is an
+ * easy mistake to make) and a whole number of sectors each.
+ */
+static
+bool
+lhd_directok(struct uio *uio)
+{
+	struct iovec *iov;
+	vaddr_t base;
+	unsigned i;
+
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return false;
+	}
+	for (i=0; i<uio->uio_iovcnt; i++) {
+		iov = &uio->uio_iov[i];
+		if (iov->iov_len == 0) {
+			continue;
+		}
+		base = (vaddr_t)iov->iov_kbase;
+		if (base < USERSPACETOP || base + iov->iov_len < base ||
+		    iov->iov_len % LHD_SECTSIZE != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * Kernel buffers are handed to the interrupt handler directly, one
+ * request per iovec. Anything else goes through a bounce buffer.
  */
 static
 int
@@ -192,8 +334,10 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	bool write = uio->uio_rw == UIO_WRITE;
+	struct iovec *iov;
+	uint32_t nsect;
+	char *bounce;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -207,61 +351,74 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
-	}
-
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	if (lhd_directok(uio)) {
+		while (uio->uio_resid > 0) {
+			KASSERT(uio->uio_iovcnt > 0);
+			iov = uio->uio_iov;
+			if (iov->iov_len == 0) {
+				uio->uio_iov++;
+				uio->uio_iovcnt--;
+				continue;
+			}
+			nsect = iov->iov_len / LHD_SECTSIZE;
+			if (nsect > len) {
+				nsect = len;
+			}
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
+			result = lhd_request(lh, iov->iov_kbase, sector,
+					     nsect, write);
 			if (result) {
-				V(lh->lh_clear);
 				return result;
 			}
-		}
-
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
 
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+			/* Advance the uio as uiomove would. */
+			iov->iov_kbase = (char *)iov->iov_kbase
+				+ nsect*LHD_SECTSIZE;
+			iov->iov_len -= nsect*LHD_SECTSIZE;
+			uio->uio_offset += nsect*LHD_SECTSIZE;
+			uio->uio_resid -= nsect*LHD_SECTSIZE;
+			sector += nsect;
+			len -= nsect;
 		}
+		return 0;
+	}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
+	nsect = len < LHD_BOUNCESECT ? len : LHD_BOUNCESECT;
+	if (nsect == 0) {
+		return 0;
+	}
+	bounce = kmalloc(nsect*LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
 
-		/* If we failed, return the error. */
+	result = 0;
+	while (len > 0) {
+		if (nsect > len) {
+			nsect = len;
+		}
+		if (write) {
+			result = uiomove(bounce, nsect*LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
+		}
+		result = lhd_request(lh, bounce, sector, nsect, write);
 		if (result) {
-			return result;
+			break;
 		}
+		if (!write) {
+			result = uiomove(bounce, nsect*LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
+		}
+		sector += nsect;
+		len -= nsect;
 	}
 
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
@@ -276,23 +433,23 @@ static const struct device_ops lhd_devops = {
 int
 config_lhd(struct lhd_softc *lh, int lhdno)
 {
-	char name[32];
-
 	/* Figure out what our name is. */
-	snprintf(name, sizeof(name), "lhd%d", lhdno);
+	snprintf(lh->lh_name, sizeof(lh->lh_name), "lhd%d", lhdno);
 
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
+	/* Set up the request queue. */
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
 		return ENOMEM;
 	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	spinlock_init(&lh->lh_lock);
+	lh->lh_sched = iosched_create(lh->lh_name, &lh->lh_lock);
+	if (lh->lh_sched == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
+		wchan_destroy(lh->lh_wchan);
+		lh->lh_wchan = NULL;
 		return ENOMEM;
 	}
 
@@ -304,5 +461,5 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	lh->lh_dev.d_data = lh;
 
 	/* Add the VFS device structure to the VFS device list. */
-	return vfs_adddev(name, &lh->lh_dev, 1);
+	return vfs_adddev(lh->lh_name, &lh->lh_dev, 1);
 }
@@ -30,8 +30,11 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
+struct iosched; /* iosched.h */
+
 /*
  * Our sector size
  */
@@ -51,9 +54,10 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the queue and device */
+	struct wchan *lh_wchan;		/* Requesters sleep here */
+	struct iosched *lh_sched;	/* Request queue */
+	char lh_name[16];		/* Our name, for lh_sched */
 
 	struct device lh_dev;		/* VFS device structure */
 };
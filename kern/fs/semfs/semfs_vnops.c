@@ -658,6 +658,7 @@ static const struct vnode_ops semfs_dirops = {
 	.vop_readlink = vopfail_uio_isdir,
 	.vop_getdirentry = semfs_getdirentry,
 	.vop_write = vopfail_uio_isdir,
+	.vop_directio = vopfail_uio_isdir,
 	.vop_ioctl = semfs_ioctl,
 	.vop_stat = semfs_dirstat,
 	.vop_gettype = semfs_gettype,
@@ -691,6 +692,7 @@ static const struct vnode_ops semfs_semops = {
 	.vop_readlink = vopfail_uio_inval,
 	.vop_getdirentry = vopfail_uio_notdir,
 	.vop_write = semfs_write,
+	.vop_directio = vnode_directio_passthru,
 	.vop_ioctl = semfs_ioctl,
 	.vop_stat = semfs_semstat,
 	.vop_gettype = semfs_gettype,
@@ -33,6 +33,7 @@
  * Block allocation.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <synch.h>
@@ -40,6 +41,32 @@
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Blocks for file contents are placed right after the previous block
+ * allocated for the same file (sv_allocgoal) if possible, so files
+ * written at the same time don't get interleaved on disk. To help
+ * that along, when we have to go looking for space for a file we
+ * take up to SFS_PREALLOC free blocks in a row and keep the extra
+ * ones for the file's next blocks. The preallocated blocks are
+ * marked in use in the freemap and handed back when the vnode is
+ * reclaimed or truncated, if the file is written somewhere else, or
+ * if we run out of space. After a crash sfsck frees any that made it
+ * to disk.
+ *
+ * Files whose data is waiting for delayed allocation (see sfs_io.c)
+ * reserve the blocks it will need ahead of time, so there's room for
+ * it when it's finally written out. sfs_nfree counts the free blocks
+ * and sfs_reserved how many of them are spoken for; allocations for
+ * anything else leave that many free.
+ *
+ * The preallocation and reservation fields of the vnode, the list of
+ * vnodes with preallocated blocks, and the counts are all protected
+ * by sfs_freemaplock.
+ */
+
+/* Number of blocks to take at once for a file */
+#define SFS_PREALLOC		8
+
 /*
  * Zero out a disk block.
  *
@@ -73,6 +100,146 @@ sfs_clearblock(struct sfs_fs *sfs, daddr_t block, struct buf **bufret)
 	return 0;
 }
 
+/*
+ * Add a vnode to, or remove it from, the list of vnodes with
+ * preallocated blocks.
+ */
+static
+void
+sfs_prealloc_link(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	sv->sv_pa_prev = NULL;
+	sv->sv_pa_next = sfs->sfs_prealloc;
+	if (sv->sv_pa_next != NULL) {
+		sv->sv_pa_next->sv_pa_prev = sv;
+	}
+	sfs->sfs_prealloc = sv;
+}
+
+static
+void
+sfs_prealloc_unlink(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	if (sv->sv_pa_prev != NULL) {
+		sv->sv_pa_prev->sv_pa_next = sv->sv_pa_next;
+	}
+	else {
+		KASSERT(sfs->sfs_prealloc == sv);
+		sfs->sfs_prealloc = sv->sv_pa_next;
+	}
+	if (sv->sv_pa_next != NULL) {
+		sv->sv_pa_next->sv_pa_prev = sv->sv_pa_prev;
+	}
+	sv->sv_pa_next = sv->sv_pa_prev = NULL;
+}
+
+/*
+ * Give back a vnode's preallocated blocks.
+ */
+static
+void
+sfs_prealloc_drop(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	KASSERT(sv->sv_pa_count > 0);
+
+	for (i=0; i<sv->sv_pa_count; i++) {
+		bitmap_unmark(sfs->sfs_freemap, sv->sv_pa_start + i);
+	}
+	sfs->sfs_nfree += sv->sv_pa_count;
+	sfs->sfs_freemapdirty = true;
+	sv->sv_pa_count = 0;
+	sfs_prealloc_unlink(sfs, sv);
+}
+
+/*
+ * Make sure there are more than RESERVED free blocks, taking back
+ * everyone's preallocated blocks if that's what it takes.
+ */
+static
+bool
+sfs_bavail(struct sfs_fs *sfs, uint32_t reserved)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	while (sfs->sfs_nfree <= reserved && sfs->sfs_prealloc != NULL) {
+		sfs_prealloc_drop(sfs, sfs->sfs_prealloc);
+	}
+	return sfs->sfs_nfree > reserved;
+}
+
+/*
+ * Find and mark a free block, preferably GOAL or soon after it, and
+ * then up to MAXRUN-1 more free blocks right after it. If GOAL isn't
+ * free, look for MAXRUN free blocks in a row past it before settling
+ * for fewer. Returns the first block and the number of blocks taken.
+ * OWNRESERVED of the reserved blocks belong to the caller and may be
+ * used.
+ */
+static
+int
+sfs_balloc_run(struct sfs_fs *sfs, daddr_t goal, unsigned maxrun,
+	       uint32_t ownreserved, daddr_t *diskblock, unsigned *runlen)
+{
+	uint32_t nblocks = sfs->sfs_sb.sb_nblocks;
+	uint32_t others;
+	daddr_t block;
+	bool found = false;
+	unsigned n;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	KASSERT(ownreserved <= sfs->sfs_reserved);
+
+	others = sfs->sfs_reserved - ownreserved;
+	if (!sfs_bavail(sfs, others)) {
+		return ENOSPC;
+	}
+
+	n = 1;
+	if (goal != 0 && goal < nblocks) {
+		if (!bitmap_isset(sfs->sfs_freemap, goal)) {
+			bitmap_mark(sfs->sfs_freemap, goal);
+			block = goal;
+			found = true;
+		}
+		else if (maxrun > 1 && sfs->sfs_nfree - others >= maxrun &&
+			 bitmap_alloc_range(sfs->sfs_freemap, maxrun, goal,
+					    &block) == 0) {
+			n = maxrun;
+			found = true;
+		}
+		else if (bitmap_alloc_range(sfs->sfs_freemap, 1, goal,
+					    &block) == 0) {
+			found = true;
+		}
+	}
+
+	if (!found) {
+		result = bitmap_alloc(sfs->sfs_freemap, &block);
+		if (result) {
+			return result;
+		}
+	}
+	sfs->sfs_nfree -= n;
+
+	for (; n < maxrun && block + n < nblocks; n++) {
+		if (sfs->sfs_nfree <= others ||
+		    bitmap_isset(sfs->sfs_freemap, block + n)) {
+			break;
+		}
+		bitmap_mark(sfs->sfs_freemap, block + n);
+		sfs->sfs_nfree--;
+	}
+	sfs->sfs_freemapdirty = true;
+
+	*diskblock = block;
+	*runlen = n;
+	return 0;
+}
+
 /*
  * Allocate a block.
  *
@@ -85,16 +252,17 @@ sfs_clearblock(struct sfs_fs *sfs, daddr_t block, struct buf **bufret)
 int
 sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock, struct buf **bufret)
 {
+	unsigned n;
 	int result;
 
 	lock_acquire(sfs->sfs_freemaplock);
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	result = sfs_balloc_run(sfs, 0, 1, 0, diskblock, &n);
 	if (result) {
 		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	KASSERT(n == 1);
 
 	lock_release(sfs->sfs_freemaplock);
 
@@ -106,13 +274,167 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock, struct buf **bufret)
 	/* Clear block before returning it */
 	result = sfs_clearblock(sfs, *diskblock, bufret);
 	if (result) {
-		lock_acquire(sfs->sfs_freemaplock);
-		bitmap_unmark(sfs->sfs_freemap, *diskblock);
-		lock_release(sfs->sfs_freemaplock);
+		sfs_bfree(sfs, *diskblock);
 	}
 	return result;
 }
 
+/*
+ * Allocate a block for the contents (or indirect blocks) of file SV,
+ * near its other blocks. The block is zeroed. If the file has blocks
+ * reserved, they're used first, and we try to take as many in a row
+ * as it has reserved.
+ *
+ * Locking: must hold the vnode lock. Gets/releases sfs_freemaplock.
+ *
+ * Uses 1 buffer.
+ */
+int
+sfs_balloc_file(struct sfs_vnode *sv, daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t goal, block;
+	unsigned maxrun, n;
+	int result;
+
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
+	goal = sv->sv_allocgoal != 0 ? sv->sv_allocgoal : sv->sv_ino + 1;
+
+	lock_acquire(sfs->sfs_freemaplock);
+
+	if (sv->sv_pa_count > 0 && sv->sv_pa_start == goal) {
+		/* Next block is already set aside */
+		block = sv->sv_pa_start;
+		sv->sv_pa_start++;
+		sv->sv_pa_count--;
+		if (sv->sv_pa_count == 0) {
+			sfs_prealloc_unlink(sfs, sv);
+		}
+	}
+	else {
+		if (sv->sv_pa_count > 0) {
+			/* Not writing where we expected; start over */
+			sfs_prealloc_drop(sfs, sv);
+		}
+		maxrun = SFS_PREALLOC;
+		if (sv->sv_dareserved > maxrun) {
+			maxrun = sv->sv_dareserved;
+		}
+		result = sfs_balloc_run(sfs, goal, maxrun, sv->sv_dareserved,
+					&block, &n);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+		if (n > sv->sv_dareserved) {
+			sfs->sfs_reserved -= sv->sv_dareserved;
+			sv->sv_dareserved = 0;
+		}
+		else {
+			sfs->sfs_reserved -= n;
+			sv->sv_dareserved -= n;
+		}
+		if (n > 1) {
+			sv->sv_pa_start = block + 1;
+			sv->sv_pa_count = n - 1;
+			sfs_prealloc_link(sfs, sv);
+		}
+	}
+
+	lock_release(sfs->sfs_freemaplock);
+
+	if (block >= sfs->sfs_sb.sb_nblocks) {
+		panic("sfs: %s: balloc: invalid block %u\n",
+		      sfs->sfs_sb.sb_volname, block);
+	}
+
+	/* Clear block before returning it */
+	result = sfs_clearblock(sfs, block, NULL);
+	if (result) {
+		sfs_bfree(sfs, block);
+		return result;
+	}
+
+	sv->sv_allocgoal = block + 1;
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * Give back any blocks preallocated for SV.
+ */
+void
+sfs_prealloc_release(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sv->sv_pa_count > 0) {
+		sfs_prealloc_drop(sfs, sv);
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Reserve NUM free blocks for file SV's delayed-allocation data.
+ * Fails with ENOSPC if there aren't enough that aren't already
+ * reserved.
+ */
+int
+sfs_breserve(struct sfs_vnode *sv, unsigned num)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	KASSERT(num > 0);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (!sfs_bavail(sfs, sfs->sfs_reserved + num - 1)) {
+		lock_release(sfs->sfs_freemaplock);
+		return ENOSPC;
+	}
+	sfs->sfs_reserved += num;
+	sv->sv_dareserved += num;
+	lock_release(sfs->sfs_freemaplock);
+	return 0;
+}
+
+/*
+ * Give back NUM (or, if more, all) of the blocks reserved for SV.
+ */
+void
+sfs_bunreserve(struct sfs_vnode *sv, unsigned num)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (num > sv->sv_dareserved) {
+		num = sv->sv_dareserved;
+	}
+	KASSERT(num <= sfs->sfs_reserved);
+	sfs->sfs_reserved -= num;
+	sv->sv_dareserved -= num;
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Count the free blocks, after loading the freemap at mount time.
+ */
+void
+sfs_bcount(struct sfs_fs *sfs)
+{
+	uint32_t i;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	sfs->sfs_nfree = 0;
+	for (i=0; i<sfs->sfs_sb.sb_nblocks; i++) {
+		if (!bitmap_isset(sfs->sfs_freemap, i)) {
+			sfs->sfs_nfree++;
+		}
+	}
+}
+
 /*
  * Free a block, for when we already have the freemap locked.
  */
@@ -122,6 +444,7 @@ sfs_bfree_prelocked(struct sfs_fs *sfs, daddr_t diskblock)
 	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
 
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
+	sfs->sfs_nfree++;
 	sfs->sfs_freemapdirty = true;
 }
 
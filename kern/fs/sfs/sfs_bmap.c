@@ -379,7 +379,7 @@ sfs_blockobj_set(struct sfs_blockobj *bo, uint32_t offset, uint32_t newval)
  */
 static
 int
-sfs_bmap_get(struct sfs_fs *sfs, struct sfs_blockobj *bo, uint32_t offset,
+sfs_bmap_get(struct sfs_vnode *sv, struct sfs_blockobj *bo, uint32_t offset,
 	     bool doalloc, daddr_t *diskblock_ret)
 {
 	daddr_t block;
@@ -394,7 +394,7 @@ sfs_bmap_get(struct sfs_fs *sfs, struct sfs_blockobj *bo, uint32_t offset,
 	 * Do we need to allocate?
 	 */
 	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block, NULL);
+		result = sfs_balloc_file(sv, &block);
 		if (result) {
 			return result;
 		}
@@ -434,6 +434,7 @@ sfs_bmap_subtree(struct sfs_fs *sfs, struct sfs_blockobj *inodeobj,
 		 uint32_t offset, bool doalloc,
 		 daddr_t *diskblock_ret)
 {
+	struct sfs_vnode *sv = inodeobj->bo_inode.i_sv;
 	daddr_t block;
 	struct buf *idbuf;
 	uint32_t idoff;
@@ -442,7 +443,7 @@ sfs_bmap_subtree(struct sfs_fs *sfs, struct sfs_blockobj *inodeobj,
 	int result;
 
 	/* Get the block inodeobj immediately points to (maybe allocating) */
-	result = sfs_bmap_get(sfs, inodeobj, 0, doalloc, &block);
+	result = sfs_bmap_get(sv, inodeobj, 0, doalloc, &block);
 	if (result) {
 		return result;
 	}
@@ -485,11 +486,35 @@ sfs_bmap_subtree(struct sfs_fs *sfs, struct sfs_blockobj *inodeobj,
 		if (result) {
 			return result;
 		}
+		if (doalloc) {
+			/* we may change it; fsync needs to find it */
+			buffer_set_owner(idbuf,
+					 &inodeobj->bo_inode.i_sv->sv_absvn);
+		}
 
 		sfs_blockobj_init_idblock(&idobj, idbuf);
 
+		/*
+		 * If the entries here are indirect blocks too and
+		 * we're at the start of the one we want, a sequential
+		 * reader will want the next one after it soon; start
+		 * reading it now. (Failure just means we don't.)
+		 */
+		if (!doalloc && indir >= 2 && offset == 0 &&
+		    idoff + 1 < SFS_DBPERIDB) {
+			daddr_t nextblock;
+
+			nextblock = sfs_blockobj_get(&idobj, idoff + 1);
+			if (nextblock != 0) {
+				(void)buffer_read_async(&sfs->sfs_absfs,
+							nextblock,
+							SFS_BLOCKSIZE,
+							NULL, NULL, NULL);
+			}
+		}
+
 		/* Get the address of the next layer down (maybe allocating) */
-		result = sfs_bmap_get(sfs, &idobj, idoff, doalloc, &block);
+		result = sfs_bmap_get(sv, &idobj, idoff, doalloc, &block);
 
 		sfs_blockobj_cleanup(&idobj);
 		buffer_release(idbuf);
@@ -523,9 +548,26 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	struct sfs_subtreeref subtree;
 	uint32_t offset;
 	struct sfs_blockobj inodeobj;
+	daddr_t prevblock;
 	int result;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
+	KASSERT(!doalloc || rwlock_do_i_hold_write(sv->sv_lock));
+
+	/*
+	 * If we might allocate and don't know where this file's blocks
+	 * go yet, start after the block before this one, if there is
+	 * one, or else after the inode. (See sfs_balloc_file.)
+	 */
+	if (doalloc && sv->sv_allocgoal == 0) {
+		sv->sv_allocgoal = sv->sv_ino + 1;
+		if (fileblock > 0) {
+			result = sfs_bmap(sv, fileblock - 1, false, &prevblock);
+			if (result == 0 && prevblock != 0) {
+				sv->sv_allocgoal = prevblock + 1;
+			}
+		}
+	}
 
 	/* Figure out where to start */
 	result = sfs_get_indirection(fileblock, &subtree, &offset);
@@ -539,6 +581,10 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		return result;
 	}
 
+	/* Inline files have no blocks; sfs_inline_unpack comes first */
+	KASSERT(!doalloc ||
+		(sfs_dinode_map(sv)->sfi_flags & SFS_DINODE_INLINE) == 0);
+
 	/* Initialize inodeobj to point at the top of this subtree */
 	sfs_blockobj_init_inode(&inodeobj, sv, &subtree);
 
@@ -699,6 +745,7 @@ sfs_itrunc_readindir(struct sfs_vnode *sv, struct layerinfo *layers,
 			layer, layers[layer].block, strerror(result));
 		return result;
 	}
+	buffer_set_owner(layers[layer].buf, &sv->sv_absvn);
 	layers[layer].modified = false;
 	return 0;
 }
@@ -1074,7 +1121,7 @@ sfs_itrunc(struct sfs_vnode *sv, off_t newlen)
 	uint32_t oldblocklen, newblocklen;
 	int result;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
 
 	result = sfs_dinode_load(sv);
 	if (result) {
@@ -1082,6 +1129,37 @@ sfs_itrunc(struct sfs_vnode *sv, off_t newlen)
 	}
 	inodeptr = sfs_dinode_map(sv);
 
+	/*
+	 * An inline file just needs the data past the new end zeroed,
+	 * unless it's growing too big to stay inline.
+	 */
+	if (inodeptr->sfi_flags & SFS_DINODE_INLINE) {
+		if (newlen <= SFS_INLINE_SIZE) {
+			if (newlen < inodeptr->sfi_size) {
+				bzero(inodeptr->sfi_inline + newlen,
+				      inodeptr->sfi_size - newlen);
+			}
+			inodeptr->sfi_size = newlen;
+			sfs_dinode_mark_dirty(sv);
+			sfs_dinode_unload(sv);
+			return 0;
+		}
+		result = sfs_inline_unpack(sv);
+		if (result) {
+			sfs_dinode_unload(sv);
+			return result;
+		}
+	}
+
+	/*
+	 * Give back any preallocated blocks and forget the allocation
+	 * goal; it may point past the new end of the file. Drop any
+	 * delayed data past the end too.
+	 */
+	sfs_prealloc_release(sv);
+	sv->sv_allocgoal = 0;
+	sfs_delalloc_truncate(sv, newlen);
+
 	/* Length in blocks (divide rounding up) */
 	oldblocklen = DIVROUNDUP(inodeptr->sfi_size, SFS_BLOCKSIZE);
 	newblocklen = DIVROUNDUP(newlen, SFS_BLOCKSIZE);
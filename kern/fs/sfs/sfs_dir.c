@@ -40,6 +40,565 @@
 #include <sfs.h>
 #include "sfsprivate.h"
 
+////////////////////////////////////////////////////////////
+// Hashed index
+
+/*
+ * Large directories get an on-disk hash index of (name hash, slot)
+ * pairs so lookups don't have to read the whole directory; see
+ * kern/sfs.h for the format. The index is kept up to date by
+ * sfs_writedir, which every change to a directory goes through, and
+ * is built the first time something is linked into a large directory
+ * that doesn't have one. If the directory outgrows the biggest index
+ * we can make, or anything goes wrong with the index, it's dropped
+ * and the directory goes back to being searched linearly.
+ *
+ * The index blocks are held while reading directory entries, so
+ * these use up to 2 buffers more than the directory ops that call
+ * them.
+ */
+
+/* Cursor for walking the hash table */
+struct sfs_dirindex_pos {
+	struct buf *ip_buf;		/* table block, or NULL */
+	unsigned ip_which;		/* which table block it is */
+};
+
+/*
+ * Hash a name.
+ */
+static
+uint32_t
+sfs_dirhash(const char *name)
+{
+	uint32_t hash = SFS_DIRINDEX_FNVBASIS;
+
+	while (*name != 0) {
+		hash ^= (unsigned char)*name++;
+		hash *= SFS_DIRINDEX_FNVPRIME;
+	}
+	return hash;
+}
+
+/*
+ * Get (or set) the index header block number from the inode.
+ */
+static
+int
+sfs_dirindex_getblock(struct sfs_vnode *sv, daddr_t *ret)
+{
+	int result;
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		return result;
+	}
+	*ret = sfs_dinode_map(sv)->sfi_dirindex;
+	sfs_dinode_unload(sv);
+	return 0;
+}
+
+static
+int
+sfs_dirindex_setblock(struct sfs_vnode *sv, daddr_t block)
+{
+	int result;
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		return result;
+	}
+	sfs_dinode_map(sv)->sfi_dirindex = block;
+	sfs_dinode_mark_dirty(sv);
+	sfs_dinode_unload(sv);
+	return 0;
+}
+
+/*
+ * Read the index header. Returns ENOENT if there's no index.
+ */
+static
+int
+sfs_dirindex_load(struct sfs_vnode *sv, struct buf **bufret,
+		  struct sfs_dirindex_header **dhret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dirindex_header *dh;
+	daddr_t block;
+	int result;
+
+	result = sfs_dirindex_getblock(sv, &block);
+	if (result) {
+		return result;
+	}
+	if (block == 0) {
+		return ENOENT;
+	}
+
+	result = buffer_read(&sfs->sfs_absfs, block, SFS_BLOCKSIZE, bufret);
+	if (result) {
+		return result;
+	}
+	dh = buffer_map(*bufret);
+	if (dh->dh_magic != SFS_DIRINDEX_MAGIC ||
+	    dh->dh_nblocks == 0 || dh->dh_nblocks > SFS_DIRINDEX_MAXBLOCKS ||
+	    dh->dh_nfree > SFS_DIRINDEX_NFREE) {
+		kprintf("sfs: %s: directory %u: bad index header; "
+			"not using it\n", sfs->sfs_sb.sb_volname, sv->sv_ino);
+		buffer_release(*bufret);
+		/*
+		 * sfsck will pick up the blocks. Under a read lock
+		 * (lookup) we can't change the inode; just search
+		 * linearly, and the next writer will drop it.
+		 */
+		if (rwlock_do_i_hold_write(sv->sv_lock)) {
+			sfs_dirindex_setblock(sv, 0);
+		}
+		return ENOENT;
+	}
+	*dhret = dh;
+	return 0;
+}
+
+/*
+ * Get the pair at position POS in the table.
+ */
+static
+int
+sfs_dirindex_entry(struct sfs_vnode *sv, struct sfs_dirindex_header *dh,
+		   struct sfs_dirindex_pos *ip, unsigned pos,
+		   struct sfs_dirindex_entry **ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	unsigned which;
+	int result;
+
+	which = pos / SFS_DIRINDEX_PERBLOCK;
+	KASSERT(which < dh->dh_nblocks);
+	if (ip->ip_buf != NULL && ip->ip_which != which) {
+		buffer_release(ip->ip_buf);
+		ip->ip_buf = NULL;
+	}
+	if (ip->ip_buf == NULL) {
+		result = buffer_read(&sfs->sfs_absfs, dh->dh_blocks[which],
+				     SFS_BLOCKSIZE, &ip->ip_buf);
+		if (result) {
+			return result;
+		}
+		ip->ip_which = which;
+	}
+	*ret = (struct sfs_dirindex_entry *)buffer_map(ip->ip_buf)
+		+ pos % SFS_DIRINDEX_PERBLOCK;
+	return 0;
+}
+
+/*
+ * Mark the table block under the cursor (and the header) modified.
+ */
+static
+void
+sfs_dirindex_dirty(struct sfs_vnode *sv, struct buf *hbuf,
+		   struct sfs_dirindex_pos *ip)
+{
+	buffer_set_owner(hbuf, &sv->sv_absvn);
+	buffer_mark_dirty(hbuf);
+	if (ip != NULL) {
+		buffer_set_owner(ip->ip_buf, &sv->sv_absvn);
+		buffer_mark_dirty(ip->ip_buf);
+	}
+}
+
+/*
+ * Look up NAME in the index. Hands back its inode number and slot,
+ * or returns ENOENT.
+ */
+static
+int
+sfs_dirindex_find(struct sfs_vnode *sv, struct sfs_dirindex_header *dh,
+		  const char *name, uint32_t *ino, int *slot)
+{
+	struct sfs_dirindex_pos ip;
+	struct sfs_dirindex_entry *de;
+	struct sfs_direntry tsd;
+	uint32_t hash;
+	unsigned cap, pos, n;
+	int result;
+
+	hash = sfs_dirhash(name);
+	cap = dh->dh_nblocks * SFS_DIRINDEX_PERBLOCK;
+	pos = hash % cap;
+	ip.ip_buf = NULL;
+
+	result = ENOENT;
+	for (n=0; n<cap; n++) {
+		result = sfs_dirindex_entry(sv, dh, &ip, pos, &de);
+		if (result) {
+			break;
+		}
+		result = ENOENT;
+		if (de->de_slot == SFS_DIRINDEX_EMPTY) {
+			break;
+		}
+		if (de->de_slot != SFS_DIRINDEX_DELETED &&
+		    de->de_hash == hash) {
+			result = sfs_readdir(sv, de->de_slot - 1, &tsd);
+			if (result) {
+				break;
+			}
+			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+			if (tsd.sfd_ino != SFS_NOINO &&
+			    !strcmp(tsd.sfd_name, name)) {
+				*ino = tsd.sfd_ino;
+				*slot = de->de_slot - 1;
+				result = 0;
+				break;
+			}
+			result = ENOENT;
+		}
+		pos = (pos + 1) % cap;
+	}
+
+	if (ip.ip_buf != NULL) {
+		buffer_release(ip.ip_buf);
+	}
+	return result;
+}
+
+/*
+ * Add a pair for NAME in slot SLOT. Returns ENOSPC if the table is
+ * too full, in which case it needs to be rebuilt bigger.
+ */
+static
+int
+sfs_dirindex_insert(struct sfs_vnode *sv, struct buf *hbuf,
+		    struct sfs_dirindex_header *dh, const char *name,
+		    unsigned slot)
+{
+	struct sfs_dirindex_pos ip;
+	struct sfs_dirindex_entry *de;
+	uint32_t hash;
+	unsigned cap, pos, n;
+	int result;
+
+	cap = dh->dh_nblocks * SFS_DIRINDEX_PERBLOCK;
+	if ((dh->dh_used + 1) * 4 > cap * 3) {
+		return ENOSPC;
+	}
+
+	hash = sfs_dirhash(name);
+	pos = hash % cap;
+	ip.ip_buf = NULL;
+
+	result = ENOSPC;
+	for (n=0; n<cap; n++) {
+		result = sfs_dirindex_entry(sv, dh, &ip, pos, &de);
+		if (result) {
+			break;
+		}
+		if (de->de_slot == SFS_DIRINDEX_EMPTY ||
+		    de->de_slot == SFS_DIRINDEX_DELETED) {
+			if (de->de_slot == SFS_DIRINDEX_EMPTY) {
+				dh->dh_used++;
+			}
+			de->de_hash = hash;
+			de->de_slot = slot + 1;
+			dh->dh_count++;
+			sfs_dirindex_dirty(sv, hbuf, &ip);
+			result = 0;
+			break;
+		}
+		pos = (pos + 1) % cap;
+	}
+
+	if (ip.ip_buf != NULL) {
+		buffer_release(ip.ip_buf);
+	}
+	return result;
+}
+
+/*
+ * Remove the pair for NAME in slot SLOT. Returns EIO if the index
+ * doesn't have it, or has the slot under a different hash.
+ */
+static
+int
+sfs_dirindex_remove(struct sfs_vnode *sv, struct buf *hbuf,
+		    struct sfs_dirindex_header *dh, const char *name,
+		    unsigned slot)
+{
+	struct sfs_dirindex_pos ip;
+	struct sfs_dirindex_entry *de;
+	uint32_t hash;
+	unsigned cap, pos, n;
+	int result;
+
+	hash = sfs_dirhash(name);
+	cap = dh->dh_nblocks * SFS_DIRINDEX_PERBLOCK;
+	pos = hash % cap;
+	ip.ip_buf = NULL;
+
+	/* not finding it means the index is wrong */
+	result = EIO;
+	for (n=0; n<cap; n++) {
+		result = sfs_dirindex_entry(sv, dh, &ip, pos, &de);
+		if (result) {
+			break;
+		}
+		result = EIO;
+		if (de->de_slot == SFS_DIRINDEX_EMPTY) {
+			break;
+		}
+		if (de->de_slot == slot + 1) {
+			if (de->de_hash != hash) {
+				/* stale or corrupt; caller drops the index */
+				break;
+			}
+			de->de_slot = SFS_DIRINDEX_DELETED;
+			dh->dh_count--;
+			sfs_dirindex_dirty(sv, hbuf, &ip);
+			result = 0;
+			break;
+		}
+		pos = (pos + 1) % cap;
+	}
+
+	if (ip.ip_buf != NULL) {
+		buffer_release(ip.ip_buf);
+	}
+	return result;
+}
+
+/*
+ * Remember (or forget) that slot SLOT is empty.
+ */
+static
+void
+sfs_dirindex_addfree(struct sfs_vnode *sv, struct buf *hbuf,
+		     struct sfs_dirindex_header *dh, unsigned slot)
+{
+	if (dh->dh_nfree < SFS_DIRINDEX_NFREE) {
+		dh->dh_free[dh->dh_nfree++] = slot;
+		sfs_dirindex_dirty(sv, hbuf, NULL);
+	}
+}
+
+static
+void
+sfs_dirindex_usefree(struct sfs_vnode *sv, struct buf *hbuf,
+		     struct sfs_dirindex_header *dh, unsigned slot)
+{
+	unsigned i;
+
+	for (i=0; i<dh->dh_nfree; i++) {
+		if (dh->dh_free[i] == slot) {
+			dh->dh_free[i] = dh->dh_free[--dh->dh_nfree];
+			sfs_dirindex_dirty(sv, hbuf, NULL);
+			return;
+		}
+	}
+}
+
+/*
+ * Free the index with header block BLOCK.
+ */
+static
+void
+sfs_dirindex_free(struct sfs_vnode *sv, daddr_t block)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dirindex_header *dh;
+	struct buf *hbuf;
+	unsigned i;
+	int result;
+
+	result = buffer_read(&sfs->sfs_absfs, block, SFS_BLOCKSIZE, &hbuf);
+	if (result) {
+		/* sfsck will pick up the blocks */
+		return;
+	}
+	dh = buffer_map(hbuf);
+	if (dh->dh_magic == SFS_DIRINDEX_MAGIC &&
+	    dh->dh_nblocks <= SFS_DIRINDEX_MAXBLOCKS) {
+		for (i=0; i<dh->dh_nblocks; i++) {
+			if (dh->dh_blocks[i] == 0) {
+				continue;
+			}
+			buffer_drop(&sfs->sfs_absfs, dh->dh_blocks[i],
+				    SFS_BLOCKSIZE);
+			sfs_bfree(sfs, dh->dh_blocks[i]);
+		}
+	}
+	buffer_release(hbuf);
+	buffer_drop(&sfs->sfs_absfs, block, SFS_BLOCKSIZE);
+	sfs_bfree(sfs, block);
+}
+
+/*
+ * Drop the directory's index, if it has one.
+ *
+ * Locking: must hold vnode lock. May get/release sfs_freemaplock.
+ */
+int
+sfs_dir_dropindex(struct sfs_vnode *sv)
+{
+	daddr_t block;
+	int result;
+
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
+	result = sfs_dirindex_getblock(sv, &block);
+	if (result) {
+		return result;
+	}
+	if (block == 0) {
+		return 0;
+	}
+	result = sfs_dirindex_setblock(sv, 0);
+	if (result) {
+		return result;
+	}
+	sfs_dirindex_free(sv, block);
+	return 0;
+}
+
+/*
+ * Build an index for the directory (dropping any old one) by reading
+ * all the entries. Sized for twice the number of slots, so it can
+ * fill in a while before needing to be rebuilt again.
+ *
+ * Locking: must hold vnode lock. May get/release sfs_freemaplock.
+ */
+static
+int
+sfs_dirindex_build(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dirindex_header *dh;
+	struct sfs_direntry tsd;
+	struct buf *hbuf;
+	daddr_t hblock;
+	unsigned nblocks, i;
+	int nentries, result;
+
+	result = sfs_dir_dropindex(sv);
+	if (result) {
+		return result;
+	}
+
+	result = sfs_dir_nentries(sv, &nentries);
+	if (result) {
+		return result;
+	}
+	if ((unsigned)nentries * 4 >
+	    SFS_DIRINDEX_MAXBLOCKS * SFS_DIRINDEX_PERBLOCK * 3) {
+		/* Too big to index; stay linear. */
+		return ENOSPC;
+	}
+	nblocks = DIVROUNDUP(nentries * 2, SFS_DIRINDEX_PERBLOCK);
+	if (nblocks > SFS_DIRINDEX_MAXBLOCKS) {
+		nblocks = SFS_DIRINDEX_MAXBLOCKS;
+	}
+
+	result = sfs_balloc(sfs, &hblock, &hbuf);
+	if (result) {
+		return result;
+	}
+	dh = buffer_map(hbuf);
+	dh->dh_magic = SFS_DIRINDEX_MAGIC;
+	dh->dh_nblocks = nblocks;
+	for (i=0; i<nblocks; i++) {
+		result = sfs_balloc(sfs, &dh->dh_blocks[i], NULL);
+		if (result) {
+			dh->dh_nblocks = i;
+			goto fail;
+		}
+	}
+	sfs_dirindex_dirty(sv, hbuf, NULL);
+
+	for (i=0; i<(unsigned)nentries; i++) {
+		result = sfs_readdir(sv, i, &tsd);
+		if (result) {
+			goto fail;
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			sfs_dirindex_addfree(sv, hbuf, dh, i);
+			continue;
+		}
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+		result = sfs_dirindex_insert(sv, hbuf, dh, tsd.sfd_name, i);
+		if (result) {
+			/* ENOSPC: too big for the largest index */
+			goto fail;
+		}
+	}
+
+	buffer_release(hbuf);
+	return sfs_dirindex_setblock(sv, hblock);
+
+ fail:
+	buffer_release(hbuf);
+	sfs_dirindex_free(sv, hblock);
+	return result;
+}
+
+/*
+ * Bring the index up to date after slot SLOT changed from OLDSD to
+ * NEWSD. Called from sfs_writedir.
+ */
+static
+int
+sfs_dirindex_update(struct sfs_vnode *sv, unsigned slot,
+		    struct sfs_direntry *oldsd, struct sfs_direntry *newsd)
+{
+	struct sfs_dirindex_header *dh;
+	struct buf *hbuf;
+	bool oldlive, newlive, samename;
+	int result;
+
+	oldlive = oldsd->sfd_ino != SFS_NOINO;
+	newlive = newsd->sfd_ino != SFS_NOINO;
+	samename = oldlive && newlive &&
+		!strcmp(oldsd->sfd_name, newsd->sfd_name);
+	if (samename || (!oldlive && !newlive)) {
+		return 0;
+	}
+
+	result = sfs_dirindex_load(sv, &hbuf, &dh);
+	if (result) {
+		return result == ENOENT ? 0 : result;
+	}
+
+	if (oldlive) {
+		result = sfs_dirindex_remove(sv, hbuf, dh, oldsd->sfd_name,
+					     slot);
+		if (result) {
+			buffer_release(hbuf);
+			return result;
+		}
+		if (!newlive) {
+			sfs_dirindex_addfree(sv, hbuf, dh, slot);
+		}
+	}
+	if (newlive) {
+		if (!oldlive) {
+			sfs_dirindex_usefree(sv, hbuf, dh, slot);
+		}
+		result = sfs_dirindex_insert(sv, hbuf, dh, newsd->sfd_name,
+					     slot);
+		if (result == ENOSPC) {
+			/* Too full; make a bigger one (with this in it). */
+			buffer_release(hbuf);
+			return sfs_dirindex_build(sv);
+		}
+	}
+
+	buffer_release(hbuf);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Directory entries
+
 /*
  * Read the directory entry out of slot SLOT of a directory vnode.
  * The "slot" is the index of the directory entry, starting at 0.
@@ -61,20 +620,55 @@ sfs_readdir(struct sfs_vnode *sv, int slot, struct sfs_direntry *sd)
 
 /*
  * Write (overwrite) the directory entry in slot SLOT of a directory
- * vnode.
+ * vnode, and update the index if there is one.
  *
- * Requires up to 3 buffers.
+ * Requires up to 5 buffers.
  */
 int
 sfs_writedir(struct sfs_vnode *sv, int slot, struct sfs_direntry *sd)
 {
+	struct sfs_direntry oldsd;
+	daddr_t indexblock;
 	off_t actualpos;
+	int nentries, result;
 
 	/* Compute the actual position in the directory. */
 	KASSERT(slot>=0);
 	actualpos = slot * sizeof(struct sfs_direntry);
 
-	return sfs_metaio(sv, actualpos, sd, sizeof(*sd), UIO_WRITE);
+	/* If there's an index, we need to know what was there before. */
+	result = sfs_dirindex_getblock(sv, &indexblock);
+	if (result) {
+		return result;
+	}
+	oldsd.sfd_ino = SFS_NOINO;
+	if (indexblock != 0) {
+		result = sfs_dir_nentries(sv, &nentries);
+		if (result) {
+			return result;
+		}
+		if (slot < nentries) {
+			result = sfs_readdir(sv, slot, &oldsd);
+			if (result) {
+				return result;
+			}
+			oldsd.sfd_name[sizeof(oldsd.sfd_name)-1] = 0;
+		}
+	}
+
+	result = sfs_metaio(sv, actualpos, sd, sizeof(*sd), UIO_WRITE);
+	if (result) {
+		return result;
+	}
+
+	if (indexblock != 0) {
+		result = sfs_dirindex_update(sv, slot, &oldsd, sd);
+		if (result) {
+			/* The entry is written; just stop using the index. */
+			(void)sfs_dir_dropindex(sv);
+		}
+	}
+	return 0;
 }
 
 /*
@@ -94,7 +688,7 @@ sfs_dir_nentries(struct sfs_vnode *sv, int *ret)
 	struct sfs_dinode *inodeptr;
 	int result;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
 	KASSERT(sv->sv_type == SFS_TYPE_DIR);
 
 	result = sfs_dinode_load(sv);
@@ -122,16 +716,41 @@ sfs_dir_nentries(struct sfs_vnode *sv, int *ret)
  *
  * Locking: must hold vnode lock. May get/release sfs_freemaplock.
  *
- * Requires up to 3 buffers.
+ * Requires up to 5 buffers.
  */
 int
 sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		uint32_t *ino, int *slot, int *emptyslot)
 {
+	struct sfs_dirindex_header *dh;
 	struct sfs_direntry tsd;
-	int found, nentries, i, result;
+	struct buf *hbuf;
+	uint32_t tino;
+	int found, nentries, i, tslot, result;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
+
+	/* Use the index if there is one. */
+	result = sfs_dirindex_load(sv, &hbuf, &dh);
+	if (result == 0) {
+		if (emptyslot != NULL && dh->dh_nfree > 0) {
+			*emptyslot = dh->dh_free[dh->dh_nfree - 1];
+		}
+		result = sfs_dirindex_find(sv, dh, name, &tino, &tslot);
+		buffer_release(hbuf);
+		if (result == 0) {
+			if (slot != NULL) {
+				*slot = tslot;
+			}
+			if (ino != NULL) {
+				*ino = tino;
+			}
+		}
+		return result;
+	}
+	else if (result != ENOENT) {
+		return result;
+	}
 
 	result = sfs_dir_nentries(sv, &nentries);
 	if (result) {
@@ -192,7 +811,7 @@ sfs_dir_findino(struct sfs_vnode *sv, uint32_t ino,
 	int nentries;
 	int i, result;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
 
 	result = sfs_dir_nentries(sv, &nentries);
 	if (result) {
@@ -229,7 +848,7 @@ sfs_dir_findino(struct sfs_vnode *sv, uint32_t ino,
  *
  * Locking: must hold vnode lock. May get/release sfs_freemaplock.
  *
- * Requires up to 3 buffers.
+ * Requires up to 5 buffers.
  */
 int
 sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
@@ -237,8 +856,9 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	int emptyslot = -1;
 	int result;
 	struct sfs_direntry sd;
+	daddr_t indexblock;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
 
 	/* Look up the name. We want to make sure it *doesn't* exist. */
 	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
@@ -272,7 +892,20 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	result = sfs_writedir(sv, emptyslot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* If the directory has gotten big, index it. */
+	if (emptyslot + 1 >= SFS_DIRINDEX_MIN) {
+		result = sfs_dirindex_getblock(sv, &indexblock);
+		if (result == 0 && indexblock == 0) {
+			/* If this fails we just go on without */
+			(void)sfs_dirindex_build(sv);
+		}
+	}
+	return 0;
 }
 
 /*
@@ -280,14 +913,14 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
  *
  * Locking: must hold vnode lock. May get/release sfs_freemaplock.
  *
- * Requires up to 3 buffers.
+ * Requires up to 5 buffers.
  */
 int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
 	struct sfs_direntry sd;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
@@ -317,7 +950,7 @@ sfs_dir_checkempty(struct sfs_vnode *sv)
 	int nentries;
 	int i, result;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
 
 	result = sfs_dir_nentries(sv, &nentries);
 	if (result) {
@@ -355,7 +988,7 @@ sfs_dir_checkempty(struct sfs_vnode *sv)
  * Locking: must hold vnode lock. May get/release sfs_freemaplock.
  *    Also gets/releases sfs_vnlock.
  *
- * Requires up to 3 buffers.
+ * Requires up to 5 buffers.
  */
 int
 sfs_lookonce(struct sfs_vnode *sv, const char *name, struct sfs_vnode **ret,
@@ -366,7 +999,7 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name, struct sfs_vnode **ret,
 	int result, result2;
 	int emptyslot = -1;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
 
 	result = sfs_dir_findname(sv, name, &ino, slot, &emptyslot);
 	if (result == ENOENT) {
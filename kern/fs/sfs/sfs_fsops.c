@@ -39,6 +39,8 @@
 #include <array.h>
 #include <bitmap.h>
 #include <synch.h>
+#include <thread.h>
+#include <clock.h>
 #include <uio.h>
 #include <vfs.h>
 #include <buf.h>
@@ -78,7 +80,7 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 {
 	uint32_t j, freemapblocks;
 	char *freemapdata;
-	int result;
+	int result = 0;
 
 	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
 
@@ -108,10 +110,15 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 
 		/* If we failed, stop. */
 		if (result) {
-			return result;
+			break;
 		}
 	}
-	return 0;
+
+	if (rw == UIO_READ) {
+		/* We changed the bits behind the bitmap's back */
+		bitmap_datachanged(sfs->sfs_freemap);
+	}
+	return result;
 }
 
 #if 0	/* This is subsumed by sync_fs_buffers, plus would now be recursive */
@@ -122,13 +129,14 @@ static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
-	unsigned i, num;
+	struct sfs_vnode *sv;
+	unsigned i;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+	/* Go over the table of loaded vnodes, syncing as we go. */
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL; sv = sv->sv_hashnext) {
+			VOP_FSYNC(&sv->sv_absvn);
+		}
 	}
 	return 0;
 }
@@ -136,9 +144,8 @@ sfs_sync_vnodes(struct sfs_fs *sfs)
 #endif
 
 /*
- * Sync routine for the freemap.
+ * Sync routine for the freemap. Also used by fsync.
  */
-static
 int
 sfs_sync_freemap(struct sfs_fs *sfs)
 {
@@ -230,6 +237,12 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
+	/* Give delayed file data its blocks */
+	result = sfs_delalloc_syncall(sfs);
+	if (result) {
+		return result;
+	}
+
 	/* Sync the buffer cache */
 	result = sync_fs_buffers(fs);
 	if (result) {
@@ -256,6 +269,279 @@ sfs_sync(struct fs *fs)
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+// Checkpointing
+
+/*
+ * The journal is a ring; if the head catches up with the tail the
+ * journal code panics. To keep that from happening each mounted
+ * volume runs a checkpoint thread that writes back everything the
+ * older records describe and then trims them off the tail.
+ *
+ * Once a second it reads the journal odometer to see how many
+ * journal blocks have gone by since the last checkpoint and how fast
+ * they are going. It checkpoints when what's in use plus
+ * SFS_CKPT_LOOKAHEAD seconds more at the current rate would pass
+ * 1/SFS_CKPT_FRACTION of the journal, so the faster the journal is
+ * being written the sooner (and more often) it checkpoints. If the
+ * journal is still over the limit after a checkpoint, it goes again
+ * without sleeping. When writes stop, it also cleans up anything over
+ * 1/SFS_CKPT_IDLEFRACTION of the journal so the next burst starts
+ * from an empty journal.
+ *
+ * The rate is smoothed, but jumps straight up when the write rate
+ * does, so a sudden burst isn't noticed a few seconds too late.
+ */
+
+/* Checkpoint when projected use passes this fraction of the journal */
+#define SFS_CKPT_FRACTION	2
+
+/* Seconds of writes at the current rate to leave room for */
+#define SFS_CKPT_LOOKAHEAD	4
+
+/* When idle, checkpoint anything over this fraction of the journal */
+#define SFS_CKPT_IDLEFRACTION	8
+
+/* Stats, protected by sfs_ckpt_lock */
+static struct spinlock sfs_ckpt_lock = SPINLOCK_INITIALIZER;
+static unsigned sfs_ckptstats_count;	/* checkpoints taken */
+static unsigned sfs_ckptstats_idle;	/* ...of which while idle */
+static unsigned sfs_ckptstats_again;	/* ...of which without sleeping */
+static uint64_t sfs_ckptstats_jblocks;	/* journal blocks trimmed */
+static unsigned sfs_ckptstats_maxused;	/* most jblocks seen in use */
+
+/*
+ * Take a checkpoint: allocate delayed data, write back the buffers,
+ * freemap, and superblock, so nothing logged before NEXTLSN is needed
+ * at recovery, then trim the journal to NEXTLSN.
+ */
+static
+int
+sfs_checkpoint(struct sfs_fs *sfs)
+{
+	sfs_lsn_t tail;
+	uint32_t odometer;
+	int result;
+
+	/*
+	 * Give delayed file data its blocks, as sfs_sync does, so the
+	 * checkpoint covers it and the records that allocate it.
+	 */
+	result = sfs_delalloc_syncall(sfs);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * Read the odometer next, so any blocks used while we work
+	 * are counted against the next checkpoint.
+	 */
+	odometer = sfs_jphys_getodometer(sfs->sfs_jphys);
+	tail = sfs_jphys_peeknextlsn(sfs);
+
+	result = sync_fs_buffers(&sfs->sfs_absfs);
+	if (result) {
+		return result;
+	}
+	result = sfs_sync_freemap(sfs);
+	if (result) {
+		return result;
+	}
+	result = sfs_sync_superblock(sfs);
+	if (result) {
+		return result;
+	}
+
+	sfs_jphys_trim(sfs, tail);
+
+	/* Get the trim record on disk so recovery sees the new tail */
+	result = sfs_jphys_flushall(sfs);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&sfs_ckpt_lock);
+	sfs_ckptstats_count++;
+	sfs_ckptstats_jblocks += odometer - sfs->sfs_ckptbase;
+	spinlock_release(&sfs_ckpt_lock);
+
+	sfs->sfs_ckptbase = odometer;
+	return 0;
+}
+
+/*
+ * Decide whether it's time for a checkpoint. Called once per pass
+ * of the checkpoint thread; ELAPSED is false if the previous pass
+ * didn't sleep, in which case the rate is left alone.
+ */
+static
+bool
+sfs_checkpoint_due(struct sfs_fs *sfs, bool elapsed, bool *idle_ret)
+{
+	uint32_t odometer, used, delta, limit;
+
+	odometer = sfs_jphys_getodometer(sfs->sfs_jphys);
+	used = odometer - sfs->sfs_ckptbase;
+	delta = odometer - sfs->sfs_ckptlast;
+	sfs->sfs_ckptlast = odometer;
+
+	if (elapsed) {
+		if (delta > sfs->sfs_ckptrate) {
+			sfs->sfs_ckptrate = delta;
+		}
+		else {
+			sfs->sfs_ckptrate = (3 * sfs->sfs_ckptrate + delta) / 4;
+		}
+	}
+
+	spinlock_acquire(&sfs_ckpt_lock);
+	if (used > sfs_ckptstats_maxused) {
+		sfs_ckptstats_maxused = used;
+	}
+	spinlock_release(&sfs_ckpt_lock);
+
+	*idle_ret = false;
+	limit = sfs->sfs_sb.sb_journalblocks / SFS_CKPT_FRACTION;
+	if (used + SFS_CKPT_LOOKAHEAD * sfs->sfs_ckptrate >= limit) {
+		return true;
+	}
+	/* (the last checkpoint's own trim record accounts for one block) */
+	if (elapsed && delta == 0 &&
+	    used > 1 + sfs->sfs_sb.sb_journalblocks / SFS_CKPT_IDLEFRACTION) {
+		*idle_ret = true;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * The checkpoint thread.
+ */
+static
+void
+sfs_checkpoint_thread(void *data1, unsigned long data2)
+{
+	struct sfs_fs *sfs = data1;
+	bool elapsed, idle, first;
+	int result;
+
+	(void)data2;
+
+	/*
+	 * Whatever recovery left in the journal isn't counted by the
+	 * odometer; checkpoint once up front to get rid of it.
+	 */
+	first = true;
+	elapsed = false;
+	while (!sfs->sfs_ckptstop) {
+		if (elapsed) {
+			clocksleep(1);
+			if (sfs->sfs_ckptstop) {
+				break;
+			}
+		}
+
+		idle = false;
+		if (!first && !sfs_checkpoint_due(sfs, elapsed, &idle)) {
+			elapsed = true;
+			continue;
+		}
+
+		result = sfs_checkpoint(sfs);
+		if (result) {
+			kprintf("%s: checkpoint failed: %s\n",
+				sfs->sfs_sb.sb_volname, strerror(result));
+			elapsed = true;
+			continue;
+		}
+
+		spinlock_acquire(&sfs_ckpt_lock);
+		if (idle) {
+			sfs_ckptstats_idle++;
+		}
+		if (!elapsed && !first) {
+			sfs_ckptstats_again++;
+		}
+		spinlock_release(&sfs_ckpt_lock);
+
+		/*
+		 * If the journal filled up past the limit again while
+		 * we were writing back, go around without sleeping.
+		 */
+		first = false;
+		elapsed = !sfs_checkpoint_due(sfs, false, &idle);
+	}
+
+	V(sfs->sfs_ckptexit);
+}
+
+/*
+ * Start the checkpoint thread. The journal must be in writer mode.
+ */
+static
+int
+sfs_checkpoint_start(struct sfs_fs *sfs)
+{
+	int result;
+
+	KASSERT(!sfs->sfs_ckptrunning);
+
+	sfs->sfs_ckptstop = false;
+	sfs->sfs_ckptbase = sfs_jphys_getodometer(sfs->sfs_jphys);
+	sfs->sfs_ckptlast = sfs->sfs_ckptbase;
+	sfs->sfs_ckptrate = 0;
+
+	result = thread_fork("sfs checkpoint", NULL, sfs_checkpoint_thread,
+			     sfs, 0);
+	if (result) {
+		return result;
+	}
+	sfs->sfs_ckptrunning = true;
+	return 0;
+}
+
+/*
+ * Stop the checkpoint thread and wait for it to exit. This may take
+ * up to a second. Don't hold the vnode table or freemap locks, as the
+ * checkpointer may need them to finish what it's doing.
+ */
+static
+void
+sfs_checkpoint_stop(struct sfs_fs *sfs)
+{
+	KASSERT(!lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(!lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (!sfs->sfs_ckptrunning) {
+		return;
+	}
+	sfs->sfs_ckptstop = true;
+	P(sfs->sfs_ckptexit);
+	sfs->sfs_ckptrunning = false;
+}
+
+/*
+ * Print the checkpoint stats.
+ */
+void
+sfs_checkpoint_printstats(void)
+{
+	unsigned count, idle, again, maxused;
+	uint64_t jblocks;
+
+	spinlock_acquire(&sfs_ckpt_lock);
+	count = sfs_ckptstats_count;
+	idle = sfs_ckptstats_idle;
+	again = sfs_ckptstats_again;
+	jblocks = sfs_ckptstats_jblocks;
+	maxused = sfs_ckptstats_maxused;
+	spinlock_release(&sfs_ckpt_lock);
+
+	kprintf("sfs: %u checkpoints (%u idle, %u back-to-back), "
+		"%llu journal blocks trimmed, %u max in use\n",
+		count, idle, again, (unsigned long long)jblocks, maxused);
+}
+
 /*
  * Code called when buffers are attached to and detached from the fs.
  * This can allocate and destroy fs-specific buffer data. We don't
@@ -293,8 +579,10 @@ sfs_detachbuf(struct fs *fs, daddr_t diskblock, struct buf *buf)
 	/* Clear the fs-specific metadata by installing null. */
 	bufdata = buffer_set_fsdata(buf, NULL);
 
-	/* The fs-specific buffer data we installed before was just NULL. */
-	KASSERT(bufdata == NULL);
+	/* It's only non-null if sfs_buffer_notelsn allocated it. */
+	if (bufdata != NULL) {
+		kfree(bufdata);
+	}
 }
 
 /*
@@ -326,14 +614,21 @@ static
 void
 sfs_fs_destroy(struct sfs_fs *sfs)
 {
+	KASSERT(!sfs->sfs_ckptrunning);
+	sem_destroy(sfs->sfs_ckptexit);
 	sfs_jphys_destroy(sfs->sfs_jphys);
+	if (sfs->sfs_jdevice != NULL) {
+		/* might fail if vfs_unmountall already dropped it */
+		(void)vfs_releasedev_locked(sfs->sfs_sb.sb_jdevname);
+		sfs->sfs_jdevice = NULL;
+	}
 	lock_destroy(sfs->sfs_renamelock);
 	lock_destroy(sfs->sfs_freemaplock);
 	lock_destroy(sfs->sfs_vnlock);
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	sfs_vnhash_cleanup(sfs);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -348,18 +643,46 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
+	/*
+	 * Stop the checkpointer before taking the locks, as it may be
+	 * waiting for them. If we can't unmount after all, restart it.
+	 */
+	sfs_checkpoint_stop(sfs);
 
 	lock_acquire(sfs->sfs_vnlock);
 	lock_acquire(sfs->sfs_freemaplock);
 
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
+	if (sfs->sfs_nvnodes > 0) {
 		lock_release(sfs->sfs_freemaplock);
 		lock_release(sfs->sfs_vnlock);
+		result = sfs_checkpoint_start(sfs);
+		if (result) {
+			kprintf("%s: cannot restart checkpointer: %s\n",
+				sfs->sfs_sb.sb_volname, strerror(result));
+		}
 		return EBUSY;
 	}
 
+	/*
+	 * Everything's been synced, so trim the journal up to the head
+	 * and leave a hint in the superblock saying where the head and
+	 * tail are. Then the next mount doesn't need to scan for them.
+	 */
+	sfs_jphys_trim(sfs, sfs_jphys_peeknextlsn(sfs));
+	result = sfs_jphys_flushall(sfs);
+	if (result == 0) {
+		sfs_jphys_savehint(sfs);
+		result = sfs_writeblock(fs, SFS_SUPER_BLOCK, NULL,
+					&sfs->sfs_sb, sizeof(sfs->sfs_sb));
+	}
+	if (result) {
+		kprintf("%s: cannot save journal hint: %s\n",
+			sfs->sfs_sb.sb_volname, strerror(result));
+	}
+
 	sfs_jphys_stopwriting(sfs);
 
 	unreserve_fsmanaged_buffers(2, SFS_BLOCKSIZE);
@@ -395,6 +718,7 @@ static const struct fs_ops sfs_fsops = {
 	.fsop_unmount = sfs_unmount,
 	.fsop_readblock = sfs_readblock,
 	.fsop_writeblock = sfs_writeblock,
+	.fsop_writeblocks = sfs_writeblocks,
 	.fsop_attachbuf = sfs_attachbuf,
 	.fsop_detachbuf = sfs_detachbuf,
 };
@@ -416,6 +740,8 @@ sfs_fs_create(void)
 	COMPILE_ASSERT(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	COMPILE_ASSERT(sizeof(struct sfs_dirindex_header)==SFS_BLOCKSIZE);
+	COMPILE_ASSERT(sizeof(struct sfs_jdevheader)==SFS_BLOCKSIZE);
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
@@ -437,16 +763,21 @@ sfs_fs_create(void)
 
 	/* device we mount on */
 	sfs->sfs_device = NULL;
+	sfs->sfs_jdevice = NULL;
 
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	if (sfs_vnhash_init(sfs)) {
 		goto cleanup_object;
 	}
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_prealloc = NULL;
+	sfs->sfs_nfree = 0;
+	sfs->sfs_reserved = 0;
+	sfs->sfs_delayed = NULL;
+	sfs->sfs_ndablocks = 0;
 
 	/* locks */
 	sfs->sfs_vnlock = lock_create("sfs_vnlock");
@@ -468,8 +799,21 @@ sfs_fs_create(void)
 		goto cleanup_renamelock;
 	}
 
+	/* checkpointer */
+	sfs->sfs_ckptexit = sem_create("sfs_ckptexit", 0);
+	if (sfs->sfs_ckptexit == NULL) {
+		goto cleanup_jphys;
+	}
+	sfs->sfs_ckptstop = false;
+	sfs->sfs_ckptrunning = false;
+	sfs->sfs_ckptbase = 0;
+	sfs->sfs_ckptlast = 0;
+	sfs->sfs_ckptrate = 0;
+
 	return sfs;
 
+cleanup_jphys:
+	sfs_jphys_destroy(sfs->sfs_jphys);
 cleanup_renamelock:
 	lock_destroy(sfs->sfs_renamelock);
 cleanup_freemaplock:
@@ -477,13 +821,82 @@ cleanup_freemaplock:
 cleanup_vnlock:
 	lock_destroy(sfs->sfs_vnlock);
 cleanup_vnodes:
-	vnodearray_destroy(sfs->sfs_vnodes);
+	sfs_vnhash_cleanup(sfs);
 cleanup_object:
 	kfree(sfs);
 fail:
 	return NULL;
 }
 
+/*
+ * Claim and check the external journal device named in the
+ * superblock. Its header must say it belongs to this volume and
+ * be big enough for the journal. On success sfs_jdevice is set
+ * and sfs_fs_destroy releases it again.
+ */
+static
+int
+sfs_attach_jdevice(struct sfs_fs *sfs)
+{
+	struct sfs_superblock *sb = &sfs->sfs_sb;
+	struct sfs_jdevheader jd;
+	struct device *jdev;
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	if (sb->sb_journalstart != sb->sb_nblocks) {
+		kprintf("sfs: %s: external journal should start at %u, "
+			"not %u\n", sb->sb_volname, sb->sb_nblocks,
+			sb->sb_journalstart);
+		return EINVAL;
+	}
+
+	result = vfs_claimdev_locked(sb->sb_jdevname, &jdev);
+	if (result) {
+		kprintf("sfs: %s: journal device %s: %s\n",
+			sb->sb_volname, sb->sb_jdevname, strerror(result));
+		return result;
+	}
+
+	if (jdev->d_blocksize != SFS_BLOCKSIZE) {
+		kprintf("sfs: %s: journal device %s has blocksize %zu\n",
+			sb->sb_volname, sb->sb_jdevname, jdev->d_blocksize);
+		result = ENXIO;
+		goto fail;
+	}
+
+	SFSUIO(&iov, &ku, &jd, SFS_JDEV_HEADER, UIO_READ);
+	result = DEVOP_IO(jdev, &ku);
+	if (result) {
+		goto fail;
+	}
+	jd.jd_volname[sizeof(jd.jd_volname)-1] = 0;
+
+	if (jd.jd_magic != SFS_JDEV_MAGIC ||
+	    jd.jd_devid != sb->sb_jdevid ||
+	    strcmp(jd.jd_volname, sb->sb_volname) != 0) {
+		kprintf("sfs: %s: %s is not this volume's journal\n",
+			sb->sb_volname, sb->sb_jdevname);
+		result = EINVAL;
+		goto fail;
+	}
+	if (jd.jd_journalblocks != sb->sb_journalblocks ||
+	    SFS_JDEV_START + sb->sb_journalblocks > jdev->d_blocks) {
+		kprintf("sfs: %s: journal size on %s doesn't match\n",
+			sb->sb_volname, sb->sb_jdevname);
+		result = EINVAL;
+		goto fail;
+	}
+
+	sfs->sfs_jdevice = jdev;
+	return 0;
+
+fail:
+	vfs_releasedev_locked(sb->sb_jdevname);
+	return result;
+}
+
 /*
  * Mount routine.
  *
@@ -558,7 +971,18 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return EINVAL;
 	}
 
-	if (sfs->sfs_sb.sb_journalblocks >= sfs->sfs_sb.sb_nblocks) {
+	if (sfs->sfs_sb.sb_features & ~SFS_FEATURES_KNOWN) {
+		kprintf("sfs: Unknown features in superblock (0x%x)\n",
+			sfs->sfs_sb.sb_features & ~SFS_FEATURES_KNOWN);
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sfs->sfs_freemaplock);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return EINVAL;
+	}
+
+	if (sfs->sfs_sb.sb_jdevname[0] == 0 &&
+	    sfs->sfs_sb.sb_journalblocks >= sfs->sfs_sb.sb_nblocks) {
 		kprintf("sfs: warning - journal takes up whole volume\n");
 	}
 
@@ -570,6 +994,19 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Ensure null termination of the volume name */
 	sfs->sfs_sb.sb_volname[sizeof(sfs->sfs_sb.sb_volname)-1] = 0;
 
+	/* Attach the journal device, if the journal is elsewhere */
+	sfs->sfs_sb.sb_jdevname[sizeof(sfs->sfs_sb.sb_jdevname)-1] = 0;
+	if (sfs->sfs_sb.sb_jdevname[0] != 0) {
+		result = sfs_attach_jdevice(sfs);
+		if (result) {
+			lock_release(sfs->sfs_vnlock);
+			lock_release(sfs->sfs_freemaplock);
+			sfs->sfs_device = NULL;
+			sfs_fs_destroy(sfs);
+			return result;
+		}
+	}
+
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
 	if (sfs->sfs_freemap == NULL) {
@@ -587,6 +1024,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		sfs_fs_destroy(sfs);
 		return result;
 	}
+	sfs_bcount(sfs);
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
@@ -639,6 +1077,19 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return result;
 	}
 
+	/*
+	 * The journal hint is about to go out of date; clear it so
+	 * the next superblock write (the checkpointer does one right
+	 * away) takes it off the disk. A stale hint would be rejected
+	 * at mount anyway, but only after reading some of the journal.
+	 */
+	if (sfs->sfs_sb.sb_jhintmagic != 0) {
+		lock_acquire(sfs->sfs_freemaplock);
+		sfs_jphys_clearhint(sfs);
+		sfs->sfs_superdirty = true;
+		lock_release(sfs->sfs_freemaplock);
+	}
+
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	/**************************************/
@@ -647,6 +1098,17 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	unreserve_buffers(SFS_BLOCKSIZE);
 
+	/* Start checkpointing, so the journal doesn't fill up. */
+	result = sfs_checkpoint_start(sfs);
+	if (result) {
+		sfs_jphys_unstartwriting(sfs);
+		unreserve_fsmanaged_buffers(2, SFS_BLOCKSIZE);
+		drop_fs_buffers(&sfs->sfs_absfs);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return result;
+	}
+
 	return 0;
 }
 
@@ -35,11 +35,13 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <spinlock.h>
 #include <synch.h>
 #include <thread.h>
 #include <current.h>
 #include <vfs.h>
 #include <buf.h>
+#include <namecache.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -57,15 +59,37 @@ sfs_vnode_create(uint32_t ino, unsigned type)
 	if (sv == NULL) {
 		return NULL;
 	}
-	sv->sv_lock = lock_create("sfs_vnode");
+	sv->sv_lock = rwlock_create("sfs_vnode");
 	if (sv->sv_lock == NULL) {
 		kfree(sv);
 		return NULL;
 	}
+	sv->sv_dinolock = lock_create("sfs_dinode");
+	if (sv->sv_dinolock == NULL) {
+		rwlock_destroy(sv->sv_lock);
+		kfree(sv);
+		return NULL;
+	}
+	spinlock_init(&sv->sv_ralock);
 	sv->sv_ino = ino;
+	sv->sv_hashnext = NULL;
+	sv->sv_hashprev = NULL;
 	sv->sv_type = type;
 	sv->sv_dinobuf = NULL;
 	sv->sv_dinobufcount = 0;
+	sv->sv_ra_next = 0;
+	sv->sv_ra_issued = 0;
+	sv->sv_ra_window = 0;
+	sv->sv_allocgoal = 0;
+	sv->sv_pa_start = 0;
+	sv->sv_pa_count = 0;
+	sv->sv_pa_next = NULL;
+	sv->sv_pa_prev = NULL;
+	sv->sv_dablocks = NULL;
+	sv->sv_ndablocks = 0;
+	sv->sv_dareserved = 0;
+	sv->sv_da_next = NULL;
+	sv->sv_da_prev = NULL;
 	return sv;
 }
 
@@ -76,10 +100,248 @@ static
 void
 sfs_vnode_destroy(struct sfs_vnode *victim)
 {
-	lock_destroy(victim->sv_lock);
+	KASSERT(victim->sv_pa_count == 0);
+	KASSERT(victim->sv_dablocks == NULL);
+	KASSERT(victim->sv_dareserved == 0);
+	spinlock_cleanup(&victim->sv_ralock);
+	lock_destroy(victim->sv_dinolock);
+	rwlock_destroy(victim->sv_lock);
 	kfree(victim);
 }
 
+/*
+ * The vnode table: the vnodes loaded in memory, in chains hashed by
+ * inode number so sfs_loadvnode doesn't have to look at all of them.
+ * The table doubles when the chains average more than
+ * SFS_VNHASH_LOAD vnodes; it never shrinks. All of this is protected
+ * by sfs_vnlock.
+ */
+
+/* Initial number of chains (a power of 2), and when to grow */
+#define SFS_VNHASH_MINSIZE	64
+#define SFS_VNHASH_LOAD		2
+
+/* stats, over all volumes */
+static struct spinlock sfs_vnstats_lock = SPINLOCK_INITIALIZER;
+static unsigned sfs_vnstats_nvnodes;	/* vnodes loaded */
+static unsigned sfs_vnstats_nchains;	/* chains in all tables */
+static unsigned sfs_vnstats_lookups;	/* sfs_vnhash_find calls */
+static unsigned sfs_vnstats_probes;	/* vnodes looked at by those */
+static unsigned sfs_vnstats_maxprobe;	/* most looked at in one call */
+static unsigned sfs_vnstats_grows;	/* times a table was doubled */
+
+static
+unsigned
+sfs_vnhash_chain(struct sfs_fs *sfs, uint32_t ino)
+{
+	return ino & (sfs->sfs_vnhashsize - 1);
+}
+
+/*
+ * Set up and tear down the table.
+ */
+int
+sfs_vnhash_init(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	sfs->sfs_vnhash = kmalloc(SFS_VNHASH_MINSIZE *
+				  sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_VNHASH_MINSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_vnhashsize = SFS_VNHASH_MINSIZE;
+	sfs->sfs_nvnodes = 0;
+
+	spinlock_acquire(&sfs_vnstats_lock);
+	sfs_vnstats_nchains += sfs->sfs_vnhashsize;
+	spinlock_release(&sfs_vnstats_lock);
+	return 0;
+}
+
+void
+sfs_vnhash_cleanup(struct sfs_fs *sfs)
+{
+	KASSERT(sfs->sfs_nvnodes == 0);
+
+	spinlock_acquire(&sfs_vnstats_lock);
+	sfs_vnstats_nchains -= sfs->sfs_vnhashsize;
+	spinlock_release(&sfs_vnstats_lock);
+
+	kfree(sfs->sfs_vnhash);
+	sfs->sfs_vnhash = NULL;
+	sfs->sfs_vnhashsize = 0;
+}
+
+/*
+ * Find the vnode for inode INO, if it's loaded.
+ */
+static
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+	unsigned probes = 0;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_vnhash[sfs_vnhash_chain(sfs, ino)]; sv != NULL;
+	     sv = sv->sv_hashnext) {
+		probes++;
+		if (sv->sv_ino == ino) {
+			break;
+		}
+	}
+
+	spinlock_acquire(&sfs_vnstats_lock);
+	sfs_vnstats_lookups++;
+	sfs_vnstats_probes += probes;
+	if (probes > sfs_vnstats_maxprobe) {
+		sfs_vnstats_maxprobe = probes;
+	}
+	spinlock_release(&sfs_vnstats_lock);
+
+	return sv;
+}
+
+static
+void
+sfs_vnhash_insert(struct sfs_vnode **table, unsigned chain,
+		  struct sfs_vnode *sv)
+{
+	sv->sv_hashprev = NULL;
+	sv->sv_hashnext = table[chain];
+	if (sv->sv_hashnext != NULL) {
+		sv->sv_hashnext->sv_hashprev = sv;
+	}
+	table[chain] = sv;
+}
+
+/*
+ * Double the number of chains. If we can't get the memory, just
+ * carry on with long chains.
+ */
+static
+void
+sfs_vnhash_grow(struct sfs_fs *sfs)
+{
+	struct sfs_vnode **oldtable, *sv, *next;
+	unsigned oldsize, i;
+
+	oldtable = sfs->sfs_vnhash;
+	oldsize = sfs->sfs_vnhashsize;
+
+	sfs->sfs_vnhash = kmalloc(oldsize * 2 * sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		sfs->sfs_vnhash = oldtable;
+		return;
+	}
+	sfs->sfs_vnhashsize = oldsize * 2;
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+
+	for (i=0; i<oldsize; i++) {
+		for (sv = oldtable[i]; sv != NULL; sv = next) {
+			next = sv->sv_hashnext;
+			sfs_vnhash_insert(sfs->sfs_vnhash,
+					  sfs_vnhash_chain(sfs, sv->sv_ino), sv);
+		}
+	}
+	kfree(oldtable);
+
+	spinlock_acquire(&sfs_vnstats_lock);
+	sfs_vnstats_nchains += oldsize;
+	sfs_vnstats_grows++;
+	spinlock_release(&sfs_vnstats_lock);
+}
+
+/*
+ * Add and remove vnodes.
+ */
+static
+void
+sfs_vnhash_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	if (sfs->sfs_nvnodes >= sfs->sfs_vnhashsize * SFS_VNHASH_LOAD) {
+		sfs_vnhash_grow(sfs);
+	}
+	sfs_vnhash_insert(sfs->sfs_vnhash, sfs_vnhash_chain(sfs, sv->sv_ino),
+			  sv);
+	sfs->sfs_nvnodes++;
+
+	spinlock_acquire(&sfs_vnstats_lock);
+	sfs_vnstats_nvnodes++;
+	spinlock_release(&sfs_vnstats_lock);
+}
+
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned chain;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	chain = sfs_vnhash_chain(sfs, sv->sv_ino);
+	if (sv->sv_hashprev != NULL) {
+		sv->sv_hashprev->sv_hashnext = sv->sv_hashnext;
+	}
+	else {
+		if (sfs->sfs_vnhash[chain] != sv) {
+			panic("sfs: %s: reclaim vnode %u not in vnode table\n",
+			      sfs->sfs_sb.sb_volname, sv->sv_ino);
+		}
+		sfs->sfs_vnhash[chain] = sv->sv_hashnext;
+	}
+	if (sv->sv_hashnext != NULL) {
+		sv->sv_hashnext->sv_hashprev = sv->sv_hashprev;
+	}
+	sv->sv_hashnext = sv->sv_hashprev = NULL;
+
+	KASSERT(sfs->sfs_nvnodes > 0);
+	sfs->sfs_nvnodes--;
+
+	spinlock_acquire(&sfs_vnstats_lock);
+	sfs_vnstats_nvnodes--;
+	spinlock_release(&sfs_vnstats_lock);
+}
+
+/*
+ * Print the stats.
+ */
+void
+sfs_printstats(void)
+{
+	unsigned nvnodes, nchains, lookups, probes, maxprobe, grows;
+	uint64_t avg100;
+
+	spinlock_acquire(&sfs_vnstats_lock);
+	nvnodes = sfs_vnstats_nvnodes;
+	nchains = sfs_vnstats_nchains;
+	lookups = sfs_vnstats_lookups;
+	probes = sfs_vnstats_probes;
+	maxprobe = sfs_vnstats_maxprobe;
+	grows = sfs_vnstats_grows;
+	spinlock_release(&sfs_vnstats_lock);
+
+	kprintf("sfs: %u vnodes loaded in %u chains (grown %u times)\n",
+		nvnodes, nchains, grows);
+	avg100 = lookups > 0 ? (uint64_t)probes * 100 / lookups : 0;
+	kprintf("sfs: %u vnode lookups, %u.%02u probes avg, %u max\n",
+		lookups, (unsigned)(avg100 / 100), (unsigned)(avg100 % 100),
+		maxprobe);
+
+	sfs_jphys_printstats();
+	sfs_checkpoint_printstats();
+	sfs_dio_printstats();
+}
+
 /*
  * Load the on-disk inode into sv->sv_dinobuf. This should be done at
  * the beginning of any operation that will need to read or change the
@@ -90,7 +352,13 @@ sfs_vnode_destroy(struct sfs_vnode *victim)
  * sometimes more than once, so for now it needs to be recursive and
  * we count how many times it's been loaded.
  *
- * Locking: must hold the vnode lock.
+ * Several readers can hold the vnode lock at once, but only the
+ * thread that got the buffer can use or release it; so whoever loads
+ * the inode first holds sv_dinolock until the matching unload, and
+ * any other reader waits for it there.
+ *
+ * Locking: must hold the vnode lock (either way). Gets sv_dinolock
+ * and holds it until the matching sfs_dinode_unload.
  */
 int
 sfs_dinode_load(struct sfs_vnode *sv)
@@ -98,15 +366,19 @@ sfs_dinode_load(struct sfs_vnode *sv)
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	int result;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
 
-	if (sv->sv_dinobufcount == 0) {
+	if (!lock_do_i_hold(sv->sv_dinolock)) {
+		lock_acquire(sv->sv_dinolock);
+		KASSERT(sv->sv_dinobufcount == 0);
 		KASSERT(sv->sv_dinobuf == NULL);
 		result = buffer_read(&sfs->sfs_absfs, sv->sv_ino,SFS_BLOCKSIZE,
 				     &sv->sv_dinobuf);
 		if (result) {
+			lock_release(sv->sv_dinolock);
 			return result;
 		}
+		buffer_set_owner(sv->sv_dinobuf, &sv->sv_absvn);
 	}
 	else {
 		KASSERT(sv->sv_dinobuf != NULL);
@@ -123,12 +395,14 @@ sfs_dinode_load(struct sfs_vnode *sv)
  * Ideally this should be exactly once per operation when the
  * operation starts and ends, but we aren't there yet. (XXX)
  *
- * Locking: must hold the vnode lock.
+ * Locking: must hold the vnode lock and sv_dinolock; releases
+ * sv_dinolock on the last unload.
  */
 void
 sfs_dinode_unload(struct sfs_vnode *sv)
 {
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
+	KASSERT(lock_do_i_hold(sv->sv_dinolock));
 
 	KASSERT(sv->sv_dinobuf != NULL);
 	KASSERT(sv->sv_dinobufcount > 0);
@@ -137,6 +411,7 @@ sfs_dinode_unload(struct sfs_vnode *sv)
 	if (sv->sv_dinobufcount == 0) {
 		buffer_release(sv->sv_dinobuf);
 		sv->sv_dinobuf = NULL;
+		lock_release(sv->sv_dinolock);
 	}
 }
 
@@ -145,12 +420,13 @@ sfs_dinode_unload(struct sfs_vnode *sv)
  * buffer_map, the pointer remains valid until the buffer is released,
  * that is, when sfs_dinode_unload is called.
  *
- * Locking: must hold the vnode lock.
+ * Locking: must hold the vnode lock and have the inode loaded.
  */
 struct sfs_dinode *
 sfs_dinode_map(struct sfs_vnode *sv)
 {
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
+	KASSERT(lock_do_i_hold(sv->sv_dinolock));
 
 	KASSERT(sv->sv_dinobuf != NULL);
 	return buffer_map(sv->sv_dinobuf);
@@ -160,12 +436,12 @@ sfs_dinode_map(struct sfs_vnode *sv)
  * Mark the on-disk inode dirty after scribbling in it with
  * sfs_dinode_map.
  *
- * Locking: must hold the vnode lock.
+ * Locking: must hold the vnode lock for writing.
  */
 void
 sfs_dinode_mark_dirty(struct sfs_vnode *sv)
 {
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
 
 	KASSERT(sv->sv_dinobuf != NULL);
 	buffer_mark_dirty(sv->sv_dinobuf);
@@ -180,7 +456,7 @@ sfs_dinode_mark_dirty(struct sfs_vnode *sv)
  *    possibly also sfs_freemaplock, while holding the vnode lock.
  *
  * Requires 1 buffer locally but may also afterward call sfs_itrunc,
- * which takes 4.
+ * which takes 4, or sfs_delalloc_flush, which takes 3.
  */
 int
 sfs_reclaim(struct vnode *v)
@@ -188,13 +464,18 @@ sfs_reclaim(struct vnode *v)
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	struct sfs_dinode *iptr;
-	unsigned ix, i, num;
 	bool buffers_needed;
 	int result;
 
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_write(sv->sv_lock);
 	lock_acquire(sfs->sfs_vnlock);
 
+	/*
+	 * Get it out of the name cache first, so that can't hand out
+	 * new references after we've looked at the count.
+	 */
+	namecache_purge(v);
+
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
 	 * decision was made to reclaim it. (This must interact
@@ -209,7 +490,7 @@ sfs_reclaim(struct vnode *v)
 
 		spinlock_release(&v->vn_countlock);
 		lock_release(sfs->sfs_vnlock);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		return EBUSY;
 	}
 	spinlock_release(&v->vn_countlock);
@@ -233,7 +514,7 @@ sfs_reclaim(struct vnode *v)
 		 * there's essentially no helping it...
 		 */
 		lock_release(sfs->sfs_vnlock);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		if (buffers_needed) {
 			unreserve_buffers(SFS_BLOCKSIZE);
 		}
@@ -243,11 +524,17 @@ sfs_reclaim(struct vnode *v)
 
 	/* If there are no on-disk references to the file either, erase it. */
 	if (iptr->sfi_linkcount == 0) {
-		result = sfs_itrunc(sv, 0);
+		result = 0;
+		if (sv->sv_type == SFS_TYPE_DIR) {
+			result = sfs_dir_dropindex(sv);
+		}
+		if (result == 0) {
+			result = sfs_itrunc(sv, 0);
+		}
 		if (result) {
 			sfs_dinode_unload(sv);
 			lock_release(sfs->sfs_vnlock);
-			lock_release(sv->sv_lock);
+			rwlock_release_write(sv->sv_lock);
 			if (buffers_needed) {
 				unreserve_buffers(SFS_BLOCKSIZE);
 			}
@@ -259,34 +546,33 @@ sfs_reclaim(struct vnode *v)
 		sfs_bfree(sfs, sv->sv_ino);
 	}
 	else {
+		/* Still in use on disk; write out any delayed data. */
+		result = sfs_delalloc_flush(sv);
 		sfs_dinode_unload(sv);
+		if (result) {
+			lock_release(sfs->sfs_vnlock);
+			rwlock_release_write(sv->sv_lock);
+			if (buffers_needed) {
+				unreserve_buffers(SFS_BLOCKSIZE);
+			}
+			return result;
+		}
 	}
 
 	if (buffers_needed) {
 		unreserve_buffers(SFS_BLOCKSIZE);
 	}
 
+	/* Give back any blocks preallocated for the file. */
+	sfs_prealloc_release(sv);
+
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs_vnhash_remove(sfs, sv);
 
 	vnode_cleanup(&sv->sv_absvn);
 
 	lock_release(sfs->sfs_vnlock);
-	lock_release(sv->sv_lock);
+	rwlock_release_write(sv->sv_lock);
 
 	sfs_vnode_destroy(sv);
 
@@ -308,43 +594,32 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	struct buf *dinobuf;
 	struct sfs_dinode *dino;
 	const struct vnode_ops *ops;
-	unsigned i, num;
 	int result;
 
 	/* sfs_vnlock protects the vnodes table */
 	lock_acquire(sfs->sfs_vnlock);
 
 	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
+	sv = sfs_vnhash_find(sfs, ino);
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: %s: Found inode %u in unallocated block\n",
 			      sfs->sfs_sb.sb_volname, sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
-			VOP_INCREF(&sv->sv_absvn);
-			lock_release(sfs->sfs_vnlock);
+		VOP_INCREF(&sv->sv_absvn);
+		lock_release(sfs->sfs_vnlock);
 
-			*ret = sv;
-			return 0;
-		}
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
@@ -380,6 +655,11 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(dino->sfi_type == SFS_TYPE_INVAL);
 		dino->sfi_type = forcetype;
+		/* New files start out inline, if the volume allows it */
+		if (forcetype == SFS_TYPE_FILE &&
+		    (sfs->sfs_sb.sb_features & SFS_FEATURE_INLINE)) {
+			dino->sfi_flags = SFS_DINODE_INLINE;
+		}
 		buffer_mark_dirty(dinobuf);
 	}
 
@@ -425,13 +705,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	}
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		sfs_vnode_destroy(sv);
-		lock_release(sfs->sfs_vnlock);
-		return result;
-	}
+	sfs_vnhash_add(sfs, sv);
 	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
@@ -480,10 +754,10 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	}
 
 	/* And load the inode. */
-	lock_acquire((*ret)->sv_lock);
+	rwlock_acquire_write((*ret)->sv_lock);
 	result = sfs_dinode_load(*ret);
 	if (result) {
-		lock_release((*ret)->sv_lock);
+		rwlock_release_write((*ret)->sv_lock);
 		/* this reclaims the inode */
 		VOP_DECREF(&(*ret)->sv_absvn);
 		return result;
@@ -43,6 +43,13 @@
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/* Read-ahead window limits, in blocks. */
+#define SFS_READAHEAD_MIN	4
+#define SFS_READAHEAD_MAX	32
+
+/* Most blocks we'll write in one clustered write. */
+#define SFS_CLUSTER_MAX		16
+
 ////////////////////////////////////////////////////////////
 //
 // Basic block-level I/O routines
@@ -51,15 +58,33 @@
  * Note: sfs_readblock is used to read the superblock
  * early in mount, before sfs is fully (or even mostly)
  * initialized, and so may not use anything from sfs
- * except sfs_device.
+ * except sfs_device and sfs_jdevice. (The latter is still
+ * null then.)
+ */
+
+/*
+ * Figure out which device BLOCK lives on. Normally that's the one
+ * we're mounted on; but if the journal is on a separate device,
+ * journal blocks live there, and *BLOCK is changed to the block
+ * number on that device.
  */
+static
+struct device *
+sfs_blockdev(struct sfs_fs *sfs, daddr_t *block)
+{
+	if (sfs->sfs_jdevice != NULL && sfs_block_is_journal(sfs, *block)) {
+		*block = *block - sfs->sfs_sb.sb_journalstart + SFS_JDEV_START;
+		return sfs->sfs_jdevice;
+	}
+	return sfs->sfs_device;
+}
 
 /*
  * Read or write a block, retrying I/O errors.
  */
 static
 int
-sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
+sfs_rwblock(struct sfs_fs *sfs, struct device *dev, struct uio *uio)
 {
 	int result;
 	int tries=0;
@@ -69,7 +94,7 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	      uio->uio_offset / SFS_BLOCKSIZE);
 
  retry:
-	result = DEVOP_IO(sfs->sfs_device, uio);
+	result = DEVOP_IO(dev, uio);
 	if (result == EINVAL) {
 		/*
 		 * This means the sector we requested was out of range,
@@ -108,13 +133,15 @@ int
 sfs_readblock(struct fs *fs, daddr_t block, void *data, size_t len)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	struct device *dev;
 	struct iovec iov;
 	struct uio ku;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
+	dev = sfs_blockdev(sfs, &block);
 	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	return sfs_rwblock(sfs, dev, &ku);
 }
 
 /*
@@ -125,15 +152,30 @@ sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
 	       void *data, size_t len)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	struct sfs_bufdata *bd = fsbufdata;
+	struct device *dev;
+	daddr_t devblock;
 	struct iovec iov;
 	struct uio ku;
 	bool isjournal;
 	int result;
 
-	(void)fsbufdata;
-
 	KASSERT(len == SFS_BLOCKSIZE);
 
+	if (bd != NULL && bd->bd_lsn != 0) {
+		/*
+		 * Write-ahead logging: the journal records describing
+		 * the block's changes must be on disk before it is.
+		 * This is also what limits fsync to flushing only as
+		 * much of the journal as the file needs.
+		 */
+		result = sfs_jphys_flush(sfs, bd->bd_lsn);
+		if (result) {
+			return result;
+		}
+		bd->bd_lsn = 0;
+	}
+
 	isjournal = sfs_block_is_journal(sfs, block);
 
 	if (isjournal) {
@@ -161,8 +203,10 @@ sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
 		}
 	}
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	result = sfs_rwblock(sfs, &ku);
+	devblock = block;
+	dev = sfs_blockdev(sfs, &devblock);
+	SFSUIO(&iov, &ku, data, devblock, UIO_WRITE);
+	result = sfs_rwblock(sfs, dev, &ku);
 	if (result) {
 		return result;
 	}
@@ -174,6 +218,586 @@ sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
 	return 0;
 }
 
+/*
+ * Write NUM adjacent blocks with a single device operation.
+ *
+ * Unlike sfs_rwblock, this doesn't retry on error; the buffer cache
+ * will write whatever didn't get written with sfs_writeblock, which
+ * does.
+ */
+static
+int
+sfs_writerun(struct sfs_fs *sfs, daddr_t block, unsigned num, void **data)
+{
+	struct iovec iov[SFS_CLUSTER_MAX];
+	struct device *dev;
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	KASSERT(num <= SFS_CLUSTER_MAX);
+
+	/* (a run never crosses into or out of the journal) */
+	dev = sfs_blockdev(sfs, &block);
+
+	for (i=0; i<num; i++) {
+		iov[i].iov_kbase = data[i];
+		iov[i].iov_len = SFS_BLOCKSIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = num;
+	ku.uio_offset = ((off_t)block) * SFS_BLOCKSIZE;
+	ku.uio_resid = num * SFS_BLOCKSIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = UIO_WRITE;
+	ku.uio_space = NULL;
+
+	DEBUG(DB_SFS, "sfs: write %u-%u\n", block, block + num - 1);
+
+	result = DEVOP_IO(dev, &ku);
+	if (result == EINVAL) {
+		/* as in sfs_rwblock */
+		panic("sfs: %s: DEVOP_IO returned EINVAL\n",
+		      sfs->sfs_sb.sb_volname);
+	}
+	return result;
+}
+
+/*
+ * Write several adjacent blocks (for clustered writes from the
+ * buffer cache). Returns the number of blocks written, counting from
+ * the first; the buffer cache writes the rest one at a time.
+ *
+ * Journal blocks have to go to disk in journal order, so before
+ * writing a run of them we flush any earlier journal blocks, just as
+ * sfs_writeblock does, and afterwards record them written in order.
+ * If the journal wraps around partway through the run that order
+ * isn't disk order, and we write nothing. We also stop where the run
+ * enters or leaves the journal, so the journal flush never happens
+ * while we're holding buffers from outside the journal. For the same
+ * reason we stop at a block that needs the journal flushed first; it
+ * gets written by sfs_writeblock.
+ */
+unsigned
+sfs_writeblocks(struct fs *fs, daddr_t block, unsigned num,
+		void **fsbufdata, void **data, size_t len)
+{
+	struct sfs_fs *sfs = fs->fs_data;
+	struct sfs_bufdata *bd;
+	bool isjournal;
+	unsigned i;
+	int result;
+
+	KASSERT(len == SFS_BLOCKSIZE);
+
+	if (num > SFS_CLUSTER_MAX) {
+		num = SFS_CLUSTER_MAX;
+	}
+	for (i=0; i<num; i++) {
+		bd = fsbufdata[i];
+		if (bd != NULL && bd->bd_lsn != 0) {
+			num = i;
+			break;
+		}
+	}
+	if (num == 0) {
+		return 0;
+	}
+
+	isjournal = sfs_block_is_journal(sfs, block);
+	for (i=1; i<num; i++) {
+		if (sfs_block_is_journal(sfs, block + i) != isjournal) {
+			num = i;
+			break;
+		}
+	}
+
+	if (isjournal) {
+		if (!sfs_jphys_journalrun_inorder(sfs, block, num)) {
+			return 0;
+		}
+		result = sfs_jphys_flushforjournalblock(sfs, block);
+		if (result) {
+			return 0;
+		}
+	}
+
+	result = sfs_writerun(sfs, block, num, data);
+	if (result) {
+		return 0;
+	}
+
+	if (isjournal) {
+		for (i=0; i<num; i++) {
+			sfs_wrote_journal_block(sfs, block + i);
+		}
+	}
+
+	return num;
+}
+
+/*
+ * Note that journal record LSN describes a change to the block in
+ * BUF, so the journal gets flushed through LSN before the block is
+ * written. The buffer must be busy. If we can't allocate the record
+ * keeping for it, flush the journal now instead.
+ */
+int
+sfs_buffer_notelsn(struct sfs_fs *sfs, struct buf *buf, sfs_lsn_t lsn)
+{
+	struct sfs_bufdata *bd;
+
+	bd = buffer_get_fsdata(buf);
+	if (bd == NULL) {
+		bd = kmalloc(sizeof(*bd));
+		if (bd == NULL) {
+			return sfs_jphys_flush(sfs, lsn);
+		}
+		bd->bd_lsn = 0;
+		buffer_set_fsdata(buf, bd);
+	}
+	if (lsn > bd->bd_lsn) {
+		bd->bd_lsn = lsn;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Delayed allocation
+
+/*
+ * When a file is written where it has no block yet, we don't pick a
+ * block for the data right away. Instead the data is kept in memory
+ * against a reservation of free blocks (see sfs_balloc.c), and real
+ * blocks are allocated when it's written out: on fsync or sync, when
+ * the vnode is reclaimed, or when the file has SFS_DELALLOC_FILEMAX
+ * blocks waiting. By then we know how much of the file there is, so
+ * it can all go in one contiguous run; and if the file is truncated
+ * or removed first (temporary files) no blocks are ever allocated
+ * for it at all.
+ *
+ * Only regular files do this; directories go through sfs_metaio and
+ * allocate as they always have. If more than SFS_DELALLOC_MAX blocks
+ * are waiting on the volume, or we can't get memory, new writes
+ * allocate immediately as well.
+ *
+ * Each file's list of waiting blocks is sorted by file block and
+ * protected by the vnode lock. The list of vnodes that have some,
+ * and the count of them, are protected by sfs_freemaplock.
+ */
+
+/* Most delayed blocks per file and per volume */
+#define SFS_DELALLOC_FILEMAX	32
+#define SFS_DELALLOC_MAX	256
+
+struct sfs_dablock {
+	struct sfs_dablock *db_next;	/* next higher file block */
+	uint32_t db_fileblock;		/* block number within file */
+	char db_data[SFS_BLOCKSIZE];	/* contents */
+};
+
+/*
+ * Number of blocks to reserve for file block FILEBLOCK: the block
+ * itself and, to be safe, any indirect blocks it might need.
+ */
+static
+unsigned
+sfs_delalloc_cost(uint32_t fileblock)
+{
+	if (fileblock < SFS_NDIRECT) {
+		return 1;
+	}
+	fileblock -= SFS_NDIRECT;
+	if (fileblock < SFS_DBPERIDB) {
+		return 2;
+	}
+	fileblock -= SFS_DBPERIDB;
+	if (fileblock < SFS_DBPERIDB * SFS_DBPERIDB) {
+		return 3;
+	}
+	return 4;
+}
+
+/*
+ * Add SV to, or remove it from, the list of vnodes with delayed
+ * blocks.
+ */
+static
+void
+sfs_delalloc_link(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	sv->sv_da_prev = NULL;
+	sv->sv_da_next = sfs->sfs_delayed;
+	if (sv->sv_da_next != NULL) {
+		sv->sv_da_next->sv_da_prev = sv;
+	}
+	sfs->sfs_delayed = sv;
+}
+
+static
+void
+sfs_delalloc_unlink(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (sv->sv_da_prev != NULL) {
+		sv->sv_da_prev->sv_da_next = sv->sv_da_next;
+	}
+	else {
+		KASSERT(sfs->sfs_delayed == sv);
+		sfs->sfs_delayed = sv->sv_da_next;
+	}
+	if (sv->sv_da_next != NULL) {
+		sv->sv_da_next->sv_da_prev = sv->sv_da_prev;
+	}
+	sv->sv_da_next = sv->sv_da_prev = NULL;
+}
+
+/*
+ * Take delayed block DB, which *DBP points to, off SV's list and free
+ * it. If it was the last one, also give back whatever is left of
+ * the file's reservation; otherwise give back UNRESERVE blocks.
+ */
+static
+void
+sfs_delalloc_remove(struct sfs_vnode *sv, struct sfs_dablock **dbp,
+		    unsigned unreserve)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dablock *db = *dbp;
+
+	*dbp = db->db_next;
+	kfree(db);
+
+	KASSERT(sv->sv_ndablocks > 0);
+	sv->sv_ndablocks--;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	KASSERT(sfs->sfs_ndablocks > 0);
+	sfs->sfs_ndablocks--;
+	if (sv->sv_ndablocks == 0) {
+		sfs_delalloc_unlink(sfs, sv);
+		unreserve = sv->sv_dareserved;
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	if (unreserve > 0) {
+		sfs_bunreserve(sv, unreserve);
+	}
+}
+
+/*
+ * Give all of SV's delayed blocks real disk blocks and move their
+ * contents into the buffer cache. If something fails, the blocks not
+ * yet written out stay delayed.
+ *
+ * Locking: must hold vnode lock. Gets/releases sfs_freemaplock.
+ *
+ * Requires up to 3 buffers.
+ */
+int
+sfs_delalloc_flush(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dablock *db;
+	struct buf *iobuf;
+	daddr_t diskblock;
+	int result;
+
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
+	while ((db = sv->sv_dablocks) != NULL) {
+		/*
+		 * sfs_balloc_file takes as many blocks in a row as
+		 * we have reserved, so these should all end up
+		 * together.
+		 */
+		result = sfs_bmap(sv, db->db_fileblock, true, &diskblock);
+		if (result) {
+			return result;
+		}
+		result = buffer_get(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE,
+				    &iobuf);
+		if (result) {
+			return result;
+		}
+		memcpy(buffer_map(iobuf), db->db_data, SFS_BLOCKSIZE);
+		buffer_set_owner(iobuf, &sv->sv_absvn);
+		buffer_mark_valid(iobuf);
+		buffer_mark_dirty(iobuf);
+		buffer_release(iobuf);
+
+		sfs_delalloc_remove(sv, &sv->sv_dablocks, 0);
+	}
+	return 0;
+}
+
+/*
+ * Throw away delayed data past LEN, for truncate, and clear the part
+ * of the last block past LEN so it reads as zeros if the file grows
+ * again.
+ *
+ * Locking: must hold vnode lock. Gets/releases sfs_freemaplock.
+ */
+void
+sfs_delalloc_truncate(struct sfs_vnode *sv, off_t len)
+{
+	struct sfs_dablock **dbp;
+	uint32_t lastblock, blockoff;
+
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
+	lastblock = len / SFS_BLOCKSIZE;
+	blockoff = len % SFS_BLOCKSIZE;
+
+	dbp = &sv->sv_dablocks;
+	while (*dbp != NULL && (*dbp)->db_fileblock < lastblock) {
+		dbp = &(*dbp)->db_next;
+	}
+	if (*dbp != NULL && (*dbp)->db_fileblock == lastblock &&
+	    blockoff > 0) {
+		bzero((*dbp)->db_data + blockoff, SFS_BLOCKSIZE - blockoff);
+		dbp = &(*dbp)->db_next;
+	}
+	while (*dbp != NULL) {
+		sfs_delalloc_remove(sv, dbp,
+				    sfs_delalloc_cost((*dbp)->db_fileblock));
+	}
+}
+
+/*
+ * Flush the delayed data of every file on the volume, for sync.
+ *
+ * We can't hold sfs_vnlock (or sfs_freemaplock) while taking vnode
+ * locks, so pick vnodes off the list one at a time and hold a
+ * reference while flushing each. Reclaim takes a vnode off the list
+ * while holding sfs_vnlock, so anything we find there is still alive.
+ * Only go around as many times as there were vnodes on the list to
+ * begin with, in case someone is busily adding more.
+ *
+ * Locking: gets/releases sfs_vnlock, sfs_freemaplock, and vnode
+ * locks, one at a time.
+ */
+int
+sfs_delalloc_syncall(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv;
+	unsigned count;
+	int result;
+
+	lock_acquire(sfs->sfs_vnlock);
+	lock_acquire(sfs->sfs_freemaplock);
+	count = 0;
+	for (sv = sfs->sfs_delayed; sv != NULL; sv = sv->sv_da_next) {
+		count++;
+	}
+	lock_release(sfs->sfs_freemaplock);
+	lock_release(sfs->sfs_vnlock);
+
+	while (count-- > 0) {
+		lock_acquire(sfs->sfs_vnlock);
+		lock_acquire(sfs->sfs_freemaplock);
+		sv = sfs->sfs_delayed;
+		if (sv != NULL) {
+			VOP_INCREF(&sv->sv_absvn);
+		}
+		lock_release(sfs->sfs_freemaplock);
+		lock_release(sfs->sfs_vnlock);
+
+		if (sv == NULL) {
+			break;
+		}
+
+		rwlock_acquire_write(sv->sv_lock);
+		reserve_buffers(SFS_BLOCKSIZE);
+		result = sfs_delalloc_flush(sv);
+		unreserve_buffers(SFS_BLOCKSIZE);
+		rwlock_release_write(sv->sv_lock);
+
+		VOP_DECREF(&sv->sv_absvn);
+
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Find the delayed data for file block FILEBLOCK, which has no disk
+ * block. If there isn't any and CREATE is set, make some (zero
+ * filled), flushing the file's other delayed blocks first if it has
+ * too many. Returns NULL in *RET if the block should be allocated
+ * right away instead.
+ *
+ * Locking: must hold vnode lock. Gets/releases sfs_freemaplock.
+ *
+ * Requires up to 3 buffers.
+ */
+static
+int
+sfs_delalloc_get(struct sfs_vnode *sv, uint32_t fileblock, bool create,
+		 struct sfs_dablock **ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dablock **dbp, *db;
+	bool full;
+	int result;
+
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
+	KASSERT(!create || rwlock_do_i_hold_write(sv->sv_lock));
+
+	*ret = NULL;
+
+	dbp = &sv->sv_dablocks;
+	while (*dbp != NULL && (*dbp)->db_fileblock < fileblock) {
+		dbp = &(*dbp)->db_next;
+	}
+	if (*dbp != NULL && (*dbp)->db_fileblock == fileblock) {
+		*ret = *dbp;
+		return 0;
+	}
+
+	if (!create || sv->sv_type != SFS_TYPE_FILE) {
+		return 0;
+	}
+
+	if (sv->sv_ndablocks >= SFS_DELALLOC_FILEMAX) {
+		result = sfs_delalloc_flush(sv);
+		if (result) {
+			return result;
+		}
+		dbp = &sv->sv_dablocks;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	full = sfs->sfs_ndablocks >= SFS_DELALLOC_MAX;
+	lock_release(sfs->sfs_freemaplock);
+	if (full) {
+		return 0;
+	}
+
+	db = kmalloc(sizeof(*db));
+	if (db == NULL) {
+		return 0;
+	}
+	result = sfs_breserve(sv, sfs_delalloc_cost(fileblock));
+	if (result) {
+		/* Might still be room for the block itself */
+		kfree(db);
+		return 0;
+	}
+	db->db_fileblock = fileblock;
+	bzero(db->db_data, SFS_BLOCKSIZE);
+
+	db->db_next = *dbp;
+	*dbp = db;
+	sv->sv_ndablocks++;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	sfs->sfs_ndablocks++;
+	if (sv->sv_ndablocks == 1) {
+		sfs_delalloc_link(sfs, sv);
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	*ret = db;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Inline data
+
+/*
+ * Small files keep their data in the inode itself (sfi_inline) when
+ * the volume allows it; see kern/sfs.h. New files start out that way
+ * (sfs_loadvnode) and sfs_io reads and writes the inode directly.
+ * The first write or truncate that would take the file past
+ * SFS_INLINE_SIZE moves the data out to file block 0 and clears the
+ * flag; after that the file is an ordinary file for good, even if it
+ * shrinks again.
+ */
+
+/*
+ * Move an inline file's data out to a real (or delayed) block 0.
+ *
+ * Locking: must hold vnode lock. May get/release sfs_freemaplock.
+ *
+ * Requires up to 3 buffers.
+ */
+int
+sfs_inline_unpack(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *dino;
+	struct sfs_dablock *db;
+	struct buf *iobuf;
+	daddr_t diskblock;
+	char *ioptr;
+	uint32_t size;
+	int result;
+
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		return result;
+	}
+	dino = sfs_dinode_map(sv);
+	KASSERT(dino->sfi_flags & SFS_DINODE_INLINE);
+	size = dino->sfi_size;
+	KASSERT(size <= SFS_INLINE_SIZE);
+
+	/* Clear the flag first so sfs_bmap will allocate for us */
+	dino->sfi_flags &= ~SFS_DINODE_INLINE;
+
+	if (size > 0) {
+		result = sfs_delalloc_get(sv, 0, true, &db);
+		if (result) {
+			goto fail;
+		}
+		if (db != NULL) {
+			memcpy(db->db_data, dino->sfi_inline, size);
+		}
+		else {
+			result = sfs_bmap(sv, 0, true, &diskblock);
+			if (result) {
+				goto fail;
+			}
+			/* sfs_balloc_file zeroed it, so this won't do I/O */
+			result = buffer_read(&sfs->sfs_absfs, diskblock,
+					     SFS_BLOCKSIZE, &iobuf);
+			if (result) {
+				/* Unmap the block again so we can stay inline */
+				dino->sfi_direct[0] = 0;
+				buffer_drop(&sfs->sfs_absfs, diskblock,
+					    SFS_BLOCKSIZE);
+				sfs_bfree(sfs, diskblock);
+				goto fail;
+			}
+			ioptr = buffer_map(iobuf);
+			memcpy(ioptr, dino->sfi_inline, size);
+			buffer_set_owner(iobuf, &sv->sv_absvn);
+			buffer_mark_dirty(iobuf);
+			buffer_release(iobuf);
+		}
+	}
+
+	bzero(dino->sfi_inline, sizeof(dino->sfi_inline));
+	sfs_dinode_mark_dirty(sv);
+	sfs_dinode_unload(sv);
+	return 0;
+
+ fail:
+	dino->sfi_flags |= SFS_DINODE_INLINE;
+	sfs_dinode_unload(sv);
+	return result;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
@@ -196,6 +820,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dablock *db;
 	struct buf *iobuffer;
 	char *ioptr;
 	daddr_t diskblock;
@@ -205,14 +830,14 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	/* Allocate missing blocks if and only if we're writing */
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
-	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	/* Get the disk block number, if there is one yet */
+	result = sfs_bmap(sv, fileblock, false, &diskblock);
 	if (result) {
 		return result;
 	}
@@ -220,24 +845,36 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 *
-		 * We must be reading, or sfs_bmap would have
-		 * allocated a block for us.
-		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(len, uio);
-	}
-	else {
-		/*
-		 * Read the block.
+		 * Use the delayed-allocation data if there is some, or
+		 * make some if we're writing.
 		 */
-		result = buffer_read(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE,
-				     &iobuffer);
+		result = sfs_delalloc_get(sv, fileblock, doalloc, &db);
+		if (result) {
+			return result;
+		}
+		if (db != NULL) {
+			return uiomove(db->db_data + skipstart, len, uio);
+		}
+		if (!doalloc) {
+			return uiomovezeros(len, uio);
+		}
+
+		/* Can't wait; allocate a block now. */
+		result = sfs_bmap(sv, fileblock, true, &diskblock);
 		if (result) {
 			return result;
 		}
 	}
 
+	/*
+	 * Read the block.
+	 */
+	result = buffer_read(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE,
+			     &iobuffer);
+	if (result) {
+		return result;
+	}
+
 	/*
 	 * Now perform the requested operation into/out of the buffer.
 	 */
@@ -252,6 +889,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	 * If it was a write, mark the modified block dirty.
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
+		buffer_set_owner(iobuffer, &sv->sv_absvn);
 		buffer_mark_dirty(iobuffer);
 	}
 
@@ -271,6 +909,7 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dablock *db;
 	struct buf *iobuf;
 	void *ioptr;
 	daddr_t diskblock;
@@ -278,26 +917,38 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	/* Look up the disk block number, if there is one yet */
+	result = sfs_bmap(sv, fileblock, false, &diskblock);
 	if (result) {
 		return result;
 	}
 
 	if (diskblock == 0) {
 		/*
-		 * No block - fill with zeros.
-		 *
-		 * We must be reading, or sfs_bmap would have
-		 * allocated a block for us.
+		 * No block - use the delayed-allocation data, or make
+		 * some if we're writing, or else fill with zeros.
 		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+		result = sfs_delalloc_get(sv, fileblock, doalloc, &db);
+		if (result) {
+			return result;
+		}
+		if (db != NULL) {
+			return uiomove(db->db_data, SFS_BLOCKSIZE, uio);
+		}
+		if (!doalloc) {
+			return uiomovezeros(SFS_BLOCKSIZE, uio);
+		}
+
+		/* Can't wait; allocate a block now. */
+		result = sfs_bmap(sv, fileblock, true, &diskblock);
+		if (result) {
+			return result;
+		}
 	}
 
 	if (uio->uio_rw == UIO_READ) {
@@ -323,6 +974,7 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	if (uio->uio_rw == UIO_WRITE) {
+		buffer_set_owner(iobuf, &sv->sv_absvn);
 		buffer_mark_valid(iobuf);
 		buffer_mark_dirty(iobuf);
 	}
@@ -331,10 +983,101 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	return 0;
 }
 
+/*
+ * Start read-ahead after a file read that covered file blocks
+ * FIRSTBLOCK through LASTBLOCK.
+ *
+ * If the read began where the previous one left off (or in the same
+ * block, for reads smaller than a block) the file is being read
+ * sequentially, so ask the buffer cache to fetch the next several
+ * blocks in the background. The window doubles each time this holds,
+ * up to SFS_READAHEAD_MAX; a read anywhere else resets it.
+ *
+ * Several readers can be here at once, so the read-ahead state is
+ * updated under sv_ralock, and each reader claims the blocks it's
+ * going to ask for before letting go of it.
+ *
+ * Locking: must hold vnode lock (either way). Gets/releases
+ * sv_ralock.
+ *
+ * Requires up to 2 buffers.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, uint32_t firstblock, uint32_t lastblock,
+	      off_t filesize)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t block, endblock, fileblocks;
+	daddr_t diskblock;
+	int result;
+
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
+
+	spinlock_acquire(&sv->sv_ralock);
+	if (firstblock != sv->sv_ra_next && firstblock + 1 != sv->sv_ra_next) {
+		/* Seek; start over. */
+		sv->sv_ra_next = lastblock + 1;
+		sv->sv_ra_issued = 0;
+		sv->sv_ra_window = 0;
+		spinlock_release(&sv->sv_ralock);
+		return;
+	}
+
+	if (lastblock + 1 > sv->sv_ra_next) {
+		/* Made progress; widen the window. */
+		if (sv->sv_ra_window == 0) {
+			sv->sv_ra_window = SFS_READAHEAD_MIN;
+		}
+		else if (sv->sv_ra_window < SFS_READAHEAD_MAX) {
+			sv->sv_ra_window *= 2;
+		}
+		sv->sv_ra_next = lastblock + 1;
+	}
+
+	endblock = sv->sv_ra_next + sv->sv_ra_window;
+	fileblocks = DIVROUNDUP(filesize, SFS_BLOCKSIZE);
+	if (endblock > fileblocks) {
+		endblock = fileblocks;
+	}
+
+	/* Don't ask again for blocks we (or anyone) already asked for. */
+	block = sv->sv_ra_next;
+	if (block < sv->sv_ra_issued) {
+		block = sv->sv_ra_issued;
+	}
+	if (block < endblock) {
+		sv->sv_ra_issued = endblock;
+	}
+	spinlock_release(&sv->sv_ralock);
+
+	for (; block < endblock; block++) {
+		result = sfs_bmap(sv, block, false/*doalloc*/, &diskblock);
+		if (result) {
+			/* It's only read-ahead; don't bother. */
+			break;
+		}
+		if (diskblock == 0) {
+			/* Hole in the file; nothing to read. */
+			continue;
+		}
+		buffer_readahead(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE);
+	}
+	if (block < endblock) {
+		/* Gave up early; let a later read try the rest. */
+		spinlock_acquire(&sv->sv_ralock);
+		if (sv->sv_ra_issued == endblock) {
+			sv->sv_ra_issued = block;
+		}
+		spinlock_release(&sv->sv_ralock);
+	}
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
  *
- * Locking: must hold vnode lock. May get/release sfs_freemaplock.
+ * Locking: must hold vnode lock; for writing, if writing. May
+ * get/release sfs_freemaplock.
  *
  * Requires up to 3 buffers.
  */
@@ -345,9 +1088,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	uint32_t firstblock;
 	struct sfs_dinode *inodeptr;
+	off_t size = 0;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
+	KASSERT(uio->uio_rw == UIO_READ ||
+		rwlock_do_i_hold_write(sv->sv_lock));
 
 	origresid = uio->uio_resid;
 
@@ -363,7 +1110,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	 * add it back to uio_resid at the end.
 	 */
 	if (uio->uio_rw == UIO_READ) {
-		off_t size, endpos;
+		off_t endpos;
 
 		size = inodeptr->sfi_size;
 		endpos = uio->uio_offset + uio->uio_resid;
@@ -381,6 +1128,40 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		}
 	}
 
+	firstblock = uio->uio_offset / SFS_BLOCKSIZE;
+
+	/*
+	 * Inline files are read and written right in the inode, unless
+	 * this write makes the file too big; then move the data out
+	 * and carry on as usual.
+	 */
+	if (inodeptr->sfi_flags & SFS_DINODE_INLINE) {
+		if (uio->uio_rw == UIO_READ ||
+		    uio->uio_offset + uio->uio_resid <= SFS_INLINE_SIZE) {
+			result = uiomove(inodeptr->sfi_inline +
+					 uio->uio_offset,
+					 uio->uio_resid, uio);
+			if (uio->uio_rw == UIO_WRITE) {
+				sfs_dinode_mark_dirty(sv);
+			}
+			goto out;
+		}
+		result = sfs_inline_unpack(sv);
+		if (result) {
+			goto out;
+		}
+	}
+
+	/*
+	 * Readers don't need the inode again (sfs_bmap loads it as it
+	 * goes), so let other readers at it while we do the I/O.
+	 * Writers keep it to update the size at the end.
+	 */
+	if (uio->uio_rw == UIO_READ) {
+		sfs_dinode_unload(sv);
+		inodeptr = NULL;
+	}
+
 	/*
 	 * First, do any leading partial block.
 	 */
@@ -442,7 +1223,19 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		inodeptr->sfi_size = uio->uio_offset;
 		sfs_dinode_mark_dirty(sv);
 	}
-	sfs_dinode_unload(sv);
+
+	/*
+	 * If reading sequentially, get the next blocks coming. (If
+	 * we still have the inode, it was an inline read.)
+	 */
+	if (result == 0 && uio->uio_rw == UIO_READ &&
+	    uio->uio_resid != origresid && inodeptr == NULL) {
+		sfs_readahead(sv, firstblock,
+			      (uio->uio_offset - 1) / SFS_BLOCKSIZE, size);
+	}
+	if (inodeptr != NULL) {
+		sfs_dinode_unload(sv);
+	}
 
 	/* Add in any extra amount we couldn't read because of EOF */
 	uio->uio_resid += extraresid;
@@ -451,6 +1244,285 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	return result;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Direct I/O
+
+/*
+ * Files opened with O_DIRECT come here (via VOP_DIRECTIO) instead of
+ * sfs_io. Whole blocks are mapped with sfs_bmap and runs of
+ * consecutive disk blocks go straight between the device and the
+ * caller's buffer in one DEVOP_IO, without passing through the
+ * buffer cache. Anything that isn't block-aligned, and inline files,
+ * just go through sfs_io as usual.
+ *
+ * To keep the cache coherent, before a direct read each block is
+ * flushed if the cache has it dirty, and delayed-allocation data
+ * (which is only in memory) is copied out of memory instead. Before
+ * a direct write, the file's delayed data is given real blocks, and
+ * the cached copy (if any) of every block about to be written is
+ * thrown away, dirty or not, since it's entirely overwritten. This
+ * includes the zeroed buffer sfs_balloc_file leaves for a newly
+ * allocated block.
+ *
+ * Read-ahead is done by the buffer cache's I/O threads, which don't
+ * take the vnode lock, so one issued earlier could read a block back
+ * in between dropping it and writing it. So before dropping the
+ * blocks, any read-ahead still queued for them is cancelled and any
+ * I/O already in progress on them is waited for. New read-ahead for
+ * the file's blocks is only requested under the vnode lock, which we
+ * hold, so after that nothing can bring the old contents back.
+ */
+
+/* Statistics */
+static struct spinlock sfs_dio_lock = SPINLOCK_INITIALIZER;
+static unsigned sfs_diostats_calls;
+static unsigned sfs_diostats_fallbacks;
+static unsigned sfs_diostats_runs;
+static uint64_t sfs_diostats_blocks;
+
+/*
+ * Transfer NUM blocks starting at disk block DISKBLOCK directly
+ * to or from UIO, and advance UIO past them.
+ */
+static
+int
+sfs_dio_run(struct sfs_fs *sfs, daddr_t diskblock, unsigned num,
+	    struct uio *uio)
+{
+	struct iovec iov;
+	struct uio ku;
+	size_t len, done;
+	int result;
+
+	KASSERT(uio->uio_iovcnt == 1);
+
+	len = num * SFS_BLOCKSIZE;
+	KASSERT(len <= uio->uio_resid);
+
+	iov = *uio->uio_iov;
+	iov.iov_len = len;
+	ku.uio_iov = &iov;
+	ku.uio_iovcnt = 1;
+	ku.uio_offset = (off_t)diskblock * SFS_BLOCKSIZE;
+	ku.uio_resid = len;
+	ku.uio_segflg = uio->uio_segflg;
+	ku.uio_rw = uio->uio_rw;
+	ku.uio_space = uio->uio_space;
+
+	DEBUG(DB_SFS, "sfs: direct %s %u-%u\n",
+	      uio->uio_rw == UIO_READ ? "read" : "write",
+	      diskblock, diskblock + num - 1);
+
+	result = DEVOP_IO(sfs->sfs_device, &ku);
+	if (result == EINVAL) {
+		/* as in sfs_rwblock */
+		panic("sfs: %s: DEVOP_IO returned EINVAL\n",
+		      sfs->sfs_sb.sb_volname);
+	}
+
+	/* Advance the caller's uio by however much got done */
+	done = len - ku.uio_resid;
+	uio->uio_iov->iov_kbase = (char *)uio->uio_iov->iov_kbase + done;
+	uio->uio_iov->iov_len -= done;
+	uio->uio_offset += done;
+	uio->uio_resid -= done;
+
+	spinlock_acquire(&sfs_dio_lock);
+	sfs_diostats_runs++;
+	sfs_diostats_blocks += done / SFS_BLOCKSIZE;
+	spinlock_release(&sfs_dio_lock);
+
+	return result;
+}
+
+/*
+ * Direct I/O on a regular file.
+ *
+ * Locking: must hold vnode lock. May get/release sfs_freemaplock.
+ *
+ * Requires up to 3 buffers.
+ */
+int
+sfs_dio(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *inodeptr;
+	struct sfs_dablock *db;
+	bool write = (uio->uio_rw == UIO_WRITE);
+	daddr_t diskblock, nextblock;
+	uint32_t fileblock, num, i;
+	off_t size, endpos;
+	size_t directlen;
+	int result;
+
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
+	spinlock_acquire(&sfs_dio_lock);
+	sfs_diostats_calls++;
+	spinlock_release(&sfs_dio_lock);
+
+	if (uio->uio_offset % SFS_BLOCKSIZE != 0 ||
+	    uio->uio_resid % SFS_BLOCKSIZE != 0 ||
+	    uio->uio_iovcnt != 1) {
+		goto fallback;
+	}
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		return result;
+	}
+	inodeptr = sfs_dinode_map(sv);
+	size = inodeptr->sfi_size;
+
+	if (inodeptr->sfi_flags & SFS_DINODE_INLINE) {
+		endpos = uio->uio_offset + uio->uio_resid;
+		if (!write || endpos <= SFS_INLINE_SIZE) {
+			sfs_dinode_unload(sv);
+			goto fallback;
+		}
+		result = sfs_inline_unpack(sv);
+		if (result) {
+			sfs_dinode_unload(sv);
+			return result;
+		}
+	}
+
+	/*
+	 * Figure out how much to do directly. A read stops at the last
+	 * whole block before EOF; sfs_io does the rest, if any.
+	 */
+	if (write) {
+		directlen = uio->uio_resid;
+		result = sfs_delalloc_flush(sv);
+		if (result) {
+			sfs_dinode_unload(sv);
+			return result;
+		}
+	}
+	else if (uio->uio_offset >= size) {
+		directlen = 0;
+	}
+	else {
+		directlen = size - uio->uio_offset;
+		if (directlen > uio->uio_resid) {
+			directlen = uio->uio_resid;
+		}
+		directlen -= directlen % SFS_BLOCKSIZE;
+	}
+
+	result = 0;
+	while (directlen > 0) {
+		fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+		result = sfs_bmap(sv, fileblock, write, &diskblock);
+		if (result) {
+			break;
+		}
+
+		if (diskblock == 0) {
+			/* Hole, or delayed data, when reading */
+			KASSERT(!write);
+			result = sfs_delalloc_get(sv, fileblock, false, &db);
+			if (result) {
+				break;
+			}
+			if (db != NULL) {
+				result = uiomove(db->db_data, SFS_BLOCKSIZE,
+						 uio);
+			}
+			else {
+				result = uiomovezeros(SFS_BLOCKSIZE, uio);
+			}
+			if (result) {
+				break;
+			}
+			directlen -= SFS_BLOCKSIZE;
+			continue;
+		}
+
+		/* Extend the run as far as the disk blocks are consecutive */
+		for (num = 1; num < directlen / SFS_BLOCKSIZE; num++) {
+			result = sfs_bmap(sv, fileblock + num, write,
+					  &nextblock);
+			if (result || nextblock != diskblock + num) {
+				break;
+			}
+		}
+		if (result) {
+			break;
+		}
+
+		/* Make the cache agree */
+		if (write) {
+			buffer_cancel_io(&sfs->sfs_absfs, diskblock, num);
+		}
+		for (i=0; i<num; i++) {
+			if (write) {
+				buffer_drop(&sfs->sfs_absfs, diskblock + i,
+					    SFS_BLOCKSIZE);
+			}
+			else {
+				result = buffer_flush(&sfs->sfs_absfs,
+						      diskblock + i,
+						      SFS_BLOCKSIZE);
+				if (result) {
+					break;
+				}
+			}
+		}
+		if (result) {
+			break;
+		}
+
+		result = sfs_dio_run(sfs, diskblock, num, uio);
+		if (result) {
+			break;
+		}
+		directlen -= num * SFS_BLOCKSIZE;
+	}
+
+	/* If writing and we did anything, adjust file length */
+	if (write && uio->uio_offset > size) {
+		inodeptr->sfi_size = uio->uio_offset;
+		sfs_dinode_mark_dirty(sv);
+	}
+	sfs_dinode_unload(sv);
+
+	if (result || uio->uio_resid == 0) {
+		return result;
+	}
+
+	/* A read's partial last block, or nothing; sfs_io copes either way */
+	return sfs_io(sv, uio);
+
+ fallback:
+	spinlock_acquire(&sfs_dio_lock);
+	sfs_diostats_fallbacks++;
+	spinlock_release(&sfs_dio_lock);
+	return sfs_io(sv, uio);
+}
+
+/*
+ * Print the direct I/O statistics.
+ */
+void
+sfs_dio_printstats(void)
+{
+	unsigned calls, fallbacks, runs;
+	uint64_t blocks;
+
+	spinlock_acquire(&sfs_dio_lock);
+	calls = sfs_diostats_calls;
+	fallbacks = sfs_diostats_fallbacks;
+	runs = sfs_diostats_runs;
+	blocks = sfs_diostats_blocks;
+	spinlock_release(&sfs_dio_lock);
+
+	kprintf("sfs: %u direct I/O calls (%u through the cache), "
+		"%llu blocks in %u runs\n",
+		calls, fallbacks, (unsigned long long)blocks, runs);
+}
+
 ////////////////////////////////////////////////////////////
 // Metadata I/O
 
@@ -480,7 +1552,8 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	bool doalloc;
 	int result;
 
-	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(rwlock_do_i_hold(sv->sv_lock));
+	KASSERT(rw == UIO_READ || rwlock_do_i_hold_write(sv->sv_lock));
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
@@ -530,6 +1603,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	else {
 		/* Update the selected region */
 		memcpy(ioptr + blockoffset, data, len);
+		buffer_set_owner(iobuf, &sv->sv_absvn);
 		buffer_mark_dirty(iobuf);
 
 		/* Update the vnode size if needed */
@@ -34,6 +34,7 @@
 #include <synch.h>
 #include <proc.h>
 #include <current.h>
+#include <clock.h>
 #include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -101,6 +102,13 @@ struct sfs_jphys {
 
 	uint32_t jp_odometer;		/* counter of jblocks used */
 
+	bool jp_gcleader;		/* a group commit is in progress */
+	bool jp_gcsealed;		/* ...and is no longer taking joiners */
+	unsigned jp_gcwaiters;		/* flushes in the commit so far */
+	unsigned jp_gcqueued;		/* flushes waiting for the next one */
+	sfs_lsn_t jp_gcdonelsn;		/* last commit flushed through here */
+	struct cv *jp_gccv;		/* to wait for the commit */
+
 	struct spinlock jp_lsnmaplock;	/* lock for the following */
 	sfs_lsn_t *jp_firstlsns;	/* first lsn in each journal block */
 	uint32_t jp_oldestjblock;	/* oldest journal block in memory */
@@ -540,6 +548,166 @@ sfs_jphys_write(struct sfs_fs *sfs,
 					code, rec, len);
 }
 
+////////////////////////////////////////////////////////////
+// group commit
+
+/*
+ * Flushing a record that's in the current journal head block means
+ * padding out the block and writing it, so if several threads each
+ * fsync at about the same time, each one would write its own mostly
+ * empty journal block. Instead, the first one to come along (the
+ * leader) waits up to sfs_gc_window microseconds, or until
+ * sfs_gc_batch flushes have piled up, before closing the block.
+ * Flushes that arrive meanwhile join the commit: they sleep, and the
+ * leader writes out the journal for all of them and then wakes them
+ * all up together. Flushes that arrive while the leader is writing
+ * wait for it to finish and then start the next commit. Setting the
+ * window to 0 turns this off.
+ *
+ * There's no sub-tick sleep, so the leader waits by yielding. It
+ * stops early once a yield brings in no new joiners and nobody is
+ * still on the way from the previous commit, so a flush with nobody
+ * else around costs one yield rather than the whole window.
+ *
+ * The settings and stats are global, for all volumes, and protected
+ * by sfs_gc_lock.
+ */
+
+static struct spinlock sfs_gc_lock = SPINLOCK_INITIALIZER;
+static unsigned sfs_gc_window = 500;		/* usecs */
+static unsigned sfs_gc_batch = 8;
+static unsigned sfs_gcstats_commits;		/* head blocks closed */
+static unsigned sfs_gcstats_flushes;		/* flushes they served */
+static unsigned sfs_gcstats_maxbatch;
+
+/* Mount-time stats for sfs_jphys_loadup, protected by sfs_loadstats_lock */
+static struct spinlock sfs_loadstats_lock = SPINLOCK_INITIALIZER;
+static unsigned sfs_loadstats_hinted;		/* loadups that used the hint */
+static unsigned sfs_loadstats_scanned;		/* loadups that scanned */
+static unsigned sfs_loadstats_lastusec;		/* how long the last one took */
+static bool sfs_loadstats_lasthinted;
+
+/*
+ * Set a group commit parameter: "window" (in microseconds) or
+ * "batch" (flushes).
+ */
+int
+sfs_jphys_setgroupcommit(const char *name, unsigned val)
+{
+	spinlock_acquire(&sfs_gc_lock);
+	if (!strcmp(name, "window")) {
+		sfs_gc_window = val;
+	}
+	else if (!strcmp(name, "batch") && val > 0) {
+		sfs_gc_batch = val;
+	}
+	else {
+		spinlock_release(&sfs_gc_lock);
+		return EINVAL;
+	}
+	spinlock_release(&sfs_gc_lock);
+	return 0;
+}
+
+/*
+ * Print the group commit settings and stats.
+ */
+void
+sfs_jphys_printstats(void)
+{
+	unsigned window, batch, commits, flushes, maxbatch;
+	unsigned hinted, scanned, lastusec;
+	bool lasthinted;
+	uint64_t avg100;
+
+	spinlock_acquire(&sfs_gc_lock);
+	window = sfs_gc_window;
+	batch = sfs_gc_batch;
+	commits = sfs_gcstats_commits;
+	flushes = sfs_gcstats_flushes;
+	maxbatch = sfs_gcstats_maxbatch;
+	spinlock_release(&sfs_gc_lock);
+
+	kprintf("sfs: journal group commit window %u us, batch %u\n",
+		window, batch);
+	avg100 = commits > 0 ? (uint64_t)flushes * 100 / commits : 0;
+	kprintf("sfs: %u journal commits for %u flushes, "
+		"%u.%02u avg, %u max\n", commits, flushes,
+		(unsigned)(avg100 / 100), (unsigned)(avg100 % 100), maxbatch);
+
+	spinlock_acquire(&sfs_loadstats_lock);
+	hinted = sfs_loadstats_hinted;
+	scanned = sfs_loadstats_scanned;
+	lastusec = sfs_loadstats_lastusec;
+	lasthinted = sfs_loadstats_lasthinted;
+	spinlock_release(&sfs_loadstats_lock);
+
+	kprintf("sfs: %u journal loadups from hints, %u by scanning; "
+		"last took %u us (%s)\n", hinted, scanned, lastusec,
+		lasthinted ? "hint" : "scan");
+}
+
+/*
+ * Wait out the group commit window, as the leader, or until the
+ * joiners stop coming. Returns with the jphys lock held, but drops it
+ * while waiting.
+ */
+static
+void
+sfs_jphys_gcwait(struct sfs_jphys *jp, unsigned window, unsigned batch)
+{
+	struct timespec start, now, diff;
+	unsigned seen;
+
+	gettime(&start);
+	while (jp->jp_gcwaiters < batch) {
+		gettime(&now);
+		timespec_sub(&now, &start, &diff);
+		if (diff.tv_sec > 0 || (unsigned)diff.tv_nsec / 1000 >= window) {
+			break;
+		}
+		seen = jp->jp_gcwaiters;
+		lock_release(jp->jp_lock);
+		thread_yield();
+		lock_acquire(jp->jp_lock);
+		if (jp->jp_gcwaiters == seen && jp->jp_gcqueued == 0) {
+			/* nobody else is coming */
+			break;
+		}
+	}
+}
+
+/*
+ * Record a finished commit, which flushed through LSN, and wake
+ * everyone who joined it.
+ */
+static
+void
+sfs_jphys_gcdone(struct sfs_jphys *jp, sfs_lsn_t lsn)
+{
+	unsigned waiters;
+
+	KASSERT(lock_do_i_hold(jp->jp_lock));
+	KASSERT(jp->jp_gcleader && jp->jp_gcsealed);
+
+	waiters = jp->jp_gcwaiters;
+	jp->jp_gcwaiters = 0;
+	jp->jp_gcleader = false;
+	jp->jp_gcsealed = false;
+	if (lsn > jp->jp_gcdonelsn) {
+		jp->jp_gcdonelsn = lsn;
+	}
+	cv_broadcast(jp->jp_gccv, jp->jp_lock);
+
+	spinlock_acquire(&sfs_gc_lock);
+	sfs_gcstats_commits++;
+	sfs_gcstats_flushes += waiters;
+	if (waiters > sfs_gcstats_maxbatch) {
+		sfs_gcstats_maxbatch = waiters;
+	}
+	spinlock_release(&sfs_gc_lock);
+}
+
 ////////////////////////////////////////////////////////////
 // journal flushing
 
@@ -684,7 +852,7 @@ sfs_jphys_flush_upto_jblock(struct sfs_fs *sfs, uint32_t endjblock)
  *
  * - If the LSN we want to write out is in the current journal head
  * block, we need to pad the current head block and get a new one.
- * We do this first.
+ * We do this first. This is where group commit (above) comes in.
  */
 int
 sfs_jphys_flush(struct sfs_fs *sfs, sfs_lsn_t lsn)
@@ -692,6 +860,8 @@ sfs_jphys_flush(struct sfs_fs *sfs, sfs_lsn_t lsn)
 	struct sfs_jphys *jp = sfs->sfs_jphys;
 	uint32_t jblock, headjblock;
 	sfs_lsn_t headfirstlsn;
+	unsigned window, batch;
+	bool leader = false;
 
 	if (lsn == 0) {
 		/*
@@ -705,6 +875,47 @@ sfs_jphys_flush(struct sfs_fs *sfs, sfs_lsn_t lsn)
 
 	KASSERT(lsn < jp->jp_nextlsn);
 
+	spinlock_acquire(&sfs_gc_lock);
+	window = sfs_gc_window;
+	batch = sfs_gc_batch;
+	spinlock_release(&sfs_gc_lock);
+
+	while (window > 0 && lsn >= jp->jp_headfirstlsn &&
+	       jp->jp_headbyte > 0 && jp->jp_gettingnext != curthread) {
+		if (!jp->jp_gcleader) {
+			/* Lead a commit; give others a chance to join. */
+			leader = true;
+			jp->jp_gcleader = true;
+			jp->jp_gcwaiters = 1;
+			sfs_jphys_gcwait(jp, window, batch);
+			jp->jp_gcsealed = true;
+
+			/* Don't close the head until the next is ready */
+			while (jp->jp_nextbuf == NULL) {
+				cv_wait(jp->jp_nextcv, jp->jp_lock);
+			}
+
+			/* Flush everything the joiners might want */
+			lsn = jp->jp_nextlsn - 1;
+			break;
+		}
+		if (!jp->jp_gcsealed) {
+			/* Join the commit in progress and wait for it. */
+			jp->jp_gcwaiters++;
+			while (jp->jp_gcdonelsn < lsn) {
+				cv_wait(jp->jp_gccv, jp->jp_lock);
+			}
+			lock_release(jp->jp_lock);
+			return 0;
+		}
+		/* Too late to join; wait for it and look again. */
+		jp->jp_gcqueued++;
+		while (jp->jp_gcleader && jp->jp_gcsealed) {
+			cv_wait(jp->jp_gccv, jp->jp_lock);
+		}
+		jp->jp_gcqueued--;
+	}
+
 	if (lsn >= jp->jp_headfirstlsn && jp->jp_headbyte > 0) {
 		/*
 		 * We will need to flush out the current journal head;
@@ -751,6 +962,12 @@ sfs_jphys_flush(struct sfs_fs *sfs, sfs_lsn_t lsn)
 	KASSERT(lsn < headfirstlsn);
 
 	spinlock_release(&jp->jp_lsnmaplock);
+
+	if (leader) {
+		lock_acquire(jp->jp_lock);
+		sfs_jphys_gcdone(jp, lsn);
+		lock_release(jp->jp_lock);
+	}
 	return 0;
 }
 
@@ -782,6 +999,33 @@ sfs_jphys_flushforjournalblock(struct sfs_fs *sfs, daddr_t diskblock)
 	return 0;
 }
 
+/*
+ * Check if the journal blocks DISKBLOCK through DISKBLOCK+COUNT-1
+ * can be written out together, in order. They can unless the oldest
+ * unwritten journal block is partway through them; then the journal
+ * has wrapped around inside the run and the later blocks are older,
+ * so they need to be written first.
+ *
+ * The answer stays good as long as the caller is holding the buffers
+ * for the run, because jp_oldestjblock can't get past them.
+ */
+bool
+sfs_jphys_journalrun_inorder(struct sfs_fs *sfs, daddr_t diskblock,
+			     unsigned count)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+	uint32_t jblock, oldest;
+
+	jblock = diskblock - sfs->sfs_sb.sb_journalstart;
+	KASSERT(jblock + count <= sfs->sfs_sb.sb_journalblocks);
+
+	spinlock_acquire(&jp->jp_lsnmaplock);
+	oldest = jp->jp_oldestjblock;
+	spinlock_release(&jp->jp_lsnmaplock);
+
+	return !(oldest > jblock && oldest < jblock + count);
+}
+
 /*
  * Flush the whole journal.
  */ 
@@ -923,6 +1167,47 @@ sfs_jphys_clearodometer(struct sfs_jphys *jp)
 	lock_release(jp->jp_lock);
 }
 
+/*
+ * Record the journal head and tail in the in-memory superblock as a
+ * hint for the next mount. The journal must have just been flushed,
+ * and nothing more may be written to it; this is for unmount. The
+ * caller marks the superblock dirty and writes it out.
+ */
+void
+sfs_jphys_savehint(struct sfs_fs *sfs)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+
+	KASSERT(jp->jp_writermode);
+
+	lock_acquire(jp->jp_lock);
+	KASSERT(jp->jp_headbyte == 0);
+	KASSERT(jp->jp_headfirstlsn == jp->jp_nextlsn);
+	sfs->sfs_sb.sb_jhinthead = jp->jp_headjblock;
+	sfs->sfs_sb.sb_jhintheadlsn = jp->jp_nextlsn;
+	spinlock_acquire(&jp->jp_lsnmaplock);
+	sfs->sfs_sb.sb_jhinttail = jp->jp_memtailjblock;
+	sfs->sfs_sb.sb_jhinttaillsn = jp->jp_memtaillsn;
+	spinlock_release(&jp->jp_lsnmaplock);
+	sfs->sfs_sb.sb_jhintmagic = SFS_JHINT_MAGIC;
+	lock_release(jp->jp_lock);
+}
+
+/*
+ * Invalidate the journal hint in the in-memory superblock, once the
+ * journal is about to be written again. As with savehint, the caller
+ * marks the superblock dirty.
+ */
+void
+sfs_jphys_clearhint(struct sfs_fs *sfs)
+{
+	sfs->sfs_sb.sb_jhintmagic = 0;
+	sfs->sfs_sb.sb_jhinthead = 0;
+	sfs->sfs_sb.sb_jhinttail = 0;
+	sfs->sfs_sb.sb_jhintheadlsn = 0;
+	sfs->sfs_sb.sb_jhinttaillsn = 0;
+}
+
 ////////////////////////////////////////////////////////////
 // journal iterator (reader mode) interface
 
@@ -1599,9 +1884,8 @@ sfs_save_firstlsn(struct sfs_fs *sfs, struct sfs_jiter *ji)
  * process, provide the tail LSN and the position to start looking for
  * the tail. Always provide the head position and head LSN.
  *
- * FUTURE: find the head by binary search. We could also stash a
- * recent head position in the superblock and use that as a hint to
- * start searching.
+ * FUTURE: find the head by binary search. (After a clean unmount
+ * sfs_jphys_checkhint usually saves us from getting here at all.)
  */
 static
 int
@@ -1894,37 +2178,140 @@ sfs_scan_for_tail(struct sfs_fs *sfs,
 }
 
 /*
- * Overall function to load up the container, which is basically
- * recovery for the container-level information.
+ * Check the journal hint left in the superblock at the last clean
+ * unmount. If it's there and it matches what's on disk, set the
+ * recovery head and tail positions from it and return true; this
+ * reads only the head block and the blocks from the tail to the
+ * head. Otherwise return false and the caller scans the whole
+ * journal. (Read errors also give false; the scan will hit them too
+ * and report them properly.)
+ *
+ * The head block must not contain anything at or past the hinted
+ * head LSN; if it does, the journal was written after the hint was
+ * saved. The records from the start of the tail block up to the head
+ * must have increasing LSNs, include the tail LSN, and end with the
+ * LSN just before the head LSN.
  */
-int
-sfs_jphys_loadup(struct sfs_fs *sfs)
+static
+bool
+sfs_jphys_checkhint(struct sfs_fs *sfs,
+		    sfs_lsn_t *headlsn_ret, sfs_lsn_t *taillsn_ret)
 {
 	struct sfs_jphys *jp = sfs->sfs_jphys;
-	struct sfs_jposition tailsearchpos;
-	sfs_lsn_t headlsn, taillsn;
-	unsigned i, journalblocks;
+	const struct sfs_superblock *sb = &sfs->sfs_sb;
+	struct sfs_jposition headpos, tailpos, pos;
+	struct sfs_jiter *ji;
+	sfs_lsn_t headlsn, taillsn, thislsn, prevlsn;
+	bool foundtail;
 	int result;
 
-	KASSERT(!jp->jp_physrecovered);
+	if (sb->sb_jhintmagic != SFS_JHINT_MAGIC) {
+		return false;
+	}
 
-	KASSERT(jp->jp_firstlsns == NULL);
-	journalblocks = sfs->sfs_sb.sb_journalblocks;
-	jp->jp_firstlsns = kmalloc(sizeof(sfs_lsn_t) * journalblocks);
-	if (jp->jp_firstlsns == NULL) {
-		return ENOMEM;
+	headlsn = sb->sb_jhintheadlsn;
+	taillsn = sb->sb_jhinttaillsn;
+	if (sb->sb_jhinthead >= sb->sb_journalblocks ||
+	    sb->sb_jhinttail >= sb->sb_journalblocks ||
+	    sb->sb_jhinthead == sb->sb_jhinttail ||
+	    taillsn == 0 || taillsn >= headlsn) {
+		goto bad;
 	}
-	for (i=0; i<journalblocks; i++) {
-		jp->jp_firstlsns[i] = 0;
+
+	headpos.jp_jblock = sb->sb_jhinthead;
+	headpos.jp_blockoffset = 0;
+	tailpos.jp_jblock = sb->sb_jhinttail;
+	tailpos.jp_blockoffset = 0;
+
+	/* Look at the first record in the head block. */
+	ji = sfs_jiter_create(sfs, &headpos, &headpos, true /*seeall*/);
+	if (ji == NULL) {
+		return false;
+	}
+	result = sfs_jiter_seektail(sfs, ji);
+	thislsn = result ? 0 : sfs_jiter_lsn(ji);
+	sfs_jiter_destroy(ji);
+	if (result || thislsn >= headlsn) {
+		goto bad;
 	}
 
-	reserve_buffers(SFS_BLOCKSIZE);
+	/* Scan from the tail block to the head. */
+	ji = sfs_jiter_create(sfs, &tailpos, &headpos, true /*seeall*/);
+	if (ji == NULL) {
+		return false;
+	}
+	result = sfs_jiter_seektail(sfs, ji);
+	if (result) {
+		sfs_jiter_destroy(ji);
+		goto bad;
+	}
+
+	foundtail = false;
+	prevlsn = 0;
+	while (!sfs_jiter_done(ji)) {
+		result = sfs_jiter_read(sfs, ji);
+		if (result) {
+			sfs_jiter_destroy(ji);
+			goto bad;
+		}
+
+		sfs_save_firstlsn(sfs, ji);
+
+		thislsn = sfs_jiter_lsn(ji);
+		if (thislsn != 0) {
+			if (thislsn <= prevlsn) {
+				sfs_jiter_destroy(ji);
+				goto bad;
+			}
+			if (thislsn == taillsn) {
+				sfs_jiter_pos(ji, &pos);
+				foundtail = true;
+			}
+			prevlsn = thislsn;
+		}
+
+		result = sfs_jiter_next(sfs, ji);
+		if (result) {
+			sfs_jiter_destroy(ji);
+			goto bad;
+		}
+	}
+	sfs_jiter_destroy(ji);
+
+	if (!foundtail || prevlsn + 1 != headlsn) {
+		goto bad;
+	}
+
+	jp->jp_recov_headpos = headpos;
+	jp->jp_recov_tailpos = pos;
+	*headlsn_ret = headlsn;
+	*taillsn_ret = taillsn;
+	return true;
+
+bad:
+	kprintf("sfs: %s: journal hint is stale; scanning the journal\n",
+		sb->sb_volname);
+	return false;
+}
+
+/*
+ * Scan the whole journal to find the head and tail.
+ */
+static
+int
+sfs_jphys_scan(struct sfs_fs *sfs,
+	       sfs_lsn_t *headlsn_ret, sfs_lsn_t *taillsn_ret)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+	struct sfs_jposition tailsearchpos;
+	sfs_lsn_t headlsn, taillsn;
+	int result;
 
 	SAY("sfs_jphys: Scanning to find the journal head...\n");
 	result = sfs_scan_for_head(sfs, &tailsearchpos, &taillsn,
 				   &jp->jp_recov_headpos, &headlsn);
 	if (result) {
-		goto out;
+		return result;
 	}
 
 	SAY("[%u.%u] %llu: HEAD\n",
@@ -1940,7 +2327,7 @@ sfs_jphys_loadup(struct sfs_fs *sfs)
 		SAY("sfs_jphys: Scanning to find a trim record...\n");
 		result = sfs_scan_for_trim(sfs, &tailsearchpos, &taillsn);
 		if (result) {
-			goto out;
+			return result;
 		}
 	}
 
@@ -1954,9 +2341,69 @@ sfs_jphys_loadup(struct sfs_fs *sfs)
 	result = sfs_scan_for_tail(sfs, &tailsearchpos, taillsn,
 				   &jp->jp_recov_tailpos);
 	if (result) {
-		goto out;
+		return result;
+	}
+
+	*headlsn_ret = headlsn;
+	*taillsn_ret = taillsn;
+	return 0;
+}
+
+/*
+ * Overall function to load up the container, which is basically
+ * recovery for the container-level information.
+ */
+int
+sfs_jphys_loadup(struct sfs_fs *sfs)
+{
+	struct sfs_jphys *jp = sfs->sfs_jphys;
+	sfs_lsn_t headlsn, taillsn;
+	unsigned i, journalblocks;
+	struct timespec start, end, diff;
+	bool hinted;
+	int result;
+
+	KASSERT(!jp->jp_physrecovered);
+
+	KASSERT(jp->jp_firstlsns == NULL);
+	journalblocks = sfs->sfs_sb.sb_journalblocks;
+	jp->jp_firstlsns = kmalloc(sizeof(sfs_lsn_t) * journalblocks);
+	if (jp->jp_firstlsns == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<journalblocks; i++) {
+		jp->jp_firstlsns[i] = 0;
 	}
 
+	reserve_buffers(SFS_BLOCKSIZE);
+	gettime(&start);
+
+	result = 0;
+	hinted = sfs_jphys_checkhint(sfs, &headlsn, &taillsn);
+	if (!hinted) {
+		/* the hint check may have seeded some of these */
+		for (i=0; i<journalblocks; i++) {
+			jp->jp_firstlsns[i] = 0;
+		}
+		result = sfs_jphys_scan(sfs, &headlsn, &taillsn);
+		if (result) {
+			goto out;
+		}
+	}
+
+	gettime(&end);
+	timespec_sub(&end, &start, &diff);
+	spinlock_acquire(&sfs_loadstats_lock);
+	if (hinted) {
+		sfs_loadstats_hinted++;
+	}
+	else {
+		sfs_loadstats_scanned++;
+	}
+	sfs_loadstats_lastusec = diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+	sfs_loadstats_lasthinted = hinted;
+	spinlock_release(&sfs_loadstats_lock);
+
 	SAY("[%u.%u] %llu: TAIL\n",
 	    jp->jp_recov_tailpos.jp_jblock,
 	    jp->jp_recov_tailpos.jp_blockoffset,
@@ -2026,6 +2473,19 @@ sfs_jphys_create(void)
 
 	jp->jp_odometer = 0;
 
+	jp->jp_gcleader = false;
+	jp->jp_gcsealed = false;
+	jp->jp_gcwaiters = 0;
+	jp->jp_gcqueued = 0;
+	jp->jp_gcdonelsn = 0;
+	jp->jp_gccv = cv_create("sfs_groupcommit");
+	if (jp->jp_gccv == NULL) {
+		cv_destroy(jp->jp_nextcv);
+		lock_destroy(jp->jp_lock);
+		kfree(jp);
+		return NULL;
+	}
+
 	spinlock_init(&jp->jp_lsnmaplock);
 	jp->jp_firstlsns = NULL;
 	jp->jp_oldestjblock = 0;
@@ -2054,6 +2514,8 @@ sfs_jphys_destroy(struct sfs_jphys *jp)
 	kfree(jp->jp_firstlsns);
 	KASSERT(jp->jp_headbuf == NULL);
 	KASSERT(jp->jp_nextbuf == NULL);
+	KASSERT(jp->jp_gcleader == false);
+	cv_destroy(jp->jp_gccv);
 	cv_destroy(jp->jp_nextcv);
 	lock_destroy(jp->jp_lock);
 	kfree(jp);
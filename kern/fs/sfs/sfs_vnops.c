@@ -42,6 +42,7 @@
 #include <synch.h>
 #include <vfs.h>
 #include <buf.h>
+#include <namecache.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -49,6 +50,7 @@
  * Locking protocol for sfs:
  *    The following locks exist:
  *       vnode locks (sv_lock)
+ *       inode buffer locks (sv_dinolock)
  *       vnode table lock (sfs_vnlock)
  *       freemap lock (sfs_freemaplock)
  *       rename lock (sfs_renamelock)
@@ -56,6 +58,7 @@
  *
  *    Ordering constraints:
  *       rename lock       before  vnode locks
+ *       vnode locks       before  inode buffer locks
  *       vnode locks       before  vnode table lock
  *       vnode locks       before  buffer locks
  *       vnode table lock  before  freemap lock
@@ -69,6 +72,14 @@
  *
  *    Ordering among directory locks:
  *       Parent first, then child.
+ *
+ *    The vnode locks are reader-writer locks. Read, stat, getdirentry
+ *    and lookup only look at the file, so they take them for reading
+ *    and can run side by side; everything that changes anything takes
+ *    them for writing. Code running under a read lock must not
+ *    modify the inode or any per-vnode state other than the inode
+ *    buffer (see sfs_dinode_load) and the read-ahead fields (which
+ *    have their own spinlock).
  */
 
 /* Slot in a directory that ".." is expected to appear in */
@@ -129,7 +140,7 @@ sfs_eachopendir(struct vnode *v, int openflags)
 /*
  * Called for read(). sfs_io() does the work.
  *
- * Locking: gets/releases vnode lock.
+ * Locking: gets/releases vnode lock for reading.
  *
  * Requires up to 3 buffers.
  */
@@ -142,13 +153,13 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_read(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_io(sv, uio);
 
 	unreserve_buffers(SFS_BLOCKSIZE);
-	lock_release(sv->sv_lock);
+	rwlock_release_read(sv->sv_lock);
 
 	return result;
 }
@@ -169,22 +180,48 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_write(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_io(sv, uio);
 
 	unreserve_buffers(SFS_BLOCKSIZE);
-	lock_release(sv->sv_lock);
+	rwlock_release_write(sv->sv_lock);
 
 	return result;
 }
 
 /*
- * Called for getdirentry()
+ * Called for read() and write() on files opened with O_DIRECT.
+ * sfs_dio() does the work.
  *
  * Locking: gets/releases vnode lock.
  *
+ * Requires up to 3 buffers.
+ */
+static
+int
+sfs_directio(struct vnode *v, struct uio *uio)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	rwlock_acquire_write(sv->sv_lock);
+	reserve_buffers(SFS_BLOCKSIZE);
+
+	result = sfs_dio(sv, uio);
+
+	unreserve_buffers(SFS_BLOCKSIZE);
+	rwlock_release_write(sv->sv_lock);
+
+	return result;
+}
+
+/*
+ * Called for getdirentry()
+ *
+ * Locking: gets/releases vnode lock for reading.
+ *
  * Requires up to 4 buffers.
  */
 static
@@ -199,13 +236,13 @@ sfs_getdirentry(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_offset >= 0);
 	KASSERT(uio->uio_rw==UIO_READ);
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_read(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_dinode_load(sv);
 	if (result) {
 		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
+		rwlock_release_read(sv->sv_lock);
 		return result;
 	}
 
@@ -213,7 +250,7 @@ sfs_getdirentry(struct vnode *v, struct uio *uio)
 	if (result) {
 		sfs_dinode_unload(sv);
 		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
+		rwlock_release_read(sv->sv_lock);
 		return result;
 	}
 
@@ -250,7 +287,7 @@ sfs_getdirentry(struct vnode *v, struct uio *uio)
 
 	unreserve_buffers(SFS_BLOCKSIZE);
 
-	lock_release(sv->sv_lock);
+	rwlock_release_read(sv->sv_lock);
 
 	/* Update the offset the way we want it */
 	uio->uio_offset = pos;
@@ -280,7 +317,7 @@ sfs_ioctl(struct vnode *v, int op, userptr_t data)
 /*
  * Called for stat/fstat/lstat.
  *
- * Locking: gets/releases vnode lock.
+ * Locking: gets/releases vnode lock for reading.
  *
  * Requires 1 buffer.
  */
@@ -300,14 +337,14 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_read(sv->sv_lock);
 
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_dinode_load(sv);
 	if (result) {
 		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
+		rwlock_release_read(sv->sv_lock);
 		return result;
 	}
 
@@ -323,7 +360,7 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 
 	sfs_dinode_unload(sv);
 	unreserve_buffers(SFS_BLOCKSIZE);
-	lock_release(sv->sv_lock);
+	rwlock_release_read(sv->sv_lock);
 	return 0;
 }
 
@@ -367,18 +404,38 @@ sfs_isseekable(struct vnode *v)
 /*
  * Called for fsync().
  *
- * Since for now the buffer cache can't sync just one file, sync the
- * whole fs. This is lame.
+ * Give any delayed data its blocks, then write out the buffers
+ * tagged with this file, which includes its inode and indirect
+ * blocks. Writing each one flushes the journal only as far as that
+ * block needs (see sfs_writeblock), not the whole thing. The freemap
+ * isn't per-file; write it too if it's dirty, since our new blocks
+ * may be in it.
+ *
+ * Locking: gets/releases vnode lock.
  *
- * Locking: gets/releases vnode lock. (XXX: really?)
+ * Requires up to 3 buffers.
  */
 static
 int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
+
+	rwlock_acquire_write(sv->sv_lock);
+	reserve_buffers(SFS_BLOCKSIZE);
+	result = sfs_delalloc_flush(sv);
+	unreserve_buffers(SFS_BLOCKSIZE);
+	if (result == 0) {
+		result = sync_vnode_buffers(v->vn_fs, &sv->sv_absvn);
+	}
+	rwlock_release_write(sv->sv_lock);
+	if (result) {
+		return result;
+	}
 
-	return FSOP_SYNC(sv->sv_absvn.vn_fs);
+	return sfs_sync_freemap(sfs);
 }
 
 /*
@@ -406,13 +463,13 @@ sfs_truncate(struct vnode *v, off_t len)
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_write(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_itrunc(sv, len);
 
 	unreserve_buffers(SFS_BLOCKSIZE);
-	lock_release(sv->sv_lock);
+	rwlock_release_write(sv->sv_lock);
 	return result;
 }
 
@@ -434,7 +491,7 @@ sfs_getonename(struct sfs_vnode *parent, uint32_t targetino,
 	size_t namelen;
 	int result;
 
-	KASSERT(lock_do_i_hold(parent->sv_lock));
+	KASSERT(rwlock_do_i_hold(parent->sv_lock));
 	KASSERT(targetino != SFS_NOINO);
 
 	result = sfs_dir_findino(parent, targetino, &sd, NULL);
@@ -493,10 +550,10 @@ sfs_namefile(struct vnode *vv, struct uio *uio)
 	VOP_INCREF(&sv->sv_absvn);
 
 	while (1) {
-		lock_acquire(sv->sv_lock);
+		rwlock_acquire_read(sv->sv_lock);
 		/* not allowed to lock child since we're going up the tree */
 		result = sfs_lookonce(sv, "..", &parent, NULL);
-		lock_release(sv->sv_lock);
+		rwlock_release_read(sv->sv_lock);
 
 		if (result) {
 			VOP_DECREF(&sv->sv_absvn);
@@ -512,9 +569,9 @@ sfs_namefile(struct vnode *vv, struct uio *uio)
 			break;
 		}
 
-		lock_acquire(parent->sv_lock);
+		rwlock_acquire_read(parent->sv_lock);
 		result = sfs_getonename(parent, sv->sv_ino, buf, &bufpos);
-		lock_release(parent->sv_lock);
+		rwlock_release_read(parent->sv_lock);
 
 		if (result) {
 			VOP_DECREF(&parent->sv_absvn);
@@ -555,7 +612,7 @@ sfs_namefile(struct vnode *vv, struct uio *uio)
  * as nobody else can get to it except by searching the directory it's in,
  * which is locked.
  *
- * Requires up to 4 buffers as VOP_DECREF invocations may take 3.
+ * Requires up to 6 buffers, as sfs_dir_link may take 5.
  */
 static
 int
@@ -570,13 +627,13 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_write(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_dinode_load(sv);
 	if (result) {
 		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 	sv_dino = sfs_dinode_map(sv);
@@ -584,7 +641,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	if (sv_dino->sfi_linkcount == 0) {
 		sfs_dinode_unload(sv);
 		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		return ENOENT;
 	}
 
@@ -594,14 +651,14 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
 		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
 		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		return EEXIST;
 	}
 
@@ -610,13 +667,13 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
 			unreserve_buffers(SFS_BLOCKSIZE);
-			lock_release(sv->sv_lock);
+			rwlock_release_write(sv->sv_lock);
 			return result;
 		}
 
 		*ret = &newguy->sv_absvn;
 		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		return 0;
 	}
 
@@ -624,7 +681,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
 		unreserve_buffers(SFS_BLOCKSIZE);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
@@ -638,12 +695,13 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
 		sfs_dinode_unload(newguy);
-		lock_release(newguy->sv_lock);
+		rwlock_release_write(newguy->sv_lock);
 		VOP_DECREF(&newguy->sv_absvn);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		unreserve_buffers(SFS_BLOCKSIZE);
 		return result;
 	}
+	namecache_remove(v, name);
 
 	/* Update the linkcount of the new file */
 	new_dino->sfi_linkcount++;
@@ -655,8 +713,8 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 
 	sfs_dinode_unload(newguy);
 	unreserve_buffers(SFS_BLOCKSIZE);
-	lock_release(newguy->sv_lock);
-	lock_release(sv->sv_lock);
+	rwlock_release_write(newguy->sv_lock);
+	rwlock_release_write(sv->sv_lock);
 	return 0;
 }
 
@@ -669,7 +727,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
  * to hardlink directories, the target can't be an ancestor of the
  * directory we're working in.
  *
- * Requires up to 4 buffers.
+ * Requires up to 6 buffers.
  */
 static
 int
@@ -691,13 +749,13 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	/* directory must be locked first */
-	lock_acquire(sv->sv_lock);
-	lock_acquire(f->sv_lock);
+	rwlock_acquire_write(sv->sv_lock);
+	rwlock_acquire_write(f->sv_lock);
 
 	result = sfs_dinode_load(f);
 	if (result) {
-		lock_release(f->sv_lock);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(f->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		unreserve_buffers(SFS_BLOCKSIZE);
 		return result;
 	}
@@ -706,11 +764,12 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
 		sfs_dinode_unload(f);
-		lock_release(f->sv_lock);
-		lock_release(sv->sv_lock);
+		rwlock_release_write(f->sv_lock);
+		rwlock_release_write(sv->sv_lock);
 		unreserve_buffers(SFS_BLOCKSIZE);
 		return result;
 	}
+	namecache_remove(dir, name);
 
 	/* and update the link count, marking the inode dirty */
 	inodeptr = sfs_dinode_map(f);
@@ -718,8 +777,8 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 	sfs_dinode_mark_dirty(f);
 
 	sfs_dinode_unload(f);
-	lock_release(f->sv_lock);
-	lock_release(sv->sv_lock);
+	rwlock_release_write(f->sv_lock);
+	rwlock_release_write(sv->sv_lock);
 	unreserve_buffers(SFS_BLOCKSIZE);
 	return 0;
 }
@@ -732,7 +791,7 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
  * lock on the new directory, because we just created it and nobody
  * else can get to it until we unlock the parent at the end.
  *
- * Requires up to 4 buffers;
+ * Requires up to 6 buffers;
  */
 
 static
@@ -749,7 +808,7 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 
 	(void)mode;
 
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_write(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_dinode_load(sv);
@@ -806,6 +865,7 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 	if (result) {
 		goto die_uncreate;
 	}
+	namecache_remove(v, name);
 
         /*
          * Increment link counts (Note: not until after the names are
@@ -824,8 +884,8 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 
 	sfs_dinode_unload(newguy);
 	sfs_dinode_unload(sv);
-	lock_release(newguy->sv_lock);
-	lock_release(sv->sv_lock);
+	rwlock_release_write(newguy->sv_lock);
+	rwlock_release_write(sv->sv_lock);
 	VOP_DECREF(&newguy->sv_absvn);
 
 	unreserve_buffers(SFS_BLOCKSIZE);
@@ -835,7 +895,7 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 
 die_uncreate:
 	sfs_dinode_unload(newguy);
-	lock_release(newguy->sv_lock);
+	rwlock_release_write(newguy->sv_lock);
 	VOP_DECREF(&newguy->sv_absvn);
 
 die_simple:
@@ -843,7 +903,7 @@ die_simple:
 
 die_early:
 	unreserve_buffers(SFS_BLOCKSIZE);
-	lock_release(sv->sv_lock);
+	rwlock_release_write(sv->sv_lock);
 	return result;
 }
 
@@ -872,7 +932,7 @@ sfs_rmdir(struct vnode *v, const char *name)
 		return EINVAL;
 	}
 
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_write(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_dinode_load(sv);
@@ -891,7 +951,7 @@ sfs_rmdir(struct vnode *v, const char *name)
 		goto die_linkcount;
 	}
 
-	lock_acquire(victim->sv_lock);
+	rwlock_acquire_write(victim->sv_lock);
 	result = sfs_dinode_load(victim);
 	if (result) {
 		goto die_loadvictim;
@@ -918,6 +978,7 @@ sfs_rmdir(struct vnode *v, const char *name)
 	if (result) {
 		goto die_total;
 	}
+	namecache_remove(v, name);
 
 	KASSERT(dir_inodeptr->sfi_linkcount > 1);
 	KASSERT(victim_inodeptr->sfi_linkcount==2);
@@ -945,13 +1006,13 @@ sfs_rmdir(struct vnode *v, const char *name)
 die_total:
 	sfs_dinode_unload(victim);
 die_loadvictim:
-	lock_release(victim->sv_lock);
+	rwlock_release_write(victim->sv_lock);
  	VOP_DECREF(&victim->sv_absvn);
 die_linkcount:
 	sfs_dinode_unload(sv);
 die_loadsv:
  	unreserve_buffers(SFS_BLOCKSIZE);
- 	lock_release(sv->sv_lock);
+ 	rwlock_release_write(sv->sv_lock);
 
 	return result;
 }
@@ -962,7 +1023,7 @@ die_loadsv:
  * Locking: locks the directory, then the file. Unlocks both.
  *   This follows the hierarchical locking order imposed by the directory tree.
  *
- * Requires up to 4 buffers.
+ * Requires up to 6 buffers.
  */
 static
 int
@@ -980,7 +1041,7 @@ sfs_remove(struct vnode *dir, const char *name)
 		return EISDIR;
 	}
 
-	lock_acquire(sv->sv_lock);
+	rwlock_acquire_write(sv->sv_lock);
 	reserve_buffers(SFS_BLOCKSIZE);
 
 	result = sfs_dinode_load(sv);
@@ -1000,10 +1061,10 @@ sfs_remove(struct vnode *dir, const char *name)
 		goto out_loadsv;
 	}
 
-	lock_acquire(victim->sv_lock);
+	rwlock_acquire_write(victim->sv_lock);
 	result = sfs_dinode_load(victim);
 	if (result) {
-		lock_release(victim->sv_lock);
+		rwlock_release_write(victim->sv_lock);
 		VOP_DECREF(&victim->sv_absvn);
 		goto out_loadsv;
 	}
@@ -1021,6 +1082,7 @@ sfs_remove(struct vnode *dir, const char *name)
 	if (result) {
 		goto out_reference;
 	}
+	namecache_remove(dir, name);
 
 	/* Decrement the link count. */
 	KASSERT(victim_inodeptr->sfi_linkcount > 0);
@@ -1030,14 +1092,14 @@ sfs_remove(struct vnode *dir, const char *name)
 out_reference:
 	/* Discard the reference that sfs_lookonce got us */
 	sfs_dinode_unload(victim);
-	lock_release(victim->sv_lock);
+	rwlock_release_write(victim->sv_lock);
 	VOP_DECREF(&victim->sv_absvn);
 
 out_loadsv:
 	sfs_dinode_unload(sv);
 
 out_buffers:
-	lock_release(sv->sv_lock);
+	rwlock_release_write(sv->sv_lock);
 	unreserve_buffers(SFS_BLOCKSIZE);
 	return result;
 }
@@ -1081,9 +1143,9 @@ check_parent(struct sfs_vnode *lookfor, struct sfs_vnode *failon,
 			*found = 1;
 		}
 
-		lock_acquire(child->sv_lock);
+		rwlock_acquire_read(child->sv_lock);
 		result = sfs_lookonce(child, "..", &up, NULL);
-		lock_release(child->sv_lock);
+		rwlock_release_read(child->sv_lock);
 
 		if (result) {
 			VOP_DECREF(&child->sv_absvn);
@@ -1116,7 +1178,7 @@ check_parent(struct sfs_vnode *lookfor, struct sfs_vnode *failon,
  *
  *    The rationale for all this is complex. See the comments below.
  *
- * Requires up to 7 buffers.
+ * Requires up to 8 buffers, counting directory index blocks.
  */
 static
 int
@@ -1175,17 +1237,17 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	 * Lock each directory temporarily. We'll check again later to
 	 * make sure they haven't disappeared and to find slots.
 	 */
-	lock_acquire(dir1->sv_lock);
+	rwlock_acquire_write(dir1->sv_lock);
 	result = sfs_lookonce(dir1, name1, &obj1, NULL);
-	lock_release(dir1->sv_lock);
+	rwlock_release_write(dir1->sv_lock);
 
 	if (result) {
 		goto out0;
 	}
 
-	lock_acquire(dir2->sv_lock);
+	rwlock_acquire_write(dir2->sv_lock);
 	result = sfs_lookonce(dir2, name2, &obj2, NULL);
-	lock_release(dir2->sv_lock);
+	rwlock_release_write(dir2->sv_lock);
 
 	if (result && result != ENOENT) {
 		goto out0;
@@ -1301,14 +1363,14 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 
 	if (dir1==dir2) {
 		/* This locks "both" dirs */
-		lock_acquire(dir1->sv_lock);
+		rwlock_acquire_write(dir1->sv_lock);
 		KASSERT(found_dir1);
 	}
 	else {
 		if (found_dir1) {
-			lock_acquire(dir1->sv_lock);
+			rwlock_acquire_write(dir1->sv_lock);
 		}
-		lock_acquire(dir2->sv_lock);
+		rwlock_acquire_write(dir2->sv_lock);
 	}
 
 	/*
@@ -1322,7 +1384,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	 * that obj1 and obj2 may now be the same even if they weren't
 	 * before.
 	 */
-	KASSERT(lock_do_i_hold(dir2->sv_lock));
+	KASSERT(rwlock_do_i_hold(dir2->sv_lock));
 	if (obj2) {
 		VOP_DECREF(&obj2->sv_absvn);
 		obj2 = NULL;
@@ -1330,12 +1392,12 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	result = sfs_lookonce(dir2, name2, &obj2, &slot2);
 	if (result==0) {
 		KASSERT(obj2 != NULL);
-		lock_acquire(obj2->sv_lock);
+		rwlock_acquire_write(obj2->sv_lock);
 		result = sfs_dinode_load(obj2);
 		if (result) {
 			/* ENOENT would confuse us below; but it can't be */
 			KASSERT(result != ENOENT);
-			lock_release(obj2->sv_lock);
+			rwlock_release_write(obj2->sv_lock);
 			VOP_DECREF(&obj2->sv_absvn);
 			/* continue to check below */
 		}
@@ -1353,7 +1415,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	}
 
 	if (!found_dir1) {
-		lock_acquire(dir1->sv_lock);
+		rwlock_acquire_write(dir1->sv_lock);
 	}
 
 	/* Postpone this check to simplify the error cleanup. */
@@ -1364,7 +1426,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	/*
 	 * Now reload obj1.
 	 */
-	KASSERT(lock_do_i_hold(dir1->sv_lock));
+	KASSERT(rwlock_do_i_hold(dir1->sv_lock));
 	VOP_DECREF(&obj1->sv_absvn);
 	obj1 = NULL;
 	result = sfs_lookonce(dir1, name1, &obj1, &slot1);
@@ -1382,10 +1444,10 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 		obj1 = NULL;
 		goto out1;
 	}
-	lock_acquire(obj1->sv_lock);
+	rwlock_acquire_write(obj1->sv_lock);
 	result = sfs_dinode_load(obj1);
 	if (result) {
-		lock_release(obj1->sv_lock);
+		rwlock_release_write(obj1->sv_lock);
 		VOP_DECREF(&obj1->sv_absvn);
 		obj1 = NULL;
 		goto out1;
@@ -1477,7 +1539,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 
 		sfs_dinode_unload(obj2);
 
-		lock_release(obj2->sv_lock);
+		rwlock_release_write(obj2->sv_lock);
 		VOP_DECREF(&obj2->sv_absvn);
 		obj2 = NULL;
 	}
@@ -1568,15 +1630,18 @@ sfs_rename(struct vnode *absdir1, const char *name1,
  	sfs_dinode_unload(dir2);
  out2:
  	sfs_dinode_unload(obj1);
-	lock_release(obj1->sv_lock);
+	rwlock_release_write(obj1->sv_lock);
  out1:
 	if (obj2) {
 		sfs_dinode_unload(obj2);
-		lock_release(obj2->sv_lock);
+		rwlock_release_write(obj2->sv_lock);
 	}
-	lock_release(dir1->sv_lock);
+	/* Even if it failed, some of it may have happened. */
+	namecache_remove(absdir1, name1);
+	namecache_remove(absdir2, name2);
+	rwlock_release_write(dir1->sv_lock);
 	if (dir1 != dir2) {
-		lock_release(dir2->sv_lock);
+		rwlock_release_write(dir2->sv_lock);
 	}
  out0:
 	if (obj2 != NULL) {
@@ -1593,6 +1658,43 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	return result;
 }
 
+/*
+ * Look up one path component, trying the name cache first.
+ *
+ * Locking: gets the vnode lock for reading while calling sfs_lookonce,
+ *   if the name isn't cached.
+ */
+static
+int
+sfs_lookonce_cached(struct sfs_vnode *sv, const char *name,
+		    struct sfs_vnode **ret)
+{
+	struct vnode *v;
+	unsigned seq;
+	int result;
+
+	if (namecache_lookup(&sv->sv_absvn, name, &v)) {
+		if (v == NULL) {
+			return ENOENT;
+		}
+		*ret = v->vn_data;
+		return 0;
+	}
+
+	seq = namecache_seq();
+	rwlock_acquire_read(sv->sv_lock);
+	result = sfs_lookonce(sv, name, ret, NULL);
+	rwlock_release_read(sv->sv_lock);
+
+	if (result == 0) {
+		namecache_enter(&sv->sv_absvn, name, &(*ret)->sv_absvn, seq);
+	}
+	else if (result == ENOENT) {
+		namecache_enter(&sv->sv_absvn, name, NULL, seq);
+	}
+	return result;
+}
+
 static
 int
 sfs_lookparent_internal(struct vnode *v, char *path, struct vnode **ret,
@@ -1620,9 +1722,7 @@ sfs_lookparent_internal(struct vnode *v, char *path, struct vnode **ret,
 		*s = 0;
 		s++;
 
-		lock_acquire(sv->sv_lock);
-		result = sfs_lookonce(sv, path, &next, NULL);
-		lock_release(sv->sv_lock);
+		result = sfs_lookonce_cached(sv, path, &next);
 
 		if (result) {
 			VOP_DECREF(&sv->sv_absvn);
@@ -1649,11 +1749,11 @@ sfs_lookparent_internal(struct vnode *v, char *path, struct vnode **ret,
  * lookparent returns the last path component as a string and the
  * directory it's in as a vnode.
  *
- * Locking: gets the vnode lock while calling sfs_lookonce. Doesn't
- *   lock the new vnode, but does hand back a reference to it (so it
- *   won't evaporate).
+ * Locking: gets the vnode lock while calling sfs_lookonce, if the
+ *   name isn't in the name cache. Doesn't lock the new vnode, but
+ *   does hand back a reference to it (so it won't evaporate).
  *
- * Requires up to 3 buffers.
+ * Requires up to 5 buffers.
  */
 static
 int
@@ -1671,11 +1771,11 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 /*
  * Lookup gets a vnode for a pathname.
  *
- * Locking: gets the vnode lock while calling sfs_lookonce. Doesn't
- *   lock the new vnode, but does hand back a reference to it (so it
- *   won't evaporate).
+ * Locking: gets the vnode lock while calling sfs_lookonce, if the
+ *   name isn't in the name cache. Doesn't lock the new vnode, but
+ *   does hand back a reference to it (so it won't evaporate).
  *
- * Requires up to 3 buffers.
+ * Requires up to 5 buffers.
  */
 static
 int
@@ -1697,11 +1797,7 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	}
 
 	dir = dirv->vn_data;
-	lock_acquire(dir->sv_lock);
-
-	result = sfs_lookonce(dir, name, &final, NULL);
-
-	lock_release(dir->sv_lock);
+	result = sfs_lookonce_cached(dir, name, &final);
 	VOP_DECREF(dirv);
 
 	if (result) {
@@ -1731,6 +1827,7 @@ const struct vnode_ops sfs_fileops = {
 	.vop_readlink = vopfail_uio_notdir,
 	.vop_getdirentry = vopfail_uio_notdir,
 	.vop_write = sfs_write,
+	.vop_directio = sfs_directio,
 	.vop_ioctl = sfs_ioctl,
 	.vop_stat = sfs_stat,
 	.vop_gettype = sfs_gettype,
@@ -1765,6 +1862,7 @@ const struct vnode_ops sfs_dirops = {
 	.vop_readlink = vopfail_uio_inval,
 	.vop_getdirentry = sfs_getdirentry,
 	.vop_write = vopfail_uio_isdir,
+	.vop_directio = vopfail_uio_isdir,
 	.vop_ioctl = sfs_ioctl,
 	.vop_stat = sfs_stat,
 	.vop_gettype = sfs_gettype,
@@ -46,6 +46,14 @@ struct sfs_jphys_writecontext;
 /* journal iterator, used during recovery */
 struct sfs_jiter; /* opaque */
 
+/*
+ * Per-buffer data, hung on the buffer's fsdata. It's only allocated
+ * once a journal record is noted against the buffer (NULL before).
+ */
+struct sfs_bufdata {
+	sfs_lsn_t bd_lsn;	/* newest journal record for the block */
+};
+
 
 /* ops tables (in sfs_vnops.c) */
 extern const struct vnode_ops sfs_fileops;
@@ -67,6 +75,11 @@ extern const struct vnode_ops sfs_dirops;
 
 /* Functions in sfs_balloc.c */
 int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock, struct buf **bufret);
+int sfs_balloc_file(struct sfs_vnode *sv, daddr_t *diskblock);
+void sfs_prealloc_release(struct sfs_vnode *sv);
+int sfs_breserve(struct sfs_vnode *sv, unsigned num);
+void sfs_bunreserve(struct sfs_vnode *sv, unsigned num);
+void sfs_bcount(struct sfs_fs *sfs);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 void sfs_bfree_prelocked(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
@@ -90,10 +103,15 @@ int sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino,
 		int *slot);
 int sfs_dir_unlink(struct sfs_vnode *sv, int slot);
 int sfs_dir_checkempty(struct sfs_vnode *sv);
+int sfs_dir_dropindex(struct sfs_vnode *sv);
 int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
+/* Functions in sfs_fsops.c */
+int sfs_sync_freemap(struct sfs_fs *sfs);
+void sfs_checkpoint_printstats(void);
+
 /* Functions in sfs_inode.c */
 int sfs_dinode_load(struct sfs_vnode *sv);
 void sfs_dinode_unload(struct sfs_vnode *sv);
@@ -104,12 +122,23 @@ int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		struct sfs_vnode **ret);
 int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
+int sfs_vnhash_init(struct sfs_fs *sfs);
+void sfs_vnhash_cleanup(struct sfs_fs *sfs);
 
 /* Functions in sfs_io.c */
 int sfs_readblock(struct fs *fs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
 		   void *data, size_t len);
+unsigned sfs_writeblocks(struct fs *fs, daddr_t block, unsigned num,
+			 void **fsbufdata, void **data, size_t len);
+int sfs_buffer_notelsn(struct sfs_fs *sfs, struct buf *buf, sfs_lsn_t lsn);
+int sfs_delalloc_flush(struct sfs_vnode *sv);
+void sfs_delalloc_truncate(struct sfs_vnode *sv, off_t len);
+int sfs_delalloc_syncall(struct sfs_fs *sfs);
+int sfs_inline_unpack(struct sfs_vnode *sv);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
+int sfs_dio(struct sfs_vnode *sv, struct uio *uio);
+void sfs_dio_printstats(void);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
 
@@ -133,11 +162,18 @@ int sfs_jphys_flushall(struct sfs_fs *sfs);
 /* these are already deployed in sfs_writeblock */
 int sfs_jphys_flushforjournalblock(struct sfs_fs *sfs, daddr_t diskblock);
 void sfs_wrote_journal_block(struct sfs_fs *sfs, daddr_t diskblock);
+bool sfs_jphys_journalrun_inorder(struct sfs_fs *sfs, daddr_t diskblock,
+				  unsigned count);
 /* interface for checkpointing */
 sfs_lsn_t sfs_jphys_peeknextlsn(struct sfs_fs *sfs);
 void sfs_jphys_trim(struct sfs_fs *sfs, sfs_lsn_t taillsn);
 uint32_t sfs_jphys_getodometer(struct sfs_jphys *jp);
 void sfs_jphys_clearodometer(struct sfs_jphys *jp);
+/* mount-time hint for finding the head and tail */
+void sfs_jphys_savehint(struct sfs_fs *sfs);
+void sfs_jphys_clearhint(struct sfs_fs *sfs);
+/* group commit stats, for sfs_printstats */
+void sfs_jphys_printstats(void);
 /* reader interface */
 bool sfs_jiter_done(struct sfs_jiter *ji);
 unsigned sfs_jiter_type(struct sfs_jiter *ji);
@@ -37,7 +37,14 @@
  *     bitmap_create  - allocate a new bitmap object.
  *                      Returns NULL on error.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
+ *     bitmap_datachanged - tell the bitmap the bits were changed
+ *                      through the bitmap_getdata pointer. Must be
+ *                      called before the next other call on the bitmap.
  *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *                      Searches onward from the previous allocation.
+ *     bitmap_alloc_range - locate NUM cleared bits in a row, at or after
+ *                      HINT if possible, set them, and return the first
+ *                      index.
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
  *     bitmap_isset   - return whether a particular bit is set or not.
@@ -49,7 +56,10 @@ struct bitmap;  /* Opaque. */
 
 struct bitmap *bitmap_create(unsigned nbits);
 void          *bitmap_getdata(struct bitmap *);
+void           bitmap_datachanged(struct bitmap *);
 int            bitmap_alloc(struct bitmap *, unsigned *index);
+int            bitmap_alloc_range(struct bitmap *, unsigned num, unsigned hint,
+                                  unsigned *index);
 void           bitmap_mark(struct bitmap *, unsigned index);
 void           bitmap_unmark(struct bitmap *, unsigned index);
 int            bitmap_isset(struct bitmap *, unsigned index);
@@ -31,6 +31,7 @@
 #define _BUF_H_
 
 struct fs;  /* fs.h */
+struct vnode;  /* vnode.h */
 
 
 /*
@@ -52,6 +53,7 @@ struct fs;  /* fs.h */
  */
 
 struct buf; /* Opaque. */
+struct bufio; /* Opaque. */
 
 /*
  * Get-a-buffer operations.
@@ -125,6 +127,17 @@ void buffer_release_and_invalidate(struct buf *buf);
 void *buffer_get_fsdata(struct buf *buf);
 void *buffer_set_fsdata(struct buf *buf, void *fsd);
 
+/*
+ * Ownership
+ *
+ * buffer_set_owner tags a buffer with the file it belongs to, so
+ * sync_vnode_buffers can find it. The tag is only ever compared,
+ * never dereferenced, and is cleared when the buffer is detached.
+ * Blocks not tagged (e.g. the freemap) belong to nobody. The buffer
+ * must be marked busy.
+ */
+void buffer_set_owner(struct buf *buf, struct vnode *owner);
+
 /*
  * Other operations on buffers.
  *
@@ -147,10 +160,64 @@ void buffer_mark_dirty(struct buf *buf);
 void buffer_mark_valid(struct buf *buf);
 int buffer_writeout(struct buf *buf);
 
+/*
+ * Read-ahead.
+ *
+ * buffer_readahead asks for a block to be read into the cache in the
+ * background, for a caller that expects to want it soon. It returns
+ * without waiting; if the block is already cached or too many
+ * requests are already pending, it does nothing.
+ */
+void buffer_readahead(struct fs *fs, daddr_t block, size_t size);
+
+/*
+ * buffer_cancel_io forgets any read-ahead still queued for the NUM
+ * blocks starting at BLOCK and waits for any other background I/O on
+ * them to finish. A file system that's about to write those blocks
+ * without going through the cache calls this before buffer_drop, so
+ * a read-ahead that was already on its way can't put the old contents
+ * back in the cache afterwards. (New requests for the blocks are the
+ * file system's business; it should be holding whatever lock keeps
+ * them from being made.) The caller must not hold any of the buffers.
+ */
+void buffer_cancel_io(struct fs *fs, daddr_t block, unsigned num);
+
+/*
+ * Asynchronous I/O.
+ *
+ * buffer_read_async starts reading a block into the cache, like
+ * buffer_read but without returning the buffer; buffer_flush_async
+ * starts writing a block out, like buffer_flush. Neither waits for
+ * the transfer. When it finishes, CALLBACK (if not NULL) is called
+ * with ARG and the result, on one of the buffer cache's I/O threads
+ * and with no buffers held; it shouldn't do anything lengthy.
+ *
+ * If RET is not NULL it gets a handle for the request, which must be
+ * passed to buffer_io_wait eventually; buffer_io_wait waits for the
+ * request to finish, frees the handle, and returns the result of the
+ * I/O. buffer_io_done checks without waiting. If RET is NULL, the
+ * request cleans up after itself.
+ *
+ * The caller must not hold the buffer for BLOCK while waiting. The
+ * submit calls fail only for lack of memory.
+ */
+int buffer_read_async(struct fs *fs, daddr_t block, size_t size,
+		      void (*callback)(void *arg, int result), void *arg,
+		      struct bufio **ret);
+int buffer_flush_async(struct fs *fs, daddr_t block, size_t size,
+		       void (*callback)(void *arg, int result), void *arg,
+		       struct bufio **ret);
+int buffer_io_wait(struct bufio *io);
+bool buffer_io_done(struct bufio *io);
+
 /*
  * Sync.
+ *
+ * sync_fs_buffers writes out everything dirty for FS;
+ * sync_vnode_buffers writes out only the buffers tagged with OWNER.
  */
 int sync_fs_buffers(struct fs *fs);
+int sync_vnode_buffers(struct fs *fs, struct vnode *owner);
 
 /*
  * For unmounting.
@@ -183,6 +250,20 @@ void unreserve_buffers(size_t size);
 void reserve_fsmanaged_buffers(unsigned count, size_t size);
 void unreserve_fsmanaged_buffers(unsigned count, size_t size);
 
+/*
+ * Replacement policy: "lru" (the default) or "2q". Returns EINVAL
+ * for an unknown name.
+ */
+int buffer_set_policy(const char *name);
+
+/*
+ * Cache sizing. The cache grows and shrinks with the amount of free
+ * memory; NAME is one of "min" or "max" (limits on the cache size)
+ * or "grow" or "shrink" (free memory thresholds), and KBYTES the new
+ * value. Returns EINVAL for an unknown name or an inconsistent value.
+ */
+int buffer_set_sizing(const char *name, unsigned kbytes);
+
 /*
  * Print stats.
  */
@@ -80,6 +80,12 @@ void dev_uncreate_vnode(struct vnode *vn);
 /* Initialization functions for builtin vfs-level devices. */
 void devnull_create(void);
 
+/* Create a RAM disk rdN of KBYTES kilobytes. */
+int ramdisk_create(unsigned kbytes);
+
+/* Create a stripe set stN across the named devices. */
+int stripe_create(unsigned unitkb, unsigned nmembers, char **members);
+
 /* Function that kicks off device probe and attach. */
 void dev_bootstrap(void);
 
@@ -54,6 +54,7 @@ struct fs {
  *      fsop_unmount    - Attempt unmount of filesystem.
  *      fsop_readblock  - Read block from storage.
  *      fsop_writeblock - Write block to storage.
+ *      fsop_writeblocks - Write several adjacent blocks to storage.
  *      fsop_attachbuf  - Hook for initializing fs-specific buffer state.
  *      fsop_detachbuf  - Hook for cleaning up fs-specific buffer state.
  *
@@ -87,6 +88,15 @@ struct fs {
  * The third argument (bufdata) to fsop_writeblock is the FS-specific
  * metadata previously set with buffer_set_fsdata, or NULL if none was
  * ever set.
+ *
+ * fsop_writeblocks is optional. It writes NUM consecutive blocks
+ * starting at the block given, ideally in a single device operation;
+ * the bufdata and data arguments are arrays with one entry per block.
+ * It returns how many of the blocks (from the start) were written,
+ * which may be fewer than asked or even none, e.g. after an I/O error
+ * or if the file system has ordering rules that would be broken; the
+ * buffer cache writes the rest with fsop_writeblock as usual. If it's
+ * NULL, the buffer cache writes all blocks one at a time.
  */
 struct fs_ops {
 	int           (*fsop_sync)(struct fs *);
@@ -96,6 +106,8 @@ struct fs_ops {
 	int           (*fsop_readblock)(struct fs *, daddr_t, void *, size_t);
 	int           (*fsop_writeblock)(struct fs *, daddr_t, void *bufdata,
 					void *, size_t);
+	unsigned      (*fsop_writeblocks)(struct fs *, daddr_t, unsigned num,
+					  void **bufdata, void **, size_t);
 	int           (*fsop_attachbuf)(struct fs *, daddr_t, struct buf *);
 	void          (*fsop_detachbuf)(struct fs *, daddr_t, struct buf *);
 };
@@ -112,6 +124,9 @@ struct fs_ops {
 #define FSOP_WRITEBLOCK(fs,bn,fsdata,ptr,sz) \
 				((fs)->fs_ops->fsop_writeblock(fs,bn,fsdata, \
 							       ptr,sz))
+#define FSOP_WRITEBLOCKS(fs,bn,num,fsdata,ptr,sz) \
+				((fs)->fs_ops->fsop_writeblocks(fs,bn,num, \
+								fsdata,ptr,sz))
 #define FSOP_ATTACHBUF(fs, blk, buf) ((fs)->fs_ops->fsop_attachbuf(fs,blk,buf))
 #define FSOP_DETACHBUF(fs, blk, buf) ((fs)->fs_ops->fsop_detachbuf(fs,blk,buf))
 
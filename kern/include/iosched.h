@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _IOSCHED_H_
+#define _IOSCHED_H_
+
+/*
+ * I/O scheduler for block device drivers.
+ *
+ * A driver keeps one struct iosched per device and hands it requests;
+ * the scheduler decides which one the device does next, using one of
+ * several policies:
+ *
+ *    fifo     - in order of arrival.
+ *    clook    - C-LOOK elevator: ascending sector order from where the
+ *               disk head is, then back around to the lowest sector.
+ *    deadline - C-LOOK, except that a request that has waited longer
+ *               than its deadline (shorter for reads than writes)
+ *               goes next.
+ *
+ * A new request that starts where a queued one in the same direction
+ * ends is merged with it: the two are dispatched together and the
+ * second one follows the first without going back through the
+ * policy.
+ *
+ * The scheduler does no locking and never sleeps or allocates
+ * memory, so the driver can call it from its interrupt handler. All
+ * calls must be made holding the spinlock passed to iosched_create,
+ * which is also what iosched_setpolicy and iosched_printstats take.
+ */
+
+#include <kern/time.h>
+
+struct spinlock;  /* spinlock.h */
+
+/*
+ * One request.
+ */
+struct ioreq {
+	/* set by the driver before iosched_add */
+	void *ir_data;			/* kernel buffer */
+	uint32_t ir_sector;		/* first sector */
+	uint32_t ir_nsect;		/* number of sectors */
+	bool ir_write;			/* writing (else reading) */
+
+	/* for the driver's use while the request runs */
+	uint32_t ir_cursect;		/* sectors done so far */
+	int ir_result;			/* result, set before iosched_done */
+	bool ir_done;			/* finished */
+
+	/* private to the scheduler */
+	struct ioreq *ir_sortnext;	/* queue in sector order */
+	struct ioreq *ir_sortprev;
+	struct ioreq *ir_fifonext;	/* queue in arrival order */
+	struct ioreq *ir_fifoprev;
+	struct ioreq *ir_merged;	/* requests merged behind this one */
+	uint32_t ir_end;		/* sector after this and ir_merged */
+	struct timespec ir_queued;	/* when submitted */
+};
+
+struct iosched; /* Opaque. */
+
+/*
+ * Set up and tear down. NAME is the device's name; the scheduler
+ * keeps the pointer.
+ */
+struct iosched *iosched_create(const char *name, struct spinlock *lk);
+void iosched_destroy(struct iosched *q);
+
+/*
+ * iosched_add queues REQ. If the device was idle it returns the
+ * request to start now (which may be REQ), otherwise NULL.
+ *
+ * iosched_done is called when the request in progress has finished,
+ * with ir_result set. It returns the next request to start, or NULL
+ * if there's nothing left to do.
+ *
+ * iosched_current returns the request in progress, if any.
+ */
+struct ioreq *iosched_add(struct iosched *q, struct ioreq *req);
+struct ioreq *iosched_done(struct iosched *q, struct ioreq *req);
+struct ioreq *iosched_current(struct iosched *q);
+
+/*
+ * Change the policy for device NAME (e.g. from the boot command
+ * line). Returns ENODEV if there's no such device or EINVAL for an
+ * unknown policy.
+ */
+int iosched_setpolicy(const char *name, const char *policy);
+
+/*
+ * Print statistics for every device.
+ */
+void iosched_printstats(void);
+
+#endif /* _IOSCHED_H_ */
@@ -49,6 +49,7 @@
 #define SFS_FREEMAP_START 2             /* 1st block of the freemap */
 #define SFS_NOINO         0             /* inode # for free dir entry */
 #define SFS_ROOTDIR_INO   1             /* loc'n of the root dir inode */
+#define SFS_INLINE_SIZE   ((128-7-SFS_NDIRECT)*4) /* inline data bytes */
 
 /* Number of bits in a block */
 #define SFS_BITSPERBLOCK (SFS_BLOCKSIZE * CHAR_BIT)
@@ -76,7 +77,52 @@ struct sfs_superblock {
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
 	uint32_t sb_journalstart;		/* First block in journal */
 	uint32_t sb_journalblocks;		/* # of blocks in journal */
-	uint32_t reserved[116];			/* unused, set to 0 */
+	uint64_t sb_jhintheadlsn;		/* Journal head LSN hint */
+	uint64_t sb_jhinttaillsn;		/* Journal tail LSN hint */
+	uint32_t sb_jhinthead;			/* Journal head block hint */
+	uint32_t sb_jhinttail;			/* Journal tail block hint */
+	uint32_t sb_jhintmagic;			/* SFS_JHINT_MAGIC if valid */
+	char sb_jdevname[SFS_VOLNAME_SIZE];	/* Journal device, if external */
+	uint32_t sb_jdevid;			/* Must match jd_devid there */
+	uint32_t sb_features;			/* SFS_FEATURE_* flags */
+	uint32_t reserved[99];			/* unused, set to 0 */
+};
+
+/*
+ * Feature flags for sb_features. A volume with a feature bit set
+ * must not be mounted by code that doesn't know about it.
+ */
+#define SFS_FEATURE_INLINE  0x00000001  /* small files may be inline */
+#define SFS_FEATURES_KNOWN  (SFS_FEATURE_INLINE)
+
+/*
+ * The journal hint fields in the superblock record where the journal
+ * head and tail were at the last clean unmount, so mount can check
+ * them instead of scanning the whole journal. They're only good if
+ * sb_jhintmagic is SFS_JHINT_MAGIC; it's cleared again on mount.
+ */
+#define SFS_JHINT_MAGIC   0x6a68696e    /* "jhin" */
+
+/*
+ * The journal can be kept on a separate device. Then sb_jdevname
+ * names that device (e.g. "lhd1") and sb_journalstart is sb_nblocks:
+ * journal blocks are numbered as if they came right after the end of
+ * the volume, and journal block N is block SFS_JDEV_START + N of the
+ * journal device. Block SFS_JDEV_HEADER of the journal device holds
+ * a header that ties it to the volume. If sb_jdevname is empty the
+ * journal is inside the volume as usual.
+ */
+#define SFS_JDEV_MAGIC    0x6a646576    /* "jdev" */
+#define SFS_JDEV_HEADER   0             /* block the header lives in */
+#define SFS_JDEV_START    1             /* first block of the journal */
+
+/* Header block of an external journal device */
+struct sfs_jdevheader {
+	uint32_t jd_magic;			/* SFS_JDEV_MAGIC */
+	uint32_t jd_devid;			/* Same as sb_jdevid */
+	uint32_t jd_journalblocks;		/* Same as sb_journalblocks */
+	char jd_volname[SFS_VOLNAME_SIZE];	/* Volume it belongs to */
+	uint32_t reserved[117];			/* unused, set to 0 */
 };
 
 /*
@@ -90,9 +136,22 @@ struct sfs_dinode {
 	uint32_t sfi_indirect;			/* Indirect block */
 	uint32_t sfi_dindirect;   /* Double indirect block */
 	uint32_t sfi_tindirect;   /* Triple indirect block */
-	uint32_t sfi_waste[128-5-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dirindex;    /* Directory index header block, or 0 */
+	uint32_t sfi_flags;       /* SFS_DINODE_* flags */
+	char sfi_inline[SFS_INLINE_SIZE];	/* Inline data, or zeros */
 };
 
+/*
+ * Inline data: on a volume with SFS_FEATURE_INLINE, a file whose
+ * contents fit in SFS_INLINE_SIZE bytes may keep them in sfi_inline
+ * instead of in a data block, marked by SFS_DINODE_INLINE in
+ * sfi_flags. Such a file has no blocks at all (every block pointer is
+ * 0) and the bytes of sfi_inline past sfi_size are zero. Directories
+ * are never inline. Otherwise sfi_inline is unused and all zeros.
+ */
+#define SFS_DINODE_INLINE   0x00000001  /* data is in sfi_inline */
+#define SFS_DINODE_FLAGS_KNOWN (SFS_DINODE_INLINE)
+
 /*
  * On-disk directory entry
  */
@@ -101,6 +160,56 @@ struct sfs_direntry {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * On-disk hashed directory index
+ *
+ * A directory may have an index so lookups don't have to read every
+ * entry. sfi_dirindex names the index header block, which lists the
+ * blocks of an open-addressed hash table of (name hash, slot) pairs;
+ * a name is looked for starting at its hash modulo the table size
+ * and moving forward (wrapping around) until an empty pair. The
+ * directory entries themselves are stored exactly as without an
+ * index, and a directory with sfi_dirindex 0 is just searched
+ * linearly, so volumes made before indexes existed work unchanged.
+ * Directories only get an index once they have SFS_DIRINDEX_MIN
+ * slots.
+ *
+ * The hash is 32-bit FNV-1a over the bytes of the name.
+ *
+ * The header also remembers up to SFS_DIRINDEX_NFREE empty slots in
+ * the directory, since with an index nothing else finds them.
+ */
+#define SFS_DIRINDEX_MAGIC     0x5f1d1dec    /* header magic number */
+#define SFS_DIRINDEX_MIN       64            /* slots before indexing */
+#define SFS_DIRINDEX_NFREE     32            /* # remembered free slots */
+#define SFS_DIRINDEX_MAXBLOCKS 90            /* max # of table blocks */
+#define SFS_DIRINDEX_FNVBASIS  2166136261U   /* hash initial value */
+#define SFS_DIRINDEX_FNVPRIME  16777619U     /* hash multiplier */
+
+/* Values for de_slot other than slot numbers (which are stored +1) */
+#define SFS_DIRINDEX_EMPTY     0             /* never used */
+#define SFS_DIRINDEX_DELETED   0xffffffff    /* entry was removed */
+
+/* # of pairs per table block */
+#define SFS_DIRINDEX_PERBLOCK \
+	(SFS_BLOCKSIZE / sizeof(struct sfs_dirindex_entry))
+
+struct sfs_dirindex_header {
+	uint32_t dh_magic;		/* SFS_DIRINDEX_MAGIC */
+	uint32_t dh_nblocks;		/* # of table blocks */
+	uint32_t dh_count;		/* # of live pairs */
+	uint32_t dh_used;		/* # of live plus deleted pairs */
+	uint32_t dh_nfree;		/* # of dh_free in use */
+	uint32_t dh_free[SFS_DIRINDEX_NFREE];	/* some empty dir slots */
+	uint32_t dh_blocks[SFS_DIRINDEX_MAXBLOCKS];	/* table blocks */
+	uint32_t dh_reserved[128-5-SFS_DIRINDEX_NFREE-SFS_DIRINDEX_MAXBLOCKS];
+};
+
+struct sfs_dirindex_entry {
+	uint32_t de_hash;		/* hash of the name */
+	uint32_t de_slot;		/* slot+1, EMPTY, or DELETED */
+};
+
 /*
  * On-disk journal container types and constants
  */
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _NAMECACHE_H_
+#define _NAMECACHE_H_
+
+/*
+ * Name cache.
+ *
+ * Remembers the results of looking up names in directories, keyed by
+ * (directory vnode, name), so that filesystems can resolve hot paths
+ * without locking directories or reading directory blocks. Negative
+ * results (the name isn't there) are remembered too, which makes
+ * probing a search path cheap.
+ *
+ * The cache does not hold references on the vnodes in it. Instead a
+ * filesystem must call namecache_purge on a vnode in VOP_RECLAIM,
+ * before it checks the reference count, and must call
+ * namecache_remove whenever it adds or removes a name.
+ *
+ * To avoid entering stale results, get namecache_seq() before doing
+ * the lookup and pass it to namecache_enter, which ignores the entry
+ * if anything was removed from the cache in between.
+ */
+
+struct vnode;
+
+/*
+ * Look up NAME in DIR. Returns false if it isn't cached. If it is,
+ * returns true and sets *RET to a new reference to the vnode, or
+ * NULL if the name is known not to exist.
+ */
+bool namecache_lookup(struct vnode *dir, const char *name,
+		      struct vnode **ret);
+
+/*
+ * Remember that NAME in DIR is VN (or that it doesn't exist, if VN
+ * is NULL). Names that are too long, and "." and "..", aren't cached.
+ */
+unsigned namecache_seq(void);
+void namecache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		     unsigned seq);
+
+/*
+ * Forget about NAME in DIR, or anything involving VN.
+ */
+void namecache_remove(struct vnode *dir, const char *name);
+void namecache_purge(struct vnode *vn);
+
+/*
+ * Print statistics.
+ */
+void namecache_printstats(void);
+
+#endif /* _NAMECACHE_H_ */
@@ -51,6 +51,7 @@
 struct openfile {
 	struct vnode *of_vnode;
 	int of_accmode;	/* from open: O_RDONLY, O_WRONLY, or O_RDWR */
+	bool of_direct;	/* from open: O_DIRECT (use VOP_DIRECTIO) */
 
 	struct lock *of_offsetlock;	/* lock for of_offset */
 	off_t of_offset;
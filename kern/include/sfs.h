@@ -50,16 +50,35 @@ struct buf; /* in buf.h */
  */
 #include <kern/sfs.h>
 
+struct sfs_dablock;  /* Private to sfs_io.c */
+
 /*
  * In-memory inode
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
 	uint32_t sv_ino;                /* inode number */
+	struct sfs_vnode *sv_hashnext;	/* vnode table chain */
+	struct sfs_vnode *sv_hashprev;
 	unsigned sv_type;		/* cache of sfi_type */
 	struct buf *sv_dinobuf;		/* buffer holding dinode */
 	uint32_t sv_dinobufcount;	/* # times dinobuf has been loaded */
-	struct lock *sv_lock;		/* lock for vnode */
+	struct lock *sv_dinolock;	/* held while dinobuf is loaded */
+	struct rwlock *sv_lock;		/* lock for vnode */
+	struct spinlock sv_ralock;	/* protects sv_ra_* */
+	uint32_t sv_ra_next;		/* expected next file block */
+	uint32_t sv_ra_issued;		/* read-ahead requested up to here */
+	unsigned sv_ra_window;		/* read-ahead window (blocks) */
+	daddr_t sv_allocgoal;		/* where to put the next block */
+	daddr_t sv_pa_start;		/* preallocated blocks (see */
+	unsigned sv_pa_count;		/*   sfs_balloc.c) */
+	struct sfs_vnode *sv_pa_next;	/* on sfs_prealloc */
+	struct sfs_vnode *sv_pa_prev;
+	struct sfs_dablock *sv_dablocks; /* data not yet given blocks */
+	unsigned sv_ndablocks;		/*   (see sfs_io.c) */
+	unsigned sv_dareserved;		/* free blocks promised to them */
+	struct sfs_vnode *sv_da_next;	/* on sfs_delayed */
+	struct sfs_vnode *sv_da_prev;
 };
 
 /*
@@ -70,14 +89,28 @@ struct sfs_fs {
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct device *sfs_jdevice;	/* external journal device, or NULL */
+	struct sfs_vnode **sfs_vnhash;	/* vnodes loaded, chained by inode */
+	unsigned sfs_vnhashsize;	/* # of chains (a power of 2) */
+	unsigned sfs_nvnodes;		/* # of vnodes loaded */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct sfs_vnode *sfs_prealloc;	/* vnodes with preallocated blocks */
+	uint32_t sfs_nfree;		/* # of blocks free in freemap */
+	uint32_t sfs_reserved;		/* # of those promised to files */
+	struct sfs_vnode *sfs_delayed;	/* vnodes with delayed blocks */
+	unsigned sfs_ndablocks;		/* # of delayed blocks in memory */
 	struct lock *sfs_vnlock;	/* lock for vnode table */
 	struct lock *sfs_freemaplock;	/* lock for freemap/superblock */
 	struct lock *sfs_renamelock;	/* lock for sfs_rename() */
 
 	struct sfs_jphys *sfs_jphys;	/* physical journal container */
+	struct semaphore *sfs_ckptexit;	/* V'd as the checkpointer exits */
+	volatile bool sfs_ckptstop;	/* tells the checkpointer to exit */
+	bool sfs_ckptrunning;		/* true if the checkpointer exists */
+	uint32_t sfs_ckptbase;		/* odometer at last checkpoint */
+	uint32_t sfs_ckptlast;		/* odometer at last look */
+	unsigned sfs_ckptrate;		/* smoothed jblocks used per second */
 };
 
 /*
@@ -85,5 +118,15 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * Print vnode table and journal statistics
+ */
+void sfs_printstats(void);
+
+/*
+ * Tune journal group commit: "window" (usecs) or "batch" (flushes)
+ */
+int sfs_jphys_setgroupcommit(const char *name, unsigned val);
+
 
 #endif /* _SFS_H_ */
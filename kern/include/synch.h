@@ -161,4 +161,68 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of threads may hold the lock for reading at once, or
+ * one thread may hold it for writing. Writers are preferred: once a
+ * writer is waiting, new readers wait behind it, so a steady stream
+ * of readers can't starve writers out. (The flip side is that a
+ * thread may not acquire a read lock it already holds; if a writer
+ * has arrived in between, it will wait forever.)
+ *
+ * Readers aren't tracked individually, so rwlock_do_i_hold can only
+ * say for certain that the current thread holds the lock if it holds
+ * it for writing; if it's held for reading by anyone at all it just
+ * says yes. That's enough for assertions.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct rwlock {
+	char *rwlock_name;
+	struct wchan *rw_readwchan;	/* readers wait here */
+	struct wchan *rw_writewchan;	/* writers and upgraders wait here */
+	struct spinlock rw_lock;
+	volatile unsigned rw_readers;	/* # holding it for reading */
+	volatile unsigned rw_writerswaiting; /* # waiting to write */
+	struct thread *volatile rw_writer;   /* holder for writing */
+	struct thread *volatile rw_upgrader; /* reader trying to upgrade */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading, waiting while
+ *                           it's held for writing or a writer is
+ *                           waiting for it.
+ *    rwlock_release_read  - Give up a read lock.
+ *    rwlock_acquire_write - Get the lock for writing, waiting until
+ *                           nobody else holds it.
+ *    rwlock_release_write - Give up a write lock.
+ *    rwlock_upgrade       - Turn a read lock into a write lock. Returns
+ *                           true if this was done without letting go;
+ *                           false if another reader was already
+ *                           upgrading, in which case the read lock was
+ *                           released and the write lock acquired from
+ *                           scratch, and anything learned under the
+ *                           read lock must be checked again.
+ *    rwlock_downgrade     - Turn a write lock into a read lock without
+ *                           letting any writer in between.
+ *    rwlock_do_i_hold     - See above.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                           the lock for writing.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_upgrade(struct rwlock *);
+void rwlock_downgrade(struct rwlock *);
+bool rwlock_do_i_hold(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
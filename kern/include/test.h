@@ -48,6 +48,7 @@ int airballoon(int, char **);
 int arraytest(int, char **);
 int arraytest2(int, char **);
 int bitmaptest(int, char **);
+int bitmapbench(int, char **);
 int threadlisttest(int, char **);
 
 /* thread tests */
@@ -59,6 +60,8 @@ int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int rwtest(int, char **);
+int rwbench(int, char **);
 
 /* semaphore unit tests */
 int semu1(int, char **);
@@ -92,6 +95,8 @@ int writestress2(int, char **);
 int longstress(int, char **);
 int createstress(int, char **);
 int printfile(int, char **);
+int bufbench(int, char **);
+int diskbench(int, char **);
 
 /* other tests */
 int kmalloctest(int, char **);
@@ -167,6 +167,16 @@ int vfs_getcwd(struct uio *buf);
  *                    previously returned by vfs_swapon should be
  *                    decref'd first. Similar to vfs_unmount.
  *
+ *    vfs_claimdev  - Look up DEVNAME and mark it in use, returning
+ *                    the device, for pseudo-devices built on top of
+ *                    other devices. Similar to vfs_swapon.
+ *
+ *    vfs_releasedev - Undo vfs_claimdev.
+ *
+ *    vfs_claimdev_locked, vfs_releasedev_locked - The same, for use
+ *                    from a filesystem's mount or unmount function,
+ *                    which is called with the device list locked.
+ *
  *    vfs_unmountall - Unmount all mounted filesystems.
  */
 
@@ -186,6 +196,10 @@ int vfs_mount(const char *devname, void *data,
 int vfs_unmount(const char *devname);
 int vfs_swapon(const char *devname, struct vnode **result);
 int vfs_swapoff(const char *devname);
+int vfs_claimdev(const char *devname, struct device **result);
+int vfs_releasedev(const char *devname);
+int vfs_claimdev_locked(const char *devname, struct device **result);
+int vfs_releasedev_locked(const char *devname);
 int vfs_unmountall(void);
 
 /*
@@ -55,6 +55,7 @@ struct vnode {
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 
 	void *vn_data;                  /* Filesystem-specific data */
+	unsigned vn_ncrefs;             /* Name cache entries using this */
 
 	const struct vnode_ops *vn_ops; /* Functions on this vnode */
 };
@@ -103,6 +104,13 @@ struct vnode {
  *                      amount written, and updating uio_offset to match.
  *                      Not allowed on directories or symlinks.
  *
+ *    vop_directio    - Read or write (according to uio_rw) like
+ *                      vop_read or vop_write, but without going through
+ *                      the filesystem's caches where possible. Used for
+ *                      files opened with O_DIRECT. Any cached copies
+ *                      must stay coherent. Objects with no cache to
+ *                      bypass can use vnode_directio_passthru.
+ *
  *    vop_ioctl       - Perform ioctl operation OP on file using data
  *                      DATA. The interpretation of the data is specific
  *                      to each ioctl.
@@ -188,6 +196,7 @@ struct vnode_ops {
 	int (*vop_readlink)(struct vnode *link, struct uio *uio);
 	int (*vop_getdirentry)(struct vnode *dir, struct uio *uio);
 	int (*vop_write)(struct vnode *file, struct uio *uio);
+	int (*vop_directio)(struct vnode *file, struct uio *uio);
 	int (*vop_ioctl)(struct vnode *object, int op, userptr_t data);
 	int (*vop_stat)(struct vnode *object, struct stat *statbuf);
 	int (*vop_gettype)(struct vnode *object, mode_t *result);
@@ -232,6 +241,7 @@ struct vnode_ops {
 #define VOP_READLINK(vn, uio)           (__VOP(vn, readlink)(vn, uio))
 #define VOP_GETDIRENTRY(vn, uio)        (__VOP(vn,getdirentry)(vn, uio))
 #define VOP_WRITE(vn, uio)              (__VOP(vn, write)(vn, uio))
+#define VOP_DIRECTIO(vn, uio)           (__VOP(vn, directio)(vn, uio))
 #define VOP_IOCTL(vn, code, buf)        (__VOP(vn, ioctl)(vn,code,buf))
 #define VOP_STAT(vn, ptr) 	        (__VOP(vn, stat)(vn, ptr))
 #define VOP_GETTYPE(vn, result)         (__VOP(vn, gettype)(vn, result))
@@ -279,6 +289,12 @@ int vnode_init(struct vnode *, const struct vnode_ops *ops,
  */
 void vnode_cleanup(struct vnode *);
 
+/*
+ * vop_directio for objects that have no cache to bypass: just does
+ * VOP_READ or VOP_WRITE.
+ */
+int vnode_directio_passthru(struct vnode *vn, struct uio *uio);
+
 /*
  * Common stubs for vnode functions that just fail, in various ways.
  */
@@ -47,19 +47,192 @@
 #define WORD_TYPE       unsigned char
 #define WORD_ALLBITS    (0xff)
 
+/*
+ * To avoid looking at every word when the bitmap is mostly full,
+ * there's also a summary level with one bit per word, set if the word
+ * has any clear bits. The summary is in memory only, so it can use
+ * uint32_t. It's rebuilt if the caller says (with bitmap_datachanged)
+ * that it changed the bits behind our back through bitmap_getdata.
+ *
+ * bitmap_alloc is next-fit: it starts looking at the word where the
+ * previous allocation was found, rather than at the beginning.
+ */
+#define SUM_BITS        32
+
 struct bitmap {
         unsigned nbits;
         WORD_TYPE *v;
+        unsigned nwords;        /* number of words in v */
+        uint32_t *sum;          /* summary: word has a clear bit */
+        unsigned cursor;        /* word to start the next search at */
+        bool stale;             /* summary needs rebuilding */
 };
 
+/*
+ * Update the summary bit for word IX.
+ */
+static
+inline
+void
+bitmap_sumupdate(struct bitmap *b, unsigned ix)
+{
+        uint32_t mask = (uint32_t)1 << (ix % SUM_BITS);
+
+        if (b->v[ix] == WORD_ALLBITS) {
+                b->sum[ix / SUM_BITS] &= ~mask;
+        }
+        else {
+                b->sum[ix / SUM_BITS] |= mask;
+        }
+}
+
+/*
+ * Rebuild the summary if necessary.
+ */
+static
+void
+bitmap_checksum(struct bitmap *b)
+{
+        unsigned ix;
+
+        if (!b->stale) {
+                return;
+        }
+        bzero(b->sum, DIVROUNDUP(b->nwords, SUM_BITS) * sizeof(uint32_t));
+        for (ix=0; ix<b->nwords; ix++) {
+                bitmap_sumupdate(b, ix);
+        }
+        b->stale = false;
+}
+
+/*
+ * Return the number of the lowest set bit in X, which isn't 0.
+ */
+static
+unsigned
+bitmap_ffs(uint32_t x)
+{
+        unsigned n = 0;
+
+        KASSERT(x != 0);
+        if ((x & 0xffff) == 0) {
+                n += 16;
+                x >>= 16;
+        }
+        if ((x & 0xff) == 0) {
+                n += 8;
+                x >>= 8;
+        }
+        if ((x & 0xf) == 0) {
+                n += 4;
+                x >>= 4;
+        }
+        if ((x & 0x3) == 0) {
+                n += 2;
+                x >>= 2;
+        }
+        if ((x & 0x1) == 0) {
+                n += 1;
+        }
+        return n;
+}
+
+/*
+ * Find the first word between FROM and TO (exclusive) that has a
+ * clear bit.
+ */
+static
+bool
+bitmap_findword(struct bitmap *b, unsigned from, unsigned to, unsigned *ret)
+{
+        unsigned s, ix;
+        uint32_t word;
+
+        if (from >= to) {
+                return false;
+        }
+        s = from / SUM_BITS;
+        word = b->sum[s] & ~(((uint32_t)1 << (from % SUM_BITS)) - 1);
+        while (1) {
+                if (word != 0) {
+                        ix = s*SUM_BITS + bitmap_ffs(word);
+                        if (ix >= to) {
+                                return false;
+                        }
+                        *ret = ix;
+                        return true;
+                }
+                s++;
+                if (s*SUM_BITS >= to) {
+                        return false;
+                }
+                word = b->sum[s];
+        }
+}
+
+/*
+ * Find NUM clear bits in a row, starting between FROM and TO
+ * (exclusive) and not extending past TO.
+ */
+static
+bool
+bitmap_findrun(struct bitmap *b, unsigned num, unsigned from, unsigned to,
+               unsigned *ret)
+{
+        unsigned pos, ix, start = 0, run = 0;
+        WORD_TYPE mask;
+
+        pos = from;
+        while (pos < to) {
+                ix = pos / BITS_PER_WORD;
+                if ((b->sum[ix / SUM_BITS] &
+                     ((uint32_t)1 << (ix % SUM_BITS))) == 0) {
+                        /* Word is full; skip to the next that isn't */
+                        run = 0;
+                        if (!bitmap_findword(b, ix+1, b->nwords, &ix)) {
+                                return false;
+                        }
+                        pos = ix * BITS_PER_WORD;
+                        continue;
+                }
+                if (pos % BITS_PER_WORD == 0 && b->v[ix] == 0 &&
+                    pos + BITS_PER_WORD <= to) {
+                        /* Whole word is clear */
+                        if (run == 0) {
+                                start = pos;
+                        }
+                        run += BITS_PER_WORD;
+                        pos += BITS_PER_WORD;
+                }
+                else {
+                        mask = ((WORD_TYPE)1) << (pos % BITS_PER_WORD);
+                        if (b->v[ix] & mask) {
+                                run = 0;
+                        }
+                        else {
+                                if (run == 0) {
+                                        start = pos;
+                                }
+                                run++;
+                        }
+                        pos++;
+                }
+                if (run >= num) {
+                        *ret = start;
+                        return true;
+                }
+        }
+        return false;
+}
 
 struct bitmap *
 bitmap_create(unsigned nbits)
 {
         struct bitmap *b;
-        unsigned words;
+        unsigned words, sumwords;
 
         words = DIVROUNDUP(nbits, BITS_PER_WORD);
+        sumwords = DIVROUNDUP(words, SUM_BITS);
         b = kmalloc(sizeof(struct bitmap));
         if (b == NULL) {
                 return NULL;
@@ -69,9 +242,17 @@ bitmap_create(unsigned nbits)
                 kfree(b);
                 return NULL;
         }
+        b->sum = kmalloc(sumwords*sizeof(uint32_t));
+        if (b->sum == NULL) {
+                kfree(b->v);
+                kfree(b);
+                return NULL;
+        }
 
         bzero(b->v, words*sizeof(WORD_TYPE));
         b->nbits = nbits;
+        b->nwords = words;
+        b->cursor = 0;
 
         /* Mark any leftover bits at the end in use */
         if (words > nbits / BITS_PER_WORD) {
@@ -86,6 +267,9 @@ bitmap_create(unsigned nbits)
                 }
         }
 
+        b->stale = true;
+        bitmap_checksum(b);
+
         return b;
 }
 
@@ -95,29 +279,69 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
+void
+bitmap_datachanged(struct bitmap *b)
+{
+        b->stale = true;
+}
+
 int
 bitmap_alloc(struct bitmap *b, unsigned *index)
 {
         unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
         unsigned offset;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
+        bitmap_checksum(b);
 
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
-                        }
-                        KASSERT(0);
-                }
+        if (!bitmap_findword(b, b->cursor, b->nwords, &ix) &&
+            !bitmap_findword(b, 0, b->cursor, &ix)) {
+                return ENOSPC;
+        }
+
+        KASSERT(b->v[ix] != WORD_ALLBITS);
+        offset = bitmap_ffs((uint32_t)(WORD_TYPE)~b->v[ix]);
+        b->v[ix] |= ((WORD_TYPE)1) << offset;
+        bitmap_sumupdate(b, ix);
+        b->cursor = ix;
+
+        *index = (ix*BITS_PER_WORD)+offset;
+        KASSERT(*index < b->nbits);
+        return 0;
+}
+
+int
+bitmap_alloc_range(struct bitmap *b, unsigned num, unsigned hint,
+                   unsigned *index)
+{
+        unsigned start, i, wrapto;
+
+        KASSERT(num > 0);
+
+        bitmap_checksum(b);
+
+        if (num > b->nbits) {
+                return ENOSPC;
+        }
+        if (hint >= b->nbits) {
+                hint = 0;
+        }
+
+        /* Look from HINT to the end, then from the start up to HINT */
+        wrapto = hint + num - 1;
+        if (wrapto > b->nbits) {
+                wrapto = b->nbits;
         }
-        return ENOSPC;
+        if (!bitmap_findrun(b, num, hint, b->nbits, &start) &&
+            !bitmap_findrun(b, num, 0, wrapto, &start)) {
+                return ENOSPC;
+        }
+
+        for (i=start; i<start+num; i++) {
+                bitmap_mark(b, i);
+        }
+
+        *index = start;
+        return 0;
 }
 
 static
@@ -140,8 +364,11 @@ bitmap_mark(struct bitmap *b, unsigned index)
         KASSERT(index < b->nbits);
         bitmap_translate(index, &ix, &mask);
 
+        bitmap_checksum(b);
+
         KASSERT((b->v[ix] & mask)==0);
         b->v[ix] |= mask;
+        bitmap_sumupdate(b, ix);
 }
 
 void
@@ -153,8 +380,11 @@ bitmap_unmark(struct bitmap *b, unsigned index)
         KASSERT(index < b->nbits);
         bitmap_translate(index, &ix, &mask);
 
+        bitmap_checksum(b);
+
         KASSERT((b->v[ix] & mask)!=0);
         b->v[ix] &= ~mask;
+        bitmap_sumupdate(b, ix);
 }
 
 
@@ -171,6 +401,7 @@ bitmap_isset(struct bitmap *b, unsigned index)
 void
 bitmap_destroy(struct bitmap *b)
 {
+        kfree(b->sum);
         kfree(b->v);
         kfree(b);
 }
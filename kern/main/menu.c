@@ -38,7 +38,10 @@
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <device.h>
 #include <buf.h>
+#include <iosched.h>
+#include <namecache.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
@@ -419,6 +422,186 @@ cmd_bufstats(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Command to choose the buffer cache replacement policy. Give it on
+ * the boot command line to run a whole workload under one policy;
+ * the current policy is shown by "buf".
+ */
+static
+int
+cmd_bufpolicy(int nargs, char **args)
+{
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: bufpolicy lru|2q\n");
+		return EINVAL;
+	}
+
+	result = buffer_set_policy(args[1]);
+	if (result) {
+		kprintf("bufpolicy: unknown policy %s\n", args[1]);
+	}
+	return result;
+}
+
+/*
+ * Command to tune how the buffer cache sizes itself. The current
+ * settings are shown by "buf".
+ */
+static
+int
+cmd_bufsize(int nargs, char **args)
+{
+	int result;
+
+	if (nargs != 3) {
+		kprintf("Usage: bufsize min|max|grow|shrink kbytes\n");
+		return EINVAL;
+	}
+
+	result = buffer_set_sizing(args[1], atoi(args[2]));
+	if (result) {
+		kprintf("bufsize: invalid setting\n");
+	}
+	return result;
+}
+
+static
+int
+cmd_ncstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		(void)args;
+		namecache_printstats();
+	}
+	else {
+		kprintf("Usage: nc\n");
+	}
+
+	return 0;
+}
+
+#if OPT_SFS
+static
+int
+cmd_sfsstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		(void)args;
+		sfs_printstats();
+	}
+	else {
+		kprintf("Usage: sfsstats\n");
+	}
+
+	return 0;
+}
+
+/*
+ * Command to tune SFS journal group commit. The current settings are
+ * shown by "sfsstats".
+ */
+static
+int
+cmd_jgc(int nargs, char **args)
+{
+	int result;
+
+	if (nargs != 3) {
+		kprintf("Usage: jgc window|batch value\n");
+		return EINVAL;
+	}
+
+	result = sfs_jphys_setgroupcommit(args[1], atoi(args[2]));
+	if (result) {
+		kprintf("jgc: invalid setting\n");
+	}
+	return result;
+}
+#endif
+
+static
+int
+cmd_iostats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		(void)args;
+		iosched_printstats();
+	}
+	else {
+		kprintf("Usage: io\n");
+	}
+
+	return 0;
+}
+
+/*
+ * Command to create a RAM disk. Give it on the boot command line to
+ * have one ready for mksfs and mount.
+ */
+static
+int
+cmd_ramdisk(int nargs, char **args)
+{
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: rd kbytes\n");
+		return EINVAL;
+	}
+
+	result = ramdisk_create(atoi(args[1]));
+	if (result) {
+		kprintf("rd: %s\n", strerror(result));
+	}
+	return result;
+}
+
+/*
+ * Command to build a stripe set out of several disks.
+ */
+static
+int
+cmd_stripe(int nargs, char **args)
+{
+	int result;
+
+	if (nargs < 4) {
+		kprintf("Usage: stripe unitkbytes device device...\n");
+		return EINVAL;
+	}
+
+	result = stripe_create(atoi(args[1]), nargs - 2, &args[2]);
+	if (result) {
+		kprintf("stripe: %s\n", strerror(result));
+	}
+	return result;
+}
+
+/*
+ * Command to choose a disk's I/O scheduling policy. Like bufpolicy,
+ * it can be given on the boot command line; "io" shows the current
+ * policies.
+ */
+static
+int
+cmd_iosched(int nargs, char **args)
+{
+	int result;
+
+	if (nargs != 3) {
+		kprintf("Usage: iosched device fifo|clook|deadline\n");
+		return EINVAL;
+	}
+
+	result = iosched_setpolicy(args[1], args[2]);
+	if (result) {
+		kprintf("iosched: %s: %s\n", args[1], strerror(result));
+	}
+	return result;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -478,6 +661,7 @@ static const char *testmenu[] = {
 	"[at]  Array test                    ",
 	"[at2] Large array test              ",
 	"[bt]  Bitmap test                   ",
+	"[bmb] Bitmap allocation benchmark   ",
 	"[tlt] Threadlist test               ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
@@ -494,6 +678,8 @@ static const char *testmenu[] = {
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
 	"[sy4] CV test #2            (1)     ",
+	"[sy5] RW lock test                  ",
+	"[rwb] RW lock contention benchmark  ",
 	"[semu1-22] Semaphore unit tests     ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress                ",
@@ -501,6 +687,8 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+	"[bb]  Buffer cache hit benchmark    ",
+	"[db]  Raw disk throughput benchmark ",
 	NULL
 };
 
@@ -526,6 +714,17 @@ static const char *mainmenu[] = {
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
 	"[buf] Print buffer cache stats      ",
+	"[bufpolicy] Set buffer cache policy ",
+	"[bufsize] Tune buffer cache sizing  ",
+	"[nc] Print name cache stats         ",
+#if OPT_SFS
+	"[sfsstats] Print SFS stats          ",
+	"[jgc] Tune journal group commit     ",
+#endif
+	"[io] Print disk I/O stats           ",
+	"[iosched] Set disk I/O scheduler    ",
+	"[rd] Create a RAM disk              ",
+	"[stripe] Create a stripe set        ",
 #if OPT_SYNCHPROBS
     "[sp1] Elves                         ",
     "[sp2] Air Balloon                   ",
@@ -580,11 +779,23 @@ static struct {
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
 	{ "buf",        cmd_bufstats },
+	{ "bufpolicy",  cmd_bufpolicy },
+	{ "bufsize",    cmd_bufsize },
+	{ "nc",         cmd_ncstats },
+#if OPT_SFS
+	{ "sfsstats",   cmd_sfsstats },
+	{ "jgc",        cmd_jgc },
+#endif
+	{ "io",         cmd_iostats },
+	{ "iosched",    cmd_iosched },
+	{ "rd",         cmd_ramdisk },
+	{ "stripe",     cmd_stripe },
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "at2",	arraytest2 },
 	{ "bt",		bitmaptest },
+	{ "bmb",	bitmapbench },
 	{ "tlt",	threadlisttest },
 	{ "km1",	kmalloctest },
 	{ "km2",	kmallocstress },
@@ -603,6 +814,8 @@ static struct {
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "sy5",	rwtest },
+	{ "rwb",	rwbench },
 #if OPT_SYNCHPROBS
     { "sp1",    elves },
     { "sp2",    airballoon },
@@ -639,6 +852,8 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	longstress },
 	{ "fs6",	createstress },
+	{ "bb",		bufbench },
+	{ "db",		diskbench },
 
 	{ NULL, NULL }
 };
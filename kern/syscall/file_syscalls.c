@@ -27,7 +27,7 @@
 int
 sys_open(const_userptr_t upath, int flags, mode_t mode, int *retval)
 {
-	const int allflags = O_ACCMODE | O_CREAT | O_EXCL | O_TRUNC | O_APPEND | O_NOCTTY;
+	const int allflags = O_ACCMODE | O_CREAT | O_EXCL | O_TRUNC | O_APPEND | O_NOCTTY | O_DIRECT;
 
 	if(flags == allflags)//check for valid falgs
 		return EINVAL;
@@ -92,8 +92,14 @@ sys_read(int fd, userptr_t buf, size_t size, int *retval)
 	}
 	//construct a struct uio
 	uio_kinit(&ioVEC, &uIO, buf, size, openFile->of_offset, UIO_READ);
-	//call VOP_READ
-	result = VOP_READ(openFile->of_vnode, &uIO);
+	//it's a user buffer; the disk driver can't hand it to the hardware
+	uIO.uio_segflg = UIO_USERSPACE;
+	uIO.uio_space = proc_getas();
+	//call VOP_READ, or VOP_DIRECTIO for O_DIRECT
+	if(openFile->of_direct)
+		result = VOP_DIRECTIO(openFile->of_vnode, &uIO);
+	else
+		result = VOP_READ(openFile->of_vnode, &uIO);
 	if(result != 0)
 		return result;
 
@@ -145,8 +151,14 @@ int sys_write(int fd, userptr_t buf, size_t size, int *retval)
 	}
 	//construct a struct uio
 	uio_kinit(&ioVEC, &uIO, buf, size, openFile->of_offset, UIO_WRITE);
-	//call VOP_WRITE
-	result = VOP_WRITE(openFile->of_vnode, &uIO);
+	//it's a user buffer; the disk driver can't hand it to the hardware
+	uIO.uio_segflg = UIO_USERSPACE;
+	uIO.uio_space = proc_getas();
+	//call VOP_WRITE, or VOP_DIRECTIO for O_DIRECT
+	if(openFile->of_direct)
+		result = VOP_DIRECTIO(openFile->of_vnode, &uIO);
+	else
+		result = VOP_WRITE(openFile->of_vnode, &uIO);
 	if(result != 0)
 		return result;
 
@@ -44,7 +44,7 @@
  */
 static
 struct openfile *
-openfile_create(struct vnode *vn, int accmode)
+openfile_create(struct vnode *vn, int accmode, bool direct)
 {
 	struct openfile *file;
 
@@ -68,6 +68,7 @@ openfile_create(struct vnode *vn, int accmode)
 
 	file->of_vnode = vn;
 	file->of_accmode = accmode;
+	file->of_direct = direct;
 	file->of_offset = 0;
 	file->of_refcount = 1;
 
@@ -106,7 +107,8 @@ openfile_open(char *filename, int openflags, mode_t mode,
 		return result;
 	}
 
-	file = openfile_create(vn, openflags & O_ACCMODE);
+	file = openfile_create(vn, openflags & O_ACCMODE,
+			       (openflags & O_DIRECT) != 0);
 	if (file == NULL) {
 		vfs_close(vn);
 		return ENOMEM;
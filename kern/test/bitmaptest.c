@@ -28,19 +28,25 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
 #include <bitmap.h>
 #include <test.h>
 
 #define TESTSIZE 533
 
+#define BENCHSIZE	(64*1024)	/* bits: a 32M volume of 512-byte blocks */
+#define BENCHOPS	20000
+#define BENCHRUN	8
+
 int
 bitmaptest(int nargs, char **args)
 {
 	struct bitmap *b;
 	char data[TESTSIZE];
 	uint32_t x;
-	int i;
+	int i, j;
 
 	(void)nargs;
 	(void)args;
@@ -101,6 +107,139 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/* Punch holes of various sizes and allocate ranges out of them */
+	for (i=0; i<TESTSIZE; i++) {
+		if (i % 16 < i / 64) {
+			bitmap_unmark(b, i);
+			data[i] = 1;
+		}
+	}
+	for (j=8; j>0; j--) {
+		while (bitmap_alloc_range(b, j, random() % TESTSIZE, &x)==0) {
+			for (i=x; i<(int)(x+j); i++) {
+				KASSERT(i < TESTSIZE);
+				KASSERT(bitmap_isset(b, i));
+				KASSERT(data[i]==1);
+				data[i] = 0;
+			}
+		}
+	}
+	for (i=0; i<TESTSIZE; i++) {
+		KASSERT(bitmap_isset(b, i));
+		KASSERT(data[i]==0);
+	}
+	KASSERT(bitmap_alloc(b, &x) == ENOSPC);
+
+	bitmap_destroy(b);
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
+
+/*
+ * Print the time taken for NUM operations.
+ */
+static
+void
+bitmapbench_report(const char *what, unsigned num, unsigned failed,
+		   struct timespec *before, struct timespec *after)
+{
+	struct timespec duration;
+	uint64_t nsecs;
+
+	timespec_sub(after, before, &duration);
+	nsecs = duration.tv_sec * 1000000000ULL + duration.tv_nsec;
+
+	kprintf("bitmapbench: %u %s in %llu.%09lu seconds (%llu ns each)",
+		num, what, (unsigned long long)duration.tv_sec,
+		(unsigned long)duration.tv_nsec,
+		(unsigned long long)(nsecs / num));
+	if (failed > 0) {
+		kprintf(", %u failed", failed);
+	}
+	kprintf("\n");
+}
+
+/*
+ * Free a random bit that's in use, so the bitmap stays as full as it
+ * started.
+ */
+static
+void
+bitmapbench_freeone(struct bitmap *b)
+{
+	unsigned x;
+
+	do {
+		x = random() % BENCHSIZE;
+	} while (!bitmap_isset(b, x));
+	bitmap_unmark(b, x);
+}
+
+/*
+ * Allocation benchmark: fill a large bitmap to the given percentage
+ * (99 by default) and time single-bit and range allocations, freeing
+ * a random bit for each bit allocated.
+ */
+int
+bitmapbench(int nargs, char **args)
+{
+	struct bitmap *b;
+	struct timespec before, after;
+	unsigned pct, i, j, x, failed;
+
+	if (nargs > 2) {
+		kprintf("Usage: bmb [percent-full]\n");
+		return EINVAL;
+	}
+	pct = nargs > 1 ? (unsigned)atoi(args[1]) : 99;
+	if (pct >= 100) {
+		kprintf("bitmapbench: percent-full must be less than 100\n");
+		return EINVAL;
+	}
+
+	b = bitmap_create(BENCHSIZE);
+	if (b == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<BENCHSIZE; i++) {
+		if (random() % 100 < pct) {
+			bitmap_mark(b, i);
+		}
+	}
+
+	kprintf("Starting bitmap benchmark (%u bits, %u%% full)...\n",
+		BENCHSIZE, pct);
+
+	failed = 0;
+	gettime(&before);
+	for (i=0; i<BENCHOPS; i++) {
+		if (bitmap_alloc(b, &x)) {
+			failed++;
+			continue;
+		}
+		bitmapbench_freeone(b);
+	}
+	gettime(&after);
+	bitmapbench_report("allocs", BENCHOPS, failed, &before, &after);
+
+	failed = 0;
+	gettime(&before);
+	for (i=0; i<BENCHOPS; i++) {
+		if (bitmap_alloc_range(b, BENCHRUN, random() % BENCHSIZE,
+				       &x)) {
+			failed++;
+			continue;
+		}
+		for (j=0; j<BENCHRUN; j++) {
+			bitmap_unmark(b, x + j);
+		}
+	}
+	gettime(&after);
+	bitmapbench_report("range allocs", BENCHOPS, failed, &before, &after);
+
+	bitmap_destroy(b);
+
+	kprintf("Bitmap benchmark done.\n");
+	return 0;
+}
@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Buffer cache benchmark.
+ *
+ * This measures the cost of the buffer cache hit path (buffer_read of
+ * a block that's already cached, followed by buffer_release) with
+ * several threads running at once. Each thread uses its own range of
+ * blocks, so the threads never wait for each other's buffers; any
+ * slowdown as threads are added is lock contention inside buf.c.
+ *
+ * The blocks belong to a dummy file system that reads zeros and never
+ * writes anything, so no disk is needed.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <fs.h>
+#include <buf.h>
+#include <test.h>
+
+#define BUFTEST_BLOCKSIZE	512	/* must match buf.c */
+#define BUFTEST_BLOCKS		16	/* blocks per thread */
+#define BUFTEST_THREADS		8	/* default thread count */
+#define BUFTEST_LOOPS		2000	/* default loops per thread */
+#define BUFTEST_MAXTHREADS	32
+
+static struct semaphore *buftest_startsem;
+static struct semaphore *buftest_donesem;
+static unsigned buftest_loops;
+static volatile unsigned buftest_errors;
+
+////////////////////////////////////////////////////////////
+// dummy fs
+
+static
+int
+buftest_sync(struct fs *fs)
+{
+	(void)fs;
+	return 0;
+}
+
+static
+const char *
+buftest_getvolname(struct fs *fs)
+{
+	(void)fs;
+	return "bufbench";
+}
+
+static
+int
+buftest_getroot(struct fs *fs, struct vnode **ret)
+{
+	(void)fs;
+	(void)ret;
+	return ENOSYS;
+}
+
+static
+int
+buftest_unmount(struct fs *fs)
+{
+	(void)fs;
+	return EBUSY;
+}
+
+static
+int
+buftest_readblock(struct fs *fs, daddr_t block, void *data, size_t len)
+{
+	(void)fs;
+	(void)block;
+	bzero(data, len);
+	return 0;
+}
+
+static
+int
+buftest_writeblock(struct fs *fs, daddr_t block, void *fsdata,
+		   void *data, size_t len)
+{
+	(void)fs;
+	(void)block;
+	(void)fsdata;
+	(void)data;
+	(void)len;
+	return 0;
+}
+
+static
+int
+buftest_attachbuf(struct fs *fs, daddr_t block, struct buf *buf)
+{
+	(void)fs;
+	(void)block;
+	(void)buf;
+	return 0;
+}
+
+static
+void
+buftest_detachbuf(struct fs *fs, daddr_t block, struct buf *buf)
+{
+	(void)fs;
+	(void)block;
+	(void)buf;
+}
+
+static const struct fs_ops buftest_fsops = {
+	.fsop_sync = buftest_sync,
+	.fsop_getvolname = buftest_getvolname,
+	.fsop_getroot = buftest_getroot,
+	.fsop_unmount = buftest_unmount,
+	.fsop_readblock = buftest_readblock,
+	.fsop_writeblock = buftest_writeblock,
+	.fsop_attachbuf = buftest_attachbuf,
+	.fsop_detachbuf = buftest_detachbuf,
+};
+
+static struct fs buftest_fs = {
+	.fs_data = NULL,
+	.fs_ops = &buftest_fsops,
+};
+
+////////////////////////////////////////////////////////////
+// benchmark
+
+/*
+ * Read and release each of a thread's blocks once.
+ */
+static
+int
+buftest_pass(unsigned long num)
+{
+	struct buf *b;
+	daddr_t block;
+	unsigned i;
+	int result;
+
+	for (i=0; i<BUFTEST_BLOCKS; i++) {
+		block = num * BUFTEST_BLOCKS + i;
+		result = buffer_read(&buftest_fs, block, BUFTEST_BLOCKSIZE,
+				     &b);
+		if (result) {
+			return result;
+		}
+		buffer_release(b);
+	}
+	return 0;
+}
+
+static
+void
+buftest_thread(void *junk, unsigned long num)
+{
+	unsigned i;
+	int result;
+
+	(void)junk;
+
+	P(buftest_startsem);
+
+	reserve_buffers(BUFTEST_BLOCKSIZE);
+	for (i=0; i<buftest_loops; i++) {
+		result = buftest_pass(num);
+		if (result) {
+			kprintf("bufbench: thread %lu: %s\n", num,
+				strerror(result));
+			buftest_errors++;
+			break;
+		}
+	}
+	unreserve_buffers(BUFTEST_BLOCKSIZE);
+
+	V(buftest_donesem);
+}
+
+int
+bufbench(int nargs, char **args)
+{
+	struct timespec before, after, duration;
+	unsigned nthreads, i;
+	uint64_t gets, nsecs;
+	int result;
+
+	if (nargs > 3) {
+		kprintf("Usage: bb [nthreads [loops]]\n");
+		return EINVAL;
+	}
+	nthreads = nargs > 1 ? (unsigned)atoi(args[1]) : BUFTEST_THREADS;
+	buftest_loops = nargs > 2 ? (unsigned)atoi(args[2]) : BUFTEST_LOOPS;
+	if (nthreads < 1 || nthreads > BUFTEST_MAXTHREADS ||
+	    buftest_loops < 1) {
+		kprintf("bufbench: 1-%u threads and at least one loop\n",
+			BUFTEST_MAXTHREADS);
+		return EINVAL;
+	}
+
+	buftest_startsem = sem_create("bufbench start", 0);
+	if (buftest_startsem == NULL) {
+		panic("bufbench: sem_create failed\n");
+	}
+	buftest_donesem = sem_create("bufbench done", 0);
+	if (buftest_donesem == NULL) {
+		panic("bufbench: sem_create failed\n");
+	}
+	buftest_errors = 0;
+
+	kprintf("Starting buffer cache benchmark: %u threads, %u loops...\n",
+		nthreads, buftest_loops);
+
+	/* Warm the cache so the timed part only sees hits. */
+	reserve_buffers(BUFTEST_BLOCKSIZE);
+	for (i=0; i<nthreads; i++) {
+		result = buftest_pass(i);
+		if (result) {
+			kprintf("bufbench: warmup: %s\n", strerror(result));
+			unreserve_buffers(BUFTEST_BLOCKSIZE);
+			goto out;
+		}
+	}
+	unreserve_buffers(BUFTEST_BLOCKSIZE);
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("bufbench", NULL, buftest_thread,
+				     NULL, i);
+		if (result) {
+			panic("bufbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	gettime(&before);
+	for (i=0; i<nthreads; i++) {
+		V(buftest_startsem);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(buftest_donesem);
+	}
+	gettime(&after);
+
+	timespec_sub(&after, &before, &duration);
+	gets = (uint64_t)nthreads * buftest_loops * BUFTEST_BLOCKS;
+	nsecs = duration.tv_sec * 1000000000ULL + duration.tv_nsec;
+
+	kprintf("bufbench: %llu gets in %llu.%09lu seconds",
+		(unsigned long long)gets,
+		(unsigned long long)duration.tv_sec,
+		(unsigned long)duration.tv_nsec);
+	if (nsecs > 0) {
+		kprintf(" (%llu gets/sec)",
+			(unsigned long long)(gets * 1000000000ULL / nsecs));
+	}
+	kprintf("\n");
+	if (buftest_errors > 0) {
+		kprintf("bufbench: %u threads failed\n", buftest_errors);
+	}
+	result = 0;
+
+ out:
+	drop_fs_buffers(&buftest_fs);
+	sem_destroy(buftest_startsem);
+	sem_destroy(buftest_donesem);
+	buftest_startsem = buftest_donesem = NULL;
+	kprintf("Buffer cache benchmark done.\n");
+	return result;
+}
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Raw disk throughput benchmark.
+ *
+ * This reads (and optionally first writes) the start of a raw device
+ * sequentially in large transfers and reports the throughput, so a
+ * stripe set can be compared against one of its member disks, e.g.
+ *
+ *    db lhd1raw: 1024
+ *    stripe 4 lhd0 lhd1
+ *    db st0raw: 1024
+ *
+ * Writing destroys whatever is on the device, so it's only done if
+ * asked for.
+ *
+ * It also works on a file (which is created if writing), and with
+ * "d" uses VOP_DIRECTIO as for O_DIRECT, so the buffer cache and
+ * direct paths can be compared:
+ *
+ *    db lhd0:big 1024 w
+ *    db lhd0:big 1024 wd
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <clock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define DISKBENCH_IOSIZE	(64*1024)	/* bytes per transfer */
+
+/*
+ * Do one pass over the first KBYTES of VN and print the result.
+ */
+static
+int
+diskbench_pass(struct vnode *vn, char *buf, unsigned kbytes, enum uio_rw rw,
+	       bool direct)
+{
+	struct timespec before, after, duration;
+	struct iovec iov;
+	struct uio ku;
+	uint64_t nsecs;
+	off_t pos, total;
+	size_t amount;
+	int result;
+
+	total = (off_t)kbytes * 1024;
+
+	gettime(&before);
+	for (pos = 0; pos < total; pos += amount) {
+		amount = DISKBENCH_IOSIZE;
+		if (pos + amount > total) {
+			amount = total - pos;
+		}
+		uio_kinit(&iov, &ku, buf, amount, pos, rw);
+		if (direct) {
+			result = VOP_DIRECTIO(vn, &ku);
+		}
+		else {
+			result = rw == UIO_READ ? VOP_READ(vn, &ku) :
+				VOP_WRITE(vn, &ku);
+		}
+		if (result) {
+			kprintf("diskbench: %s at %llu: %s\n",
+				rw == UIO_READ ? "read" : "write",
+				(unsigned long long)pos, strerror(result));
+			return result;
+		}
+	}
+	gettime(&after);
+
+	timespec_sub(&after, &before, &duration);
+	nsecs = duration.tv_sec * 1000000000ULL + duration.tv_nsec;
+
+	kprintf("diskbench: %s %u KB%s in %llu.%09lu seconds",
+		rw == UIO_READ ? "read" : "wrote", kbytes,
+		direct ? " direct" : "",
+		(unsigned long long)duration.tv_sec,
+		(unsigned long)duration.tv_nsec);
+	if (nsecs > 0) {
+		kprintf(" (%llu KB/sec)",
+			(unsigned long long)(kbytes * 1000000000ULL / nsecs));
+	}
+	kprintf("\n");
+	return 0;
+}
+
+int
+diskbench(int nargs, char **args)
+{
+	struct vnode *vn;
+	char *buf, *path;
+	unsigned kbytes;
+	bool dowrite = false, direct = false;
+	const char *s;
+	int result;
+
+	if (nargs == 4) {
+		for (s = args[3]; *s; s++) {
+			if (*s == 'w') {
+				dowrite = true;
+			}
+			else if (*s == 'd') {
+				direct = true;
+			}
+			else {
+				nargs = 0;
+			}
+		}
+	}
+	if (nargs < 3 || nargs > 4) {
+		kprintf("Usage: db rawdevice|file kbytes [w][d]\n");
+		return EINVAL;
+	}
+	kbytes = atoi(args[2]);
+	if (kbytes == 0) {
+		kprintf("diskbench: need at least 1 KB\n");
+		return EINVAL;
+	}
+
+	buf = kmalloc(DISKBENCH_IOSIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	bzero(buf, DISKBENCH_IOSIZE);
+
+	/*
+	 * vfs_open destroys the string it's passed, so keep a copy in
+	 * case we need to retry. Devices can't be created, so O_CREAT
+	 * is only tried if the plain open says the file isn't there.
+	 */
+	path = kstrdup(args[1]);
+	if (path == NULL) {
+		kfree(buf);
+		return ENOMEM;
+	}
+	result = vfs_open(args[1], dowrite ? O_RDWR : O_RDONLY, 0, &vn);
+	if (result == ENOENT && dowrite) {
+		result = vfs_open(path, O_RDWR|O_CREAT, 0664, &vn);
+	}
+	kfree(path);
+	if (result) {
+		kprintf("diskbench: %s: %s\n", args[1], strerror(result));
+		kfree(buf);
+		return result;
+	}
+
+	kprintf("Starting disk benchmark...\n");
+	result = 0;
+	if (dowrite) {
+		result = diskbench_pass(vn, buf, kbytes, UIO_WRITE, direct);
+	}
+	if (result == 0) {
+		result = diskbench_pass(vn, buf, kbytes, UIO_READ, direct);
+	}
+
+	vfs_close(vn);
+	kfree(buf);
+	kprintf("Disk benchmark done.\n");
+	return result;
+}
@@ -32,6 +32,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <clock.h>
 #include <thread.h>
@@ -399,3 +400,344 @@ cvtest2(int nargs, char **args)
 	kprintf("cvtest2 done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Reader-writer lock test.
+ *
+ * Writers (every fourth thread) store a consistent triple in
+ * testval1-3 as in the lock test; readers check it, and count how
+ * many of them are in at once, which should go above one. Another
+ * quarter of the threads take the lock for reading, upgrade it,
+ * write, and downgrade again, checking that nobody wrote in between.
+ */
+
+#define NRWLOOPS      40
+
+static struct rwlock *testrwlock;
+static struct spinlock rwtest_lock = SPINLOCK_INITIALIZER;
+static volatile unsigned rwtest_readers;
+static volatile unsigned rwtest_writers;
+static volatile unsigned rwtest_maxreaders;
+static volatile bool rwtest_failed;
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	rwtest_failed = true;
+}
+
+static
+void
+rwtest_enter(unsigned long num, bool writing)
+{
+	spinlock_acquire(&rwtest_lock);
+	if (writing) {
+		if (rwtest_readers > 0 || rwtest_writers > 0) {
+			rwfail(num, "writer not alone");
+		}
+		rwtest_writers++;
+	}
+	else {
+		if (rwtest_writers > 0) {
+			rwfail(num, "reader alongside writer");
+		}
+		rwtest_readers++;
+		if (rwtest_readers > rwtest_maxreaders) {
+			rwtest_maxreaders = rwtest_readers;
+		}
+	}
+	spinlock_release(&rwtest_lock);
+}
+
+static
+void
+rwtest_leave(bool writing)
+{
+	spinlock_acquire(&rwtest_lock);
+	if (writing) {
+		rwtest_writers--;
+	}
+	else {
+		rwtest_readers--;
+	}
+	spinlock_release(&rwtest_lock);
+}
+
+static
+void
+rwtest_check(unsigned long num)
+{
+	if (testval2 != testval1*testval1) {
+		rwfail(num, "Mismatch on testval2/testval1");
+	}
+	if (testval3 != testval1%3) {
+		rwfail(num, "Mismatch on testval3/testval1");
+	}
+}
+
+static
+void
+rwtest_write(unsigned long num)
+{
+	testval1 = num;
+	thread_yield();
+	testval2 = num*num;
+	thread_yield();
+	testval3 = num%3;
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i;
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		switch (num % 4) {
+		    case 0:
+			rwlock_acquire_write(testrwlock);
+			rwtest_enter(num, true);
+			rwtest_write(num);
+			rwtest_check(num);
+			rwtest_leave(true);
+			rwlock_release_write(testrwlock);
+			break;
+		    case 1:
+			rwlock_acquire_read(testrwlock);
+			rwtest_enter(num, false);
+			rwtest_check(num);
+			rwtest_leave(false);
+			/* whether or not it held on, we're alone now */
+			(void)rwlock_upgrade(testrwlock);
+			rwtest_enter(num, true);
+			rwtest_write(num);
+			rwtest_leave(true);
+			rwlock_downgrade(testrwlock);
+			rwtest_enter(num, false);
+			thread_yield();
+			if (testval1 != num) {
+				rwfail(num, "Write between downgrade and read");
+			}
+			rwtest_check(num);
+			rwtest_leave(false);
+			rwlock_release_read(testrwlock);
+			break;
+		    default:
+			rwlock_acquire_read(testrwlock);
+			rwtest_enter(num, false);
+			thread_yield();
+			rwtest_check(num);
+			rwtest_leave(false);
+			rwlock_release_read(testrwlock);
+			break;
+		}
+	}
+	V(donesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	if (testrwlock == NULL) {
+		testrwlock = rwlock_create("testrwlock");
+		if (testrwlock == NULL) {
+			panic("synchtest: rwlock_create failed\n");
+		}
+	}
+	kprintf("Starting rwlock test...\n");
+
+	testval1 = testval2 = testval3 = 0;
+	rwtest_maxreaders = 0;
+	rwtest_failed = false;
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("synchtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	kprintf("Up to %u readers at once\n", rwtest_maxreaders);
+	if (rwtest_maxreaders < 2) {
+		rwfail(0, "Readers never overlapped");
+	}
+	kprintf("Rwlock test %s\n", rwtest_failed ? "FAILED" : "done");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Reader-writer lock contention benchmark.
+ *
+ *    rwbench [threads [write-percent]]
+ *
+ * Each thread goes around RWBENCH_LOOPS times taking a lock, looking
+ * through a small table, and letting go, writing to the table instead
+ * WRITE-PERCENT percent of the time. The critical section yields
+ * partway through, as a reader in the filesystem would while waiting
+ * for the disk, so readers overlap even on one CPU. This is done once
+ * with a plain lock and once with a reader-writer lock, and the time
+ * for each is printed.
+ */
+
+#define RWBENCH_LOOPS	200
+#define RWBENCH_TABLE	64
+
+static volatile unsigned rwbench_table[RWBENCH_TABLE];
+static struct lock *rwbench_lock;
+static struct rwlock *rwbench_rwlock;
+static unsigned rwbench_writepct;
+
+static
+void
+rwbench_work(unsigned long num, unsigned i, bool writing)
+{
+	unsigned j, sum;
+
+	sum = 0;
+	for (j=0; j<RWBENCH_TABLE; j++) {
+		if (j == RWBENCH_TABLE/2) {
+			thread_yield();
+		}
+		if (writing) {
+			rwbench_table[j] = num + i;
+		}
+		else {
+			sum += rwbench_table[j];
+		}
+	}
+	(void)sum;
+}
+
+static
+void
+rwbenchthread(void *junk, unsigned long num)
+{
+	unsigned i;
+	bool writing;
+
+	(void)junk;
+
+	for (i=0; i<RWBENCH_LOOPS; i++) {
+		/* spread the writes evenly over the threads and loops */
+		writing = ((num * RWBENCH_LOOPS + i) * 37) % 100 <
+			rwbench_writepct;
+		if (rwbench_rwlock != NULL) {
+			if (writing) {
+				rwlock_acquire_write(rwbench_rwlock);
+			}
+			else {
+				rwlock_acquire_read(rwbench_rwlock);
+			}
+			rwbench_work(num, i, writing);
+			if (writing) {
+				rwlock_release_write(rwbench_rwlock);
+			}
+			else {
+				rwlock_release_read(rwbench_rwlock);
+			}
+		}
+		else {
+			lock_acquire(rwbench_lock);
+			rwbench_work(num, i, writing);
+			lock_release(rwbench_lock);
+		}
+	}
+	V(donesem);
+}
+
+static
+void
+rwbench_run(const char *what, unsigned nthreads)
+{
+	struct timespec before, after, duration;
+	uint64_t nsecs, ops;
+	unsigned i;
+	int result;
+
+	gettime(&before);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("rwbench", NULL, rwbenchthread, NULL, i);
+		if (result) {
+			panic("rwbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(donesem);
+	}
+	gettime(&after);
+
+	timespec_sub(&after, &before, &duration);
+	nsecs = duration.tv_sec * 1000000000ULL + duration.tv_nsec;
+	ops = (uint64_t)nthreads * RWBENCH_LOOPS;
+
+	kprintf("rwbench: %-6s %llu ops in %llu.%09lu seconds", what,
+		(unsigned long long)ops,
+		(unsigned long long)duration.tv_sec,
+		(unsigned long)duration.tv_nsec);
+	if (nsecs > 0) {
+		kprintf(" (%llu ops/sec)",
+			(unsigned long long)(ops * 1000000000ULL / nsecs));
+	}
+	kprintf("\n");
+}
+
+int
+rwbench(int nargs, char **args)
+{
+	unsigned nthreads;
+
+	if (nargs > 3) {
+		kprintf("Usage: rwbench [threads [write-percent]]\n");
+		return EINVAL;
+	}
+	nthreads = nargs > 1 ? atoi(args[1]) : NTHREADS;
+	rwbench_writepct = nargs > 2 ? atoi(args[2]) : 10;
+	if (nthreads == 0 || rwbench_writepct > 100) {
+		kprintf("rwbench: need at least 1 thread and at most "
+			"100%% writes\n");
+		return EINVAL;
+	}
+
+	inititems();
+	rwbench_lock = lock_create("rwbench");
+	if (rwbench_lock == NULL) {
+		return ENOMEM;
+	}
+
+	kprintf("rwbench: %u threads, %u%% writes\n", nthreads,
+		rwbench_writepct);
+
+	rwbench_rwlock = NULL;
+	rwbench_run("lock", nthreads);
+
+	rwbench_rwlock = rwlock_create("rwbench");
+	if (rwbench_rwlock == NULL) {
+		lock_destroy(rwbench_lock);
+		return ENOMEM;
+	}
+	rwbench_run("rwlock", nthreads);
+
+	rwlock_destroy(rwbench_rwlock);
+	rwbench_rwlock = NULL;
+	lock_destroy(rwbench_lock);
+	rwbench_lock = NULL;
+	return 0;
+}
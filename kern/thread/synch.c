@@ -455,3 +455,241 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 //	(void)cv;    // suppress warning until code gets written
 //	(void)lock;  // suppress warning until code gets written
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(*rw));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rwlock_name = kstrdup(name);
+	if (rw->rwlock_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_readwchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_readwchan == NULL) {
+		kfree(rw->rwlock_name);
+		kfree(rw);
+		return NULL;
+	}
+	rw->rw_writewchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_writewchan == NULL) {
+		wchan_destroy(rw->rw_readwchan);
+		kfree(rw->rwlock_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_writerswaiting = 0;
+	rw->rw_writer = NULL;
+	rw->rw_upgrader = NULL;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writerswaiting == 0);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_upgrader == NULL);
+
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_writewchan);
+	wchan_destroy(rw->rw_readwchan);
+	kfree(rw->rwlock_name);
+	kfree(rw);
+}
+
+/*
+ * Wake whoever can go now, after the lock has been given up (in
+ * whole or in part). Call with rw_lock held.
+ *
+ * An upgrader goes first once it's the only reader left; it shares
+ * rw_writewchan with the writers, so wake them all and let the ones
+ * that can't go yet sleep again. Otherwise one writer goes once
+ * there are no readers, and readers go only if no writer is waiting.
+ */
+static
+void
+rwlock_wakeup(struct rwlock *rw)
+{
+	KASSERT(spinlock_do_i_hold(&rw->rw_lock));
+
+	if (rw->rw_writer != NULL) {
+		return;
+	}
+	if (rw->rw_upgrader != NULL) {
+		if (rw->rw_readers == 1) {
+			wchan_wakeall(rw->rw_writewchan, &rw->rw_lock);
+		}
+	}
+	else if (rw->rw_writerswaiting > 0) {
+		if (rw->rw_readers == 0) {
+			wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+		}
+	}
+	else {
+		wchan_wakeall(rw->rw_readwchan, &rw->rw_lock);
+	}
+}
+
+/*
+ * Wait for the write lock. Call with rw_lock held.
+ */
+static
+void
+rwlock_waitwrite(struct rwlock *rw)
+{
+	rw->rw_writerswaiting++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		wchan_sleep(rw->rw_writewchan, &rw->rw_lock);
+	}
+	rw->rw_writerswaiting--;
+	rw->rw_writer = curthread;
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	while (rw->rw_writer != NULL || rw->rw_writerswaiting > 0 ||
+	       rw->rw_upgrader != NULL) {
+		wchan_sleep(rw->rw_readwchan, &rw->rw_lock);
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(rw->rw_upgrader != curthread);
+	rw->rw_readers--;
+	rwlock_wakeup(rw);
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	rwlock_waitwrite(rw);
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	KASSERT(rw->rw_readers == 0);
+	rw->rw_writer = NULL;
+	rwlock_wakeup(rw);
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_upgrade(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_readers > 0);
+
+	if (rw->rw_upgrader != NULL) {
+		/*
+		 * Someone else is already waiting for us to go away;
+		 * if we waited for them too, neither would ever get
+		 * it. So let go and queue up as an ordinary writer.
+		 */
+		KASSERT(rw->rw_upgrader != curthread);
+		rw->rw_readers--;
+		rwlock_wakeup(rw);
+		rwlock_waitwrite(rw);
+		spinlock_release(&rw->rw_lock);
+		return false;
+	}
+
+	rw->rw_upgrader = curthread;
+	while (rw->rw_readers > 1) {
+		wchan_sleep(rw->rw_writewchan, &rw->rw_lock);
+	}
+	rw->rw_upgrader = NULL;
+	rw->rw_readers--;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+	return true;
+}
+
+void
+rwlock_downgrade(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	KASSERT(rw->rw_readers == 0);
+	rw->rw_writer = NULL;
+	rw->rw_readers = 1;
+	rwlock_wakeup(rw);
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold(struct rwlock *rw)
+{
+	bool ret;
+
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	ret = rw->rw_writer == curthread || rw->rw_readers > 0;
+	spinlock_release(&rw->rw_lock);
+	return ret;
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	bool ret;
+
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	ret = (rw->rw_writer == curthread);
+	spinlock_release(&rw->rw_lock);
+	return ret;
+}
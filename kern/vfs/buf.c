@@ -36,6 +36,7 @@
 #include <current.h>
 #include <synch.h>
 #include <mainbus.h>
+#include <vm.h>
 #include <vfs.h>
 #include <fs.h>
 #include <buf.h>
@@ -43,6 +44,7 @@
 /* Uncomment this to enable printouts of the syncer state. */
 //#define SYNCER_VERBOSE
 
+
 DECLARRAY(buf, static __UNUSED inline);
 DEFARRAY(buf, static __UNUSED inline);
 
@@ -54,6 +56,55 @@ DEFARRAY(buf, static __UNUSED inline);
  */
 #define ONE_TRUE_BUFFER_SIZE		512
 
+/*
+ * Number of independently locked shards the attached buffers are
+ * split across. (See struct bufshard below.)
+ */
+#define BUFFER_NSHARDS			8
+
+/*
+ * Maximum number of pending read-ahead requests.
+ */
+#define READAHEAD_QUEUE_SIZE		64
+
+/*
+ * Number of threads doing asynchronous I/O.
+ */
+#define BUFIO_NTHREADS			4
+
+/*
+ * Maximum number of physically adjacent dirty buffers to write out
+ * in one clustered write.
+ */
+#define BUFFER_CLUSTER_MAX		16
+
+/*
+ * Replacement policies.
+ *
+ * BUFPOLICY_LRU is plain LRU.
+ *
+ * BUFPOLICY_2Q is the 2Q algorithm (Johnson and Shasha, VLDB '94).
+ * Buffers are first loaded into the A1in queue, which is FIFO and
+ * kept to a fraction of the cache; a second reference while a buffer
+ * is still in A1in doesn't count. When a buffer falls out of A1in,
+ * its key is remembered (without the data) in a "ghost" queue,
+ * A1out. If the block is then used again while its ghost is still
+ * around, it goes into the main queue, Am, which is LRU. This keeps
+ * a single pass over a large file from flushing everything that's
+ * actually being reused. (Am is bs_lru, the same list LRU uses.)
+ *
+ * The policy can be changed at any time with buffer_set_policy,
+ * including from the boot command line.
+ */
+#define BUFPOLICY_LRU			0
+#define BUFPOLICY_2Q			1
+#define BUFPOLICY_NUM			2
+
+static const char *const buffer_policy_names[BUFPOLICY_NUM] = {
+	"lru",
+	"2q",
+};
+
 /*
  * Illegal array index.
  */
@@ -74,15 +125,48 @@ DEFARRAY(buf, static __UNUSED inline);
  */
 #define EDEADBUF EBADF
 
+/*
+ * Intrusive doubly-linked list of buffers.
+ *
+ * This is the same AmigaOS-style arrangement as threadlist: the two
+ * nodes in the list structure are always on the list, as bookends,
+ * which removes the special cases. Those have bln_self NULL. So do
+ * markers, which are nodes a scan puts into a list to hold its place
+ * while the list is unlocked (see below); markers are not counted in
+ * bl_count and iterations skip over them.
+ *
+ * Every buffer has three list nodes: b_lrunode, which is on one of
+ * its shard's replacement queues (see below) when the buffer is
+ * attached and on the detached list otherwise; b_dirtynode, which is
+ * on its shard's dirty list when the buffer is dirty; and b_fsnode,
+ * which is on the list of its file system's buffers in its shard when
+ * the buffer is attached.
+ */
+struct buflistnode {
+	struct buflistnode *bln_prev;
+	struct buflistnode *bln_next;
+	struct buf *bln_self;
+};
+
+struct buflist {
+	struct buflistnode bl_head;
+	struct buflistnode bl_tail;
+	unsigned bl_count;
+};
+
 /*
  * One buffer.
  */
 struct buf {
 	/* maintenance */
-	unsigned b_tableindex;	/* index into {de,at}tached_buffers */
-	unsigned b_dirtyindex;	/* index into dirty_buffers */
+	struct buflistnode b_lrunode;	/* on LRU/A1in or detached list */
+	struct buflistnode b_dirtynode;	/* on dirty list */
+	struct buflistnode b_fsnode;	/* on per-fs list */
+	struct bufshard_fs *b_shardfs;	/* per-fs list we're on */
+	struct buflist *b_queue;	/* replacement queue we're on */
 	unsigned b_bucketindex;	/* index into buffer_hash bucket */
 	unsigned b_dirtyepoch;	/* when we became dirty */
+	struct bufshard *b_shard; /* shard we're attached in, if any */
 
 	/* status flags */
 	unsigned b_attached:1;	/* key fields are valid */
@@ -90,7 +174,9 @@ struct buf {
 	unsigned b_valid:1;	/* contains real data */
 	unsigned b_dirty:1;	/* data needs to be written to disk */
 	unsigned b_fsmanaged:1;	/* managed by file system */
+	unsigned b_readahead:1;	/* read ahead and not yet used */
 	struct thread *b_holder; /* who did buffer_mark_busy() */
+	unsigned b_waiters;	/* # waiting in buffer_mark_busy() */
 	struct timespec b_timestamp; /* when it became dirty */
 
 	/* key */
@@ -102,6 +188,7 @@ struct buf {
 	size_t b_size;
 
 	void *b_fsdata;		/* fs-specific metadata */
+	struct vnode *b_owner;	/* file the block belongs to, if known */
 };
 
 /*
@@ -112,82 +199,233 @@ struct bufhash {
 	struct bufarray *bh_buckets;
 };
 
+/*
+ * The attached buffers in one shard that belong to one file system.
+ * These are created on demand and stay around until drop_fs_buffers.
+ */
+struct bufshard_fs {
+	struct fs *bsf_fs;
+	struct buflist bsf_buffers;
+};
+DECLARRAY(bufshard_fs, static __UNUSED inline);
+DEFARRAY(bufshard_fs, static __UNUSED inline);
+
+/*
+ * Ghost entry for the 2Q policy: the key of a buffer recently evicted
+ * from the A1in queue. These live in a ring buffer in each shard (in
+ * FIFO order) and are also chained into a small hash table.
+ */
+struct bufghost {
+	struct fs *bg_fs;	/* NULL if no longer in use */
+	daddr_t bg_block;
+	unsigned bg_next;	/* next index in hash chain */
+};
+
+/*
+ * Buffer cache shard.
+ *
+ * The attached buffers are split across BUFFER_NSHARDS shards, each
+ * with its own lock. Which shard a buffer lives in is chosen by
+ * hashing its key (fs and block number), so a buffer never moves
+ * between shards while it's attached, and operations on different
+ * blocks mostly don't contend with each other.
+ *
+ * Each shard has its own bufhash, its own LRU list of attached
+ * buffers, its own list of dirty buffers, and its own per-fs lists:
+ * see below.
+ *
+ * Everything in a shard, and every field of a buffer attached in the
+ * shard, is protected by bs_lock.
+ */
+struct bufshard {
+	unsigned bs_index;		/* our index in buffer_shards[] */
+	struct lock *bs_lock;		/* lock for everything here */
+	struct cv *bs_busy_cv;		/* for waiting on busy buffers */
+	struct bufhash bs_hash;		/* hash table of attached buffers */
+
+	struct buflist bs_lru;		/* LRU list of attached buffers */
+	struct buflist bs_a1in;		/* 2Q: first-time buffers, FIFO */
+	struct buflist bs_dirty;	/* age-ordered list of dirty buffers */
+	struct bufshard_fsarray bs_fslists; /* per-fs lists */
+
+	unsigned bs_policy;		/* replacement policy */
+	unsigned bs_kin;		/* 2Q: target size of bs_a1in */
+	struct bufghost *bs_ghosts;	/* 2Q: ring of ghost entries */
+	unsigned bs_ghostmax;		/* size of bs_ghosts */
+	unsigned bs_ghosthead;		/* oldest ghost entry */
+	unsigned bs_ghostcount;		/* # of ring slots in use */
+	unsigned *bs_ghostbuckets;	/* hash chains of ghost entries */
+	unsigned bs_numghostbuckets;
+
+	unsigned bs_busy_count;		/* # of busy buffers */
+
+	/* counters */
+	unsigned bs_total_gets;
+	unsigned bs_valid_gets;
+	unsigned bs_read_gets;
+	unsigned bs_total_writeouts;
+	unsigned bs_write_ios;
+	unsigned bs_cluster_writes;
+	unsigned bs_total_evictions;
+	unsigned bs_dirty_evictions;
+	unsigned bs_readahead_reads;
+	unsigned bs_readahead_hits;
+	unsigned bs_readahead_wasted;
+	unsigned bs_policy_gets[BUFPOLICY_NUM];
+	unsigned bs_policy_hits[BUFPOLICY_NUM];
+	unsigned bs_ghost_hits;
+};
+
+/*
+ * Asynchronous I/O request.
+ */
+struct bufio {
+	unsigned bio_op;		/* BUFIO_* */
+	struct fs *bio_fs;
+	daddr_t bio_block;
+	size_t bio_size;
+	void (*bio_callback)(void *, int); /* completion callback */
+	void *bio_arg;			/* argument for callback */
+	bool bio_handle;		/* caller will buffer_io_wait */
+	bool bio_done;			/* finished (if bio_handle) */
+	int bio_result;			/* result (if bio_done) */
+	struct bufio *bio_next;		/* next in request queue */
+};
+
+#define BUFIO_READ	0	/* read into the cache */
+#define BUFIO_READAHEAD	1	/* same, but advisory */
+#define BUFIO_FLUSH	2	/* write out if dirty */
+
 /*
  * Global state.
  *
- * The main table of buffers is attached_buffers[]. This is an
- * LRU-ordered array. All buffers in attached_buffers[] should be
- * attached (that is, they are associated with a specific fs and
- * block), and should also be in buffer_hash.
+ * The main list of buffers in each shard is bs_lru, which is kept in
+ * LRU order with the least recently used buffer at the head. All
+ * buffers on bs_lru should be attached (that is, they are associated
+ * with a specific fs and block), and should also be in the shard's
+ * bs_hash and on the per-fs list for their fs.
+ *
+ * Buffers that are dirty *also* appear on the shard's bs_dirty; this
+ * list is ordered by how recently the buffer was *first* modified,
+ * oldest at the head.
  *
- * Buffers that are dirty *also* appear in dirty_buffers[]; this array
- * is ordered by how recently the buffer was *first* modified.
+ * Buffers that are not attached appear (only) on detached_buffers,
+ * which is not ordered and is shared by all the shards.
  *
- * Buffers that are not attached appear (only) in detached_buffers[],
- * which is not ordered.
+ * Since the lists are intrusive, inserting and removing never
+ * allocates and never fails, and moving a buffer to the recent end of
+ * the LRU list is O(1).
  *
- * Space in all three arrays is preallocated when buffers are created
- * so insert ops won't fail on the fly.
+ * Scans that need to release the lock partway through (e.g. to write
+ * a buffer out) leave a marker node in the list behind them and pick
+ * up again from the marker afterwards. The buffer they were looking
+ * at may have left the list by then, but the marker can't have.
  *
- * The ordered arrays (attached_buffers and dirty_buffers) are
- * preallocated with extra space (and may contain NULL entries) and
- * are compacted only when the extra space runs out.
+ * detached_buffers, the reservation state, the buffer totals, and
+ * each buffer's b_waiters count are protected by buffer_lock. (The
+ * waiters count has to outlive the buffer's attachment to a shard:
+ * someone waiting for a buffer may wake up to find it detached, or
+ * it may be detached and freed by buffer_shrink; so it can't be
+ * protected by a shard lock.) Lock ordering: a shard lock may be held
+ * while getting buffer_lock, but not the reverse, and no thread may
+ * hold more than one shard lock at a time.
  */
 
-static struct bufhash buffer_hash;
-
-static struct bufarray attached_buffers;
-static unsigned attached_buffers_first;   /* hint for first empty element */
-static unsigned attached_buffers_thresh;  /* size limit before compacting */
-
-static struct bufarray dirty_buffers;
-static unsigned dirty_buffers_first;      /* hint for first empty element */
-static unsigned dirty_buffers_thresh;     /* size limit before compacting */
+static struct bufshard buffer_shards[BUFFER_NSHARDS];
 
-static struct bufarray detached_buffers;
+static struct buflist detached_buffers;
 
 /*
- * Epochs and generations.
+ * Epochs.
  *
  * The dirty_epoch is incremented whenever an explicit sync call is
- * made, and is used to know when to stop syncing. The
- * dirty_buffers_generation, conversely, is incremented whenever the
- * dirty_buffers table is compacted so syncs in progress know they
- * need to restart from the beginning of it. The attached_buffers
- * generation is the same, but for the attached_buffers table.
+ * made, and is used to know when to stop syncing. It is updated under
+ * buffer_lock; buffer_mark_dirty reads it without, which is harmless:
+ * at worst a buffer that got dirty while a sync was starting gets
+ * written out by that sync when it didn't strictly need to be.
  */
 
 static unsigned dirty_epoch;
-static unsigned dirty_buffers_generation;
-static unsigned attached_buffers_generation;
 
 /*
- * Counters.
+ * The replacement policy most recently asked for. (Each shard has its
+ * own copy, which is what actually counts; they can differ briefly
+ * while the policy is being changed.)
  */
+static unsigned buffer_policy;
 
-static unsigned attached_buffers_count;
-static unsigned busy_buffers_count;
-static unsigned dirty_buffers_count;
+/*
+ * Counters.
+ */
 
 static unsigned num_reserved_buffers;
 static unsigned num_total_buffers;
 static unsigned max_total_buffers;
 
-static unsigned num_total_gets;
-static unsigned num_valid_gets;
-static unsigned num_read_gets;
-static unsigned num_total_writeouts;
-static unsigned num_total_evictions;
-static unsigned num_dirty_evictions;
+/*
+ * Cache sizing.
+ *
+ * max_total_buffers is the current size limit. The syncer moves it
+ * between buffer_minbuffers and buffer_maxbuffers according to how
+ * much memory is free: up when there's more than buffer_growfree
+ * pages, down (evicting clean buffers) when there's less than
+ * buffer_shrinkfree. These four can be changed at runtime, but
+ * buffer_maxbuffers can't exceed buffer_hardmax, which is fixed at
+ * boot because the hash tables are sized for it. The cache starts
+ * out well below buffer_hardmax, so it has room to grow when there's
+ * memory to spare.
+ *
+ * All protected by buffer_lock.
+ */
+static unsigned buffer_hardmax;
+static unsigned buffer_minbuffers;
+static unsigned buffer_maxbuffers;
+static unsigned long buffer_growfree;
+static unsigned long buffer_shrinkfree;
+static unsigned buffer_resizestep;
+static unsigned num_cache_grows;
+static unsigned num_cache_shrinks;
+static unsigned num_buffers_freed;
 
 /*
  * Syncer state. (This is file-static so it's easily visible from the
  * debugger.)
+ *
+ * The flags are only changed by the syncer, but are looked at
+ * without synchronization by buffer_get.
  */
-static bool syncer_under_load;
-static bool syncer_needs_help;
+static volatile bool syncer_under_load;
+static volatile bool syncer_needs_help;
 static struct thread *syncer_thread;
 
+/*
+ * Asynchronous I/O state.
+ *
+ * Asynchronous requests (including read-ahead) are queued in FIFO
+ * order and serviced by a pool of BUFIO_NTHREADS I/O threads, so the
+ * thread that asked for them can get on with its own work and
+ * several transfers can be in progress at once. Read-ahead is only
+ * advisory, so at most READAHEAD_QUEUE_SIZE read-ahead requests are
+ * allowed to wait in the queue and any more are dropped.
+ *
+ * bufio_busyfs[] and bufio_busyblock[] hold the fs and block each I/O
+ * thread is currently working on, if any, so drop_fs_buffers and
+ * buffer_cancel_io can wait for it.
+ *
+ * All of this (and the bio_done and bio_result fields of requests)
+ * is protected by bufio_lock, which is a leaf: no other buffer cache
+ * locks may be acquired while holding it.
+ */
+static struct bufio *bufio_head;	/* first queued request */
+static struct bufio *bufio_tail;	/* last queued request */
+static unsigned bufio_numreadahead;	/* queued read-ahead requests */
+static struct fs *bufio_busyfs[BUFIO_NTHREADS];
+static daddr_t bufio_busyblock[BUFIO_NTHREADS];
+static unsigned num_readahead_dropped;	/* requests dropped (queue full) */
+static struct lock *bufio_lock;
+static struct cv *bufio_cv;		/* for waiting for requests */
+static struct cv *bufio_done_cv;	/* for waiting for completion */
+
 /*
  * Lock
  */
@@ -197,7 +435,6 @@ static struct lock *buffer_lock;
 /*
  * CVs
  */
-static struct cv *buffer_busy_cv;
 static struct cv *buffer_reserve_cv;
 
 /*
@@ -212,14 +449,6 @@ static struct cv *buffer_reserve_cv;
 /* Number of buffers to reserve for each file system operation. */
 #define RESERVE_BUFFERS		8
 
-/* Factor for choosing attached_buffers_thresh. */
-#define ATTACHED_THRESH_NUM	3
-#define ATTACHED_THRESH_DENOM	2
-
-/* Factor for choosing dirty_buffers_thresh. */
-#define DIRTY_THRESH_NUM	5
-#define DIRTY_THRESH_DENOM	4
-
 /* Proportion of buffers we want to keep always clean. */
 #define SYNCER_ALWAYS_NUM	1
 #define SYNCER_ALWAYS_DENOM	5
@@ -251,9 +480,40 @@ static struct cv *buffer_reserve_cv;
 #define SYNCER_LIMIT_DENOM	2
 #endif
 
+/* 2Q: target size of A1in, as a proportion of a shard's buffers. */
+#define TWOQ_KIN_NUM		1
+#define TWOQ_KIN_DENOM		4
+
+/* 2Q: size of A1out (ghosts), as a proportion of a shard's buffers. */
+#define TWOQ_KOUT_NUM		1
+#define TWOQ_KOUT_DENOM		2
+
 /* Overall limit on fraction of main memory to use for buffers */
 #define BUFFER_MAXMEM_NUM	1
-#define BUFFER_MAXMEM_DENOM	4
+#define BUFFER_MAXMEM_DENOM	2
+
+/* Initial cache size, as a fraction of main memory */
+#define BUFFER_STARTMEM_NUM	1
+#define BUFFER_STARTMEM_DENOM	4
+
+/* Default lower limit on the cache size, as a fraction of main memory */
+#define BUFFER_MINMEM_NUM	1
+#define BUFFER_MINMEM_DENOM	32
+
+/* Grow the cache when more than this fraction of main memory is free */
+#define BUFFER_GROWFREE_NUM	1
+#define BUFFER_GROWFREE_DENOM	8
+
+/* Shrink the cache when less than this fraction is free */
+#define BUFFER_SHRINKFREE_NUM	1
+#define BUFFER_SHRINKFREE_DENOM	16
+
+/* Grow or shrink by this fraction of the largest size at a time */
+#define BUFFER_RESIZE_NUM	1
+#define BUFFER_RESIZE_DENOM	16
+
+/* Absolute minimum cache size (in buffers) */
+#define BUFFER_MINBUFFERS	(RESERVE_BUFFERS * 4)
 
 /* Macro for applying a NUM/DENOM pair. */
 #define SCALE(x, K) (((x) * K##_NUM) / K##_DENOM)
@@ -273,23 +533,195 @@ static
 void
 bufcheck(void)
 {
-	KASSERT(attached_buffers_count <= bufarray_num(&attached_buffers));
-	KASSERT(attached_buffers_first <= bufarray_num(&attached_buffers));
-	KASSERT(bufarray_num(&attached_buffers) <= attached_buffers_thresh);
-
-	KASSERT(dirty_buffers_count <= bufarray_num(&dirty_buffers));
-	KASSERT(dirty_buffers_first <= bufarray_num(&dirty_buffers));
-	KASSERT(bufarray_num(&dirty_buffers) <= dirty_buffers_thresh);
+	KASSERT(lock_do_i_hold(buffer_lock));
 
-	KASSERT(bufarray_num(&detached_buffers) + attached_buffers_count
-		== num_total_buffers);
 	// This is not true any more, because busy_buffers_count now
 	// includes buffers marked busy by syncing.
 	//KASSERT(busy_buffers_count <= num_reserved_buffers);
+	KASSERT(detached_buffers.bl_count <= num_total_buffers);
 	KASSERT(num_reserved_buffers <= max_total_buffers);
 	KASSERT(num_total_buffers <= max_total_buffers);
 }
 
+/*
+ * Check consistency of one shard.
+ */
+static
+void
+bufshard_check(struct bufshard *sh)
+{
+	KASSERT(lock_do_i_hold(sh->bs_lock));
+
+	KASSERT(sh->bs_dirty.bl_count <=
+		sh->bs_lru.bl_count + sh->bs_a1in.bl_count);
+	KASSERT(sh->bs_busy_count <=
+		sh->bs_lru.bl_count + sh->bs_a1in.bl_count);
+	KASSERT(sh->bs_policy == BUFPOLICY_2Q || sh->bs_a1in.bl_count == 0);
+	KASSERT(sh->bs_ghostcount <= sh->bs_ghostmax);
+}
+
+////////////////////////////////////////////////////////////
+// buffer lists
+
+/*
+ * Set up a list node.
+ */
+static
+void
+buflistnode_init(struct buflistnode *bln, struct buf *self)
+{
+	bln->bln_prev = NULL;
+	bln->bln_next = NULL;
+	bln->bln_self = self;
+}
+
+/*
+ * Check if a node is on a list. (Which list is up to the caller.)
+ */
+static
+bool
+buflistnode_onlist(struct buflistnode *bln)
+{
+	return bln->bln_next != NULL;
+}
+
+/*
+ * Set up a list.
+ */
+static
+void
+buflist_init(struct buflist *bl)
+{
+	buflistnode_init(&bl->bl_head, NULL);
+	buflistnode_init(&bl->bl_tail, NULL);
+	bl->bl_head.bln_next = &bl->bl_tail;
+	bl->bl_tail.bln_prev = &bl->bl_head;
+	bl->bl_count = 0;
+}
+
+/*
+ * Link a node in after another node. Doesn't touch the count.
+ */
+static
+void
+buflist_link(struct buflistnode *onlist, struct buflistnode *addee)
+{
+	KASSERT(addee->bln_prev == NULL);
+	KASSERT(addee->bln_next == NULL);
+
+	addee->bln_prev = onlist;
+	addee->bln_next = onlist->bln_next;
+	addee->bln_prev->bln_next = addee;
+	addee->bln_next->bln_prev = addee;
+}
+
+/*
+ * Unlink a node. Doesn't touch the count.
+ */
+static
+void
+buflist_unlink(struct buflistnode *bln)
+{
+	KASSERT(bln->bln_prev != NULL);
+	KASSERT(bln->bln_next != NULL);
+
+	bln->bln_prev->bln_next = bln->bln_next;
+	bln->bln_next->bln_prev = bln->bln_prev;
+	bln->bln_prev = NULL;
+	bln->bln_next = NULL;
+}
+
+/*
+ * Add a buffer's node at the tail of a list.
+ */
+static
+void
+buflist_addtail(struct buflist *bl, struct buflistnode *bln)
+{
+	KASSERT(bln->bln_self != NULL);
+	buflist_link(bl->bl_tail.bln_prev, bln);
+	bl->bl_count++;
+}
+
+/*
+ * Remove a buffer's node from a list.
+ */
+static
+void
+buflist_remove(struct buflist *bl, struct buflistnode *bln)
+{
+	KASSERT(bln->bln_self != NULL);
+	KASSERT(bl->bl_count > 0);
+	buflist_unlink(bln);
+	bl->bl_count--;
+}
+
+/*
+ * Get the first buffer in a list at or after the node BLN, skipping
+ * markers, or NULL if there aren't any.
+ */
+static
+struct buf *
+buflist_first_from(struct buflist *bl, struct buflistnode *bln)
+{
+	while (bln != &bl->bl_tail) {
+		if (bln->bln_self != NULL) {
+			return bln->bln_self;
+		}
+		bln = bln->bln_next;
+	}
+	return NULL;
+}
+
+/*
+ * Get the first buffer in a list, or NULL if it's empty.
+ */
+static
+struct buf *
+buflist_first(struct buflist *bl)
+{
+	return buflist_first_from(bl, bl->bl_head.bln_next);
+}
+
+/*
+ * Get the buffer after the node BLN (which must be on the list), or
+ * NULL if it's the last one.
+ */
+static
+struct buf *
+buflist_next(struct buflist *bl, struct buflistnode *bln)
+{
+	KASSERT(buflistnode_onlist(bln));
+	return buflist_first_from(bl, bln->bln_next);
+}
+
+/*
+ * Place a marker in a list right after a node that's on it, so a
+ * scan can drop the lock and later continue from where it was.
+ */
+static
+void
+buflist_mark(struct buflistnode *onlist, struct buflistnode *marker)
+{
+	buflistnode_init(marker, NULL);
+	buflist_link(onlist, marker);
+}
+
+/*
+ * Remove a marker, returning the first buffer after it.
+ */
+static
+struct buf *
+buflist_unmark(struct buflist *bl, struct buflistnode *marker)
+{
+	struct buf *next;
+
+	KASSERT(marker->bln_self == NULL);
+	next = buflist_first_from(bl, marker->bln_next);
+	buflist_unlink(marker);
+	return next;
+}
+
 ////////////////////////////////////////////////////////////
 // supplemental array ops
 
@@ -322,43 +754,7 @@ bufarray_remove_unordered(struct bufarray *a, unsigned index,
 }
 
 /*
- * Remove null entries from a bufarray, preserving order.
- *
- * Use fixup() to correct the index stored in the objects that get
- * moved.
- */
-static
-void
-bufarray_compact(struct bufarray *a,
-		 unsigned *firstp,
-		 void (*fixup)(struct buf *, unsigned oldix, unsigned newix))
-{
-	unsigned i, j, num;
-	struct buf *b;
-	int result;
-
-	num = bufarray_num(a);
-	for (i = j = *firstp; i<num; i++) {
-		b = bufarray_get(a, i);
-		if (b != NULL) {
-			if (j < i) {
-				fixup(b, i, j);
-				bufarray_set(a, j++, b);
-			}
-			else {
-				j++;
-			}
-		}
-	}
-	KASSERT(j <= num);
-	result = bufarray_setsize(a, j);
-	/* shrinking, shouldn't fail */
-	KASSERT(result == 0);
-	*firstp = j;
-}
-
-/*
- * Routines for that fixup()...
+ * Routine for that fixup()...
  */
 static
 void
@@ -368,22 +764,6 @@ buf_fixup_bucketindex(struct buf *b, unsigned oldix, unsigned newix)
 	b->b_bucketindex = newix;
 }
 
-static
-void
-buf_fixup_dirtyindex(struct buf *b, unsigned oldix, unsigned newix)
-{
-	KASSERT(b->b_dirtyindex == oldix);
-	b->b_dirtyindex = newix;
-}
-
-static
-void
-buf_fixup_tableindex(struct buf *b, unsigned oldix, unsigned newix)
-{
-	KASSERT(b->b_tableindex == oldix);
-	b->b_tableindex = newix;
-}
-
 ////////////////////////////////////////////////////////////
 // bufhash
 
@@ -435,6 +815,21 @@ buffer_hashfunc(struct fs *fs, daddr_t physblock)
 	return val;
 }
 
+/*
+ * Choose the bucket for a key. The low bits of the hash pick the
+ * shard (see buffer_shard() below) so use the rest here; otherwise
+ * every key in a shard would land in the same few buckets.
+ */
+static
+unsigned
+bufhash_bucket(struct bufhash *bh, struct fs *fs, daddr_t physblock)
+{
+	unsigned hash;
+
+	hash = buffer_hashfunc(fs, physblock);
+	return (hash / BUFFER_NSHARDS) % bh->bh_numbuckets;
+}
+
 /*
  * Add a buffer to a bufhash.
  */
@@ -442,12 +837,11 @@ static
 int
 bufhash_add(struct bufhash *bh, struct buf *b)
 {
-	unsigned hash, bn;
+	unsigned bn;
 
 	KASSERT(b->b_bucketindex == INVALID_INDEX);
 
-	hash = buffer_hashfunc(b->b_fs, b->b_physblock);
-	bn = hash % bh->bh_numbuckets;
+	bn = bufhash_bucket(bh, b->b_fs, b->b_physblock);
 	return bufarray_add(&bh->bh_buckets[bn], b, &b->b_bucketindex);
 }
 
@@ -458,10 +852,9 @@ static
 void
 bufhash_remove(struct bufhash *bh, struct buf *b)
 {
-	unsigned hash, bn;
+	unsigned bn;
 
-	hash = buffer_hashfunc(b->b_fs, b->b_physblock);
-	bn = hash % bh->bh_numbuckets;
+	bn = bufhash_bucket(bh, b->b_fs, b->b_physblock);
 
 	KASSERT(bufarray_get(&bh->bh_buckets[bn], b->b_bucketindex) == b);
 	bufarray_set(&bh->bh_buckets[bn], b->b_bucketindex, NULL);
@@ -477,12 +870,11 @@ static
 struct buf *
 bufhash_get(struct bufhash *bh, struct fs *fs, daddr_t physblock)
 {
-	unsigned hash, bn;
+	unsigned bn;
 	unsigned num, i;
 	struct buf *b;
 
-	hash = buffer_hashfunc(fs, physblock);
-	bn = hash % bh->bh_numbuckets;
+	bn = bufhash_bucket(bh, fs, physblock);
 
 	num = bufarray_num(&bh->bh_buckets[bn]);
 	for (i=0; i<num; i++) {
@@ -497,167 +889,448 @@ bufhash_get(struct bufhash *bh, struct fs *fs, daddr_t physblock)
 }
 
 ////////////////////////////////////////////////////////////
-// buffer tables
+// 2Q ghosts
 
 /*
- * Preallocate the buffer lists so adding things to them on the fly
- * can't blow up.
+ * Set up a shard's ghost queue with room for MAX entries.
  */
 static
 int
-preallocate_buffer_arrays(unsigned newtotal)
+bufghost_init(struct bufshard *sh, unsigned max)
 {
-	int result;
-	unsigned newathresh, newdthresh;
+	unsigned i;
 
-	newathresh = (newtotal*ATTACHED_THRESH_NUM)/ATTACHED_THRESH_DENOM;
-	newdthresh = (newtotal*DIRTY_THRESH_NUM)/DIRTY_THRESH_DENOM;
+	sh->bs_ghostmax = max;
+	sh->bs_ghosthead = 0;
+	sh->bs_ghostcount = 0;
+	sh->bs_numghostbuckets = max / 4 > 0 ? max / 4 : 1;
 
-	result = bufarray_preallocate(&detached_buffers, newtotal);
-	if (result) {
-		return result;
+	sh->bs_ghosts = kmalloc(max * sizeof(sh->bs_ghosts[0]));
+	if (sh->bs_ghosts == NULL) {
+		return ENOMEM;
 	}
-
-	result = bufarray_preallocate(&attached_buffers, newathresh);
-	if (result) {
-		return result;
+	sh->bs_ghostbuckets = kmalloc(sh->bs_numghostbuckets *
+				      sizeof(sh->bs_ghostbuckets[0]));
+	if (sh->bs_ghostbuckets == NULL) {
+		kfree(sh->bs_ghosts);
+		return ENOMEM;
 	}
-	attached_buffers_thresh = newathresh;
-
-	result = bufarray_preallocate(&dirty_buffers, newdthresh);
-	if (result) {
-		return result;
+	for (i=0; i<sh->bs_numghostbuckets; i++) {
+		sh->bs_ghostbuckets[i] = INVALID_INDEX;
 	}
-	dirty_buffers_thresh = newdthresh;
-
 	return 0;
 }
 
 /*
- * Go through the attached_buffers array and close up gaps.
+ * Hash chain for a key.
  */
 static
-void
-compact_attached_buffers(void)
+unsigned *
+bufghost_bucket(struct bufshard *sh, struct fs *fs, daddr_t block)
 {
-	bufarray_compact(&attached_buffers, &attached_buffers_first,
-			 buf_fixup_tableindex);
-	KASSERT(attached_buffers_count == bufarray_num(&attached_buffers));
+	unsigned hash;
 
-	/* it does not matter if this overflows */
-	attached_buffers_generation++;
+	/* as in bufhash_bucket, the low bits chose the shard */
+	hash = buffer_hashfunc(fs, block) / BUFFER_NSHARDS;
+	return &sh->bs_ghostbuckets[hash % sh->bs_numghostbuckets];
 }
 
 /*
- * Go through the dirty_buffers array and close up gaps.
+ * Take the ghost entry at index IX out of its hash chain and mark it
+ * unused. It stays in the ring until it gets to the head.
  */
 static
 void
-compact_dirty_buffers(void)
+bufghost_unlink(struct bufshard *sh, unsigned ix)
 {
-	bufarray_compact(&dirty_buffers, &dirty_buffers_first,
-			 buf_fixup_dirtyindex);
-	KASSERT(dirty_buffers_count == bufarray_num(&dirty_buffers));
-
-	/* it does not matter if this overflows */
-	dirty_buffers_generation++;
+	struct bufghost *bg = &sh->bs_ghosts[ix];
+	unsigned *ixp;
+
+	KASSERT(bg->bg_fs != NULL);
+	ixp = bufghost_bucket(sh, bg->bg_fs, bg->bg_block);
+	while (*ixp != ix) {
+		KASSERT(*ixp != INVALID_INDEX);
+		ixp = &sh->bs_ghosts[*ixp].bg_next;
+	}
+	*ixp = bg->bg_next;
+	bg->bg_fs = NULL;
+	bg->bg_next = INVALID_INDEX;
 }
 
 /*
- * Get a buffer from the pool of detached buffers.
+ * Remember the key of a buffer evicted from A1in, forgetting the
+ * oldest ghost if there's no room.
  */
 static
-struct buf *
-buffer_remove_detached(void)
+void
+bufghost_add(struct bufshard *sh, struct fs *fs, daddr_t block)
 {
-	struct buf *b;
-	unsigned num;
-	int result;
+	struct bufghost *bg;
+	unsigned ix, *bucket;
 
-	num = bufarray_num(&detached_buffers);
-	if (num > 0) {
-		b = bufarray_get(&detached_buffers, num-1);
-		KASSERT(b->b_tableindex == num-1);
-		b->b_tableindex = INVALID_INDEX;
-
-		/* shrink array (should not fail) */
-		result = bufarray_setsize(&detached_buffers, num-1);
-		KASSERT(result == 0);
+	KASSERT(lock_do_i_hold(sh->bs_lock));
 
-		return b;
+	if (sh->bs_ghostmax == 0) {
+		return;
+	}
+	if (sh->bs_ghostcount == sh->bs_ghostmax) {
+		ix = sh->bs_ghosthead;
+		if (sh->bs_ghosts[ix].bg_fs != NULL) {
+			bufghost_unlink(sh, ix);
+		}
+		sh->bs_ghosthead = (ix + 1) % sh->bs_ghostmax;
+		sh->bs_ghostcount--;
 	}
 
-	return NULL;
+	ix = (sh->bs_ghosthead + sh->bs_ghostcount) % sh->bs_ghostmax;
+	bg = &sh->bs_ghosts[ix];
+	bucket = bufghost_bucket(sh, fs, block);
+	bg->bg_fs = fs;
+	bg->bg_block = block;
+	bg->bg_next = *bucket;
+	*bucket = ix;
+	sh->bs_ghostcount++;
 }
 
 /*
- * Put a buffer into the pool of detached buffers.
+ * Look for a ghost for a key, and remove it if found. Returns true if
+ * there was one.
  */
 static
-void
-buffer_insert_detached(struct buf *b)
+bool
+bufghost_remove(struct bufshard *sh, struct fs *fs, daddr_t block)
 {
-	int result;
+	unsigned ix;
 
-	KASSERT(b->b_attached == 0);
-	KASSERT(b->b_busy == 0);
-	KASSERT(b->b_tableindex == INVALID_INDEX);
+	KASSERT(lock_do_i_hold(sh->bs_lock));
 
-	result = bufarray_add(&detached_buffers, b, &b->b_tableindex);
-	/* arrays are preallocated to avoid failure here */
-	KASSERT(result == 0);
+	if (sh->bs_ghostmax == 0) {
+		return false;
+	}
+	ix = *bufghost_bucket(sh, fs, block);
+	while (ix != INVALID_INDEX) {
+		if (sh->bs_ghosts[ix].bg_fs == fs &&
+		    sh->bs_ghosts[ix].bg_block == block) {
+			bufghost_unlink(sh, ix);
+			return true;
+		}
+		ix = sh->bs_ghosts[ix].bg_next;
+	}
+	return false;
 }
 
 /*
- * Remove a buffer from the attached (LRU) list.
+ * Forget ghosts: all of them if FS is NULL, otherwise those for FS.
  */
 static
 void
-buffer_remove_attached(struct buf *b, unsigned expected_busy)
+bufghost_purge(struct bufshard *sh, struct fs *fs)
 {
-	unsigned ix;
+	unsigned i, ix;
 
-	KASSERT(b->b_attached == 1);
-	KASSERT(b->b_busy == expected_busy);
+	KASSERT(lock_do_i_hold(sh->bs_lock));
+
+	for (i=0; i<sh->bs_ghostcount; i++) {
+		ix = (sh->bs_ghosthead + i) % sh->bs_ghostmax;
+		if (sh->bs_ghosts[ix].bg_fs == NULL) {
+			continue;
+		}
+		if (fs == NULL || sh->bs_ghosts[ix].bg_fs == fs) {
+			bufghost_unlink(sh, ix);
+		}
+	}
+	if (fs == NULL) {
+		sh->bs_ghosthead = 0;
+		sh->bs_ghostcount = 0;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// shards
+
+/*
+ * Find the shard a given key lives in.
+ */
+static
+struct bufshard *
+buffer_shard(struct fs *fs, daddr_t physblock)
+{
+	unsigned hash;
+
+	hash = buffer_hashfunc(fs, physblock);
+	return &buffer_shards[hash % BUFFER_NSHARDS];
+}
+
+/*
+ * Lock the shard a buffer is attached in and return it. The buffer
+ * must be busy (and thus held by us) so it can't move in the
+ * meantime.
+ */
+static
+struct bufshard *
+buffer_lock_shard(struct buf *b)
+{
+	struct bufshard *sh;
+
+	KASSERT(b->b_busy);
+	sh = b->b_shard;
+	KASSERT(sh != NULL);
+	lock_acquire(sh->bs_lock);
+	KASSERT(b->b_shard == sh);
+	return sh;
+}
+
+/*
+ * Set up a shard.
+ */
+static
+int
+bufshard_init(struct bufshard *sh, unsigned index, unsigned numbuckets,
+	      unsigned numbufs)
+{
+	unsigned i;
+	int result;
+
+	sh->bs_index = index;
+
+	result = bufhash_init(&sh->bs_hash, numbuckets);
+	if (result) {
+		return result;
+	}
+
+	result = bufghost_init(sh, SCALE(numbufs, TWOQ_KOUT));
+	if (result) {
+		return result;
+	}
+	sh->bs_policy = BUFPOLICY_LRU;
+	sh->bs_kin = SCALE(numbufs, TWOQ_KIN);
+
+	sh->bs_lock = lock_create("buffer cache shard");
+	if (sh->bs_lock == NULL) {
+		return ENOMEM;
+	}
+
+	sh->bs_busy_cv = cv_create("bufbusy");
+	if (sh->bs_busy_cv == NULL) {
+		return ENOMEM;
+	}
+
+	buflist_init(&sh->bs_lru);
+	buflist_init(&sh->bs_a1in);
+	buflist_init(&sh->bs_dirty);
+	bufshard_fsarray_init(&sh->bs_fslists);
+
+	sh->bs_busy_count = 0;
+
+	sh->bs_total_gets = 0;
+	sh->bs_valid_gets = 0;
+	sh->bs_read_gets = 0;
+	sh->bs_total_writeouts = 0;
+	sh->bs_write_ios = 0;
+	sh->bs_cluster_writes = 0;
+	sh->bs_total_evictions = 0;
+	sh->bs_dirty_evictions = 0;
+	sh->bs_readahead_reads = 0;
+	sh->bs_readahead_hits = 0;
+	sh->bs_readahead_wasted = 0;
+	for (i=0; i<BUFPOLICY_NUM; i++) {
+		sh->bs_policy_gets[i] = 0;
+		sh->bs_policy_hits[i] = 0;
+	}
+	sh->bs_ghost_hits = 0;
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// buffer lists
+
+/*
+ * Find a shard's per-fs list for FS, if there is one.
+ */
+static
+struct bufshard_fs *
+bufshard_findfs(struct bufshard *sh, struct fs *fs, unsigned *index_ret)
+{
+	struct bufshard_fs *bsf;
+	unsigned i, num;
 
-	ix = b->b_tableindex;
+	KASSERT(lock_do_i_hold(sh->bs_lock));
 
-	KASSERT(bufarray_get(&attached_buffers, ix) == b);
+	/* There are only ever a few of these, so just search. */
+	num = bufshard_fsarray_num(&sh->bs_fslists);
+	for (i=0; i<num; i++) {
+		bsf = bufshard_fsarray_get(&sh->bs_fslists, i);
+		if (bsf->bsf_fs == fs) {
+			if (index_ret != NULL) {
+				*index_ret = i;
+			}
+			return bsf;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Find a shard's per-fs list for FS, creating it if necessary.
+ */
+static
+int
+bufshard_getfs(struct bufshard *sh, struct fs *fs, struct bufshard_fs **ret)
+{
+	struct bufshard_fs *bsf;
+	int result;
+
+	bsf = bufshard_findfs(sh, fs, NULL);
+	if (bsf != NULL) {
+		*ret = bsf;
+		return 0;
+	}
+
+	bsf = kmalloc(sizeof(*bsf));
+	if (bsf == NULL) {
+		return ENOMEM;
+	}
+	bsf->bsf_fs = fs;
+	buflist_init(&bsf->bsf_buffers);
+	result = bufshard_fsarray_add(&sh->bs_fslists, bsf, NULL);
+	if (result) {
+		kfree(bsf);
+		return result;
+	}
+	*ret = bsf;
+	return 0;
+}
+
+/*
+ * Get a buffer from the pool of detached buffers. Skip any that still
+ * have threads waiting in buffer_mark_busy: they haven't yet noticed
+ * the buffer was detached, and if we reattached it now they'd look at
+ * it under the wrong shard lock.
+ */
+static
+struct buf *
+buffer_remove_detached(void)
+{
+	struct buflistnode *bln;
+	struct buf *b;
 
-	/* Remove from table, leave NULL behind (compact lazily, later) */
-	bufarray_set(&attached_buffers, ix, NULL);
-	b->b_tableindex = INVALID_INDEX;
+	KASSERT(lock_do_i_hold(buffer_lock));
 
-	/* cache the first empty slot  */
-	if (ix < attached_buffers_first) {
-		attached_buffers_first = ix;
+	for (bln = detached_buffers.bl_head.bln_next;
+	     bln != &detached_buffers.bl_tail;
+	     bln = bln->bln_next) {
+		b = bln->bln_self;
+		if (b->b_waiters == 0) {
+			buflist_remove(&detached_buffers, &b->b_lrunode);
+			return b;
+		}
 	}
+	return NULL;
+}
+
+/*
+ * Put a buffer into the pool of detached buffers.
+ */
+static
+void
+buffer_insert_detached(struct buf *b)
+{
+	KASSERT(b->b_attached == 0);
+	KASSERT(b->b_busy == 0);
+	KASSERT(!buflistnode_onlist(&b->b_lrunode));
+
+	lock_acquire(buffer_lock);
+	buflist_addtail(&detached_buffers, &b->b_lrunode);
+	lock_release(buffer_lock);
+}
+
+/*
+ * Remove a buffer from its replacement queue (bs_lru or bs_a1in).
+ */
+static
+void
+buffer_remove_attached(struct buf *b, unsigned expected_busy)
+{
+	struct bufshard *sh = b->b_shard;
+
+	KASSERT(b->b_attached == 1);
+	KASSERT(b->b_busy == expected_busy);
+	KASSERT(lock_do_i_hold(sh->bs_lock));
+	KASSERT(b->b_queue == &sh->bs_lru || b->b_queue == &sh->bs_a1in);
 
-	attached_buffers_count--;
+	buflist_remove(b->b_queue, &b->b_lrunode);
 }
 
 /*
- * Put a buffer into the attached (LRU) list, always at the end.
+ * Put a buffer into its replacement queue, always at the end.
  */
 static
 void
 buffer_insert_attached(struct buf *b)
 {
-	unsigned num;
-	int result;
+	struct bufshard *sh = b->b_shard;
 
 	KASSERT(b->b_attached == 1);
-	KASSERT(b->b_tableindex == INVALID_INDEX);
+	KASSERT(lock_do_i_hold(sh->bs_lock));
+	KASSERT(b->b_queue == &sh->bs_lru || b->b_queue == &sh->bs_a1in);
+
+	buflist_addtail(b->b_queue, &b->b_lrunode);
+}
+
+/*
+ * Note that a buffer has been used. On the LRU list (which is also
+ * 2Q's Am) that means moving it to the recent end; in 2Q's A1in it
+ * means nothing, as A1in is FIFO.
+ */
+static
+void
+buffer_touch(struct buf *b)
+{
+	struct bufshard *sh = b->b_shard;
+
+	KASSERT(lock_do_i_hold(sh->bs_lock));
 
-	num = bufarray_num(&attached_buffers);
-	if (num >= attached_buffers_thresh) {
-		compact_attached_buffers();
+	if (b->b_queue == &sh->bs_lru) {
+		buflist_remove(&sh->bs_lru, &b->b_lrunode);
+		buflist_addtail(&sh->bs_lru, &b->b_lrunode);
 	}
+}
 
-	result = bufarray_add(&attached_buffers, b, &b->b_tableindex);
-	/* arrays are preallocated to avoid failure here */
-	KASSERT(result == 0);
-	attached_buffers_count++;
+/*
+ * Choose the replacement queue for a newly attached buffer.
+ */
+static
+struct buflist *
+buffer_choose_queue(struct bufshard *sh, struct fs *fs, daddr_t block)
+{
+	KASSERT(lock_do_i_hold(sh->bs_lock));
+
+	if (sh->bs_policy == BUFPOLICY_2Q) {
+		if (!bufghost_remove(sh, fs, block)) {
+			/* First time we've seen it (recently) */
+			return &sh->bs_a1in;
+		}
+		/* Seen before; it goes straight into Am */
+		sh->bs_ghost_hits++;
+	}
+	return &sh->bs_lru;
+}
+
+/*
+ * Return the replacement queue to take buffers from first.
+ */
+static
+struct buflist *
+buffer_victim_queue(struct bufshard *sh)
+{
+	KASSERT(lock_do_i_hold(sh->bs_lock));
+
+	if (sh->bs_policy == BUFPOLICY_2Q &&
+	    (sh->bs_a1in.bl_count > sh->bs_kin || sh->bs_lru.bl_count == 0)) {
+		return &sh->bs_a1in;
+	}
+	return &sh->bs_lru;
 }
 
 /*
@@ -667,24 +1340,14 @@ static
 void
 buffer_remove_dirty(struct buf *b)
 {
-	unsigned ix;
+	struct bufshard *sh = b->b_shard;
 
 	KASSERT(b->b_attached == 1);
 	// not necessarily true, e.g. in buffer_drop()
 	//KASSERT(b->b_busy == 1);
+	KASSERT(lock_do_i_hold(sh->bs_lock));
 
-	ix = b->b_dirtyindex;
-
-	KASSERT(bufarray_get(&dirty_buffers, ix) == b);
-
-	/* Remove from table, leave NULL behind (compact lazily, later) */
-	bufarray_set(&dirty_buffers, ix, NULL);
-	b->b_dirtyindex = INVALID_INDEX;
-
-	/* cache the first empty slot  */
-	if (ix < dirty_buffers_first) {
-		dirty_buffers_first = ix;
-	}
+	buflist_remove(&sh->bs_dirty, &b->b_dirtynode);
 }
 
 /*
@@ -694,21 +1357,13 @@ static
 void
 buffer_insert_dirty(struct buf *b)
 {
-	unsigned num;
-	int result;
+	struct bufshard *sh = b->b_shard;
 
 	KASSERT(b->b_attached == 1);
 	KASSERT(b->b_busy == 1);
-	KASSERT(b->b_dirtyindex == INVALID_INDEX);
+	KASSERT(lock_do_i_hold(sh->bs_lock));
 
-	num = bufarray_num(&dirty_buffers);
-	if (num >= dirty_buffers_thresh) {
-		compact_dirty_buffers();
-	}
-
-	result = bufarray_add(&dirty_buffers, b, &b->b_dirtyindex);
-	/* arrays are preallocated to avoid failure here */
-	KASSERT(result == 0);
+	buflist_addtail(&sh->bs_dirty, &b->b_dirtynode);
 }
 
 ////////////////////////////////////////////////////////////
@@ -722,12 +1377,8 @@ struct buf *
 buffer_create(void)
 {
 	struct buf *b;
-	int result;
 
-	result = preallocate_buffer_arrays(num_total_buffers+1);
-	if (result) {
-		return NULL;
-	}
+	KASSERT(lock_do_i_hold(buffer_lock));
 
 	b = kmalloc(sizeof(*b));
 	if (b == NULL) {
@@ -740,51 +1391,95 @@ buffer_create(void)
 		return NULL;
 	}
 
-	b->b_tableindex = INVALID_INDEX;
-	b->b_dirtyindex = INVALID_INDEX;
+	buflistnode_init(&b->b_lrunode, b);
+	buflistnode_init(&b->b_dirtynode, b);
+	buflistnode_init(&b->b_fsnode, b);
+	b->b_shardfs = NULL;
+	b->b_queue = NULL;
 	b->b_bucketindex = INVALID_INDEX;
 	b->b_dirtyepoch = 0;
+	b->b_shard = NULL;
 	b->b_attached = 0;
 	b->b_busy = 0;
 	b->b_valid = 0;
 	b->b_dirty = 0;
 	b->b_fsmanaged = 0;
+	b->b_readahead = 0;
 	b->b_holder = NULL;
+	b->b_waiters = 0;
 	b->b_timestamp.tv_sec = 0;
 	b->b_timestamp.tv_nsec = 0;
 	b->b_fs = NULL;
 	b->b_physblock = 0;
 	b->b_size = ONE_TRUE_BUFFER_SIZE;
 	b->b_fsdata = NULL;
+	b->b_owner = NULL;
 	num_total_buffers++;
 	return b;
 }
 
+/*
+ * Get a buffer that isn't attached to anything: either one from the
+ * detached pool or, if there aren't any and we're allowed, a new one.
+ * Returns NULL if neither is possible; the caller should then evict
+ * something.
+ */
+static
+struct buf *
+buffer_get_detached(void)
+{
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+	bufcheck();
+	b = buffer_remove_detached();
+	if (b == NULL && num_total_buffers < max_total_buffers) {
+		/* Can create a new buffer... */
+		b = buffer_create();
+	}
+	lock_release(buffer_lock);
+	return b;
+}
+
 /*
  * Attach a buffer to a given key (fs and block number)
  */
 static
 int
-buffer_attach(struct buf *b, struct fs *fs, daddr_t block)
+buffer_attach(struct buf *b, struct bufshard *sh, struct fs *fs,
+	      daddr_t block)
 {
+	struct bufshard_fs *bsf;
 	int result;
 
+	KASSERT(lock_do_i_hold(sh->bs_lock));
+	KASSERT(sh == buffer_shard(fs, block));
 	KASSERT(b->b_busy == 0);
 	KASSERT(b->b_attached == 0);
 	KASSERT(b->b_valid == 0);
 	KASSERT(b->b_busy == 0);
 	KASSERT(b->b_fsdata == NULL);
+	KASSERT(b->b_shard == NULL);
+
+	result = bufshard_getfs(sh, fs, &bsf);
+	if (result) {
+		return result;
+	}
+
 	b->b_attached = 1;
 	b->b_fs = fs;
 	b->b_physblock = block;
 
-	result = bufhash_add(&buffer_hash, b);
+	result = bufhash_add(&sh->bs_hash, b);
 	if (result) {
 		b->b_attached = 0;
 		b->b_fs = NULL;
 		b->b_physblock = 0;
 		return result;
 	}
+	b->b_shard = sh;
+	b->b_shardfs = bsf;
+	buflist_addtail(&bsf->bsf_buffers, &b->b_fsnode);
 	return 0;
 }
 
@@ -795,19 +1490,26 @@ static
 void
 buffer_detach(struct buf *b)
 {
+	struct bufshard *sh = b->b_shard;
+
 	KASSERT(b->b_attached == 1);
 	KASSERT(b->b_busy == 0);
-	bufhash_remove(&buffer_hash, b);
+	KASSERT(lock_do_i_hold(sh->bs_lock));
+	bufhash_remove(&sh->bs_hash, b);
+	buflist_remove(&b->b_shardfs->bsf_buffers, &b->b_fsnode);
+	b->b_shardfs = NULL;
 
 	if (b->b_fsdata != NULL) {
 		kprintf("vfs: %s left behind fs-specific buffer data\n",
 			FSOP_GETVOLNAME(b->b_fs));
 		b->b_fsdata = NULL;
 	}
+	b->b_owner = NULL;
 	b->b_attached = 0;
 	b->b_fs = NULL;
 	b->b_physblock = 0;
-	cv_broadcast(buffer_busy_cv, buffer_lock);
+	b->b_shard = NULL;
+	cv_broadcast(sh->bs_busy_cv, sh->bs_lock);
 }
 
 /*
@@ -818,31 +1520,65 @@ buffer_detach(struct buf *b)
  * then gets evicted before we wake up. If it gets detached and
  * reattached to the same block, we won't notice, but in that case we
  * probably don't care either.
+ *
+ * While we're waiting we count ourselves in b_waiters, which keeps
+ * the buffer from being freed or reattached. The count is protected
+ * by buffer_lock rather than the shard lock, because by the time we
+ * take ourselves back out the buffer may no longer be in this shard.
  */
 static
 int
 buffer_mark_busy(struct buf *b)
 {
+	struct bufshard *sh;
 	struct fs *fs;
 	daddr_t block;
+	bool waiting;
 
 	KASSERT(b->b_holder != curthread);
+	sh = b->b_shard;
+	KASSERT(sh != NULL);
+	KASSERT(lock_do_i_hold(sh->bs_lock));
 	fs = b->b_fs;
 	block = b->b_physblock;
-	while (b->b_busy) {
+	waiting = false;
+	while (1) {
 		if (!b->b_attached || fs != b->b_fs ||
-		    block != b->b_physblock) {
+		    block != b->b_physblock || sh != b->b_shard) {
+			/* don't touch the buffer after this */
+			if (waiting) {
+				lock_acquire(buffer_lock);
+				KASSERT(b->b_waiters > 0);
+				b->b_waiters--;
+				lock_release(buffer_lock);
+			}
 			return EDEADBUF;
 		}
-		cv_wait(buffer_busy_cv, buffer_lock);
+		if (!b->b_busy) {
+			break;
+		}
+		/*
+		 * Count ourselves so buffer_shrink doesn't free the
+		 * buffer out from under us while we're waiting.
+		 */
+		if (!waiting) {
+			lock_acquire(buffer_lock);
+			b->b_waiters++;
+			lock_release(buffer_lock);
+			waiting = true;
+		}
+		cv_wait(sh->bs_busy_cv, sh->bs_lock);
 	}
-	if (!b->b_attached || fs != b->b_fs || block != b->b_physblock) {
-		return EDEADBUF;
+	if (waiting) {
+		lock_acquire(buffer_lock);
+		KASSERT(b->b_waiters > 0);
+		b->b_waiters--;
+		lock_release(buffer_lock);
 	}
 	b->b_busy = 1;
 	KASSERT(b->b_fsmanaged == 0);
 	b->b_holder = curthread;
-	busy_buffers_count++;
+	sh->bs_busy_count++;
 	return 0;
 }
 
@@ -853,7 +1589,10 @@ static
 void
 buffer_unmark_busy(struct buf *b)
 {
+	struct bufshard *sh = b->b_shard;
+
 	KASSERT(b->b_busy != 0);
+	KASSERT(lock_do_i_hold(sh->bs_lock));
 	b->b_busy = 0;
 	if (b->b_fsmanaged) {
 		b->b_fsmanaged = false;
@@ -862,8 +1601,8 @@ buffer_unmark_busy(struct buf *b)
 		KASSERT(b->b_holder == curthread);
 	}
 	b->b_holder = NULL;
-	busy_buffers_count--;
-	cv_broadcast(buffer_busy_cv, buffer_lock);
+	sh->bs_busy_count--;
+	cv_broadcast(sh->bs_busy_cv, sh->bs_lock);
 }
 
 /*
@@ -873,9 +1612,10 @@ static
 int
 buffer_readin(struct buf *b)
 {
+	struct bufshard *sh = b->b_shard;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(lock_do_i_hold(sh->bs_lock));
 	KASSERT(b->b_attached);
 	KASSERT(b->b_busy);
 	KASSERT(b->b_fs != NULL);
@@ -884,9 +1624,9 @@ buffer_readin(struct buf *b)
 		return 0;
 	}
 
-	lock_release(buffer_lock);
+	lock_release(sh->bs_lock);
 	result = FSOP_READBLOCK(b->b_fs, b->b_physblock, b->b_data, b->b_size);
-	lock_acquire(buffer_lock);
+	lock_acquire(sh->bs_lock);
 	if (result == 0) {
 		b->b_valid = 1;
 	}
@@ -908,10 +1648,11 @@ static
 int
 buffer_writeout_internal(struct buf *b)
 {
+	struct bufshard *sh = b->b_shard;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
+	KASSERT(lock_do_i_hold(sh->bs_lock));
+	bufshard_check(sh);
 
 	KASSERT(b->b_attached);
 	KASSERT(b->b_valid);
@@ -922,13 +1663,13 @@ buffer_writeout_internal(struct buf *b)
 		return 0;
 	}
 
-	num_total_writeouts++;
-	lock_release(buffer_lock);
+	sh->bs_total_writeouts++;
+	sh->bs_write_ios++;
+	lock_release(sh->bs_lock);
 	result = FSOP_WRITEBLOCK(b->b_fs, b->b_physblock, b->b_fsdata,
 				 b->b_data, b->b_size);
-	lock_acquire(buffer_lock);
+	lock_acquire(sh->bs_lock);
 	if (result == 0) {
-		dirty_buffers_count--;
 		b->b_dirty = 0;
 		buffer_remove_dirty(b);
 	}
@@ -938,62 +1679,207 @@ buffer_writeout_internal(struct buf *b)
 int
 buffer_writeout(struct buf *b)
 {
+	struct bufshard *sh;
 	int result;
 
-	lock_acquire(buffer_lock);
+	sh = buffer_lock_shard(b);
 	result = buffer_writeout_internal(b);
-	lock_release(buffer_lock);
+	lock_release(sh->bs_lock);
 	return result;
 }
 
 /*
- * Fetch buffer pointer (external op)
+ * Grab a physical neighbor of a buffer being written out, to write
+ * it in the same cluster. Returns the buffer marked busy, or NULL if
+ * it isn't present, isn't dirty, or someone else has it.
  *
- * no lock necessary because of busy bit
- */
-void *
-buffer_map(struct buf *b)
-{
-	KASSERT(b->b_busy);
-	return b->b_data;
-}
-
-/*
- * Check if buffer is dirty. (external op)
+ * We must not wait for the buffer, because we're already holding
+ * (at least) one busy buffer and the holder of this one might be
+ * waiting for that. Neighbors usually live in other shards, so the
+ * caller must not be holding any shard lock.
  */
-bool
-buffer_is_dirty(struct buf *b)
+static
+struct buf *
+buffer_cluster_grab(struct fs *fs, daddr_t block, size_t size)
 {
-	KASSERT(b->b_busy);
-	KASSERT(b->b_valid);
+	struct bufshard *sh;
+	struct buf *b;
 
-	return b->b_dirty;
+	sh = buffer_shard(fs, block);
+	lock_acquire(sh->bs_lock);
+	b = bufhash_get(&sh->bs_hash, fs, block);
+	if (b == NULL || b->b_busy || !b->b_valid || !b->b_dirty ||
+	    b->b_size != size) {
+		lock_release(sh->bs_lock);
+		return NULL;
+	}
+	KASSERT(b->b_fsmanaged == 0);
+	b->b_busy = 1;
+	b->b_holder = curthread;
+	sh->bs_busy_count++;
+	lock_release(sh->bs_lock);
+	return b;
 }
 
 /*
- * Check if buffer is valid. (external op)
+ * I/O: buffer to disk, along with any dirty buffers physically
+ * adjacent to it, in one write.
+ *
+ * Like buffer_writeout_internal: the buffer should be busy, and its
+ * shard locked; the lock is released to do I/O.
+ *
+ * File systems that don't supply fsop_writeblocks just get the one
+ * buffer written. The file system is allowed to write only some
+ * leading part of a cluster (e.g. if ordering constraints of its own
+ * get in the way); if that leaves the original buffer dirty we write
+ * it alone afterwards.
  */
-bool
-buffer_is_valid(struct buf *b)
+static
+int
+buffer_writeout_cluster(struct buf *b)
 {
-	KASSERT(b->b_busy);
-
-	return b->b_valid;
-}
+	struct bufshard *sh = b->b_shard, *nsh;
+	struct buf *run[BUFFER_CLUSTER_MAX], *nb;
+	void *fsdata[BUFFER_CLUSTER_MAX];
+	void *data[BUFFER_CLUSTER_MAX];
+	struct fs *fs;
+	daddr_t block;
+	size_t size;
+	unsigned num, below, i, written;
 
-/*
- * Mark buffer dirty (external op, for after messing with buffer pointer)
- */
-void
-buffer_mark_dirty(struct buf *b)
-{
+	KASSERT(lock_do_i_hold(sh->bs_lock));
 	KASSERT(b->b_busy);
-	KASSERT(b->b_valid);
 
-	lock_acquire(buffer_lock);
+	fs = b->b_fs;
+	if (!b->b_dirty || fs->fs_ops->fsop_writeblocks == NULL) {
+		return buffer_writeout_internal(b);
+	}
+	block = b->b_physblock;
+	size = b->b_size;
+
+	/* Don't hold the shard lock while looking in other shards. */
+	lock_release(sh->bs_lock);
+
+	/*
+	 * Collect dirty neighbors below the buffer (in descending
+	 * order), then put them in ascending order and add the buffer
+	 * and the dirty neighbors above it.
+	 */
+	num = 0;
+	while (num < BUFFER_CLUSTER_MAX - 1 && num < block) {
+		nb = buffer_cluster_grab(fs, block - num - 1, size);
+		if (nb == NULL) {
+			break;
+		}
+		run[num++] = nb;
+	}
+	below = num;
+	for (i=0; i<below/2; i++) {
+		nb = run[i];
+		run[i] = run[below - i - 1];
+		run[below - i - 1] = nb;
+	}
+	run[num++] = b;
+	while (num < BUFFER_CLUSTER_MAX) {
+		nb = buffer_cluster_grab(fs, block + num - below, size);
+		if (nb == NULL) {
+			break;
+		}
+		run[num++] = nb;
+	}
+
+	if (num == 1) {
+		/* Nothing to cluster with. */
+		lock_acquire(sh->bs_lock);
+		return buffer_writeout_internal(b);
+	}
+
+	for (i=0; i<num; i++) {
+		fsdata[i] = run[i]->b_fsdata;
+		data[i] = run[i]->b_data;
+	}
+	written = FSOP_WRITEBLOCKS(fs, block - below, num, fsdata, data,
+				   size);
+	KASSERT(written <= num);
+
+	/* Mark what got written clean, and let go of the neighbors. */
+	for (i=0; i<num; i++) {
+		nb = run[i];
+		nsh = nb->b_shard;
+		lock_acquire(nsh->bs_lock);
+		if (i < written) {
+			nb->b_dirty = 0;
+			buffer_remove_dirty(nb);
+			nsh->bs_total_writeouts++;
+		}
+		if (nb != b) {
+			buffer_unmark_busy(nb);
+		}
+		lock_release(nsh->bs_lock);
+	}
+
+	lock_acquire(sh->bs_lock);
+	if (written > 0) {
+		sh->bs_write_ios++;
+		sh->bs_cluster_writes++;
+	}
+	if (b->b_dirty) {
+		/* Short write; do it the ordinary way. */
+		return buffer_writeout_internal(b);
+	}
+	return 0;
+}
+
+/*
+ * Fetch buffer pointer (external op)
+ *
+ * no lock necessary because of busy bit
+ */
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+/*
+ * Check if buffer is dirty. (external op)
+ */
+bool
+buffer_is_dirty(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	KASSERT(b->b_valid);
+
+	return b->b_dirty;
+}
+
+/*
+ * Check if buffer is valid. (external op)
+ */
+bool
+buffer_is_valid(struct buf *b)
+{
+	KASSERT(b->b_busy);
+
+	return b->b_valid;
+}
+
+/*
+ * Mark buffer dirty (external op, for after messing with buffer pointer)
+ */
+void
+buffer_mark_dirty(struct buf *b)
+{
+	struct bufshard *sh;
+
+	KASSERT(b->b_busy);
+	KASSERT(b->b_valid);
+
+	sh = buffer_lock_shard(b);
 	if (b->b_dirty) {
 		/* nothing to do */
-		lock_release(buffer_lock);
+		lock_release(sh->bs_lock);
 		return;
 	}
 
@@ -1004,9 +1890,8 @@ buffer_mark_dirty(struct buf *b)
 	/* XXX: should we avoid putting fsmanaged buffers on the dirty list? */
 
 	buffer_insert_dirty(b);
-	dirty_buffers_count++;
 	/* Here we might prod the syncer, but currently it doesn't need it */
-	lock_release(buffer_lock);
+	lock_release(sh->bs_lock);
 }
 
 /*
@@ -1061,12 +1946,12 @@ buffer_sync(struct buf *b)
 		return 0;
 	}
 
-	result = buffer_writeout_internal(b);
+	result = buffer_writeout_cluster(b);
 	/*
 	 * The caller needs to be able to distinguish buffer_mark_busy
 	 * failing (which requires specific handling) from any failure
 	 * that can happen writing the buffer out. Therefore,
-	 * buffer_writeout_internal isn't allowed to return EDEADBUF.
+	 * buffer_writeout_cluster isn't allowed to return EDEADBUF.
 	 */
 	KASSERT(result != EDEADBUF);
 
@@ -1076,11 +1961,12 @@ buffer_sync(struct buf *b)
 }
 
 /*
- * Write out one buffer from the dirty_buffers queue.
+ * Write out one buffer from a shard's dirty_buffers queue.
  *
  * If the syncer has signalled for help, this is called on every
  * buffer_get until the dirty_buffers queue gets back to a manageable
- * state.
+ * state. We only look at the shard the caller already has locked;
+ * across many calls this spreads the work over all of them.
  *
  * We don't attempt to sync buffers that are currently busy, because
  * that might deadlock; we'll let the syncer deal with those.
@@ -1090,15 +1976,18 @@ buffer_sync(struct buf *b)
  */
 static
 void
-sync_one_old_buffer(void)
+sync_one_old_buffer(struct bufshard *sh)
 {
-	unsigned i;
+	struct buflistnode *bln;
 	struct buf *b;
 	int result;
 
-	for (i=0; i < bufarray_num(&dirty_buffers); i++) {
-		b = bufarray_get(&dirty_buffers, i);
+	for (bln = sh->bs_dirty.bl_head.bln_next;
+	     bln != &sh->bs_dirty.bl_tail;
+	     bln = bln->bln_next) {
+		b = bln->bln_self;
 		if (b == NULL) {
+			/* someone's marker */
 			continue;
 		}
 		if (b->b_fsmanaged) {
@@ -1132,6 +2021,7 @@ static
 void
 buffer_clean(struct buf *b)
 {
+	struct bufshard *sh = b->b_shard;
 	int result;
 
 	KASSERT(b->b_busy == 0);
@@ -1139,40 +2029,45 @@ buffer_clean(struct buf *b)
 	/* not busy, won't sleep, can't fail */
 	KASSERT(result == 0);
 
-	lock_release(buffer_lock);
+	lock_release(sh->bs_lock);
 	FSOP_DETACHBUF(b->b_fs, b->b_physblock, b);
-	lock_acquire(buffer_lock);
+	lock_acquire(sh->bs_lock);
 	buffer_unmark_busy(b);
 
 	buffer_remove_attached(b, 0);
+	b->b_queue = NULL;
 	b->b_valid = 0;
+	if (b->b_readahead) {
+		/* read ahead but nobody ever wanted it */
+		b->b_readahead = 0;
+		sh->bs_readahead_wasted++;
+	}
 	if (b->b_dirty) {
 		b->b_dirty = 0;
-		dirty_buffers_count--;
 		buffer_remove_dirty(b);
 	}
 	buffer_detach(b);
 }
 
 /*
- * Evict a buffer.
+ * Choose a buffer to evict from the replacement queue Q, or return
+ * NULL if there's nothing suitable. Normally this is the first buffer
+ * on the queue, so this doesn't take long unless the old end of the
+ * queue is full of busy or dirty buffers.
  */
 static
-int
-buffer_evict(struct buf **ret)
+struct buf *
+buffer_evict_pick(struct buflist *q)
 {
+	struct buflistnode *bln;
 	unsigned num, i;
 	struct buf *b, *db;
-	int result;
-
-	/*
-	 * Find a target buffer.
-	 */
 
- tryagain:
-	num = bufarray_num(&attached_buffers);
+	num = q->bl_count;
 	b = db = NULL;
-	for (i=0; i<num; i++) {
+	for (bln = q->bl_head.bln_next, i = 0;
+	     bln != &q->bl_tail;
+	     bln = bln->bln_next) {
 		if (i >= num/2 && db != NULL) {
 			/*
 			 * voodoo: avoid preferring very recent clean
@@ -1180,10 +2075,12 @@ buffer_evict(struct buf **ret)
 			 */
 			break;
 		}
-		b = bufarray_get(&attached_buffers, i);
+		b = bln->bln_self;
 		if (b == NULL) {
+			/* someone's marker */
 			continue;
 		}
+		i++;
 		if (b->b_busy == 1) {
 			b = NULL;
 			continue;
@@ -1203,18 +2100,51 @@ buffer_evict(struct buf **ret)
 	if (b == NULL && db != NULL) {
 		b = db;
 	}
+	return b;
+}
+
+/*
+ * Evict a buffer from a shard.
+ *
+ * Returns EAGAIN if there's nothing in the shard that can be evicted;
+ * the caller should then try another shard.
+ */
+static
+int
+buffer_evict(struct bufshard *sh, struct buf **ret)
+{
+	struct buflist *q;
+	struct buf *b;
+	struct fs *fs;
+	daddr_t block;
+	bool froma1in;
+	int result;
+
+	KASSERT(lock_do_i_hold(sh->bs_lock));
+
+	/*
+	 * Find a target buffer: from the queue the policy says to
+	 * take from, or failing that the other one.
+	 */
+
+ tryagain:
+	q = buffer_victim_queue(sh);
+	b = buffer_evict_pick(q);
+	if (b == NULL) {
+		q = (q == &sh->bs_lru) ? &sh->bs_a1in : &sh->bs_lru;
+		b = buffer_evict_pick(q);
+	}
 	if (b == NULL) {
-		/* No buffers at all...? */
-		kprintf("buffer_evict: no targets!?\n");
+		/* Nothing evictable in this shard. */
 		return EAGAIN;
 	}
 
 	/*
 	 * Flush the buffer out if necessary.
 	 */
-	num_total_evictions++;
+	sh->bs_total_evictions++;
 	if (b->b_dirty) {
-		num_dirty_evictions++;
+		sh->bs_dirty_evictions++;
 		KASSERT(b->b_busy == 0);
 		/* lock may be released here */
 		result = buffer_sync(b);
@@ -1235,36 +2165,93 @@ buffer_evict(struct buf **ret)
 
 	/*
 	 * Detach it from its old key, and return it in a state where
-	 * it can be reattached properly.
+	 * it can be reattached properly. If it's leaving 2Q's A1in,
+	 * leave a ghost behind.
 	 */
+	froma1in = (b->b_queue == &sh->bs_a1in);
+	fs = b->b_fs;
+	block = b->b_physblock;
 	buffer_clean(b);
+	if (froma1in) {
+		bufghost_add(sh, fs, block);
+	}
+
+	/*
+	 * If someone started waiting for it while the lock was
+	 * released, it can't be reused until they've woken up and
+	 * noticed it's gone; park it and find another.
+	 */
+	lock_acquire(buffer_lock);
+	if (b->b_waiters > 0) {
+		buflist_addtail(&detached_buffers, &b->b_lrunode);
+		lock_release(buffer_lock);
+		goto tryagain;
+	}
+	lock_release(buffer_lock);
 
 	*ret = b;
 	return 0;
 }
 
+/*
+ * Evict a buffer from some shard other than MYSH, which we have
+ * locked. This is for when MYSH has nothing it can give up. Since we
+ * can't hold two shard locks at once, this releases MYSH's lock while
+ * working and reacquires it afterwards.
+ */
+static
+int
+buffer_evict_elsewhere(struct bufshard *mysh, struct buf **ret)
+{
+	struct bufshard *sh;
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(mysh->bs_lock));
+
+	lock_release(mysh->bs_lock);
+	result = EAGAIN;
+	for (i=1; i<BUFFER_NSHARDS && result == EAGAIN; i++) {
+		sh = &buffer_shards[(mysh->bs_index + i) % BUFFER_NSHARDS];
+		lock_acquire(sh->bs_lock);
+		result = buffer_evict(sh, ret);
+		lock_release(sh->bs_lock);
+	}
+	lock_acquire(mysh->bs_lock);
+
+	if (result == EAGAIN) {
+		/* No buffers at all...? */
+		kprintf("buffer_evict: no targets!?\n");
+	}
+	return result;
+}
+
 static
 struct buf *
-buffer_find(struct fs *fs, daddr_t physblock)
+buffer_find(struct bufshard *sh, struct fs *fs, daddr_t physblock)
 {
-	return bufhash_get(&buffer_hash, fs, physblock);
+	KASSERT(lock_do_i_hold(sh->bs_lock));
+	return bufhash_get(&sh->bs_hash, fs, physblock);
 }
 
 /*
  * Find a buffer for the given block, if one already exists; otherwise
  * attach one but don't bother to read it in. Set fsmanaged mode if
  * FSMANAGED is true.
+ *
+ * SH must be the shard for the block, and locked.
  */
 static
 int
-buffer_get_internal(struct fs *fs, daddr_t block, size_t size, bool fsmanaged,
-		    struct buf **ret)
+buffer_get_internal(struct bufshard *sh, struct fs *fs, daddr_t block,
+		    size_t size, bool fsmanaged, struct buf **ret)
 {
 	struct buf *b;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
+	KASSERT(lock_do_i_hold(sh->bs_lock));
+	KASSERT(sh == buffer_shard(fs, block));
+	bufshard_check(sh);
 
 	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
 	if (!fsmanaged) {
@@ -1272,41 +2259,57 @@ buffer_get_internal(struct fs *fs, daddr_t block, size_t size, bool fsmanaged,
 	}
 
 	if (!fsmanaged && syncer_needs_help) {
-		sync_one_old_buffer();
+		sync_one_old_buffer(sh);
 	}
 
-	num_total_gets++;
+	sh->bs_total_gets++;
+	sh->bs_policy_gets[sh->bs_policy]++;
 
 again:
-	b = buffer_find(fs, block);
+	b = buffer_find(sh, fs, block);
 	if (b != NULL) {
 		result = buffer_mark_busy(b);
 		if (result) {
 			KASSERT(result == EDEADBUF);
 			goto again;
 		}
-		num_valid_gets++;
-		buffer_remove_attached(b, 1);
+		sh->bs_valid_gets++;
+		sh->bs_policy_hits[sh->bs_policy]++;
+		if (b->b_readahead) {
+			b->b_readahead = 0;
+			sh->bs_readahead_hits++;
+		}
 
-		/* move it to the tail (recent end) of the LRU list */
-		buffer_insert_attached(b);
+		/* tell the replacement policy */
+		buffer_touch(b);
 	}
 	else {
-		b = buffer_remove_detached();
-		if (b == NULL && num_total_buffers < max_total_buffers) {
-			/* Can create a new buffer... */
-			b = buffer_create();
-		}
+		b = buffer_get_detached();
 		if (b == NULL) {
-			result = buffer_evict(&b);
+			/* lock may be released here */
+			result = buffer_evict(sh, &b);
+			if (result == EAGAIN) {
+				result = buffer_evict_elsewhere(sh, &b);
+			}
 			if (result) {
 				return result;
 			}
 			KASSERT(b != NULL);
+
+			/*
+			 * We lost the shard lock while evicting, so
+			 * someone else might have attached a buffer
+			 * for our block in the meantime. If so, use
+			 * theirs instead.
+			 */
+			if (buffer_find(sh, fs, block) != NULL) {
+				buffer_insert_detached(b);
+				goto again;
+			}
 		}
 
 		KASSERT(b->b_size == ONE_TRUE_BUFFER_SIZE);
-		result = buffer_attach(b, fs, block);
+		result = buffer_attach(b, sh, fs, block);
 		if (result) {
 			buffer_insert_detached(b);
 			return result;
@@ -1316,15 +2319,17 @@ again:
 		/* b wasn't busy, so we didn't wait and it didn't disappear */
 		KASSERT(result == 0);
 
-		/* move it to the tail (recent end) of the LRU list */
+		/* put it at the tail (recent end) of its queue */
+		b->b_queue = buffer_choose_queue(sh, fs, block);
 		buffer_insert_attached(b);
 
 		/*
 		 * Call the FS's buffer attach routine. We do this
 		 * after buffer_attach (rather than in it) so we can
 		 * do it safely with the buffer marked busy and
-		 * without holding buffer_lock, as buffer_lock isn't
-		 * supposed to be exposed to file system code.
+		 * without holding the shard lock, as buffer cache
+		 * locks aren't supposed to be exposed to file system
+		 * code.
 		 *
 		 * Note: b_fsmanaged, if requested, hasn't been set
 		 * yet.  There's some chance that this might confuse
@@ -1333,11 +2338,14 @@ again:
 		 * duplicating the code.
 		 */
 
-		lock_release(buffer_lock);
+		lock_release(sh->bs_lock);
 		result = FSOP_ATTACHBUF(b->b_fs, block, b);
-		lock_acquire(buffer_lock);
+		lock_acquire(sh->bs_lock);
 		if (result) {
 			buffer_unmark_busy(b);
+			buffer_remove_attached(b, 0);
+			b->b_queue = NULL;
+			buffer_detach(b);
 			buffer_insert_detached(b);
 			return result;
 		}
@@ -1361,22 +2369,21 @@ again:
  */
 static
 int
-buffer_read_internal(struct fs *fs, daddr_t block, size_t size, bool fsmanaged,
-		     struct buf **ret)
+buffer_read_internal(struct bufshard *sh, struct fs *fs, daddr_t block,
+		     size_t size, bool fsmanaged, struct buf **ret)
 {
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(lock_do_i_hold(sh->bs_lock));
 
-	result = buffer_get_internal(fs, block, size, fsmanaged, ret);
+	result = buffer_get_internal(sh, fs, block, size, fsmanaged, ret);
 	if (result) {
-		lock_release(buffer_lock);
 		*ret = NULL;
 		return result;
 	}
 
 	if (!(*ret)->b_valid) {
-		num_read_gets++;
+		sh->bs_read_gets++;
 		/* may lose (and then re-acquire) lock here */
 		result = buffer_readin(*ret);
 		if (result) {
@@ -1396,11 +2403,14 @@ buffer_read_internal(struct fs *fs, daddr_t block, size_t size, bool fsmanaged,
 int
 buffer_get(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
 {
+	struct bufshard *sh;
 	int result;
 
-	lock_acquire(buffer_lock);
-	result = buffer_get_internal(fs, block, size, false/*fsmanaged*/, ret);
-	lock_release(buffer_lock);
+	sh = buffer_shard(fs, block);
+	lock_acquire(sh->bs_lock);
+	result = buffer_get_internal(sh, fs, block, size,
+				     false/*fsmanaged*/, ret);
+	lock_release(sh->bs_lock);
 
 	return result;
 }
@@ -1412,11 +2422,14 @@ buffer_get(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
 int
 buffer_read(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
 {
+	struct bufshard *sh;
 	int result;
 
-	lock_acquire(buffer_lock);
-	result = buffer_read_internal(fs, block, size, false/*fsmanaged*/,ret);
-	lock_release(buffer_lock);
+	sh = buffer_shard(fs, block);
+	lock_acquire(sh->bs_lock);
+	result = buffer_read_internal(sh, fs, block, size,
+				      false/*fsmanaged*/, ret);
+	lock_release(sh->bs_lock);
 
 	return result;
 }
@@ -1428,11 +2441,14 @@ int
 buffer_get_fsmanaged(struct fs *fs, daddr_t block, size_t size,
 		     struct buf **ret)
 {
+	struct bufshard *sh;
 	int result;
 
-	lock_acquire(buffer_lock);
-	result = buffer_get_internal(fs, block, size, true/*fsmanaged*/, ret);
-	lock_release(buffer_lock);
+	sh = buffer_shard(fs, block);
+	lock_acquire(sh->bs_lock);
+	result = buffer_get_internal(sh, fs, block, size,
+				     true/*fsmanaged*/, ret);
+	lock_release(sh->bs_lock);
 
 	return result;
 }
@@ -1444,11 +2460,14 @@ int
 buffer_read_fsmanaged(struct fs *fs, daddr_t block, size_t size,
 		      struct buf **ret)
 {
+	struct bufshard *sh;
 	int result;
 
-	lock_acquire(buffer_lock);
-	result = buffer_read_internal(fs, block, size, true/*fsmanaged*/, ret);
-	lock_release(buffer_lock);
+	sh = buffer_shard(fs, block);
+	lock_acquire(sh->bs_lock);
+	result = buffer_read_internal(sh, fs, block, size,
+				      true/*fsmanaged*/, ret);
+	lock_release(sh->bs_lock);
 
 	return result;
 }
@@ -1464,15 +2483,17 @@ buffer_read_fsmanaged(struct fs *fs, daddr_t block, size_t size,
 int
 buffer_flush(struct fs *fs, daddr_t block, size_t size)
 {
+	struct bufshard *sh;
 	struct buf *b;
 	int result = 0;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
+	sh = buffer_shard(fs, block);
+	lock_acquire(sh->bs_lock);
+	bufshard_check(sh);
 
 	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
 
-	b = buffer_find(fs, block);
+	b = buffer_find(sh, fs, block);
 	if (b == NULL) {
 		goto done;
 	}
@@ -1506,7 +2527,7 @@ buffer_flush(struct fs *fs, daddr_t block, size_t size)
 
 	buffer_unmark_busy(b);
 done:
-	lock_release(buffer_lock);
+	lock_release(sh->bs_lock);
 	return result;
 }
 
@@ -1517,15 +2538,17 @@ done:
 void
 buffer_drop(struct fs *fs, daddr_t block, size_t size)
 {
+	struct bufshard *sh;
 	struct buf *b;
 	int result;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
+	sh = buffer_shard(fs, block);
+	lock_acquire(sh->bs_lock);
+	bufshard_check(sh);
 
 	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
 
-	b = buffer_find(fs, block);
+	b = buffer_find(sh, fs, block);
 	if (b != NULL) {
 		/*
 		 * While the FS shouldn't ever drop a buffer that it's also
@@ -1536,7 +2559,7 @@ buffer_drop(struct fs *fs, daddr_t block, size_t size)
 		result = buffer_mark_busy(b);
 		if (result == EDEADBUF) {
 			/* someone else already dropped it */
-			lock_release(buffer_lock);
+			lock_release(sh->bs_lock);
 			return;
 		}
 		KASSERT(result == 0);
@@ -1545,15 +2568,17 @@ buffer_drop(struct fs *fs, daddr_t block, size_t size)
 		buffer_clean(b);
 		buffer_insert_detached(b);
 	}
-	lock_release(buffer_lock);
+	lock_release(sh->bs_lock);
 }
 
 static
 void
 buffer_release_internal(struct buf *b)
 {
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
+	struct bufshard *sh = b->b_shard;
+
+	KASSERT(lock_do_i_hold(sh->bs_lock));
+	bufshard_check(sh);
 
 	if (!b->b_fsmanaged) {
 		/* buffers must be released while still reserved */
@@ -1568,9 +2593,8 @@ buffer_release_internal(struct buf *b)
 		buffer_insert_detached(b);
 	}
 	else {
-		/* move it to the end of the LRU list */
-		buffer_remove_attached(b, 0);
-		buffer_insert_attached(b);
+		/* tell the replacement policy it was used */
+		buffer_touch(b);
 	}
 }
 
@@ -1580,9 +2604,11 @@ buffer_release_internal(struct buf *b)
 void
 buffer_release(struct buf *b)
 {
-	lock_acquire(buffer_lock);
+	struct bufshard *sh;
+
+	sh = buffer_lock_shard(b);
 	buffer_release_internal(b);
-	lock_release(buffer_lock);
+	lock_release(sh->bs_lock);
 }
 
 /*
@@ -1591,12 +2617,14 @@ buffer_release(struct buf *b)
 void
 buffer_release_and_invalidate(struct buf *b)
 {
-	lock_acquire(buffer_lock);
-	bufcheck();
+	struct bufshard *sh;
+
+	sh = buffer_lock_shard(b);
+	bufshard_check(sh);
 
 	b->b_valid = 0;
 	buffer_release_internal(b);
-	lock_release(buffer_lock);
+	lock_release(sh->bs_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1611,135 +2639,817 @@ buffer_get_fsdata(struct buf *buf)
 void *
 buffer_set_fsdata(struct buf *buf, void *newfsd)
 {
-	void *oldfsd;
+	void *oldfsd;
+
+	oldfsd = buf->b_fsdata;
+	buf->b_fsdata = newfsd;
+	return oldfsd;
+}
+
+void
+buffer_set_owner(struct buf *buf, struct vnode *owner)
+{
+	struct bufshard *sh;
+
+	if (buf->b_owner == owner) {
+		return;
+	}
+	/* the sync scans read b_owner under the shard lock */
+	sh = buffer_lock_shard(buf);
+	buf->b_owner = owner;
+	lock_release(sh->bs_lock);
+}
+
+////////////////////////////////////////////////////////////
+// explicit sync
+
+/*
+ * Sync one shard's buffers for FS that were dirty as of MY_EPOCH. If
+ * OWNER is not NULL, sync only the buffers tagged with it.
+ */
+static
+int
+sync_shard_fs_buffers(struct bufshard *sh, struct fs *fs,
+		      struct vnode *owner, unsigned my_epoch)
+{
+	struct buflistnode marker;
+	struct buf *b, *next;
+	int result;
+
+	KASSERT(lock_do_i_hold(sh->bs_lock));
+	bufshard_check(sh);
+
+	b = buflist_first(&sh->bs_dirty);
+	while (b != NULL) {
+		if (b->b_fs != fs) {
+			b = buflist_next(&sh->bs_dirty, &b->b_dirtynode);
+			continue;
+		}
+		if (b->b_dirtyepoch > my_epoch) {
+			/*
+			 * This buffer became dirty after we started
+			 * syncing. Not only do we not need to write
+			 * it, but we can stop completely as any
+			 * subsequent buffers will be even newer.
+			 */
+			break;
+		}
+		if (owner != NULL && b->b_owner != owner) {
+			b = buflist_next(&sh->bs_dirty, &b->b_dirtynode);
+			continue;
+		}
+
+		KASSERT(b->b_valid);
+		KASSERT(b->b_dirty);
+
+		/* lock may be released (and then re-acquired) here */
+		buflist_mark(&b->b_dirtynode, &marker);
+		result = buffer_sync(b);
+		next = buflist_unmark(&sh->bs_dirty, &marker);
+		if (result == EDEADBUF) {
+			/*
+			 * The buffer was invalidated/evicted while we
+			 * were waiting to sync it. It no longer needs
+			 * syncing, so do nothing and just go on.
+			 */
+		}
+		else if (result) {
+			return result;
+		}
+		b = next;
+	}
+
+	return 0;
+}
+
+/*
+ * Sync the buffers for FS (and OWNER, if not NULL) that are dirty now.
+ */
+static
+int
+sync_buffers(struct fs *fs, struct vnode *owner)
+{
+	struct bufshard *sh;
+	unsigned my_epoch;
+	unsigned i;
+	int result;
+
+	lock_acquire(buffer_lock);
+	bufcheck();
+
+	my_epoch = dirty_epoch++;
+	if (dirty_epoch == 0) {
+		/*
+		 * Handling this instead of dying is not that
+		 * difficult, but for OS/161 it's not really worth the
+		 * trouble.
+		 */
+		panic("vfs: buffer cache syncer epoch wrapped around\n");
+	}
+
+	lock_release(buffer_lock);
+
+	for (i=0; i<BUFFER_NSHARDS; i++) {
+		sh = &buffer_shards[i];
+		lock_acquire(sh->bs_lock);
+		result = sync_shard_fs_buffers(sh, fs, owner, my_epoch);
+		lock_release(sh->bs_lock);
+		if (result) {
+			return result;
+		}
+	}
+
+	return 0;
+}
+
+int
+sync_fs_buffers(struct fs *fs)
+{
+	return sync_buffers(fs, NULL);
+}
+
+int
+sync_vnode_buffers(struct fs *fs, struct vnode *owner)
+{
+	KASSERT(owner != NULL);
+	return sync_buffers(fs, owner);
+}
+
+////////////////////////////////////////////////////////////
+// asynchronous I/O
+
+/*
+ * Queue a request for the I/O threads.
+ *
+ * Read-ahead requests are dropped (with EAGAIN) if there are already
+ * READAHEAD_QUEUE_SIZE of them waiting.
+ */
+static
+int
+bufio_submit(unsigned op, struct fs *fs, daddr_t block, size_t size,
+	     void (*callback)(void *, int), void *arg, struct bufio **ret)
+{
+	struct bufio *io;
+
+	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+
+	io = kmalloc(sizeof(*io));
+	if (io == NULL) {
+		return ENOMEM;
+	}
+	io->bio_op = op;
+	io->bio_fs = fs;
+	io->bio_block = block;
+	io->bio_size = size;
+	io->bio_callback = callback;
+	io->bio_arg = arg;
+	io->bio_handle = (ret != NULL);
+	io->bio_done = false;
+	io->bio_result = 0;
+	io->bio_next = NULL;
+
+	lock_acquire(bufio_lock);
+	if (op == BUFIO_READAHEAD) {
+		if (bufio_numreadahead == READAHEAD_QUEUE_SIZE) {
+			num_readahead_dropped++;
+			lock_release(bufio_lock);
+			kfree(io);
+			return EAGAIN;
+		}
+		bufio_numreadahead++;
+	}
+	if (bufio_tail == NULL) {
+		bufio_head = io;
+	}
+	else {
+		bufio_tail->bio_next = io;
+	}
+	bufio_tail = io;
+	cv_signal(bufio_cv, bufio_lock);
+	lock_release(bufio_lock);
+
+	if (ret != NULL) {
+		*ret = io;
+	}
+	return 0;
+}
+
+/*
+ * Start reading a block into the cache. (external op)
+ */
+int
+buffer_read_async(struct fs *fs, daddr_t block, size_t size,
+		  void (*callback)(void *, int), void *arg,
+		  struct bufio **ret)
+{
+	return bufio_submit(BUFIO_READ, fs, block, size, callback, arg, ret);
+}
+
+/*
+ * Start writing a block out. (external op)
+ */
+int
+buffer_flush_async(struct fs *fs, daddr_t block, size_t size,
+		   void (*callback)(void *, int), void *arg,
+		   struct bufio **ret)
+{
+	return bufio_submit(BUFIO_FLUSH, fs, block, size, callback, arg, ret);
+}
+
+/*
+ * Wait for an asynchronous request to finish, and return its result.
+ * The handle is freed. (external op)
+ */
+int
+buffer_io_wait(struct bufio *io)
+{
+	int result;
+
+	KASSERT(io->bio_handle);
+
+	lock_acquire(bufio_lock);
+	while (!io->bio_done) {
+		cv_wait(bufio_done_cv, bufio_lock);
+	}
+	lock_release(bufio_lock);
+
+	result = io->bio_result;
+	kfree(io);
+	return result;
+}
+
+/*
+ * Check if an asynchronous request has finished. (external op)
+ */
+bool
+buffer_io_done(struct bufio *io)
+{
+	bool done;
+
+	KASSERT(io->bio_handle);
+
+	lock_acquire(bufio_lock);
+	done = io->bio_done;
+	lock_release(bufio_lock);
+
+	return done;
+}
+
+/*
+ * Ask for a block to be read into the cache in the background.
+ *
+ * This is advisory: if the block is already cached, or the queue is
+ * full, nothing happens. The caller must not be holding any buffer
+ * cache locks (which is always true outside this file).
+ */
+void
+buffer_readahead(struct fs *fs, daddr_t block, size_t size)
+{
+	struct bufshard *sh;
+	struct buf *b;
+
+	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+
+	/* Cheap check first, to avoid filling the queue with hits. */
+	sh = buffer_shard(fs, block);
+	lock_acquire(sh->bs_lock);
+	b = buffer_find(sh, fs, block);
+	lock_release(sh->bs_lock);
+	if (b != NULL) {
+		return;
+	}
+
+	/* errors just mean we don't read ahead */
+	(void)bufio_submit(BUFIO_READAHEAD, fs, block, size,
+			   NULL, NULL, NULL);
+}
+
+/*
+ * Read a block into the cache for an I/O thread. If AHEAD is set,
+ * it's for read-ahead and gets counted as such.
+ */
+static
+int
+bufio_read(struct fs *fs, daddr_t block, bool ahead)
+{
+	struct bufshard *sh;
+	struct buf *b;
+	int result;
+
+	reserve_buffers(ONE_TRUE_BUFFER_SIZE);
+
+	sh = buffer_shard(fs, block);
+	lock_acquire(sh->bs_lock);
+
+	if (buffer_find(sh, fs, block) != NULL) {
+		/* Someone else got there first. */
+		result = 0;
+		goto done;
+	}
+
+	result = buffer_get_internal(sh, fs, block, ONE_TRUE_BUFFER_SIZE,
+				     false/*fsmanaged*/, &b);
+	if (result) {
+		goto done;
+	}
+	if (!b->b_valid) {
+		/* may lose (and then re-acquire) lock here */
+		result = buffer_readin(b);
+		if (result == 0 && ahead) {
+			b->b_readahead = 1;
+			sh->bs_readahead_reads++;
+		}
+	}
+	/* if the read failed, this discards the buffer */
+	buffer_release_internal(b);
+
+ done:
+	lock_release(sh->bs_lock);
+	unreserve_buffers(ONE_TRUE_BUFFER_SIZE);
+	return result;
+}
+
+/*
+ * Check if a request for IOFS/IOBLOCK is for blocks BLOCK through
+ * BLOCK+NUM-1 of FS, or for any block of FS if NUM is 0.
+ */
+static
+bool
+bufio_inrange(struct fs *iofs, daddr_t ioblock,
+	      struct fs *fs, daddr_t block, unsigned num)
+{
+	if (iofs != fs) {
+		return false;
+	}
+	return num == 0 || (ioblock >= block && ioblock - block < num);
+}
+
+/*
+ * Check if any request in the range (as above) is queued or in
+ * progress.
+ */
+static
+bool
+bufio_pending(struct fs *fs, daddr_t block, unsigned num)
+{
+	struct bufio *io;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(bufio_lock));
+
+	for (io = bufio_head; io != NULL; io = io->bio_next) {
+		if (bufio_inrange(io->bio_fs, io->bio_block,
+				  fs, block, num)) {
+			return true;
+		}
+	}
+	for (i=0; i<BUFIO_NTHREADS; i++) {
+		if (bufio_inrange(bufio_busyfs[i], bufio_busyblock[i],
+				  fs, block, num)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Forget any queued read-ahead requests in the range (as above) and
+ * wait for any other requests in it to finish. Used with NUM 0 when
+ * unmounting.
+ */
+static
+void
+bufio_cancel(struct fs *fs, daddr_t block, unsigned num)
+{
+	struct bufio *io, **iop;
+
+	lock_acquire(bufio_lock);
+	bufio_tail = NULL;
+	iop = &bufio_head;
+	while (*iop != NULL) {
+		io = *iop;
+		if (io->bio_op == BUFIO_READAHEAD &&
+		    bufio_inrange(io->bio_fs, io->bio_block,
+				  fs, block, num)) {
+			*iop = io->bio_next;
+			bufio_numreadahead--;
+			kfree(io);
+			continue;
+		}
+		bufio_tail = io;
+		iop = &io->bio_next;
+	}
+	while (bufio_pending(fs, block, num)) {
+		cv_wait(bufio_done_cv, bufio_lock);
+	}
+	lock_release(bufio_lock);
+}
+
+/*
+ * Cancel or wait for background I/O on some blocks. (external op)
+ */
+void
+buffer_cancel_io(struct fs *fs, daddr_t block, unsigned num)
+{
+	KASSERT(num > 0);
+	bufio_cancel(fs, block, num);
+}
+
+/*
+ * An I/O thread. WHICH is its index in bufio_busyfs[].
+ */
+static
+void
+bufio_thread(void *x1, unsigned long which)
+{
+	struct bufio *io;
+	int result;
+
+	(void)x1;
+	KASSERT(which < BUFIO_NTHREADS);
+
+	lock_acquire(bufio_lock);
+	while (1) {
+		while (bufio_head == NULL) {
+			cv_wait(bufio_cv, bufio_lock);
+		}
+		io = bufio_head;
+		bufio_head = io->bio_next;
+		if (bufio_head == NULL) {
+			bufio_tail = NULL;
+		}
+		if (io->bio_op == BUFIO_READAHEAD) {
+			bufio_numreadahead--;
+		}
+		bufio_busyfs[which] = io->bio_fs;
+		bufio_busyblock[which] = io->bio_block;
+		lock_release(bufio_lock);
+
+		switch (io->bio_op) {
+		    case BUFIO_READ:
+			result = bufio_read(io->bio_fs, io->bio_block, false);
+			break;
+		    case BUFIO_READAHEAD:
+			result = bufio_read(io->bio_fs, io->bio_block, true);
+			break;
+		    case BUFIO_FLUSH:
+			result = buffer_flush(io->bio_fs, io->bio_block,
+					      io->bio_size);
+			break;
+		    default:
+			panic("bufio_thread: invalid op %u\n", io->bio_op);
+		}
+
+		if (io->bio_callback != NULL) {
+			io->bio_callback(io->bio_arg, result);
+		}
+
+		lock_acquire(bufio_lock);
+		bufio_busyfs[which] = NULL;
+		if (io->bio_handle) {
+			io->bio_result = result;
+			io->bio_done = true;
+		}
+		else {
+			kfree(io);
+		}
+		cv_broadcast(bufio_done_cv, bufio_lock);
+	}
+	lock_release(bufio_lock);
+}
+
+////////////////////////////////////////////////////////////
+// for unmounting
+
+/*
+ * Invalidate and detach all buffers belonging to a filesystem. Every
+ * fs should do this as part of its unmount routine once it's sure
+ * that the fs is idle.
+ *
+ * Panic if we hit a dirty buffer, as sync should just have been
+ * called and no buffers should get dirty again after that.
+ */
+void
+drop_fs_buffers(struct fs *fs)
+{
+	struct bufshard *sh;
+	struct bufshard_fs *bsf;
+	unsigned i, ix;
+	struct buf *b;
+
+	/* Read-ahead must not bring anything back in behind us. */
+	bufio_cancel(fs, 0, 0);
+
+	for (i=0; i<BUFFER_NSHARDS; i++) {
+		sh = &buffer_shards[i];
+		lock_acquire(sh->bs_lock);
+		bufshard_check(sh);
+
+		bsf = bufshard_findfs(sh, fs, &ix);
+		if (bsf == NULL) {
+			/* Never had any buffers in this shard. */
+			bufghost_purge(sh, fs);
+			lock_release(sh->bs_lock);
+			continue;
+		}
+
+		/*
+		 * buffer_clean releases the lock, but the fs is idle,
+		 * so nothing else is going to be added to the list.
+		 */
+		while ((b = buflist_first(&bsf->bsf_buffers)) != NULL) {
+			KASSERT(b->b_fs == fs);
+			KASSERT(b->b_valid);
+			if (b->b_dirty) {
+				panic("drop_fs_buffers: buffer did not "
+				      "get synced\n");
+			}
+			if (b->b_busy) {
+				panic("drop_fs_buffers: buffer is busy\n");
+			}
+
+			buffer_clean(b);
+			buffer_insert_detached(b);
+		}
+
+		bufshard_fsarray_remove(&sh->bs_fslists, ix);
+		kfree(bsf);
+
+		/* the fs pointer might get reused; forget its ghosts too */
+		bufghost_purge(sh, fs);
+
+		lock_release(sh->bs_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// cache sizing
+
+/*
+ * Destroy a detached buffer, giving its memory back.
+ */
+static
+void
+buffer_destroy(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(b->b_attached == 0);
+	KASSERT(b->b_busy == 0);
+	KASSERT(!buflistnode_onlist(&b->b_lrunode));
+
+	kfree(b->b_data);
+	kfree(b);
+	KASSERT(num_total_buffers > 0);
+	num_total_buffers--;
+}
+
+/*
+ * Choose a buffer to throw away to shrink the cache: the oldest
+ * clean one that isn't in use, from the queue the next evictions
+ * would come from or failing that the other one.
+ */
+static
+struct buf *
+buffer_shrink_pick(struct bufshard *sh)
+{
+	struct buflist *q;
+	struct buflistnode *bln;
+	struct buf *b;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(sh->bs_lock));
+
+	q = buffer_victim_queue(sh);
+	for (i=0; i<2; i++) {
+		for (bln = q->bl_head.bln_next;
+		     bln != &q->bl_tail;
+		     bln = bln->bln_next) {
+			b = bln->bln_self;
+			if (b != NULL && !b->b_busy && !b->b_dirty &&
+			    b->b_waiters == 0) {
+				return b;
+			}
+		}
+		q = (q == &sh->bs_lru) ? &sh->bs_a1in : &sh->bs_lru;
+	}
+	return NULL;
+}
+
+/*
+ * Shrink the cache to TARGET buffers, or as close as we can get by
+ * discarding detached and clean buffers. Returns the number of
+ * buffers freed. Call with buffer_lock held; it is released and
+ * reacquired.
+ */
+static
+unsigned
+buffer_shrink(unsigned target)
+{
+	struct bufshard *sh;
+	struct buflistnode *bln;
+	struct buf *b;
+	unsigned freed, i;
+	bool progress;
 
-	oldfsd = buf->b_fsdata;
-	buf->b_fsdata = newfsd;
-	return oldfsd;
-}
+	KASSERT(lock_do_i_hold(buffer_lock));
 
-////////////////////////////////////////////////////////////
-// explicit sync
+	/*
+	 * Detached buffers first; nobody will miss them. (Except
+	 * anyone still waking up from waiting for one.)
+	 */
+	freed = 0;
+	bln = detached_buffers.bl_head.bln_next;
+	while (num_total_buffers > target && bln != &detached_buffers.bl_tail) {
+		b = bln->bln_self;
+		bln = bln->bln_next;
+		if (b->b_waiters > 0) {
+			continue;
+		}
+		buflist_remove(&detached_buffers, &b->b_lrunode);
+		buffer_destroy(b);
+		freed++;
+	}
 
-int
-sync_fs_buffers(struct fs *fs)
+	/*
+	 * Then clean buffers, one per shard per pass so the shards
+	 * shrink evenly. (Shard locks come before buffer_lock.)
+	 */
+	progress = true;
+	while (num_total_buffers > target && progress) {
+		lock_release(buffer_lock);
+		progress = false;
+		for (i=0; i<BUFFER_NSHARDS; i++) {
+			sh = &buffer_shards[i];
+			lock_acquire(sh->bs_lock);
+			b = buffer_shrink_pick(sh);
+			if (b != NULL) {
+				/* this may release the shard lock */
+				buffer_clean(b);
+				lock_acquire(buffer_lock);
+				if (b->b_waiters > 0) {
+					/*
+					 * Someone found it while the
+					 * lock was released; they'll
+					 * look at it again when they
+					 * wake up, so keep it around.
+					 */
+					buflist_addtail(&detached_buffers,
+							&b->b_lrunode);
+				}
+				else {
+					buffer_destroy(b);
+					freed++;
+				}
+				lock_release(buffer_lock);
+				progress = true;
+			}
+			lock_release(sh->bs_lock);
+		}
+		lock_acquire(buffer_lock);
+	}
+	return freed;
+}
+
+/*
+ * Adjust the size of the cache to the amount of free memory. Called
+ * by the syncer once per pass.
+ *
+ * Buffers we're allowed to have but haven't allocated yet are counted
+ * as used memory; otherwise we'd keep growing without ever using it.
+ */
+static
+void
+buffer_resize(void)
 {
-	unsigned i;
-	struct buf *b;
-	unsigned my_epoch, my_generation;
-	int result;
+	unsigned long freepages, promised;
+	unsigned target, newmax, freed, i, kin;
+
+	freepages = vm_freepages();
 
 	lock_acquire(buffer_lock);
 	bufcheck();
 
-	my_epoch = dirty_epoch++;
-	if (dirty_epoch == 0) {
-		/*
-		 * Handling this instead of dying is not that
-		 * difficult, but for OS/161 it's not really worth the
-		 * trouble.
-		 */
-		panic("vfs: buffer cache syncer epoch wrapped around\n");
-	}
+	promised = (max_total_buffers - num_total_buffers) /
+		(PAGE_SIZE / ONE_TRUE_BUFFER_SIZE);
+	freepages = freepages > promised ? freepages - promised : 0;
 
-	my_generation = dirty_buffers_generation;
+	target = max_total_buffers;
+	if (freepages > buffer_growfree) {
+		target += buffer_resizestep;
+	}
+	else if (freepages < buffer_shrinkfree) {
+		target = target > buffer_resizestep ?
+			target - buffer_resizestep : 0;
+	}
+	/* (This also applies changes to the limits.) */
+	if (target > buffer_maxbuffers) {
+		target = buffer_maxbuffers;
+	}
+	if (target < buffer_minbuffers) {
+		target = buffer_minbuffers;
+	}
 
-	/* Don't cache the array size; it might change as we work. */
-	for (i=0; i<bufarray_num(&dirty_buffers); i++) {
-		b = bufarray_get(&dirty_buffers, i);
-		if (b == NULL || b->b_fs != fs) {
-			continue;
-		}
-		if (b->b_dirtyepoch > my_epoch) {
-			/*
-			 * This buffer became dirty after we started
-			 * syncing. Not only do we not need to write
-			 * it, but we can stop completely as any
-			 * subsequent buffers will be even newer.
-			 */
-			break;
-		}
+	if (target == max_total_buffers) {
+		lock_release(buffer_lock);
+		return;
+	}
 
-		KASSERT(b->b_valid);
-		KASSERT(b->b_dirty);
+	if (target > max_total_buffers) {
+		newmax = target;
+		num_cache_grows++;
+		/* might let waiting reservations through */
+		cv_broadcast(buffer_reserve_cv, buffer_lock);
+	}
+	else {
+		freed = buffer_shrink(target);
+		num_buffers_freed += freed;
+		num_cache_shrinks++;
 
-		/* lock may be released (and then re-acquired) here */
-		result = buffer_sync(b);
-		if (result == EDEADBUF) {
-			/*
-			 * The buffer was invalidated/evicted while we
-			 * were waiting to sync it. It no longer needs
-			 * syncing, so do nothing and just go on.
-			 */
+		/*
+		 * We might not have been able to get all the way down;
+		 * also leave room for at least one more reservation
+		 * so nobody gets stuck waiting for the cache to grow.
+		 */
+		newmax = target;
+		if (newmax < num_total_buffers) {
+			newmax = num_total_buffers;
 		}
-		else if (result) {
-			lock_release(buffer_lock);
-			return result;
+		if (newmax < num_reserved_buffers + RESERVE_BUFFERS) {
+			newmax = num_reserved_buffers + RESERVE_BUFFERS;
 		}
-
-		if (my_generation != dirty_buffers_generation) {
-			/* compact_dirty_buffers ran; restart loop */
-			i = 0;
-			my_generation = dirty_buffers_generation;
-			/* compensate for the i++ */
-			i--;
+		if (newmax > max_total_buffers) {
+			newmax = max_total_buffers;
 		}
 	}
-
+	max_total_buffers = newmax;
+	bufcheck();
 	lock_release(buffer_lock);
-	return 0;
-}
 
-////////////////////////////////////////////////////////////
-// for unmounting
+	/* 2Q's A1in is sized relative to the shard. */
+	kin = SCALE(newmax / BUFFER_NSHARDS, TWOQ_KIN);
+	for (i=0; i<BUFFER_NSHARDS; i++) {
+		lock_acquire(buffer_shards[i].bs_lock);
+		buffer_shards[i].bs_kin = kin;
+		lock_release(buffer_shards[i].bs_lock);
+	}
+}
 
 /*
- * Invalidate and detach all buffers belonging to a filesystem. Every
- * fs should do this as part of its unmount routine once it's sure
- * that the fs is idle.
- *
- * Panic if we hit a dirty buffer, as sync should just have been
- * called and no buffers should get dirty again after that.
+ * Change one of the cache sizing parameters:
+ *    min	smallest size of the cache, in kilobytes
+ *    max	largest size of the cache, in kilobytes
+ *    grow	grow the cache if more than this many kilobytes are free
+ *    shrink	shrink the cache if less than this many kilobytes are free
+ * Takes effect at the syncer's next pass.
  */
-void
-drop_fs_buffers(struct fs *fs)
+int
+buffer_set_sizing(const char *name, unsigned kbytes)
 {
-	unsigned i;
-	struct buf *b;
-	unsigned my_generation;
+	unsigned bufs;
+	unsigned long pages;
+	int result = 0;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
+	bufs = kbytes * (1024 / ONE_TRUE_BUFFER_SIZE);
+	pages = kbytes / (PAGE_SIZE / 1024);
 
-	my_generation = attached_buffers_generation;
-	/* Don't cache the array size; it might change as we work. */
-	for (i=0; i<bufarray_num(&attached_buffers); i++) {
-		b = bufarray_get(&attached_buffers, i);
-		if (b == NULL || b->b_fs != fs) {
-			continue;
+	lock_acquire(buffer_lock);
+	if (!strcmp(name, "min")) {
+		if (bufs < BUFFER_MINBUFFERS || bufs > buffer_maxbuffers) {
+			result = EINVAL;
 		}
-
-		KASSERT(b->b_valid);
-		if (b->b_dirty) {
-			panic("drop_fs_buffers: buffer did not get synced\n");
+		else {
+			buffer_minbuffers = bufs;
 		}
-		if (b->b_busy) {
-			panic("drop_fs_buffers: buffer is busy\n");
+	}
+	else if (!strcmp(name, "max")) {
+		if (bufs < buffer_minbuffers || bufs > buffer_hardmax) {
+			result = EINVAL;
 		}
-
-		buffer_clean(b);
-		buffer_insert_detached(b);
-
-		if (my_generation != attached_buffers_generation) {
-			/* compact_attached_buffers ran; restart loop */
-			i = 0;
-			my_generation = attached_buffers_generation;
-			/* compensate for the i++ */
-			i--;
+		else {
+			buffer_maxbuffers = bufs;
 		}
 	}
-
+	else if (!strcmp(name, "grow")) {
+		if (pages < buffer_shrinkfree) {
+			result = EINVAL;
+		}
+		else {
+			buffer_growfree = pages;
+		}
+	}
+	else if (!strcmp(name, "shrink")) {
+		if (pages > buffer_growfree) {
+			result = EINVAL;
+		}
+		else {
+			buffer_shrinkfree = pages;
+		}
+	}
+	else {
+		result = EINVAL;
+	}
 	lock_release(buffer_lock);
+	return result;
 }
 
 ////////////////////////////////////////////////////////////
@@ -1752,17 +3462,18 @@ drop_fs_buffers(struct fs *fs)
  * avoid data loss in a crash.
  *
  * Pursuant to this, there are two work functions, one for working
- * the queue of least-recently-used buffers (attached_buffers) and
- * one for working the queue of old dirty buffers (dirty_buffers).
+ * the queue of least-recently-used buffers (bs_lru) and one for
+ * working the queue of old dirty buffers (bs_dirty). Each works on
+ * one shard at a time; the outer loop visits all the shards in turn.
  *
  * We balance work between them as follows:
- *    - Under normal circumstances, we work attached_buffers first and
- *      then dirty_buffers.
+ *    - Under normal circumstances, we work bs_lru first and
+ *      then bs_dirty.
  *    - Each of the work functions has a goal after which it stops;
  *      but it limits itself to some fixed maximum number of buffers
  *      before returning, in order to bound the amount of time before
  *      the outer loop reconsiders the situation.
- *    - Under write load, we switch to working dirty_buffers first, in
+ *    - Under write load, we switch to working bs_dirty first, in
  *      order to attempt to bound data loss in a crash. Because client
  *      threads will fall back to synchronous evictions from the LRU
  *      list, under these conditions the syncer should concentrate on
@@ -1771,18 +3482,22 @@ drop_fs_buffers(struct fs *fs)
  *      write out old buffers.
  *    - "Write load" and "heavy write load" are defined by whether the
  *      syncer is managing to keep up with the dirty buffer load; or
- *      more precisely, by how far behind it is on dirty_buffers
- *      relative to where it wants to be.
+ *      more precisely, by how far behind it is on bs_dirty relative
+ *      to where it wants to be.
  */
 
 /*
- * Sync buffers from the LRU list (attached_buffers)
+ * Sync buffers from a shard's LRU list (bs_lru), or under 2Q from
+ * whichever queue buffers are currently being evicted from.
  *
  * When activated, we write out:
  *    - any of the N least recently used buffers that are dirty;
  *    - any of the N+K least recently used buffers that are dirty and
  *      are older than one second.
  *
+ * N and K are scaled down by the number of shards, since each shard
+ * holds (roughly) its share of the buffers.
+ *
  * Any buffers that can still be allocated (max_total_buffers -
  * num_total_buffers) are counted as very old clean buffers, so at
  * first we don't sync anything at all until one of the time limits
@@ -1794,42 +3509,45 @@ drop_fs_buffers(struct fs *fs)
  */
 static
 bool
-sync_lru_buffers(void)
+sync_lru_buffers(struct bufshard *sh)
 {
 	struct timespec started, now, age;
 	unsigned sync_always; /* N */
 	unsigned sync_ifold; /* N + K */
+	unsigned unallocated;
 	unsigned seenbuffers;
-	unsigned my_generation;
-	unsigned loops;
-	unsigned i;
-	struct buf *b;
+	struct buflist *q;
+	struct buflistnode marker;
+	struct buf *b, *next;
 	bool finished;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
-	KASSERT(dirty_buffers_count > 0);
+	KASSERT(lock_do_i_hold(sh->bs_lock));
+	bufshard_check(sh);
+	KASSERT(sh->bs_dirty.bl_count > 0);
 
 	gettime(&started);
 	finished = false;
 
-	sync_always = SCALE(max_total_buffers, SYNCER_ALWAYS);
-	sync_ifold = SCALE(max_total_buffers, SYNCER_IFOLD);
-	seenbuffers = 0;
+	/* shard lock before buffer_lock is the allowed order */
+	lock_acquire(buffer_lock);
+	sync_always = SCALE(max_total_buffers, SYNCER_ALWAYS) / BUFFER_NSHARDS;
+	sync_ifold = SCALE(max_total_buffers, SYNCER_IFOLD) / BUFFER_NSHARDS;
+	unallocated = (max_total_buffers - num_total_buffers) / BUFFER_NSHARDS;
+	lock_release(buffer_lock);
 
 	/*
 	 * Buffers not allocated yet are buffers we have effectively
 	 * already processed.
 	 */
-	seenbuffers += max_total_buffers - num_total_buffers;
+	seenbuffers = unallocated;
+
+	/* Work on the queue the next evictions will come from */
+	q = buffer_victim_queue(sh);
 
-	my_generation = attached_buffers_generation;
-	loops = 0;
-	i = 0;
+	next = buflist_first(q);
 	while (1) {
-		/* Don't cache the array size; it might change as we work. */
-		if (i >= bufarray_num(&attached_buffers)) {
+		if (next == NULL) {
 			/* no more buffers to look at */
 			finished = true;
 			break;
@@ -1840,11 +3558,8 @@ sync_lru_buffers(void)
 			break;
 		}
 
-		b = bufarray_get(&attached_buffers, i);
-		i++;
-		if (b == NULL) {
-			continue;
-		}
+		b = next;
+		next = buflist_next(q, &b->b_lrunode);
 		seenbuffers++;
 		if (!b->b_dirty) {
 			continue;
@@ -1869,7 +3584,9 @@ sync_lru_buffers(void)
 		}
 
 		/* This can sleep */
+		buflist_mark(&b->b_lrunode, &marker);
 		result = buffer_sync(b);
+		next = buflist_unmark(q, &marker);
 		if (result == EDEADBUF) {
 			/*
 			 * The buffer was invalidated/evicted while we
@@ -1886,20 +3603,6 @@ sync_lru_buffers(void)
 				FSOP_GETVOLNAME(b->b_fs), b->b_physblock,
 				strerror(result));
 		}
-
-		if (my_generation != attached_buffers_generation) {
-			/* compact_attached_buffers ran; restart loop */
-			loops++;
-			if (loops > 15) {
-				/* limit 15 tries, then go on */
-				break;
-			}
-			i = 0;
-			seenbuffers = 0;
-			seenbuffers += max_total_buffers - num_total_buffers;
-			my_generation = attached_buffers_generation;
-			continue;
-		}
 	}
 	return finished;
 }
@@ -1960,41 +3663,39 @@ syncer_adjust_state(unsigned age)
 }
 
 /*
- * Sync buffers from the age-sorted list of dirty buffers.
+ * Sync buffers from a shard's age-sorted list of dirty buffers.
  *
  * We write out any dirty buffers that are older than two seconds.
+ *
+ * Finishing one shard doesn't mean the syncer has caught up overall,
+ * so resetting the load state is left to the caller once every shard
+ * has finished.
  */
 static
 bool
-sync_old_buffers(void)
+sync_old_buffers(struct bufshard *sh)
 {
 	struct timespec started, now, age;
-	unsigned my_generation;
-	unsigned i;
-	struct buf *b;
+	struct buflistnode marker;
+	struct buf *b, *next;
 	bool finished;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
-	KASSERT(dirty_buffers_count > 0);
+	KASSERT(lock_do_i_hold(sh->bs_lock));
+	bufshard_check(sh);
+	KASSERT(sh->bs_dirty.bl_count > 0);
 
 	gettime(&started);
 	finished = false;
 
-	my_generation = dirty_buffers_generation;
-	i = 0;
+	next = buflist_first(&sh->bs_dirty);
 	while (1) {
-		/* Don't cache the array size; it might change as we work. */
-		if (i >= bufarray_num(&dirty_buffers)) {
+		if (next == NULL) {
 			finished = true;
 			break;
 		}
-		b = bufarray_get(&dirty_buffers, i);
-		i++;
-		if (b == NULL) {
-			continue;
-		}
+		b = next;
+		next = buflist_next(&sh->bs_dirty, &b->b_dirtynode);
 		KASSERT(b->b_dirty);
 		gettime(&now);
 		timespec_sub(&started, &now, &age);
@@ -2008,7 +3709,7 @@ sync_old_buffers(void)
 		timespec_sub(&now, &b->b_timestamp, &age);
 		if (age.tv_sec < SYNCER_TARGET_AGE) {
 			/*
-			 * Because buffers are added to dirty[] in
+			 * Because buffers are added to bs_dirty in
 			 * order and it's never reshuffled, once we
 			 * see one buffer newer than we need to force
 			 * out, all the rest will be newer too. So we
@@ -2021,7 +3722,9 @@ sync_old_buffers(void)
 		/* If we're seeing sufficiently old buffers, take steps */
 		syncer_adjust_state(age.tv_sec);
 
+		buflist_mark(&b->b_dirtynode, &marker);
 		result = buffer_sync(b);
+		next = buflist_unmark(&sh->bs_dirty, &marker);
 		if (result == EDEADBUF) {
 			/* as above */
 		}
@@ -2034,17 +3737,6 @@ sync_old_buffers(void)
 				FSOP_GETVOLNAME(b->b_fs), b->b_physblock,
 				strerror(result));
 		}
-
-		if (my_generation != dirty_buffers_generation) {
-			/* compact_dirty_buffers ran; restart loop */
-			i = 0;
-			my_generation = dirty_buffers_generation;
-			continue;
-		}
-	}
-	if (finished && syncer_under_load) {
-		/* If we finished, the age of the "next" buffer is 0. */
-		syncer_adjust_state(0);
 	}
 	return finished;
 }
@@ -2054,47 +3746,70 @@ sync_old_buffers(void)
  * the syncer either when enough buffers become dirty or every second
  * or two when dirty buffers exist. But we don't really have the
  * facilities for that, so instead we'll just run once a second.
+ *
+ * Each pass visits every shard once; we only sleep when a whole pass
+ * finished everywhere.
  */
 static
 void
 syncer(void *x1, unsigned long x2)
 {
+	struct bufshard *sh;
 	bool lru_finished, old_finished;
+	bool all_lru_finished, all_old_finished;
+	unsigned i;
 
 	(void)x1;
 	(void)x2;
 
-	lock_acquire(buffer_lock);
 	syncer_thread = curthread;
 
-	lru_finished = true;
-	old_finished = true;
+	all_lru_finished = true;
+	all_old_finished = true;
 	while (1) {
-		if (lru_finished && old_finished) {
-			lock_release(buffer_lock);
+		if (all_lru_finished && all_old_finished) {
 			clocksleep(1);
-			lock_acquire(buffer_lock);
 		}
 
-		if (syncer_needs_help) {
-			old_finished = sync_old_buffers();
-			lru_finished = false;
-		}
-		else if (syncer_under_load) {
-			old_finished = sync_old_buffers();
-			lru_finished = sync_lru_buffers();
-		}
-		else if (dirty_buffers_count > 0) {
-			lru_finished = sync_lru_buffers();
-			old_finished = sync_old_buffers();
+		buffer_resize();
+
+		all_lru_finished = true;
+		all_old_finished = true;
+		for (i=0; i<BUFFER_NSHARDS; i++) {
+			sh = &buffer_shards[i];
+			lock_acquire(sh->bs_lock);
+
+			if (sh->bs_dirty.bl_count == 0) {
+				lru_finished = true;
+				old_finished = true;
+			}
+			else if (syncer_needs_help) {
+				old_finished = sync_old_buffers(sh);
+				lru_finished = false;
+			}
+			else if (syncer_under_load) {
+				old_finished = sync_old_buffers(sh);
+				lru_finished = (sh->bs_dirty.bl_count == 0) ||
+					sync_lru_buffers(sh);
+			}
+			else {
+				lru_finished = sync_lru_buffers(sh);
+				old_finished = (sh->bs_dirty.bl_count == 0) ||
+					sync_old_buffers(sh);
+			}
+
+			lock_release(sh->bs_lock);
+
+			all_lru_finished = all_lru_finished && lru_finished;
+			all_old_finished = all_old_finished && old_finished;
 		}
-		else {
-			lru_finished = true;
-			old_finished = true;
+
+		if (all_old_finished && syncer_under_load) {
+			/* If we finished, the age of the "next" buffer is 0. */
+			syncer_adjust_state(0);
 		}
 	}
 	syncer_thread = NULL;
-	lock_release(buffer_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -2192,29 +3907,196 @@ unreserve_fsmanaged_buffers(unsigned count, size_t size)
 	lock_release(buffer_lock);
 }
 
+////////////////////////////////////////////////////////////
+// replacement policy
+
+/*
+ * Switch one shard to a new replacement policy.
+ */
+static
+void
+bufshard_set_policy(struct bufshard *sh, unsigned policy)
+{
+	struct buflistnode *bln, *nextbln;
+	struct buf *b;
+
+	KASSERT(lock_do_i_hold(sh->bs_lock));
+
+	if (sh->bs_policy == policy) {
+		return;
+	}
+
+	if (sh->bs_policy == BUFPOLICY_2Q) {
+		/*
+		 * A1in holds buffers more recently loaded than most of
+		 * Am, so add them at the recent end of the LRU list in
+		 * order. Leave any markers behind; the scans that own
+		 * them will just find nothing after them.
+		 */
+		for (bln = sh->bs_a1in.bl_head.bln_next;
+		     bln != &sh->bs_a1in.bl_tail;
+		     bln = nextbln) {
+			nextbln = bln->bln_next;
+			b = bln->bln_self;
+			if (b == NULL) {
+				continue;
+			}
+			buflist_remove(&sh->bs_a1in, &b->b_lrunode);
+			b->b_queue = &sh->bs_lru;
+			buflist_addtail(&sh->bs_lru, &b->b_lrunode);
+		}
+		bufghost_purge(sh, NULL);
+	}
+	/* Switching to 2Q, everything cached already counts as Am. */
+
+	sh->bs_policy = policy;
+}
+
+/*
+ * Change the buffer replacement policy. NAME is "lru" or "2q".
+ */
+int
+buffer_set_policy(const char *name)
+{
+	unsigned policy, i;
+
+	for (policy = 0; policy < BUFPOLICY_NUM; policy++) {
+		if (!strcmp(name, buffer_policy_names[policy])) {
+			break;
+		}
+	}
+	if (policy == BUFPOLICY_NUM) {
+		return EINVAL;
+	}
+
+	lock_acquire(buffer_lock);
+	buffer_policy = policy;
+	lock_release(buffer_lock);
+
+	for (i=0; i<BUFFER_NSHARDS; i++) {
+		lock_acquire(buffer_shards[i].bs_lock);
+		bufshard_set_policy(&buffer_shards[i], policy);
+		lock_release(buffer_shards[i].bs_lock);
+	}
+	return 0;
+}
+
+/*
+ * Print a hit rate.
+ */
+static
+void
+buffer_print_hitrate(const char *what, unsigned gets, unsigned hits)
+{
+	unsigned pct;
+
+	pct = gets == 0 ? 0 : (unsigned)(((uint64_t)hits * 100) / gets);
+	kprintf("   %s: %u gets, %u hits (%u%%)\n", what, gets, hits, pct);
+}
+
 ////////////////////////////////////////////////////////////
 // print stats
 
 void
 buffer_printstats(void)
 {
+	struct bufshard *sh;
+	unsigned attached, busy, dirty;
+	unsigned gets, hits, reads, writeouts, evictions, dirtyevictions;
+	unsigned writeios, clusterwrites;
+	unsigned rareads, rahits, rawasted, radropped;
+	unsigned policygets[BUFPOLICY_NUM], policyhits[BUFPOLICY_NUM];
+	unsigned a1in, ghosts, ghosthits;
+	unsigned i, j;
+
+	attached = busy = dirty = 0;
+	gets = hits = reads = writeouts = evictions = dirtyevictions = 0;
+	writeios = clusterwrites = 0;
+	rareads = rahits = rawasted = 0;
+	a1in = ghosts = ghosthits = 0;
+	for (j=0; j<BUFPOLICY_NUM; j++) {
+		policygets[j] = policyhits[j] = 0;
+	}
+
+	kprintf("Buffer cache shards: %u\n", BUFFER_NSHARDS);
+	for (i=0; i<BUFFER_NSHARDS; i++) {
+		sh = &buffer_shards[i];
+		lock_acquire(sh->bs_lock);
+
+		kprintf("   shard %u: %u attached, %u dirty, "
+			"%u gets (%u hits)\n", i,
+			sh->bs_lru.bl_count + sh->bs_a1in.bl_count,
+			sh->bs_dirty.bl_count,
+			sh->bs_total_gets, sh->bs_valid_gets);
+
+		attached += sh->bs_lru.bl_count + sh->bs_a1in.bl_count;
+		busy += sh->bs_busy_count;
+		dirty += sh->bs_dirty.bl_count;
+		gets += sh->bs_total_gets;
+		hits += sh->bs_valid_gets;
+		reads += sh->bs_read_gets;
+		writeouts += sh->bs_total_writeouts;
+		writeios += sh->bs_write_ios;
+		clusterwrites += sh->bs_cluster_writes;
+		evictions += sh->bs_total_evictions;
+		dirtyevictions += sh->bs_dirty_evictions;
+		rareads += sh->bs_readahead_reads;
+		rahits += sh->bs_readahead_hits;
+		rawasted += sh->bs_readahead_wasted;
+		a1in += sh->bs_a1in.bl_count;
+		ghosts += sh->bs_ghostcount;
+		ghosthits += sh->bs_ghost_hits;
+		for (j=0; j<BUFPOLICY_NUM; j++) {
+			policygets[j] += sh->bs_policy_gets[j];
+			policyhits[j] += sh->bs_policy_hits[j];
+		}
+
+		lock_release(sh->bs_lock);
+	}
+
+	lock_acquire(bufio_lock);
+	radropped = num_readahead_dropped;
+	lock_release(bufio_lock);
+
 	lock_acquire(buffer_lock);
 
 	kprintf("Buffers: %u of %u allocated\n",
 		num_total_buffers, max_total_buffers);
+	kprintf("   size %uk (%uk-%uk); grow above %luk free, "
+		"shrink below %luk\n",
+		max_total_buffers / (1024 / ONE_TRUE_BUFFER_SIZE),
+		buffer_minbuffers / (1024 / ONE_TRUE_BUFFER_SIZE),
+		buffer_maxbuffers / (1024 / ONE_TRUE_BUFFER_SIZE),
+		buffer_growfree * (PAGE_SIZE / 1024),
+		buffer_shrinkfree * (PAGE_SIZE / 1024));
+	kprintf("   %u grows, %u shrinks (%u buffers freed)\n",
+		num_cache_grows, num_cache_shrinks, num_buffers_freed);
 	kprintf("   %u detached, %u attached\n",
-		bufarray_num(&detached_buffers), attached_buffers_count);
+		detached_buffers.bl_count, attached);
 	kprintf("   %u reserved\n", num_reserved_buffers);
-	kprintf("   %u busy\n", busy_buffers_count);
-	kprintf("   %u dirty\n", dirty_buffers_count);
+	kprintf("   %u busy\n", busy);
+	kprintf("   %u dirty\n", dirty);
 
 	kprintf("Buffer operations:\n");
 	kprintf("   %u gets (%u hits, %u reads)\n",
-		num_total_gets, num_valid_gets, num_read_gets);
-	kprintf("   %u writeouts\n",
-		num_total_writeouts);
+		gets, hits, reads);
+	kprintf("   %u writeouts (%u write I/Os, %u clustered)\n",
+		writeouts, writeios, clusterwrites);
 	kprintf("   %u evictions (%u when dirty)\n",
-		num_total_evictions, num_dirty_evictions);
+		evictions, dirtyevictions);
+	kprintf("   %u read-aheads (%u hits, %u wasted, %u dropped)\n",
+		rareads, rahits, rawasted, radropped);
+
+	kprintf("Replacement policy: %s\n",
+		buffer_policy_names[buffer_policy]);
+	for (j=0; j<BUFPOLICY_NUM; j++) {
+		if (policygets[j] > 0) {
+			buffer_print_hitrate(buffer_policy_names[j],
+					     policygets[j], policyhits[j]);
+		}
+	}
+	kprintf("   2q: %u in A1in, %u ghosts, %u ghost hits\n",
+		a1in, ghosts, ghosthits);
 
 	lock_release(buffer_lock);
 }
@@ -2226,41 +4108,64 @@ void
 buffer_bootstrap(void)
 {
 	size_t max_buffer_mem;
+	unsigned numbuckets;
+	unsigned i;
 	int result;
 
-	attached_buffers_count = 0;
-	dirty_buffers_count = 0;
-
 	num_reserved_buffers = 0;
 	num_total_buffers = 0;
 
 	/* Limit total memory usage for buffers */
 	max_buffer_mem =
 		(mainbus_ramsize() * BUFFER_MAXMEM_NUM) / BUFFER_MAXMEM_DENOM;
-	max_total_buffers = max_buffer_mem / ONE_TRUE_BUFFER_SIZE;
+	buffer_hardmax = max_buffer_mem / ONE_TRUE_BUFFER_SIZE;
+	buffer_maxbuffers = buffer_hardmax;
+	buffer_minbuffers =
+		SCALE(mainbus_ramsize(), BUFFER_MINMEM) / ONE_TRUE_BUFFER_SIZE;
+	if (buffer_minbuffers < BUFFER_MINBUFFERS) {
+		buffer_minbuffers = BUFFER_MINBUFFERS;
+	}
+	KASSERT(buffer_minbuffers <= buffer_maxbuffers);
+	buffer_growfree = SCALE(mainbus_ramsize(), BUFFER_GROWFREE) / PAGE_SIZE;
+	buffer_shrinkfree =
+		SCALE(mainbus_ramsize(), BUFFER_SHRINKFREE) / PAGE_SIZE;
+	buffer_resizestep = SCALE(buffer_hardmax, BUFFER_RESIZE);
+	if (buffer_resizestep == 0) {
+		buffer_resizestep = 1;
+	}
+
+	/*
+	 * Start in the middle; the syncer grows it if memory is
+	 * plentiful and shrinks it if memory gets short.
+	 */
+	max_total_buffers =
+		SCALE(mainbus_ramsize(), BUFFER_STARTMEM) / ONE_TRUE_BUFFER_SIZE;
+	if (max_total_buffers < buffer_minbuffers) {
+		max_total_buffers = buffer_minbuffers;
+	}
 
-	kprintf("buffers: max count %lu; max size %luk\n",
+	kprintf("buffers: count %lu (max %lu); max size %luk\n",
 		(unsigned long) max_total_buffers,
+		(unsigned long) buffer_hardmax,
 		(unsigned long) max_buffer_mem/1024);
 
-	num_total_gets = 0;
-	num_valid_gets = 0;
-	num_read_gets = 0;
-	num_total_writeouts = 0;
-	num_total_evictions = 0;
-	num_dirty_evictions = 0;
-
-	bufarray_init(&detached_buffers);
-	bufarray_init(&attached_buffers);
-	bufarray_init(&dirty_buffers);
-	attached_buffers_first = 0;
-	attached_buffers_thresh = 0;
-	dirty_buffers_first = 0;
-	dirty_buffers_thresh = 0;
-
-	result = bufhash_init(&buffer_hash, max_total_buffers/16);
-	if (result) {
-		panic("Creating buffer_hash failed\n");
+	buflist_init(&detached_buffers);
+	buffer_policy = BUFPOLICY_LRU;
+
+	/* The hash tables and ghost lists are sized for the largest size */
+	numbuckets = buffer_hardmax/16/BUFFER_NSHARDS;
+	if (numbuckets == 0) {
+		numbuckets = 1;
+	}
+	for (i=0; i<BUFFER_NSHARDS; i++) {
+		result = bufshard_init(&buffer_shards[i], i, numbuckets,
+				       buffer_hardmax / BUFFER_NSHARDS);
+		if (result) {
+			panic("Creating buffer cache shard %u failed\n", i);
+		}
+		/* but A1in goes by the current size, as in buffer_resize */
+		buffer_shards[i].bs_kin =
+			SCALE(max_total_buffers / BUFFER_NSHARDS, TWOQ_KIN);
 	}
 
 	buffer_lock = lock_create("buffer cache lock");
@@ -2268,18 +4173,35 @@ buffer_bootstrap(void)
 		panic("Creating buffer cache lock failed\n");
 	}
 
-	buffer_busy_cv = cv_create("bufbusy");
-	if (buffer_busy_cv == NULL) {
-		panic("Creating buffer_busy_cv failed\n");
-	}
-
 	buffer_reserve_cv = cv_create("bufreserve");
 	if (buffer_reserve_cv == NULL) {
 		panic("Creating buffer_reserve_cv failed\n");
 	}
 
+	bufio_lock = lock_create("buffer I/O queue lock");
+	if (bufio_lock == NULL) {
+		panic("Creating buffer I/O queue lock failed\n");
+	}
+
+	bufio_cv = cv_create("bufio");
+	if (bufio_cv == NULL) {
+		panic("Creating bufio_cv failed\n");
+	}
+
+	bufio_done_cv = cv_create("bufio done");
+	if (bufio_done_cv == NULL) {
+		panic("Creating bufio_done_cv failed\n");
+	}
+
 	result = thread_fork("syncer", NULL, syncer, NULL, 0);
 	if (result) {
 		panic("Starting syncer failed\n");
 	}
+
+	for (i=0; i<BUFIO_NTHREADS; i++) {
+		result = thread_fork("bufio", NULL, bufio_thread, NULL, i);
+		if (result) {
+			panic("Starting buffer I/O thread failed\n");
+		}
+	}
 }
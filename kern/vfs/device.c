@@ -331,6 +331,7 @@ static const struct vnode_ops dev_vnode_ops = {
 	.vop_readlink = vopfail_uio_inval,
 	.vop_getdirentry = vopfail_uio_notdir,
 	.vop_write = dev_write,
+	.vop_directio = vnode_directio_passthru,
 	.vop_ioctl = dev_ioctl,
 	.vop_stat = dev_stat,
 	.vop_gettype = dev_gettype,
@@ -0,0 +1,469 @@
+/*
+ * Copyright (c) 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * I/O scheduler for block device drivers. See iosched.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <iosched.h>
+
+/* Deadlines for the deadline policy, in milliseconds */
+#define IOSCHED_READ_DEADLINE   100
+#define IOSCHED_WRITE_DEADLINE  1000
+
+/* Largest request we'll build by merging, in sectors */
+#define IOSCHED_MAXMERGE        128
+
+struct iosched;
+
+/*
+ * A policy picks the next request to dispatch from a nonempty queue.
+ */
+struct iosched_policy {
+	const char *ip_name;
+	struct ioreq *(*ip_pick)(struct iosched *q);
+};
+
+struct iosched {
+	const char *q_name;		/* device name */
+	struct spinlock *q_lock;	/* driver's lock */
+	const struct iosched_policy *q_policy;
+	struct iosched *q_next;		/* on iosched_all */
+
+	/* queued (not yet dispatched) requests */
+	struct ioreq *q_sorthead;	/* by sector */
+	struct ioreq *q_fifohead;	/* by arrival */
+	struct ioreq *q_fifotail;
+	unsigned q_queued;
+
+	/* what the device is doing */
+	struct ioreq *q_current;	/* in progress */
+	uint32_t q_headpos;		/* sector after the last dispatched */
+
+	/* stats */
+	unsigned q_nreqs;		/* requests finished */
+	unsigned q_nmerged;		/* of which merged into another */
+	unsigned q_ndispatched;		/* dispatches (after merging) */
+	unsigned q_ndeadline;		/* dispatches forced by deadline */
+	unsigned q_maxqueued;		/* longest queue seen */
+	uint64_t q_totlatency;		/* total submit-to-done time (us) */
+	uint32_t q_maxlatency;		/* longest submit-to-done time (us) */
+};
+
+/*
+ * All the schedulers, for iosched_setpolicy and iosched_printstats.
+ * Devices are attached during autoconfiguration, before anything
+ * else runs, so this needs no lock.
+ */
+static struct iosched *iosched_all;
+
+////////////////////////////////////////////////////////////
+// queue ops
+
+/*
+ * Insert into the sector-ordered queue.
+ */
+static
+void
+iosched_sortinsert(struct iosched *q, struct ioreq *req)
+{
+	struct ioreq *prev, *cur;
+
+	prev = NULL;
+	for (cur = q->q_sorthead; cur != NULL; cur = cur->ir_sortnext) {
+		if (cur->ir_sector > req->ir_sector) {
+			break;
+		}
+		prev = cur;
+	}
+	req->ir_sortprev = prev;
+	req->ir_sortnext = cur;
+	if (prev != NULL) {
+		prev->ir_sortnext = req;
+	}
+	else {
+		q->q_sorthead = req;
+	}
+	if (cur != NULL) {
+		cur->ir_sortprev = req;
+	}
+}
+
+/*
+ * Take a request off both queues.
+ */
+static
+void
+iosched_remove(struct iosched *q, struct ioreq *req)
+{
+	if (req->ir_sortprev != NULL) {
+		req->ir_sortprev->ir_sortnext = req->ir_sortnext;
+	}
+	else {
+		q->q_sorthead = req->ir_sortnext;
+	}
+	if (req->ir_sortnext != NULL) {
+		req->ir_sortnext->ir_sortprev = req->ir_sortprev;
+	}
+
+	if (req->ir_fifoprev != NULL) {
+		req->ir_fifoprev->ir_fifonext = req->ir_fifonext;
+	}
+	else {
+		q->q_fifohead = req->ir_fifonext;
+	}
+	if (req->ir_fifonext != NULL) {
+		req->ir_fifonext->ir_fifoprev = req->ir_fifoprev;
+	}
+	else {
+		q->q_fifotail = req->ir_fifoprev;
+	}
+
+	req->ir_sortnext = req->ir_sortprev = NULL;
+	req->ir_fifonext = req->ir_fifoprev = NULL;
+	q->q_queued--;
+}
+
+/*
+ * Try to merge REQ onto the end of a queued request. Because the
+ * queue is in sector order, the candidate is the last one starting
+ * before REQ does.
+ */
+static
+bool
+iosched_merge(struct iosched *q, struct ioreq *req)
+{
+	struct ioreq *cur, *prev, *last;
+
+	prev = NULL;
+	for (cur = q->q_sorthead; cur != NULL; cur = cur->ir_sortnext) {
+		if (cur->ir_sector >= req->ir_sector) {
+			break;
+		}
+		prev = cur;
+	}
+	if (prev == NULL || prev->ir_end != req->ir_sector ||
+	    prev->ir_write != req->ir_write ||
+	    prev->ir_end - prev->ir_sector + req->ir_nsect > IOSCHED_MAXMERGE) {
+		return false;
+	}
+
+	for (last = prev; last->ir_merged != NULL; last = last->ir_merged) {
+		KASSERT(last->ir_write == req->ir_write);
+	}
+	last->ir_merged = req;
+	prev->ir_end = req->ir_end;
+	q->q_nmerged++;
+	return true;
+}
+
+/*
+ * Dispatch the next request, per the policy.
+ */
+static
+struct ioreq *
+iosched_dispatch(struct iosched *q)
+{
+	struct ioreq *req;
+
+	if (q->q_sorthead == NULL) {
+		return NULL;
+	}
+	req = q->q_policy->ip_pick(q);
+	KASSERT(req != NULL);
+	iosched_remove(q, req);
+	q->q_headpos = req->ir_end;
+	q->q_ndispatched++;
+	return req;
+}
+
+////////////////////////////////////////////////////////////
+// policies
+
+static
+struct ioreq *
+iosched_fifo_pick(struct iosched *q)
+{
+	return q->q_fifohead;
+}
+
+static
+struct ioreq *
+iosched_clook_pick(struct iosched *q)
+{
+	struct ioreq *req;
+
+	for (req = q->q_sorthead; req != NULL; req = req->ir_sortnext) {
+		if (req->ir_sector >= q->q_headpos) {
+			return req;
+		}
+	}
+	/* nothing further out; go back around */
+	return q->q_sorthead;
+}
+
+static
+struct ioreq *
+iosched_deadline_pick(struct iosched *q)
+{
+	struct timespec now, age;
+	struct ioreq *req;
+	unsigned ms;
+
+	gettime(&now);
+
+	/*
+	 * Within each direction the arrival queue is in deadline
+	 * order, so the first expired request is at least close to
+	 * the most overdue one.
+	 */
+	for (req = q->q_fifohead; req != NULL; req = req->ir_fifonext) {
+		timespec_sub(&now, &req->ir_queued, &age);
+		ms = age.tv_sec * 1000 + age.tv_nsec / 1000000;
+		if (ms >= (req->ir_write ? IOSCHED_WRITE_DEADLINE :
+			   IOSCHED_READ_DEADLINE)) {
+			q->q_ndeadline++;
+			return req;
+		}
+	}
+	return iosched_clook_pick(q);
+}
+
+static const struct iosched_policy iosched_policies[] = {
+	{ "fifo",	iosched_fifo_pick },
+	{ "clook",	iosched_clook_pick },
+	{ "deadline",	iosched_deadline_pick },
+};
+#define NPOLICIES (sizeof(iosched_policies) / sizeof(iosched_policies[0]))
+
+/* default policy */
+#define IOSCHED_DEFAULT (&iosched_policies[2])
+
+////////////////////////////////////////////////////////////
+// driver interface
+
+struct iosched *
+iosched_create(const char *name, struct spinlock *lk)
+{
+	struct iosched *q;
+
+	q = kmalloc(sizeof(*q));
+	if (q == NULL) {
+		return NULL;
+	}
+	q->q_name = name;
+	q->q_lock = lk;
+	q->q_policy = IOSCHED_DEFAULT;
+
+	q->q_sorthead = NULL;
+	q->q_fifohead = q->q_fifotail = NULL;
+	q->q_queued = 0;
+	q->q_current = NULL;
+	q->q_headpos = 0;
+
+	q->q_nreqs = 0;
+	q->q_nmerged = 0;
+	q->q_ndispatched = 0;
+	q->q_ndeadline = 0;
+	q->q_maxqueued = 0;
+	q->q_totlatency = 0;
+	q->q_maxlatency = 0;
+
+	q->q_next = iosched_all;
+	iosched_all = q;
+	return q;
+}
+
+void
+iosched_destroy(struct iosched *q)
+{
+	struct iosched **qp;
+
+	KASSERT(q->q_sorthead == NULL);
+	KASSERT(q->q_current == NULL);
+
+	for (qp = &iosched_all; *qp != NULL; qp = &(*qp)->q_next) {
+		if (*qp == q) {
+			*qp = q->q_next;
+			break;
+		}
+	}
+	kfree(q);
+}
+
+struct ioreq *
+iosched_add(struct iosched *q, struct ioreq *req)
+{
+	KASSERT(spinlock_do_i_hold(q->q_lock));
+	KASSERT(req->ir_nsect > 0);
+
+	req->ir_cursect = 0;
+	req->ir_result = 0;
+	req->ir_sortnext = req->ir_sortprev = NULL;
+	req->ir_fifonext = req->ir_fifoprev = NULL;
+	req->ir_merged = NULL;
+	req->ir_end = req->ir_sector + req->ir_nsect;
+	gettime(&req->ir_queued);
+
+	if (!iosched_merge(q, req)) {
+		iosched_sortinsert(q, req);
+		req->ir_fifoprev = q->q_fifotail;
+		if (q->q_fifotail != NULL) {
+			q->q_fifotail->ir_fifonext = req;
+		}
+		else {
+			q->q_fifohead = req;
+		}
+		q->q_fifotail = req;
+		q->q_queued++;
+		if (q->q_queued > q->q_maxqueued) {
+			q->q_maxqueued = q->q_queued;
+		}
+	}
+
+	if (q->q_current != NULL) {
+		return NULL;
+	}
+	q->q_current = iosched_dispatch(q);
+	return q->q_current;
+}
+
+struct ioreq *
+iosched_done(struct iosched *q, struct ioreq *req)
+{
+	struct timespec now, lat;
+	uint32_t us;
+
+	KASSERT(spinlock_do_i_hold(q->q_lock));
+	KASSERT(req == q->q_current);
+
+	gettime(&now);
+	timespec_sub(&now, &req->ir_queued, &lat);
+	us = lat.tv_sec * 1000000 + lat.tv_nsec / 1000;
+	q->q_nreqs++;
+	q->q_totlatency += us;
+	if (us > q->q_maxlatency) {
+		q->q_maxlatency = us;
+	}
+
+	if (req->ir_merged != NULL) {
+		/* the rest of the merged request goes next */
+		q->q_current = req->ir_merged;
+		req->ir_merged = NULL;
+	}
+	else {
+		q->q_current = iosched_dispatch(q);
+	}
+	return q->q_current;
+}
+
+struct ioreq *
+iosched_current(struct iosched *q)
+{
+	KASSERT(spinlock_do_i_hold(q->q_lock));
+	return q->q_current;
+}
+
+////////////////////////////////////////////////////////////
+// control and stats
+
+static
+struct iosched *
+iosched_find(const char *name)
+{
+	struct iosched *q;
+
+	for (q = iosched_all; q != NULL; q = q->q_next) {
+		if (!strcmp(q->q_name, name)) {
+			return q;
+		}
+	}
+	return NULL;
+}
+
+int
+iosched_setpolicy(const char *name, const char *policy)
+{
+	struct iosched *q;
+	unsigned i;
+
+	q = iosched_find(name);
+	if (q == NULL) {
+		return ENODEV;
+	}
+	for (i=0; i<NPOLICIES; i++) {
+		if (!strcmp(iosched_policies[i].ip_name, policy)) {
+			/* all policies share the same queues */
+			spinlock_acquire(q->q_lock);
+			q->q_policy = &iosched_policies[i];
+			spinlock_release(q->q_lock);
+			return 0;
+		}
+	}
+	return EINVAL;
+}
+
+void
+iosched_printstats(void)
+{
+	struct iosched *q;
+	const char *policy;
+	unsigned nreqs, nmerged, ndispatched, ndeadline, maxqueued;
+	uint64_t totlatency;
+	uint32_t maxlatency;
+
+	for (q = iosched_all; q != NULL; q = q->q_next) {
+		/* copy out so we don't print holding the spinlock */
+		spinlock_acquire(q->q_lock);
+		policy = q->q_policy->ip_name;
+		nreqs = q->q_nreqs;
+		nmerged = q->q_nmerged;
+		ndispatched = q->q_ndispatched;
+		ndeadline = q->q_ndeadline;
+		maxqueued = q->q_maxqueued;
+		totlatency = q->q_totlatency;
+		maxlatency = q->q_maxlatency;
+		spinlock_release(q->q_lock);
+
+		kprintf("%s: %s, %u requests (%u merged), %u dispatches "
+			"(%u by deadline), max queue %u\n",
+			q->q_name, policy, nreqs, nmerged, ndispatched,
+			ndeadline, maxqueued);
+		kprintf("%s: latency avg %u us, max %u us\n",
+			q->q_name,
+			nreqs > 0 ? (unsigned)(totlatency / nreqs) : 0,
+			maxlatency);
+	}
+}
@@ -0,0 +1,368 @@
+/*
+ * Copyright (c) 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Name cache. See namecache.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vnode.h>
+#include <namecache.h>
+
+/* Number of entries */
+#define NAMECACHE_SIZE		512
+
+/* Number of hash chains */
+#define NAMECACHE_BUCKETS	128
+
+/* Longest name (plus 1) that we'll cache */
+#define NAMECACHE_NAMELEN	32
+
+struct ncentry {
+	struct ncentry *nc_hashnext;	/* hash chain */
+	struct ncentry *nc_hashprev;
+	struct ncentry *nc_lrunext;	/* LRU list, most recent first */
+	struct ncentry *nc_lruprev;
+	struct vnode *nc_dir;		/* directory; NULL if unused */
+	struct vnode *nc_vn;		/* what NAME is, or NULL */
+	char nc_name[NAMECACHE_NAMELEN];
+};
+
+static struct spinlock nc_lock = SPINLOCK_INITIALIZER;
+static struct ncentry nc_entries[NAMECACHE_SIZE];
+static struct ncentry *nc_buckets[NAMECACHE_BUCKETS];
+static struct ncentry *nc_lruhead, *nc_lrutail;
+static bool nc_ready;
+
+/* Bumped whenever an entry is removed; see namecache_enter. */
+static unsigned nc_seq;
+
+/* stats */
+static unsigned nc_hits, nc_neghits, nc_misses;
+static unsigned nc_enters, nc_removes, nc_purges;
+
+////////////////////////////////////////////////////////////
+// Internals (all called with nc_lock held)
+
+/*
+ * Put all the entries on the LRU list. Done on first use, so there's
+ * no bootstrap call.
+ */
+static
+void
+nc_init(void)
+{
+	unsigned i;
+
+	for (i=0; i<NAMECACHE_SIZE; i++) {
+		nc_entries[i].nc_lrunext =
+			i+1 < NAMECACHE_SIZE ? &nc_entries[i+1] : NULL;
+		nc_entries[i].nc_lruprev = i > 0 ? &nc_entries[i-1] : NULL;
+	}
+	nc_lruhead = &nc_entries[0];
+	nc_lrutail = &nc_entries[NAMECACHE_SIZE-1];
+	nc_ready = true;
+}
+
+static
+unsigned
+nc_hash(struct vnode *dir, const char *name)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*name != 0) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	hash ^= (uint32_t)(uintptr_t)dir >> 4;
+	return hash % NAMECACHE_BUCKETS;
+}
+
+static
+void
+nc_lru_remove(struct ncentry *nc)
+{
+	if (nc->nc_lruprev != NULL) {
+		nc->nc_lruprev->nc_lrunext = nc->nc_lrunext;
+	}
+	else {
+		nc_lruhead = nc->nc_lrunext;
+	}
+	if (nc->nc_lrunext != NULL) {
+		nc->nc_lrunext->nc_lruprev = nc->nc_lruprev;
+	}
+	else {
+		nc_lrutail = nc->nc_lruprev;
+	}
+}
+
+static
+void
+nc_lru_addhead(struct ncentry *nc)
+{
+	nc->nc_lruprev = NULL;
+	nc->nc_lrunext = nc_lruhead;
+	if (nc_lruhead != NULL) {
+		nc_lruhead->nc_lruprev = nc;
+	}
+	else {
+		nc_lrutail = nc;
+	}
+	nc_lruhead = nc;
+}
+
+static
+void
+nc_lru_addtail(struct ncentry *nc)
+{
+	nc->nc_lrunext = NULL;
+	nc->nc_lruprev = nc_lrutail;
+	if (nc_lrutail != NULL) {
+		nc_lrutail->nc_lrunext = nc;
+	}
+	else {
+		nc_lruhead = nc;
+	}
+	nc_lrutail = nc;
+}
+
+static
+struct ncentry *
+nc_find(struct vnode *dir, const char *name)
+{
+	struct ncentry *nc;
+
+	for (nc = nc_buckets[nc_hash(dir, name)]; nc != NULL;
+	     nc = nc->nc_hashnext) {
+		if (nc->nc_dir == dir && !strcmp(nc->nc_name, name)) {
+			return nc;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take an entry out of its hash chain and put it at the cold end of
+ * the LRU list for reuse.
+ */
+static
+void
+nc_free(struct ncentry *nc)
+{
+	KASSERT(nc->nc_dir != NULL);
+
+	if (nc->nc_hashprev != NULL) {
+		nc->nc_hashprev->nc_hashnext = nc->nc_hashnext;
+	}
+	else {
+		nc_buckets[nc_hash(nc->nc_dir, nc->nc_name)] = nc->nc_hashnext;
+	}
+	if (nc->nc_hashnext != NULL) {
+		nc->nc_hashnext->nc_hashprev = nc->nc_hashprev;
+	}
+
+	KASSERT(nc->nc_dir->vn_ncrefs > 0);
+	nc->nc_dir->vn_ncrefs--;
+	if (nc->nc_vn != NULL) {
+		KASSERT(nc->nc_vn->vn_ncrefs > 0);
+		nc->nc_vn->vn_ncrefs--;
+	}
+	nc->nc_dir = NULL;
+	nc->nc_vn = NULL;
+
+	nc_lru_remove(nc);
+	nc_lru_addtail(nc);
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+bool
+namecache_lookup(struct vnode *dir, const char *name, struct vnode **ret)
+{
+	struct ncentry *nc;
+
+	spinlock_acquire(&nc_lock);
+	if (!nc_ready || dir->vn_ncrefs == 0) {
+		nc_misses++;
+		spinlock_release(&nc_lock);
+		return false;
+	}
+	nc = nc_find(dir, name);
+	if (nc == NULL) {
+		nc_misses++;
+		spinlock_release(&nc_lock);
+		return false;
+	}
+
+	if (nc->nc_vn != NULL) {
+		/* Safe: reclaim purges before checking the refcount */
+		VOP_INCREF(nc->nc_vn);
+		nc_hits++;
+	}
+	else {
+		nc_neghits++;
+	}
+	*ret = nc->nc_vn;
+
+	nc_lru_remove(nc);
+	nc_lru_addhead(nc);
+	spinlock_release(&nc_lock);
+	return true;
+}
+
+unsigned
+namecache_seq(void)
+{
+	unsigned seq;
+
+	spinlock_acquire(&nc_lock);
+	seq = nc_seq;
+	spinlock_release(&nc_lock);
+	return seq;
+}
+
+void
+namecache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		unsigned seq)
+{
+	struct ncentry *nc;
+	unsigned bucket;
+
+	if (strlen(name) >= NAMECACHE_NAMELEN ||
+	    !strcmp(name, ".") || !strcmp(name, "..")) {
+		return;
+	}
+
+	spinlock_acquire(&nc_lock);
+	if (!nc_ready) {
+		nc_init();
+	}
+	if (seq != nc_seq) {
+		/* something may have changed since the lookup */
+		spinlock_release(&nc_lock);
+		return;
+	}
+
+	nc = nc_find(dir, name);
+	if (nc != NULL) {
+		/* raced with another lookup of the same name */
+		spinlock_release(&nc_lock);
+		return;
+	}
+
+	/* Recycle the least recently used entry. */
+	nc = nc_lrutail;
+	if (nc->nc_dir != NULL) {
+		nc_free(nc);
+	}
+
+	nc->nc_dir = dir;
+	nc->nc_vn = vn;
+	strcpy(nc->nc_name, name);
+	dir->vn_ncrefs++;
+	if (vn != NULL) {
+		vn->vn_ncrefs++;
+	}
+
+	bucket = nc_hash(dir, name);
+	nc->nc_hashprev = NULL;
+	nc->nc_hashnext = nc_buckets[bucket];
+	if (nc->nc_hashnext != NULL) {
+		nc->nc_hashnext->nc_hashprev = nc;
+	}
+	nc_buckets[bucket] = nc;
+
+	nc_lru_remove(nc);
+	nc_lru_addhead(nc);
+	nc_enters++;
+	spinlock_release(&nc_lock);
+}
+
+void
+namecache_remove(struct vnode *dir, const char *name)
+{
+	struct ncentry *nc;
+
+	spinlock_acquire(&nc_lock);
+	/* Always bump the sequence number so lookups in flight notice. */
+	nc_seq++;
+	if (nc_ready && dir->vn_ncrefs > 0) {
+		nc = nc_find(dir, name);
+		if (nc != NULL) {
+			nc_free(nc);
+			nc_removes++;
+		}
+	}
+	spinlock_release(&nc_lock);
+}
+
+void
+namecache_purge(struct vnode *vn)
+{
+	unsigned i;
+
+	spinlock_acquire(&nc_lock);
+	nc_seq++;
+	if (vn->vn_ncrefs > 0) {
+		for (i=0; i<NAMECACHE_SIZE && vn->vn_ncrefs > 0; i++) {
+			if (nc_entries[i].nc_dir == vn ||
+			    (nc_entries[i].nc_dir != NULL &&
+			     nc_entries[i].nc_vn == vn)) {
+				nc_free(&nc_entries[i]);
+				nc_purges++;
+			}
+		}
+	}
+	KASSERT(vn->vn_ncrefs == 0);
+	spinlock_release(&nc_lock);
+}
+
+void
+namecache_printstats(void)
+{
+	unsigned hits, neghits, misses, enters, removes, purges;
+
+	spinlock_acquire(&nc_lock);
+	hits = nc_hits;
+	neghits = nc_neghits;
+	misses = nc_misses;
+	enters = nc_enters;
+	removes = nc_removes;
+	purges = nc_purges;
+	spinlock_release(&nc_lock);
+
+	kprintf("namecache: %u entries, %u hits, %u negative hits, "
+		"%u misses\n", NAMECACHE_SIZE, hits, neghits, misses);
+	kprintf("namecache: %u entered, %u removed, %u purged\n",
+		enters, removes, purges);
+}
@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * RAM disk device, "rdN:". It behaves like a disk (fixed-size sectors,
+ * sector-aligned I/O, a raw device "rdNraw:" for mksfs, mountable as
+ * SFS) but has no seek or rotation time, so measurements on it show
+ * the CPU cost of the file system and buffer cache by themselves.
+ *
+ * The disk is a table of separately allocated pages, so it doesn't
+ * need contiguous memory. Contents are lost at shutdown.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <vm.h>
+#include <vfs.h>
+#include <device.h>
+
+/* Our sector size */
+#define RD_SECTSIZE  512
+
+/* Sectors per page of storage */
+#define RD_SECTPERPAGE  (PAGE_SIZE / RD_SECTSIZE)
+
+/* Largest size accepted, so the size arithmetic can't overflow */
+#define RD_MAXKBYTES  (1024*1024)
+
+struct ramdisk {
+	struct device rd_dev;		/* VFS device structure */
+	char rd_name[16];		/* rdN */
+	unsigned rd_npages;		/* size of rd_pages */
+	vaddr_t *rd_pages;		/* storage */
+};
+
+/* Number of RAM disks made so far, for naming */
+static unsigned ramdisk_count;
+
+/* For open() */
+static
+int
+rd_eachopen(struct device *d, int openflags)
+{
+	(void)d;
+	(void)openflags;
+
+	return 0;
+}
+
+/* For d_io() */
+static
+int
+rd_io(struct device *d, struct uio *uio)
+{
+	struct ramdisk *rd = d->d_data;
+	uint32_t sector = uio->uio_offset / RD_SECTSIZE;
+	uint32_t sectoff = uio->uio_offset % RD_SECTSIZE;
+	uint32_t len = uio->uio_resid / RD_SECTSIZE;
+	uint32_t lenoff = uio->uio_resid % RD_SECTSIZE;
+	size_t pageoff, amount;
+	unsigned page;
+	off_t pos;
+	int result;
+
+	/* Same rules as a real disk. */
+	if (sectoff != 0 || lenoff != 0) {
+		return EINVAL;
+	}
+	if (uio->uio_offset < 0 || sector + len > d->d_blocks ||
+	    sector + len < sector) {
+		return EINVAL;
+	}
+
+	/* Copy a page's worth at a time. */
+	while (uio->uio_resid > 0) {
+		pos = uio->uio_offset;
+		page = pos / PAGE_SIZE;
+		pageoff = pos % PAGE_SIZE;
+		amount = PAGE_SIZE - pageoff;
+		if (amount > uio->uio_resid) {
+			amount = uio->uio_resid;
+		}
+		KASSERT(page < rd->rd_npages);
+
+		result = uiomove((char *)rd->rd_pages[page] + pageoff,
+				 amount, uio);
+		if (result) {
+			return result;
+		}
+	}
+
+	return 0;
+}
+
+/* For ioctl() */
+static
+int
+rd_ioctl(struct device *d, int op, userptr_t data)
+{
+	/*
+	 * No ioctls.
+	 */
+
+	(void)d;
+	(void)op;
+	(void)data;
+
+	return EIOCTL;
+}
+
+static const struct device_ops rd_devops = {
+	.devop_eachopen = rd_eachopen,
+	.devop_io = rd_io,
+	.devop_ioctl = rd_ioctl,
+};
+
+/*
+ * Free a RAM disk and whatever storage it has so far (on failure to
+ * set it up).
+ */
+static
+void
+ramdisk_destroy(struct ramdisk *rd)
+{
+	unsigned i;
+
+	if (rd->rd_pages != NULL) {
+		for (i=0; i<rd->rd_npages; i++) {
+			if (rd->rd_pages[i] != 0) {
+				free_kpages(rd->rd_pages[i]);
+			}
+		}
+		kfree(rd->rd_pages);
+	}
+	kfree(rd);
+}
+
+/*
+ * Create and attach a new zero-filled RAM disk of KBYTES kilobytes
+ * (rounded up to whole pages). It gets the next free name rdN.
+ */
+int
+ramdisk_create(unsigned kbytes)
+{
+	struct ramdisk *rd;
+	unsigned i;
+	int result;
+
+	if (kbytes == 0 || kbytes > RD_MAXKBYTES) {
+		return EINVAL;
+	}
+
+	rd = kmalloc(sizeof(*rd));
+	if (rd == NULL) {
+		return ENOMEM;
+	}
+	rd->rd_npages = DIVROUNDUP(kbytes * 1024, PAGE_SIZE);
+	rd->rd_pages = kmalloc(rd->rd_npages * sizeof(vaddr_t));
+	if (rd->rd_pages == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	for (i=0; i<rd->rd_npages; i++) {
+		rd->rd_pages[i] = 0;
+	}
+	for (i=0; i<rd->rd_npages; i++) {
+		rd->rd_pages[i] = alloc_kpages(1);
+		if (rd->rd_pages[i] == 0) {
+			result = ENOMEM;
+			goto fail;
+		}
+		bzero((void *)rd->rd_pages[i], PAGE_SIZE);
+	}
+
+	snprintf(rd->rd_name, sizeof(rd->rd_name), "rd%u", ramdisk_count);
+
+	rd->rd_dev.d_ops = &rd_devops;
+	rd->rd_dev.d_blocks = rd->rd_npages * RD_SECTPERPAGE;
+	rd->rd_dev.d_blocksize = RD_SECTSIZE;
+	rd->rd_dev.d_devnumber = 0; /* assigned by vfs_adddev */
+	rd->rd_dev.d_data = rd;
+
+	result = vfs_adddev(rd->rd_name, &rd->rd_dev, 1);
+	if (result) {
+		goto fail;
+	}
+	ramdisk_count++;
+
+	kprintf("%s: %u KB RAM disk\n", rd->rd_name,
+		rd->rd_npages * PAGE_SIZE / 1024);
+	return 0;
+
+ fail:
+	/* frees the pages as well as the page table */
+	ramdisk_destroy(rd);
+	return result;
+}
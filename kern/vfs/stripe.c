@@ -0,0 +1,498 @@
+/*
+ * Copyright (c) 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Striped (RAID-0) pseudo-device, "stN:". It spreads its blocks over
+ * several member disks a stripe unit at a time: unit 0 on the first
+ * member, unit 1 on the second, and so on around. Transfers that
+ * cover more than one unit are split up and the pieces for different
+ * members are done at the same time, one worker thread per member,
+ * so sequential I/O runs at up to the members' combined speed.
+ *
+ * The members are claimed with vfs_claimdev so nothing else can mount
+ * them. The layout isn't recorded anywhere; a stripe set has to be
+ * put back together with the same members in the same order and the
+ * same stripe unit to read the data again.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <thread.h>
+#include <vfs.h>
+#include <device.h>
+
+/* Most members per stripe set */
+#define STRIPE_MAXMEMBERS  8
+
+/* Largest piece of a transfer we stage at once */
+#define STRIPE_MAXIO       (64*1024)
+
+/* Largest stripe unit, in kilobytes */
+#define STRIPE_MAXUNITKB   1024
+
+struct stripe_req;
+struct stripe_member;
+
+/*
+ * The part of a transfer that goes to one member, within one unit.
+ */
+struct stripe_chunk {
+	struct stripe_chunk *sc_next;	/* on member queue */
+	struct stripe_req *sc_req;	/* transfer we're part of */
+	struct stripe_member *sc_member; /* member it goes to */
+	void *sc_data;			/* kernel buffer */
+	off_t sc_offset;		/* position on the member */
+	size_t sc_len;
+};
+
+/*
+ * A transfer in progress.
+ */
+struct stripe_req {
+	enum uio_rw sr_rw;
+	unsigned sr_pending;		/* chunks not yet done */
+	int sr_result;			/* first error, if any */
+};
+
+struct stripe_member {
+	char *sm_name;			/* device name */
+	struct device *sm_dev;
+	struct stripe_chunk *sm_head;	/* queue for the worker */
+	struct stripe_chunk *sm_tail;
+	struct cv *sm_cv;		/* worker waits here */
+};
+
+struct stripe {
+	struct device st_dev;		/* VFS device structure */
+	char st_name[16];		/* stN */
+	size_t st_unit;			/* stripe unit, in bytes */
+	unsigned st_nmembers;
+	struct stripe_member st_members[STRIPE_MAXMEMBERS];
+	struct lock *st_lock;		/* protects queues and requests */
+	struct cv *st_donecv;		/* requesters wait here */
+	unsigned st_nworkers;		/* worker threads running */
+	bool st_dying;			/* workers should exit */
+};
+
+/* Number of stripe sets made so far, for naming */
+static unsigned stripe_count;
+
+/*
+ * Worker thread for one member: do its chunks in order. Exits when
+ * st_dying is set and its queue is empty.
+ */
+static
+void
+stripe_thread(void *vst, unsigned long index)
+{
+	struct stripe *st = vst;
+	struct stripe_member *sm = &st->st_members[index];
+	struct stripe_chunk *sc;
+	struct stripe_req *sr;
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	lock_acquire(st->st_lock);
+	while (1) {
+		while (sm->sm_head == NULL && !st->st_dying) {
+			cv_wait(sm->sm_cv, st->st_lock);
+		}
+		if (sm->sm_head == NULL) {
+			break;
+		}
+		sc = sm->sm_head;
+		sm->sm_head = sc->sc_next;
+		if (sm->sm_head == NULL) {
+			sm->sm_tail = NULL;
+		}
+		sr = sc->sc_req;
+		lock_release(st->st_lock);
+
+		uio_kinit(&iov, &ku, sc->sc_data, sc->sc_len, sc->sc_offset,
+			  sr->sr_rw);
+		result = DEVOP_IO(sm->sm_dev, &ku);
+
+		lock_acquire(st->st_lock);
+		if (result && sr->sr_result == 0) {
+			sr->sr_result = result;
+		}
+		KASSERT(sr->sr_pending > 0);
+		sr->sr_pending--;
+		if (sr->sr_pending == 0) {
+			cv_broadcast(st->st_donecv, st->st_lock);
+		}
+	}
+	KASSERT(st->st_nworkers > 0);
+	st->st_nworkers--;
+	cv_broadcast(st->st_donecv, st->st_lock);
+	lock_release(st->st_lock);
+}
+
+/*
+ * Transfer LEN bytes at POS on the stripe set to or from the kernel
+ * buffer DATA, using CHUNKS (big enough for the worst case) to hand
+ * out the pieces.
+ */
+static
+int
+stripe_transfer(struct stripe *st, void *data, off_t pos, size_t len,
+		enum uio_rw rw, struct stripe_chunk *chunks)
+{
+	struct stripe_req sr;
+	struct stripe_member *sm;
+	struct stripe_chunk *sc;
+	size_t done, amount, inunit;
+	uint64_t unitno;
+	unsigned i, nchunks;
+
+	sr.sr_rw = rw;
+	sr.sr_result = 0;
+
+	/* Cut it up at unit boundaries. */
+	nchunks = 0;
+	for (done = 0; done < len; done += amount) {
+		unitno = (pos + done) / st->st_unit;
+		inunit = (pos + done) % st->st_unit;
+		amount = st->st_unit - inunit;
+		if (amount > len - done) {
+			amount = len - done;
+		}
+
+		sc = &chunks[nchunks++];
+		sc->sc_next = NULL;
+		sc->sc_req = &sr;
+		sc->sc_member = &st->st_members[unitno % st->st_nmembers];
+		sc->sc_data = (char *)data + done;
+		sc->sc_offset = (unitno / st->st_nmembers) * st->st_unit
+			+ inunit;
+		sc->sc_len = amount;
+	}
+	sr.sr_pending = nchunks;
+
+	/* Hand the pieces out and wait for them all. */
+	lock_acquire(st->st_lock);
+	for (i=0; i<nchunks; i++) {
+		sc = &chunks[i];
+		sm = sc->sc_member;
+		if (sm->sm_tail == NULL) {
+			sm->sm_head = sm->sm_tail = sc;
+		}
+		else {
+			sm->sm_tail->sc_next = sc;
+			sm->sm_tail = sc;
+		}
+		cv_signal(sm->sm_cv, st->st_lock);
+	}
+	while (sr.sr_pending > 0) {
+		cv_wait(st->st_donecv, st->st_lock);
+	}
+	lock_release(st->st_lock);
+
+	return sr.sr_result;
+}
+
+/* For open() */
+static
+int
+stripe_eachopen(struct device *d, int openflags)
+{
+	(void)d;
+	(void)openflags;
+
+	return 0;
+}
+
+/* For d_io() */
+static
+int
+stripe_io(struct device *d, struct uio *uio)
+{
+	struct stripe *st = d->d_data;
+	struct stripe_chunk *chunks;
+	size_t amount, maxamount;
+	char *bounce;
+	off_t pos;
+	int result;
+
+	/* Same rules as a real disk. */
+	if (uio->uio_offset % d->d_blocksize != 0 ||
+	    uio->uio_resid % d->d_blocksize != 0) {
+		return EINVAL;
+	}
+	if (uio->uio_offset < 0 ||
+	    uio->uio_offset + uio->uio_resid >
+	    (off_t)d->d_blocks * d->d_blocksize) {
+		return EINVAL;
+	}
+	if (uio->uio_resid == 0) {
+		return 0;
+	}
+
+	/*
+	 * Stage the data in a kernel buffer so the workers can get at
+	 * it no matter where it came from.
+	 */
+	maxamount = uio->uio_resid < STRIPE_MAXIO ?
+		uio->uio_resid : STRIPE_MAXIO;
+	bounce = kmalloc(maxamount);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+	chunks = kmalloc((maxamount / st->st_unit + 2) * sizeof(*chunks));
+	if (chunks == NULL) {
+		kfree(bounce);
+		return ENOMEM;
+	}
+
+	result = 0;
+	while (uio->uio_resid > 0) {
+		pos = uio->uio_offset;
+		amount = uio->uio_resid < maxamount ?
+			uio->uio_resid : maxamount;
+
+		if (uio->uio_rw == UIO_WRITE) {
+			result = uiomove(bounce, amount, uio);
+			if (result) {
+				break;
+			}
+		}
+		result = stripe_transfer(st, bounce, pos, amount,
+					 uio->uio_rw, chunks);
+		if (result) {
+			break;
+		}
+		if (uio->uio_rw == UIO_READ) {
+			result = uiomove(bounce, amount, uio);
+			if (result) {
+				break;
+			}
+		}
+	}
+
+	kfree(chunks);
+	kfree(bounce);
+	return result;
+}
+
+/* For ioctl() */
+static
+int
+stripe_ioctl(struct device *d, int op, userptr_t data)
+{
+	/*
+	 * No ioctls.
+	 */
+
+	(void)d;
+	(void)op;
+	(void)data;
+
+	return EIOCTL;
+}
+
+static const struct device_ops stripe_devops = {
+	.devop_eachopen = stripe_eachopen,
+	.devop_io = stripe_io,
+	.devop_ioctl = stripe_ioctl,
+};
+
+/*
+ * Stop the worker threads, and wait until they're gone.
+ */
+static
+void
+stripe_stopworkers(struct stripe *st)
+{
+	unsigned i;
+
+	lock_acquire(st->st_lock);
+	st->st_dying = true;
+	for (i=0; i<st->st_nmembers; i++) {
+		cv_broadcast(st->st_members[i].sm_cv, st->st_lock);
+	}
+	while (st->st_nworkers > 0) {
+		cv_wait(st->st_donecv, st->st_lock);
+	}
+	lock_release(st->st_lock);
+}
+
+/*
+ * Stop the workers, release the members, and free everything (on
+ * failure to set up).
+ */
+static
+void
+stripe_destroy(struct stripe *st)
+{
+	struct stripe_member *sm;
+	unsigned i;
+
+	if (st->st_nworkers > 0) {
+		stripe_stopworkers(st);
+	}
+	for (i=0; i<st->st_nmembers; i++) {
+		sm = &st->st_members[i];
+		if (sm->sm_cv != NULL) {
+			cv_destroy(sm->sm_cv);
+		}
+		if (sm->sm_dev != NULL) {
+			vfs_releasedev(sm->sm_name);
+		}
+		kfree(sm->sm_name);
+	}
+	if (st->st_donecv != NULL) {
+		cv_destroy(st->st_donecv);
+	}
+	if (st->st_lock != NULL) {
+		lock_destroy(st->st_lock);
+	}
+	kfree(st);
+}
+
+/*
+ * Make a stripe set stN from the NMEMBERS devices named in MEMBERS,
+ * with a stripe unit of UNITKB kilobytes.
+ */
+int
+stripe_create(unsigned unitkb, unsigned nmembers, char **members)
+{
+	struct stripe *st;
+	struct stripe_member *sm;
+	uint32_t blocksize, blocks;
+	unsigned i;
+	int result;
+
+	if (nmembers < 2 || nmembers > STRIPE_MAXMEMBERS || unitkb == 0 ||
+	    unitkb > STRIPE_MAXUNITKB) {
+		return EINVAL;
+	}
+
+	st = kmalloc(sizeof(*st));
+	if (st == NULL) {
+		return ENOMEM;
+	}
+	st->st_unit = unitkb * 1024;
+	st->st_nmembers = 0;
+	st->st_lock = NULL;
+	st->st_donecv = NULL;
+	st->st_nworkers = 0;
+	st->st_dying = false;
+
+	blocksize = 0;
+	blocks = 0;
+	for (i=0; i<nmembers; i++) {
+		sm = &st->st_members[i];
+		sm->sm_dev = NULL;
+		sm->sm_head = sm->sm_tail = NULL;
+		sm->sm_cv = NULL;
+		sm->sm_name = kstrdup(members[i]);
+		if (sm->sm_name == NULL) {
+			result = ENOMEM;
+			goto fail;
+		}
+		st->st_nmembers++;
+
+		result = vfs_claimdev(sm->sm_name, &sm->sm_dev);
+		if (result) {
+			sm->sm_dev = NULL;
+			goto fail;
+		}
+		if (i == 0) {
+			blocksize = sm->sm_dev->d_blocksize;
+			blocks = sm->sm_dev->d_blocks;
+		}
+		else if (sm->sm_dev->d_blocksize != blocksize) {
+			result = EINVAL;
+			goto fail;
+		}
+		else if (sm->sm_dev->d_blocks < blocks) {
+			blocks = sm->sm_dev->d_blocks;
+		}
+
+		sm->sm_cv = cv_create(sm->sm_name);
+		if (sm->sm_cv == NULL) {
+			result = ENOMEM;
+			goto fail;
+		}
+	}
+	if (st->st_unit % blocksize != 0) {
+		result = EINVAL;
+		goto fail;
+	}
+
+	st->st_lock = lock_create("stripe");
+	if (st->st_lock == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	st->st_donecv = cv_create("stripe");
+	if (st->st_donecv == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+
+	/* Use whole stripes of the smallest member. */
+	blocks -= blocks % (st->st_unit / blocksize);
+
+	snprintf(st->st_name, sizeof(st->st_name), "st%u", stripe_count);
+	st->st_dev.d_ops = &stripe_devops;
+	st->st_dev.d_blocks = blocks * nmembers;
+	st->st_dev.d_blocksize = blocksize;
+	st->st_dev.d_devnumber = 0; /* assigned by vfs_adddev */
+	st->st_dev.d_data = st;
+
+	for (i=0; i<nmembers; i++) {
+		result = thread_fork(st->st_name, NULL, stripe_thread, st, i);
+		if (result) {
+			goto fail;
+		}
+		lock_acquire(st->st_lock);
+		st->st_nworkers++;
+		lock_release(st->st_lock);
+	}
+
+	result = vfs_adddev(st->st_name, &st->st_dev, 1);
+	if (result) {
+		goto fail;
+	}
+	stripe_count++;
+
+	kprintf("%s: %u members, %zu KB stripe unit, %llu KB\n",
+		st->st_name, nmembers, st->st_unit / 1024,
+		(unsigned long long)st->st_dev.d_blocks * blocksize / 1024);
+	return 0;
+
+ fail:
+	stripe_destroy(st);
+	return result;
+}
@@ -82,7 +82,10 @@ struct knowndev {
 	struct fs *kd_fs;
 };
 
-/* A placeholder for kd_fs for devices used as swap */
+/*
+ * A placeholder for kd_fs for devices used as swap, or claimed by a
+ * pseudo-device built on them (see vfs_claimdev)
+ */
 #define SWAP_FS	((struct fs *)-1)
 
 DECLARRAY(knowndev, static __UNUSED inline);
@@ -670,6 +673,85 @@ vfs_swapoff(const char *devname)
 	return result;
 }
 
+/*
+ * Claim a device for use underneath another (e.g. a stripe set), so
+ * it can't also be mounted or used for swap. Hands back the device.
+ *
+ * This is the version for a filesystem's mount or unmount function
+ * (e.g. for an external journal), which runs with knowndevs_lock
+ * already held; likewise vfs_releasedev_locked.
+ */
+int
+vfs_claimdev_locked(const char *devname, struct device **ret)
+{
+	struct knowndev *kd;
+	int result;
+
+	KASSERT(lock_do_i_hold(knowndevs_lock));
+
+	result = findmount(devname, &kd);
+	if (result) {
+		return result;
+	}
+
+	if (kd->kd_fs != NULL) {
+		return EBUSY;
+	}
+	KASSERT(kd->kd_device != NULL);
+
+	kd->kd_fs = SWAP_FS;
+	*ret = kd->kd_device;
+	return 0;
+}
+
+/*
+ * Undo vfs_claimdev_locked.
+ */
+int
+vfs_releasedev_locked(const char *devname)
+{
+	struct knowndev *kd;
+	int result;
+
+	KASSERT(lock_do_i_hold(knowndevs_lock));
+
+	result = findmount(devname, &kd);
+	if (result) {
+		return result;
+	}
+
+	if (kd->kd_fs != SWAP_FS) {
+		return EINVAL;
+	}
+	kd->kd_fs = NULL;
+	return 0;
+}
+
+/*
+ * Same as above, for everyone else.
+ */
+int
+vfs_claimdev(const char *devname, struct device **ret)
+{
+	int result;
+
+	lock_acquire(knowndevs_lock);
+	result = vfs_claimdev_locked(devname, ret);
+	lock_release(knowndevs_lock);
+	return result;
+}
+
+int
+vfs_releasedev(const char *devname)
+{
+	int result;
+
+	lock_acquire(knowndevs_lock);
+	result = vfs_releasedev_locked(devname);
+	lock_release(knowndevs_lock);
+	return result;
+}
+
 /*
  * Global unmount function.
  */
@@ -35,6 +35,7 @@
 #include <lib.h>
 #include <synch.h>
 #include <vfs.h>
+#include <uio.h>
 #include <vnode.h>
 
 /*
@@ -52,6 +53,7 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 	spinlock_init(&vn->vn_countlock);
 	vn->vn_fs = fs;
 	vn->vn_data = fsdata;
+	vn->vn_ncrefs = 0;
 	return 0;
 }
 
@@ -62,6 +64,8 @@ void
 vnode_cleanup(struct vnode *vn)
 {
 	KASSERT(vn->vn_refcount == 1);
+	/* The filesystem should have called namecache_purge */
+	KASSERT(vn->vn_ncrefs == 0);
 
 	spinlock_cleanup(&vn->vn_countlock);
 
@@ -122,6 +126,18 @@ vnode_decref(struct vnode *vn)
 	}
 }
 
+/*
+ * Generic vop_directio, for objects with no cache to bypass.
+ */
+int
+vnode_directio_passthru(struct vnode *vn, struct uio *uio)
+{
+	if (uio->uio_rw == UIO_READ) {
+		return VOP_READ(vn, uio);
+	}
+	return VOP_WRITE(vn, uio);
+}
+
 /*
  * Check for various things being valid.
  * Called before all VOP_* calls.
@@ -73,6 +73,11 @@ static bool dofiles, dodirs;
 static bool doindirect;
 static bool recurse;
 
+/* External journal device, if the superblock names one */
+static bool jexternal;
+static char jdevname[SFS_VOLNAME_SIZE];
+static uint32_t jdevid;
+
 ////////////////////////////////////////////////////////////
 // printouts
 
@@ -203,9 +208,69 @@ readsb(void)
 	if (SWAP32(sb.sb_magic) != SFS_MAGIC) {
 		errx(1, "Not an sfs filesystem");
 	}
+	if (sb.sb_jdevname[0] != 0) {
+		jexternal = true;
+		memcpy(jdevname, sb.sb_jdevname, sizeof(jdevname));
+		jdevname[sizeof(jdevname)-1] = 0;
+		jdevid = SWAP32(sb.sb_jdevid);
+	}
 	return SWAP32(sb.sb_nblocks);
 }
 
+/*
+ * Open the external journal device, if there is one, and check
+ * that it belongs to this volume.
+ */
+static
+void
+openjournal(const char *path)
+{
+	struct sfs_superblock sb;
+	struct sfs_jdevheader jd;
+	char pathbuf[SFS_VOLNAME_SIZE + 8];
+
+	if (!jexternal) {
+		return;
+	}
+	if (path == NULL) {
+		snprintf(pathbuf, sizeof(pathbuf), "%sraw:", jdevname);
+		path = pathbuf;
+	}
+	openjdisk(path);
+
+	diskread(&sb, SFS_SUPER_BLOCK);
+	jdiskread(&jd, SFS_JDEV_HEADER);
+	jd.jd_volname[sizeof(jd.jd_volname)-1] = 0;
+	sb.sb_volname[sizeof(sb.sb_volname)-1] = 0;
+	if (SWAP32(jd.jd_magic) != SFS_JDEV_MAGIC) {
+		errx(1, "%s: Not an sfs journal device", path);
+	}
+	if (SWAP32(jd.jd_devid) != jdevid ||
+	    strcmp(jd.jd_volname, sb.sb_volname) != 0) {
+		errx(1, "%s: Journal belongs to volume %s, not this one",
+		     path, jd.jd_volname);
+	}
+	if (SWAP32(jd.jd_journalblocks) != SWAP32(sb.sb_journalblocks) ||
+	    SFS_JDEV_START + SWAP32(jd.jd_journalblocks) > jdiskblocks()) {
+		errx(1, "%s: Journal size mismatch", path);
+	}
+}
+
+/*
+ * Read a journal block, wherever the journal is.
+ */
+static
+void
+readjournalblock(void *buf, uint32_t jstart, uint32_t block)
+{
+	if (jexternal) {
+		jdiskread(buf, SFS_JDEV_START + block);
+	}
+	else {
+		diskread(buf, jstart + block);
+	}
+}
+
 static
 void
 dumpsb(void)
@@ -226,6 +291,25 @@ dumpsb(void)
 	dumpvalf("Journal start", "%u", SWAP32(sb.sb_journalstart));
 	dumpvalf("Journal size", "%u blocks", SWAP32(sb.sb_journalblocks));
 	dumplval("Volume name", sb.sb_volname);
+	dumpvalf("Features", "0x%x%s", SWAP32(sb.sb_features),
+		 (SWAP32(sb.sb_features) & SFS_FEATURE_INLINE) ?
+		 " (inline)" : "");
+	if (jexternal) {
+		dumplval("Journal device", jdevname);
+		dumpvalf("Journal device id", "0x%08x", jdevid);
+	}
+	if (SWAP32(sb.sb_jhintmagic) == SFS_JHINT_MAGIC) {
+		dumpvalf("Journal head hint", "block %u, lsn %llu",
+			 SWAP32(sb.sb_jhinthead),
+			 (unsigned long long)SWAP64(sb.sb_jhintheadlsn));
+		dumpvalf("Journal tail hint", "block %u, lsn %llu",
+			 SWAP32(sb.sb_jhinttail),
+			 (unsigned long long)SWAP64(sb.sb_jhinttaillsn));
+	}
+	else if (sb.sb_jhintmagic != 0) {
+		dumpvalf("Journal hint magic", "0x%x (invalid)",
+			 SWAP32(sb.sb_jhintmagic));
+	}
 
 	for (i=0; i<ARRAYCOUNT(sb.reserved); i++) {
 		if (sb.reserved[i] != 0) {
@@ -418,7 +502,7 @@ findlsn(const uint64_t *firstlsns, uint32_t jstart, uint32_t jblocks,
 
  found:
 
-	diskread(buf, jstart + block);
+	readjournalblock(buf, jstart, block);
 	offset = 0;
 	while (offset + sizeof(jh) <= SFS_BLOCKSIZE) {
 		memcpy(&jh, buf + offset, sizeof(jh));
@@ -472,7 +556,8 @@ dumpjournal(void)
 	jstart = SWAP32(sb.sb_journalstart);
 	jblocks = SWAP32(sb.sb_journalblocks);
 
-	printf("Journal (%u blocks at %u)\n", jblocks, jstart);
+	printf("Journal (%u blocks at %u%s)\n", jblocks, jstart,
+	       jexternal ? ", external" : "");
 	printf("--------------------------------\n");
 
 	/*
@@ -495,7 +580,7 @@ dumpjournal(void)
 	firstlsns = malloc(jblocks * sizeof(firstlsns[0]));
 
 	for (block=0; block<jblocks; block++) {
-		diskread(buf, jstart + block);
+		readjournalblock(buf, jstart, block);
 		offset = 0;
 		while (offset + sizeof(jh) <= SFS_BLOCKSIZE) {
 			assert(offset % sizeof(uint16_t) == 0);
@@ -630,7 +715,7 @@ dumpjournal(void)
 	myblock = tailblock;
 	myoffset = tailoffset;
 	mylsn = taillsn;
-	diskread(buf, jstart + myblock);
+	readjournalblock(buf, jstart, myblock);
 	while (mylsn < headlsn) {
 		while (myoffset + sizeof(jh) <= SFS_BLOCKSIZE) {
 			memcpy(&jh, buf + myoffset, sizeof(jh));
@@ -661,7 +746,7 @@ dumpjournal(void)
 		}
 		myblock = (myblock + 1) % jblocks;
 		myoffset = 0;
-		diskread(buf, jstart + myblock);
+		readjournalblock(buf, jstart, myblock);
 	}
 	printf("\n");
 }
@@ -694,11 +779,12 @@ dumpphysjournal(void)
 	jstart = SWAP32(sb.sb_journalstart);
 	jblocks = SWAP32(sb.sb_journalblocks);
 
-	printf("Physical journal (%u blocks at %u)\n", jblocks, jstart);
+	printf("Physical journal (%u blocks at %u%s)\n", jblocks, jstart,
+	       jexternal ? ", external" : "");
 	printf("----------------------------------------\n");
 
 	for (block=0; block<jblocks; block++) {
-		diskread(buf, jstart + block);
+		readjournalblock(buf, jstart, block);
 		offset = 0;
 		while (offset + sizeof(jh) <= SFS_BLOCKSIZE) {
 			slop = offset % sizeof(uint16_t);
@@ -761,6 +847,23 @@ dumpphysjournal(void)
 	}
 }
 
+static
+void
+dumpdirindex(uint32_t block)
+{
+	struct sfs_dirindex_header dh;
+
+	diskread(&dh, block);
+	if (SWAP32(dh.dh_magic) != SFS_DIRINDEX_MAGIC) {
+		printf("      Bad magic number 0x%x\n", SWAP32(dh.dh_magic));
+		return;
+	}
+	printf("      %u table blocks, %u entries, %u cells used, "
+	       "%u free slots noted\n",
+	       SWAP32(dh.dh_nblocks), SWAP32(dh.dh_count),
+	       SWAP32(dh.dh_used), SWAP32(dh.dh_nfree));
+}
+
 static
 void
 dumpindirect(uint32_t block, unsigned indirection)
@@ -937,23 +1040,19 @@ recursedir(uint32_t ino, const struct sfs_dinode *sfi)
 	printf("Done with directory %u\n", ino);
 }
 
+/*
+ * Hex dump LEN bytes of file data found at file offset POS.
+ */
 static
-void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
+void
+dumpfiledata(uint32_t pos, const uint8_t *data, unsigned len)
 {
-	uint8_t data[SFS_BLOCKSIZE];
-	unsigned i, j;
+	unsigned i, j, rowstart;
 	char tmp[128];
 
-	if (diskblock == 0) {
-		printf("    0x%6x  [sparse]\n", fileblock * SFS_BLOCKSIZE);
-		return;
-	}
-
-	diskread(data, diskblock);
-	for (i=0; i<SFS_BLOCKSIZE; i++) {
+	for (i=0; i<len; i++) {
 		if (i % 16 == 0) {
-			snprintf(tmp, sizeof(tmp), "0x%x",
-				 fileblock * SFS_BLOCKSIZE + i);
+			snprintf(tmp, sizeof(tmp), "0x%x", pos + i);
 			printf("%8s", tmp);
 		}
 		if (i % 8 == 0) {
@@ -963,9 +1062,14 @@ void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
 			printf(" ");
 		}
 		printf("%02x", data[i]);
-		if (i % 16 == 15) {
+		if (i % 16 == 15 || i == len - 1) {
+			/* line up the text of a short last row */
+			for (j = i % 16 + 1; j < 16; j++) {
+				printf(j % 8 == 0 ? "    " : "   ");
+			}
 			printf("  ");
-			for (j = i-15; j<=i; j++) {
+			rowstart = i - i % 16;
+			for (j = rowstart; j<=i; j++) {
 				if (data[j] < 32 || data[j] > 126) {
 					putchar('.');
 				}
@@ -978,14 +1082,75 @@ void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
 	}
 }
 
+static
+void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
+{
+	uint8_t data[SFS_BLOCKSIZE];
+
+	if (diskblock == 0) {
+		printf("    0x%6x  [sparse]\n", fileblock * SFS_BLOCKSIZE);
+		return;
+	}
+
+	diskread(data, diskblock);
+	dumpfiledata(fileblock * SFS_BLOCKSIZE, data, SFS_BLOCKSIZE);
+}
+
 static
 void
 dumpfile(uint32_t ino, const struct sfs_dinode *sfi)
 {
+	uint32_t size;
+
 	printf("File contents for inode %u:\n", ino);
+	if (SWAP32(sfi->sfi_flags) & SFS_DINODE_INLINE) {
+		size = SWAP32(sfi->sfi_size);
+		if (size > SFS_INLINE_SIZE) {
+			size = SFS_INLINE_SIZE;
+		}
+		dumpfiledata(0, (const uint8_t *)sfi->sfi_inline, size);
+		return;
+	}
 	traverse(sfi, dumpfileblock);
 }
 
+/*
+ * Count the runs of consecutive disk blocks in a file, as a measure
+ * of how fragmented it is. Holes don't count as blocks and end the
+ * current run.
+ */
+static uint32_t extent_prev;
+static uint32_t extent_count, extent_blocks;
+static uint32_t total_files, total_extents, total_blocks;
+
+static
+void
+countextentblock(uint32_t fileblock, uint32_t diskblock)
+{
+	(void)fileblock;
+
+	if (diskblock != 0) {
+		if (extent_prev == 0 || diskblock != extent_prev + 1) {
+			extent_count++;
+		}
+		extent_blocks++;
+	}
+	extent_prev = diskblock;
+}
+
+static
+void
+countextents(const struct sfs_dinode *sfi)
+{
+	extent_prev = 0;
+	extent_count = extent_blocks = 0;
+	traverse(sfi, countextentblock);
+
+	total_files++;
+	total_extents += extent_count;
+	total_blocks += extent_blocks;
+}
+
 static
 void
 dumpinode(uint32_t ino, const char *name)
@@ -1012,6 +1177,8 @@ dumpinode(uint32_t ino, const char *name)
 	dumpvalf("Type", "%u (%s)", SWAP16(sfi.sfi_type), typename);
 	dumpvalf("Size", "%u", SWAP32(sfi.sfi_size));
 	dumpvalf("Link count", "%u", SWAP16(sfi.sfi_linkcount));
+	countextents(&sfi);
+	dumpvalf("Extents", "%u for %u blocks", extent_count, extent_blocks);
 	printf("\n");
 
         printf("    Direct blocks:\n");
@@ -1043,11 +1210,19 @@ dumpinode(uint32_t ino, const char *name)
 	       SWAP32(sfi.sfi_dindirect), SWAP32(sfi.sfi_dindirect));
 	printf("    Triple indirect block: %u (0x%x)\n",
 	       SWAP32(sfi.sfi_tindirect), SWAP32(sfi.sfi_tindirect));
-	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
-		if (sfi.sfi_waste[i] != 0) {
-			printf("    Word %u in waste area: 0x%x\n",
-			       i, SWAP32(sfi.sfi_waste[i]));
-		}
+	if (sfi.sfi_dirindex != 0) {
+		printf("    Directory index: %u (0x%x)\n",
+		       SWAP32(sfi.sfi_dirindex), SWAP32(sfi.sfi_dirindex));
+		dumpdirindex(SWAP32(sfi.sfi_dirindex));
+	}
+	if (sfi.sfi_flags != 0) {
+		printf("    Flags: 0x%x%s\n", SWAP32(sfi.sfi_flags),
+		       (SWAP32(sfi.sfi_flags) & SFS_DINODE_INLINE) ?
+		       " (inline data)" : "");
+	}
+	else if (!iszeroed((const uint8_t *)sfi.sfi_inline,
+			   sizeof(sfi.sfi_inline))) {
+		printf("    Inline data area not zeroed\n");
 	}
 
 	if (doindirect) {
@@ -1085,6 +1260,7 @@ usage(void)
 	warnx("   -d: dump directory contents");
 	warnx("   -r: recurse into directory contents");
 	warnx("   -a: equivalent to -sbdfr -i 1");
+	warnx("   -e path: external journal device (default from superblock)");
 	errx(1, "   Default is -i 1");
 }
 
@@ -1097,6 +1273,7 @@ main(int argc, char **argv)
 	bool dophysjournal = false;
 	uint32_t dumpino = 0;
 	const char *dumpdisk = NULL;
+	const char *jdevpath = NULL;
 
 	int i, j;
 	uint32_t nblocks;
@@ -1125,6 +1302,17 @@ main(int argc, char **argv)
 					}
 					/* XXX ugly */
 					goto nextarg;
+				    case 'e':
+					if (argv[i][j+1] == 0) {
+						if (i + 1 >= argc) {
+							usage();
+						}
+						jdevpath = argv[++i];
+					}
+					else {
+						jdevpath = argv[i]+j+1;
+					}
+					goto nextarg;
 				    case 'I': doindirect = true; break;
 				    case 'f': dofiles = true; break;
 				    case 'd': dodirs = true; break;
@@ -1166,6 +1354,9 @@ main(int argc, char **argv)
 
 	opendisk(dumpdisk);
 	nblocks = readsb();
+	if (dojournal || dophysjournal) {
+		openjournal(jdevpath);
+	}
 
 	if (dosb) {
 		dumpsb();
@@ -1181,8 +1372,19 @@ main(int argc, char **argv)
 	}
 	if (dumpino != 0) {
 		dumpinode(dumpino, NULL);
+		if (recurse && total_blocks > 0) {
+			printf("%u files: %u extents for %u blocks "
+			       "(%u.%02u blocks per extent)\n",
+			       total_files, total_extents, total_blocks,
+			       total_blocks / total_extents,
+			       (total_blocks % total_extents) * 100 /
+			       total_extents);
+		}
 	}
 
+	if (jexternal && (dojournal || dophysjournal)) {
+		closejdisk();
+	}
 	closedisk();
 
 	return 0;
@@ -47,38 +47,47 @@
 #define EINTR 0
 #endif
 
-static int fd=-1;
-static uint32_t nblocks;
+/*
+ * There's the disk, and optionally a second one holding its journal.
+ */
+struct disk {
+	int fd;
+	uint32_t nblocks;
+};
+
+static struct disk maindisk = { -1, 0 };
+static struct disk jdisk = { -1, 0 };
 
 /*
  * Open a disk. If we're built for the host OS, check that it's a
  * System/161 disk image, and then ignore the header block.
  */
+static
 void
-opendisk(const char *path)
+doopen(struct disk *d, const char *path)
 {
 	struct stat statbuf;
 
-	assert(fd<0);
-	fd = open(path, O_RDWR);
-	if (fd<0) {
+	assert(d->fd<0);
+	d->fd = open(path, O_RDWR);
+	if (d->fd<0) {
 		err(1, "%s", path);
 	}
-	if (fstat(fd, &statbuf)) {
+	if (fstat(d->fd, &statbuf)) {
 		err(1, "%s: fstat", path);
 	}
 
-	nblocks = statbuf.st_size / BLOCKSIZE;
+	d->nblocks = statbuf.st_size / BLOCKSIZE;
 
 #ifdef HOST
-	nblocks--;
+	d->nblocks--;
 
 	{
 		char buf[64];
 		int len;
 
 		do {
-			len = read(fd, buf, sizeof(buf)-1);
+			len = read(d->fd, buf, sizeof(buf)-1);
 			if (len < 0 && (errno==EINTR || errno==EAGAIN)) {
 				continue;
 			}
@@ -94,49 +103,30 @@ opendisk(const char *path)
 #endif
 }
 
-/*
- * Return the block size. (This is fixed, but still...)
- */
-uint32_t
-diskblocksize(void)
-{
-	assert(fd>=0);
-	return BLOCKSIZE;
-}
-
-/*
- * Return the device/image size in blocks.
- */
-uint32_t
-diskblocks(void)
-{
-	assert(fd>=0);
-	return nblocks;
-}
-
 /*
  * Write a block.
  */
+static
 void
-diskwrite(const void *data, uint32_t block)
+dowrite(struct disk *d, const void *data, uint32_t block)
 {
 	const char *cdata = data;
 	uint32_t tot=0;
 	int len;
 
-	assert(fd>=0);
+	assert(d->fd>=0);
 
 #ifdef HOST
 	// skip over disk file header
 	block++;
 #endif
 
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
+	if (lseek(d->fd, block*BLOCKSIZE, SEEK_SET)<0) {
 		err(1, "lseek");
 	}
 
 	while (tot < BLOCKSIZE) {
-		len = write(fd, cdata + tot, BLOCKSIZE - tot);
+		len = write(d->fd, cdata + tot, BLOCKSIZE - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -153,26 +143,27 @@ diskwrite(const void *data, uint32_t block)
 /*
  * Read a block.
  */
+static
 void
-diskread(void *data, uint32_t block)
+doread(struct disk *d, void *data, uint32_t block)
 {
 	char *cdata = data;
 	uint32_t tot=0;
 	int len;
 
-	assert(fd>=0);
+	assert(d->fd>=0);
 
 #ifdef HOST
 	// skip over disk file header
 	block++;
 #endif
 
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
+	if (lseek(d->fd, block*BLOCKSIZE, SEEK_SET)<0) {
 		err(1, "lseek");
 	}
 
 	while (tot < BLOCKSIZE) {
-		len = read(fd, cdata + tot, BLOCKSIZE - tot);
+		len = read(d->fd, cdata + tot, BLOCKSIZE - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -187,14 +178,96 @@ diskread(void *data, uint32_t block)
 }
 
 /*
- * Close the disk.
+ * Close a disk.
  */
+static
 void
-closedisk(void)
+doclose(struct disk *d)
 {
-	assert(fd>=0);
-	if (close(fd)) {
+	assert(d->fd>=0);
+	if (close(d->fd)) {
 		err(1, "close");
 	}
-	fd = -1;
+	d->fd = -1;
+}
+
+////////////////////////////////////////////////////////////
+// the disk
+
+void
+opendisk(const char *path)
+{
+	doopen(&maindisk, path);
+}
+
+/*
+ * Return the block size. (This is fixed, but still...)
+ */
+uint32_t
+diskblocksize(void)
+{
+	assert(maindisk.fd>=0);
+	return BLOCKSIZE;
+}
+
+/*
+ * Return the device/image size in blocks.
+ */
+uint32_t
+diskblocks(void)
+{
+	assert(maindisk.fd>=0);
+	return maindisk.nblocks;
+}
+
+void
+diskwrite(const void *data, uint32_t block)
+{
+	dowrite(&maindisk, data, block);
+}
+
+void
+diskread(void *data, uint32_t block)
+{
+	doread(&maindisk, data, block);
+}
+
+void
+closedisk(void)
+{
+	doclose(&maindisk);
+}
+
+////////////////////////////////////////////////////////////
+// the external journal disk
+
+void
+openjdisk(const char *path)
+{
+	doopen(&jdisk, path);
+}
+
+uint32_t
+jdiskblocks(void)
+{
+	assert(jdisk.fd>=0);
+	return jdisk.nblocks;
+}
+
+void
+jdiskwrite(const void *data, uint32_t block)
+{
+	dowrite(&jdisk, data, block);
+}
+
+void
+jdiskread(void *data, uint32_t block)
+{
+	doread(&jdisk, data, block);
+}
+
+void
+closejdisk(void)
+{
+	doclose(&jdisk);
 }
@@ -36,3 +36,13 @@ void diskwrite(const void *data, uint32_t block);
 void diskread(void *data, uint32_t block);
 
 void closedisk(void);
+
+/*
+ * The same for a second disk holding an external journal. Block
+ * numbers are on that disk.
+ */
+void openjdisk(const char *path);
+uint32_t jdiskblocks(void);
+void jdiskwrite(const void *data, uint32_t block);
+void jdiskread(void *data, uint32_t block);
+void closejdisk(void);
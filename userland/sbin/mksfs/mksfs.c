@@ -29,7 +29,10 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <assert.h>
 #include <limits.h>
 #include <err.h>
@@ -66,6 +69,10 @@ static uint32_t rootdir_data_block;
 /* Journal location and size */
 static uint32_t journalstart, journalblocks;
 
+/* External journal device name (OS/161 name, e.g. lhd1), or NULL */
+static const char *jdevname;
+static uint32_t jdevid;
+
 /* Free block bitmap */
 static char freemapbuf[MAXFREEMAPBLOCKS * SFS_BLOCKSIZE];
 
@@ -79,6 +86,7 @@ check(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_jdevheader)==SFS_BLOCKSIZE);
 }
 
 /*
@@ -120,15 +128,26 @@ initfreemap(uint32_t fsblocks)
 		allocblock(SFS_FREEMAP_START + i);
 	}
 
-	/* journal goes after the freemap */
-	journalstart = SFS_FREEMAP_START + freemapblocks;
-	journalblocks = fsblocks / 20;
-	for (i=0; i<journalblocks; i++) {
-		allocblock(journalstart + i);
+	if (jdevname != NULL) {
+		/*
+		 * External journal: it takes up the whole journal
+		 * device, and is numbered from just past our end.
+		 */
+		journalstart = fsblocks;
+		journalblocks = jdiskblocks() - SFS_JDEV_START;
+		rootdir_data_block = SFS_FREEMAP_START + freemapblocks;
+	}
+	else {
+		/* journal goes after the freemap */
+		journalstart = SFS_FREEMAP_START + freemapblocks;
+		journalblocks = fsblocks / 20;
+		for (i=0; i<journalblocks; i++) {
+			allocblock(journalstart + i);
+		}
+		rootdir_data_block = journalstart + journalblocks;
 	}
 
 	/* allocate a block for the root directory contents */
-	rootdir_data_block = journalstart + journalblocks;
 	allocblock(rootdir_data_block);
 
 	/* all blocks in the freemap but past the volume end are "in use" */
@@ -159,11 +178,34 @@ writesuper(const char *volname, uint32_t nblocks)
 	strcpy(sb.sb_volname, volname);
 	sb.sb_journalstart = SWAP32(journalstart);
 	sb.sb_journalblocks = SWAP32(journalblocks);
+	sb.sb_features = SWAP32(SFS_FEATURE_INLINE);
+	if (jdevname != NULL) {
+		strcpy(sb.sb_jdevname, jdevname);
+		sb.sb_jdevid = SWAP32(jdevid);
+	}
 
 	/* and write it out. */
 	diskwrite(&sb, SFS_SUPER_BLOCK);
 }
 
+/*
+ * Write the header block of an external journal device.
+ */
+static
+void
+writejdevheader(const char *volname)
+{
+	struct sfs_jdevheader jd;
+
+	bzero((void *)&jd, sizeof(jd));
+	jd.jd_magic = SWAP32(SFS_JDEV_MAGIC);
+	jd.jd_devid = SWAP32(jdevid);
+	jd.jd_journalblocks = SWAP32(journalblocks);
+	strcpy(jd.jd_volname, volname);
+
+	jdiskwrite(&jd, SFS_JDEV_HEADER);
+}
+
 /*
  * Write out the free block bitmap.
  */
@@ -217,6 +259,21 @@ writerootdir(void)
 	diskwrite(sfd, rootdir_data_block);
 }
 
+/*
+ * Write a journal block, wherever the journal is.
+ */
+static
+void
+journalwrite(const void *data, uint32_t jblock)
+{
+	if (jdevname != NULL) {
+		jdiskwrite(data, SFS_JDEV_START + jblock);
+	}
+	else {
+		diskwrite(data, journalstart + jblock);
+	}
+}
+
 /*
  * Write out the journal.
  */
@@ -234,7 +291,7 @@ writejournal(void)
 
 	/* Zero all of the journal but the first block */
 	for (i=1; i<journalblocks; i++) {
-		diskwrite(block, journalstart + i);
+		journalwrite(block, i);
 	}
 
 	/* and write a trim record into the first block */
@@ -257,7 +314,7 @@ writejournal(void)
 	hdr.jh_coninfo = SWAP64(coninfo);
 	memcpy(block + sizeof(hdr) + sizeof(rec), &hdr, sizeof(hdr));
 
-	diskwrite(block, journalstart);
+	journalwrite(block, 0);
 }
 
 /*
@@ -268,17 +325,64 @@ main(int argc, char **argv)
 {
 	uint32_t size, blocksize;
 	char *volname, *s;
+	char *jdevspec, *jdevpath;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	/*
+	 * -j name[=path] puts the journal on a separate device. NAME
+	 * is the device's name under OS/161 (e.g. lhd1), which is
+	 * recorded in the superblock; PATH is what to open to write
+	 * it, and defaults to NAMEraw:.
+	 */
+	jdevspec = NULL;
+	if (argc > 1 && !strcmp(argv[1], "-j")) {
+		if (argc < 3) {
+			errx(1, "-j needs a device name");
+		}
+		jdevspec = argv[2];
+		argc -= 2;
+		argv += 2;
+	}
+
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		errx(1, "Usage: mksfs [-j journaldev[=path]] "
+		     "device/diskfile volume-name");
 	}
 
 	check();
 
+	jdevpath = NULL;
+	if (jdevspec != NULL) {
+		s = strchr(jdevspec, '=');
+		if (s != NULL) {
+			*s = 0;
+			jdevpath = s + 1;
+		}
+		/* Remove one trailing colon from the name, as for volname */
+		s = strchr(jdevspec, ':');
+		if (s != NULL && strlen(s) == 1) {
+			*s = 0;
+		}
+		if (*jdevspec == 0 || strlen(jdevspec) >= SFS_VOLNAME_SIZE ||
+		    strchr(jdevspec, ':') != NULL ||
+		    strchr(jdevspec, '/') != NULL) {
+			errx(1, "Illegal journal device name %s", jdevspec);
+		}
+		if (jdevpath == NULL) {
+			jdevpath = malloc(strlen(jdevspec) + 5);
+			if (jdevpath == NULL) {
+				errx(1, "Out of memory");
+			}
+			strcpy(jdevpath, jdevspec);
+			strcat(jdevpath, "raw:");
+		}
+		jdevname = jdevspec;
+		jdevid = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+	}
+
 	volname = argv[2];
 
 	/* Remove one trailing colon from volname, if present */
@@ -305,13 +409,26 @@ main(int argc, char **argv)
 	}
 	size = diskblocks();
 
+	if (jdevname != NULL) {
+		openjdisk(jdevpath);
+		if (jdiskblocks() < SFS_JDEV_START + 8) {
+			errx(1, "%s: Too small for a journal", jdevpath);
+		}
+	}
+
 	/* Write out the on-disk structures */
 	initfreemap(size);
 	writesuper(volname, size);
 	writefreemap(size);
+	if (jdevname != NULL) {
+		writejdevheader(volname);
+	}
     writejournal();
 	writerootdir();
 
+	if (jdevname != NULL) {
+		closejdisk();
+	}
 	closedisk();
 
 	return 0;
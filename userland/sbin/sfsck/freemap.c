@@ -76,9 +76,11 @@ freemap_setup(void)
 		freemap_blockinuse(i, B_PASTEND, 0);
 	}
 
-	/* Mark off the blocks that are in the journal */
-	for (i=0; i<jblocks; i++) {
-		freemap_blockinuse(jstart + i, B_JOURNAL, i);
+	/* Mark off the blocks that are in the journal, if it's ours */
+	if (sb_journaldev() == NULL) {
+		for (i=0; i<jblocks; i++) {
+			freemap_blockinuse(jstart + i, B_JOURNAL, i);
+		}
 	}
 
 	/* Mark the superblock block and the freemap blocks in use */
@@ -119,6 +121,10 @@ blockusagestr(blockusage_t how, uint32_t howdesc)
 		snprintf(rv, sizeof(rv), "directory data from inode %lu",
 			 (unsigned long) howdesc);
 		break;
+	    case B_DIRINDEX:
+		snprintf(rv, sizeof(rv), "directory index from inode %lu",
+			 (unsigned long) howdesc);
+		break;
 	    case B_DATA:
 		snprintf(rv, sizeof(rv), "file data from inode %lu",
 			 (unsigned long) howdesc);
@@ -187,6 +193,27 @@ freemap_blockfree(uint32_t block)
 	tofreedata[index] |= mask;
 }
 
+/*
+ * Undo freemap_blockinuse for a block whose user we've decided to
+ * drop after all (e.g. a directory index that pass 2 throws away),
+ * so it gets freed.
+ */
+void
+freemap_blockunuse(uint32_t block)
+{
+	unsigned index = block/8;
+	uint8_t mask = ((uint8_t)1)<<(block%8);
+
+	if ((freemapdata[index] & mask) == 0) {
+		/* already given back (listed twice) */
+		return;
+	}
+	freemapdata[index] &= ~mask;
+	tofreedata[index] |= mask;
+	assert(blocksinuse > 0);
+	blocksinuse--;
+}
+
 /*
  * Count the number of bits set.
  */
@@ -230,8 +257,9 @@ reportfreemap(uint32_t mapblock, uint32_t byte, uint8_t val, const char *what)
 /*
  * Scan the freemap.
  *
- * This is called after (at the end of) pass 1, when we've recursively
- * found all the reachable blocks and marked them.
+ * This is called after pass 2, when we've recursively found all the
+ * reachable blocks and marked them, and pass 2 has taken back any it
+ * decided to drop.
  */
 void
 freemap_check(void)
@@ -313,7 +341,7 @@ freemap_check(void)
 
 /*
  * Return the total number of blocks in use, which we count during
- * pass 1.
+ * pass 1 (less any pass 2 gives back).
  */
 unsigned long
 freemap_blocksused(void)
@@ -45,6 +45,7 @@ typedef enum {
 	B_INODE,	/* Block that is an inode */
 	B_IBLOCK,	/* Indirect (or doubly-indirect etc.) block */
 	B_DIRDATA,	/* Data block of a directory */
+	B_DIRINDEX,	/* Hashed index block of a directory */
 	B_DATA,		/* Data block */
 	B_PASTEND,	/* Block off the end of the fs */
 } blockusage_t;
@@ -58,6 +59,9 @@ void freemap_blockinuse(uint32_t block, blockusage_t how, uint32_t howdesc);
 /* Note that a block has been found where it should be dropped. */
 void freemap_blockfree(uint32_t block);
 
+/* Take back freemap_blockinuse for a block whose user is dropped. */
+void freemap_blockunuse(uint32_t block);
+
 /* Call this after all checks that call freemap_block{inuse,free}. */
 void freemap_check(void);
 
@@ -30,6 +30,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <err.h>
 
 #include "compat.h"
@@ -64,13 +65,25 @@ setbadness(int code)
 int
 main(int argc, char **argv)
 {
+	const char *jdevpath = NULL;
+
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	/* -j path names the external journal device, if not the default */
+	if (argc > 1 && !strcmp(argv[1], "-j")) {
+		if (argc < 3) {
+			errx(EXIT_USAGE, "-j needs a path");
+		}
+		jdevpath = argv[2];
+		argc -= 2;
+		argv += 2;
+	}
+
 	/* FUTURE: add -n option */
 	if (argc!=2) {
-		errx(EXIT_USAGE, "Usage: sfsck device/diskfile");
+		errx(EXIT_USAGE, "Usage: sfsck [-j journaldev] device/diskfile");
 	}
 
 	opendisk(argv[1]);
@@ -78,19 +91,23 @@ main(int argc, char **argv)
 	sfs_setup();
 	sb_load();
 	sb_check();
+	sb_checkjournaldev(jdevpath);
 	freemap_setup();
 
 	printf("Phase 1 -- check blocks and sizes\n");
 	pass1();
-	freemap_check();
 
 	printf("Phase 2 -- check directory tree\n");
 	inode_sorttable();
 	pass2();
+	freemap_check();
 
 	printf("Phase 3 -- check reference counts\n");
 	inode_adjust_filelinks();
 
+	if (sb_journaldev() != NULL) {
+		closejdisk();
+	}
 	closedisk();
 
 	warnx("%lu blocks used (of %lu); %lu directories; %lu files",
@@ -193,7 +193,13 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 
 	ibs.ino = ino;
 	/*ibs.curfileblock = 0;*/
-	ibs.fileblocks = size/SFS_BLOCKSIZE;
+	/* An inline file has no blocks at all */
+	if (sfi->sfi_flags & SFS_DINODE_INLINE) {
+		ibs.fileblocks = 0;
+	}
+	else {
+		ibs.fileblocks = size/SFS_BLOCKSIZE;
+	}
 	ibs.volblocks = sb_totalblocks();
 	ibs.pasteofcount = 0;
 	ibs.usagetype = isdir ? B_DIRDATA : B_DATA;
@@ -247,6 +253,142 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	return changed;
 }
 
+/*
+ * Check the directory index of inode INO, which has already been
+ * loaded into SFI, and record the blocks it uses. Files shouldn't
+ * have one. The contents of the hash table are checked in pass 2,
+ * after the directory itself has been fixed.
+ *
+ * Returns nonzero if SFI has been modified and needs to be written
+ * back.
+ */
+static
+int
+check_inode_dirindex(uint32_t ino, struct sfs_dinode *sfi, int isdir)
+{
+	struct sfs_dirindex_header dh;
+	uint32_t volblocks, i;
+	const char *bad = NULL;
+
+	if (sfi->sfi_dirindex == 0) {
+		return 0;
+	}
+	if (!isdir) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: file has a directory index (cleared)",
+		      (unsigned long) ino);
+		sfi->sfi_dirindex = 0;
+		return 1;
+	}
+
+	volblocks = sb_totalblocks();
+	if (sfi->sfi_dirindex >= volblocks) {
+		bad = "outside of volume";
+	}
+	else {
+		sfs_readdirindex(sfi->sfi_dirindex, &dh);
+		if (dh.dh_magic != SFS_DIRINDEX_MAGIC) {
+			bad = "has bad magic number";
+		}
+		else if (dh.dh_nblocks == 0 ||
+			 dh.dh_nblocks > SFS_DIRINDEX_MAXBLOCKS) {
+			bad = "has bad size";
+		}
+		else if (dh.dh_nfree > SFS_DIRINDEX_NFREE) {
+			bad = "has bad free slot count";
+		}
+		else {
+			for (i=0; i<dh.dh_nblocks; i++) {
+				if (dh.dh_blocks[i] == 0 ||
+				    dh.dh_blocks[i] >= volblocks) {
+					bad = "has bad table block";
+					break;
+				}
+			}
+		}
+	}
+	if (bad != NULL) {
+		/* Any blocks it had are leaked, so the freemap check frees them */
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: directory index %s (cleared)",
+		      (unsigned long) ino, bad);
+		sfi->sfi_dirindex = 0;
+		return 1;
+	}
+
+	freemap_blockinuse(sfi->sfi_dirindex, B_DIRINDEX, ino);
+	for (i=0; i<dh.dh_nblocks; i++) {
+		freemap_blockinuse(dh.dh_blocks[i], B_DIRINDEX, ino);
+	}
+	return 0;
+}
+
+/*
+ * Check the flags and inline data area of inode INO, which has
+ * already been loaded into SFI. This is done before checking the
+ * blocks, since an inline file shouldn't have any.
+ *
+ * Returns nonzero if SFI has been modified and needs to be written
+ * back.
+ */
+static
+int
+check_inode_inline(uint32_t ino, struct sfs_dinode *sfi, int isdir)
+{
+	int changed = 0;
+
+	if (sfi->sfi_flags & ~SFS_DINODE_FLAGS_KNOWN) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: unknown flags 0x%lx (cleared)",
+		      (unsigned long) ino,
+		      (unsigned long)(sfi->sfi_flags &
+				      ~SFS_DINODE_FLAGS_KNOWN));
+		sfi->sfi_flags &= SFS_DINODE_FLAGS_KNOWN;
+		changed = 1;
+	}
+
+	if (isdir && (sfi->sfi_flags & SFS_DINODE_INLINE)) {
+		/* Directories always use blocks, so it's just a stray bit */
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: directory marked inline (cleared)",
+		      (unsigned long) ino);
+		sfi->sfi_flags &= ~SFS_DINODE_INLINE;
+		changed = 1;
+	}
+
+	if ((sfi->sfi_flags & SFS_DINODE_INLINE) == 0) {
+		if (checkzeroed(sfi->sfi_inline, sizeof(sfi->sfi_inline))) {
+			warnx("Inode %lu: inline data area not zeroed (fixed)",
+			      (unsigned long) ino);
+			setbadness(EXIT_RECOV);
+			changed = 1;
+		}
+		return changed;
+	}
+
+	if (!sb_hasfeature(SFS_FEATURE_INLINE)) {
+		warnx("Inode %lu: inline file, but volume does not have "
+		      "the inline feature (fixed)", (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		sb_addfeature(SFS_FEATURE_INLINE);
+	}
+	if (sfi->sfi_size > SFS_INLINE_SIZE) {
+		warnx("Inode %lu: inline file size %lu too large (fixed)",
+		      (unsigned long) ino, (unsigned long) sfi->sfi_size);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_size = SFS_INLINE_SIZE;
+		changed = 1;
+	}
+	if (checkzeroed(sfi->sfi_inline + sfi->sfi_size,
+			SFS_INLINE_SIZE - sfi->sfi_size)) {
+		warnx("Inode %lu: inline data past EOF not zeroed (fixed)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+	return changed;
+}
+
 /*
  * Do the pass1 inode-level checks on inode INO, which has already
  * been loaded into SFI. Note that sfi_type has already been
@@ -270,10 +412,7 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 
 	freemap_blockinuse(ino, B_INODE, ino);
 
-	if (checkzeroed(sfi->sfi_waste, sizeof(sfi->sfi_waste))) {
-		warnx("Inode %lu: sfi_waste section not zeroed (fixed)",
-		      (unsigned long) ino);
-		setbadness(EXIT_RECOV);
+	if (check_inode_inline(ino, sfi, isdir)) {
 		changed = 1;
 	}
 
@@ -281,6 +420,10 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 		changed = 1;
 	}
 
+	if (check_inode_dirindex(ino, sfi, isdir)) {
+		changed = 1;
+	}
+
 	if (changed) {
 		sfs_writeinode(ino, sfi);
 	}
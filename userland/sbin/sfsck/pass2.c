@@ -47,6 +47,158 @@
 #include "passes.h"
 #include "main.h"
 
+/*
+ * Look up entry SLOT of a directory in the hash table TABLE, which
+ * has CAP cells. Returns nonzero if it's there.
+ */
+static
+int
+dirindex_present(struct sfs_dirindex_entry *table, uint32_t cap,
+		 uint32_t hash, uint32_t slot)
+{
+	uint32_t pos, n;
+
+	pos = hash % cap;
+	for (n=0; n<cap; n++) {
+		if (table[pos].de_slot == SFS_DIRINDEX_EMPTY) {
+			return 0;
+		}
+		if (table[pos].de_slot == slot + 1) {
+			return table[pos].de_hash == hash;
+		}
+		pos = (pos + 1) % cap;
+	}
+	return 0;
+}
+
+/*
+ * Check the hashed index of a directory against the (already fixed)
+ * entries in DIRENTRIES, and rebuild it in place if it doesn't match.
+ * Pass 1 has already checked the header and claimed its blocks. If
+ * the entries no longer fit, the index is dropped and its blocks are
+ * given back to the freemap (which is checked after this pass).
+ *
+ * Returns nonzero if SFI has been modified and needs to be written
+ * back.
+ */
+static
+int
+pass2_dirindex(struct sfs_dinode *sfi, struct sfs_direntry *direntries,
+	       uint32_t ndirentries, const char *pathsofar)
+{
+	struct sfs_dirindex_header dh;
+	struct sfs_dirindex_entry *table, *de;
+	uint32_t cap, live, used, i, pos, slot;
+	int bad = 0;
+
+	if (sfi->sfi_dirindex == 0) {
+		return 0;
+	}
+
+	sfs_readdirindex(sfi->sfi_dirindex, &dh);
+	cap = dh.dh_nblocks * SFS_DIRINDEX_PERBLOCK;
+	table = domalloc(cap * sizeof(*table));
+	for (i=0; i<dh.dh_nblocks; i++) {
+		sfs_readdirindextable(dh.dh_blocks[i],
+				      table + i*SFS_DIRINDEX_PERBLOCK);
+	}
+
+	/* Every cell in use must name a live entry with that hash... */
+	live = used = 0;
+	for (i=0; i<cap && !bad; i++) {
+		de = &table[i];
+		if (de->de_slot == SFS_DIRINDEX_EMPTY) {
+			continue;
+		}
+		used++;
+		if (de->de_slot == SFS_DIRINDEX_DELETED) {
+			continue;
+		}
+		live++;
+		slot = de->de_slot - 1;
+		if (slot >= ndirentries ||
+		    direntries[slot].sfd_ino == SFS_NOINO ||
+		    sfsdir_hash(direntries[slot].sfd_name) != de->de_hash) {
+			bad = 1;
+		}
+	}
+	if (live != dh.dh_count || used != dh.dh_used) {
+		bad = 1;
+	}
+
+	/* ...and every live entry must be findable. */
+	for (i=0; i<ndirentries && !bad; i++) {
+		if (direntries[i].sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		if (!dirindex_present(table, cap,
+				      sfsdir_hash(direntries[i].sfd_name), i)) {
+			bad = 1;
+		}
+	}
+
+	/* The remembered free slots must be free. */
+	for (i=0; i<dh.dh_nfree && !bad; i++) {
+		if (dh.dh_free[i] >= ndirentries ||
+		    direntries[dh.dh_free[i]].sfd_ino != SFS_NOINO) {
+			bad = 1;
+		}
+	}
+
+	if (!bad) {
+		free(table);
+		return 0;
+	}
+
+	setbadness(EXIT_RECOV);
+
+	live = 0;
+	for (i=0; i<ndirentries; i++) {
+		if (direntries[i].sfd_ino != SFS_NOINO) {
+			live++;
+		}
+	}
+	if (live * 4 > cap * 3) {
+		warnx("Directory %s: Index out of date and too small "
+		      "(removed)", pathsofar);
+		free(table);
+		for (i=0; i<dh.dh_nblocks; i++) {
+			freemap_blockunuse(dh.dh_blocks[i]);
+		}
+		freemap_blockunuse(sfi->sfi_dirindex);
+		sfi->sfi_dirindex = 0;
+		return 1;
+	}
+
+	warnx("Directory %s: Index out of date (rebuilt)", pathsofar);
+	bzero(table, cap * sizeof(*table));
+	dh.dh_count = dh.dh_used = dh.dh_nfree = 0;
+	for (i=0; i<ndirentries; i++) {
+		if (direntries[i].sfd_ino == SFS_NOINO) {
+			if (dh.dh_nfree < SFS_DIRINDEX_NFREE) {
+				dh.dh_free[dh.dh_nfree++] = i;
+			}
+			continue;
+		}
+		pos = sfsdir_hash(direntries[i].sfd_name) % cap;
+		while (table[pos].de_slot != SFS_DIRINDEX_EMPTY) {
+			pos = (pos + 1) % cap;
+		}
+		table[pos].de_hash = sfsdir_hash(direntries[i].sfd_name);
+		table[pos].de_slot = i + 1;
+		dh.dh_count++;
+		dh.dh_used++;
+	}
+	for (i=0; i<dh.dh_nblocks; i++) {
+		sfs_writedirindextable(dh.dh_blocks[i],
+				       table + i*SFS_DIRINDEX_PERBLOCK);
+	}
+	sfs_writedirindex(sfi->sfi_dirindex, &dh);
+
+	free(table);
+	return 0;
+}
+
 /*
  * Process a directory. INO is the inode number; PARENTINO is the
  * parent's inode number; PATHSOFAR is the path to this directory.
@@ -297,6 +449,14 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		ichanged = 1;
 	}
 
+	/*
+	 * Check the hashed index, now that the entries are final.
+	 */
+
+	if (pass2_dirindex(&sfi, direntries, ndirentries, pathsofar)) {
+		ichanged = 1;
+	}
+
 	/*
 	 * Write back anything that changed, clean up, and return.
 	 */
@@ -30,12 +30,15 @@
 #include <sys/types.h>	/* for CHAR_BIT */
 #include <limits.h>	/* also for CHAR_BIT */
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include <err.h>
 
 #include "compat.h"
 #include <kern/sfs.h>
 
+#include "disk.h"
 #include "utils.h"
 #include "sfs.h"
 #include "sb.h"
@@ -83,18 +86,50 @@ sb_check(void)
 		setbadness(EXIT_RECOV);
 		schanged = 1;
 	}
-	if (sb.sb_journalstart <
-	    SFS_FREEMAP_START + SFS_FREEMAPBLOCKS(sb.sb_nblocks)) {
-		warnx("Journal begins at illegal block %lu (NOT FIXED)",
-		      (unsigned long)sb.sb_journalstart);
-		setbadness(EXIT_UNRECOV);
+	if (checknullstring(sb.sb_jdevname, sizeof(sb.sb_jdevname))) {
+		warnx("Journal device name not null-terminated (fixed)");
+		setbadness(EXIT_RECOV);
+		schanged = 1;
 	}
-	if (sb.sb_journalstart + sb.sb_journalblocks < sb.sb_journalstart) {
-		warnx("Journal extends past block 0xffffffff (NOT FIXED)");
-		setbadness(EXIT_UNRECOV);
+	if (sb.sb_jdevname[0] != 0) {
+		/* External journal; numbered from the end of the volume */
+		if (sb.sb_journalstart != sb.sb_nblocks) {
+			warnx("External journal begins at illegal block %lu "
+			      "(NOT FIXED)",
+			      (unsigned long)sb.sb_journalstart);
+			setbadness(EXIT_UNRECOV);
+		}
+	}
+	else {
+		if (sb.sb_journalstart <
+		    SFS_FREEMAP_START + SFS_FREEMAPBLOCKS(sb.sb_nblocks)) {
+			warnx("Journal begins at illegal block %lu "
+			      "(NOT FIXED)",
+			      (unsigned long)sb.sb_journalstart);
+			setbadness(EXIT_UNRECOV);
+		}
+		if (sb.sb_journalstart + sb.sb_journalblocks <
+		    sb.sb_journalstart) {
+			warnx("Journal extends past block 0xffffffff "
+			      "(NOT FIXED)");
+			setbadness(EXIT_UNRECOV);
+		}
+		if (sb.sb_journalstart + sb.sb_journalblocks >=
+		    sb.sb_nblocks) {
+			warnx("Journal extends past volume end (NOT FIXED)");
+			setbadness(EXIT_UNRECOV);
+		}
+		if (sb.sb_jdevid != 0) {
+			warnx("Journal device id set without a journal "
+			      "device (fixed)");
+			setbadness(EXIT_RECOV);
+			sb.sb_jdevid = 0;
+			schanged = 1;
+		}
 	}
-	if (sb.sb_journalstart + sb.sb_journalblocks >= sb.sb_nblocks) {
-		warnx("Journal extends past volume end (NOT FIXED)");
+	if (sb.sb_features & ~SFS_FEATURES_KNOWN) {
+		warnx("Unknown features 0x%lx in superblock (NOT FIXED)",
+		      (unsigned long)(sb.sb_features & ~SFS_FEATURES_KNOWN));
 		setbadness(EXIT_UNRECOV);
 	}
 	if (checkzeroed(sb.reserved, sizeof(sb.reserved))) {
@@ -109,6 +144,55 @@ sb_check(void)
 	}
 }
 
+/*
+ * Open and check the external journal device.
+ *
+ * Any mismatch here is unrecoverable: the kernel will refuse to
+ * mount, and we don't know enough to pick the right device.
+ */
+void
+sb_checkjournaldev(const char *path)
+{
+	struct sfs_jdevheader jd;
+	char pathbuf[SFS_VOLNAME_SIZE + 8];
+
+	if (sb.sb_jdevname[0] == 0) {
+		return;
+	}
+	if (path == NULL) {
+		snprintf(pathbuf, sizeof(pathbuf), "%sraw:", sb.sb_jdevname);
+		path = pathbuf;
+	}
+	openjdisk(path);
+
+	sfs_readjdevheader(&jd);
+	if (jd.jd_magic != SFS_JDEV_MAGIC) {
+		errx(EXIT_FATAL, "%s: Not an sfs journal device", path);
+	}
+	if (jd.jd_devid != sb.sb_jdevid) {
+		errx(EXIT_FATAL, "%s: Journal device belongs to a different "
+		     "volume", path);
+	}
+	if (checknullstring(jd.jd_volname, sizeof(jd.jd_volname)) ||
+	    strcmp(jd.jd_volname, sb.sb_volname) != 0) {
+		warnx("Journal device volume name does not match "
+		      "(NOT FIXED)");
+		setbadness(EXIT_UNRECOV);
+	}
+	if (jd.jd_journalblocks != sb.sb_journalblocks) {
+		warnx("Journal device size %lu does not match superblock "
+		      "size %lu (NOT FIXED)",
+		      (unsigned long)jd.jd_journalblocks,
+		      (unsigned long)sb.sb_journalblocks);
+		setbadness(EXIT_UNRECOV);
+	}
+	if (SFS_JDEV_START + sb.sb_journalblocks > jdiskblocks()) {
+		warnx("Journal extends past end of journal device "
+		      "(NOT FIXED)");
+		setbadness(EXIT_UNRECOV);
+	}
+}
+
 /*
  * Return the total number of blocks in the volume.
  */
@@ -154,3 +238,36 @@ sb_journalblocks(void)
 {
 	return sb.sb_journalblocks;
 }
+
+/*
+ * Return the external journal device name, or NULL if the journal
+ * is on the volume itself.
+ */
+const char *
+sb_journaldev(void)
+{
+	return sb.sb_jdevname[0] != 0 ? sb.sb_jdevname : NULL;
+}
+
+/*
+ * Check whether a feature flag is set.
+ */
+int
+sb_hasfeature(uint32_t feature)
+{
+	return (sb.sb_features & feature) != 0;
+}
+
+/*
+ * Turn on a feature flag, because something on the volume uses it,
+ * and write the superblock back.
+ */
+void
+sb_addfeature(uint32_t feature)
+{
+	if ((sb.sb_features & feature) == feature) {
+		return;
+	}
+	sb.sb_features |= feature;
+	sfs_writesb(SFS_SUPER_BLOCK, &sb);
+}
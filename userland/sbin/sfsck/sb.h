@@ -53,7 +53,21 @@ const char *sb_volname(void);
 uint32_t sb_journalstart(void);
 uint32_t sb_journalblocks(void);
 
+/* After the superblock is loaded: external journal device name, or NULL. */
+const char *sb_journaldev(void);
+
+/* After the superblock is loaded: check or turn on SFS_FEATURE_* flags. */
+int sb_hasfeature(uint32_t feature);
+void sb_addfeature(uint32_t feature);
+
 /* Check the superblock. Must load it first. */
 void sb_check(void);
 
+/*
+ * Open and check the external journal device, if there is one. PATH
+ * may be NULL to use the device named in the superblock. Call after
+ * sb_check.
+ */
+void sb_checkjournaldev(const char *path);
+
 #endif /* SB_H */
@@ -51,6 +51,7 @@ sfs_setup(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_dirindex_header)==SFS_BLOCKSIZE);
 }
 
 ////////////////////////////////////////////////////////////
@@ -64,6 +65,22 @@ swapsb(struct sfs_superblock *sb)
 	sb->sb_nblocks = SWAP32(sb->sb_nblocks);
 	sb->sb_journalstart = SWAP32(sb->sb_journalstart);
 	sb->sb_journalblocks = SWAP32(sb->sb_journalblocks);
+	sb->sb_jhintheadlsn = SWAP64(sb->sb_jhintheadlsn);
+	sb->sb_jhinttaillsn = SWAP64(sb->sb_jhinttaillsn);
+	sb->sb_jhinthead = SWAP32(sb->sb_jhinthead);
+	sb->sb_jhinttail = SWAP32(sb->sb_jhinttail);
+	sb->sb_jhintmagic = SWAP32(sb->sb_jhintmagic);
+	sb->sb_jdevid = SWAP32(sb->sb_jdevid);
+	sb->sb_features = SWAP32(sb->sb_features);
+}
+
+static
+void
+swapjdevheader(struct sfs_jdevheader *jd)
+{
+	jd->jd_magic = SWAP32(jd->jd_magic);
+	jd->jd_devid = SWAP32(jd->jd_devid);
+	jd->jd_journalblocks = SWAP32(jd->jd_journalblocks);
 }
 
 static
@@ -99,6 +116,9 @@ swapinode(struct sfs_dinode *sfi)
 	for (i=0; i<NUM_III; i++) {
 		SET_III(sfi, i) = SWAP32(GET_III(sfi, i));
 	}
+
+	sfi->sfi_dirindex = SWAP32(sfi->sfi_dirindex);
+	sfi->sfi_flags = SWAP32(sfi->sfi_flags);
 }
 
 static
@@ -108,6 +128,37 @@ swapdir(struct sfs_direntry *sfd)
 	sfd->sfd_ino = SWAP32(sfd->sfd_ino);
 }
 
+static
+void
+swapdirindex(struct sfs_dirindex_header *dh)
+{
+	int i;
+
+	dh->dh_magic = SWAP32(dh->dh_magic);
+	dh->dh_nblocks = SWAP32(dh->dh_nblocks);
+	dh->dh_count = SWAP32(dh->dh_count);
+	dh->dh_used = SWAP32(dh->dh_used);
+	dh->dh_nfree = SWAP32(dh->dh_nfree);
+	for (i=0; i<SFS_DIRINDEX_NFREE; i++) {
+		dh->dh_free[i] = SWAP32(dh->dh_free[i]);
+	}
+	for (i=0; i<SFS_DIRINDEX_MAXBLOCKS; i++) {
+		dh->dh_blocks[i] = SWAP32(dh->dh_blocks[i]);
+	}
+}
+
+static
+void
+swapdirindextable(struct sfs_dirindex_entry *de)
+{
+	unsigned i;
+
+	for (i=0; i<SFS_DIRINDEX_PERBLOCK; i++) {
+		de[i].de_hash = SWAP32(de[i].de_hash);
+		de[i].de_slot = SWAP32(de[i].de_slot);
+	}
+}
+
 static
 void
 swapindir(uint32_t *entries)
@@ -208,6 +259,17 @@ sfs_writesb(uint32_t blocknum, struct sfs_superblock *sb)
 	swapsb(sb);
 }
 
+/*
+ * external journal device header
+ */
+
+void
+sfs_readjdevheader(struct sfs_jdevheader *jd)
+{
+	jdiskread(jd, SFS_JDEV_HEADER);
+	swapjdevheader(jd);
+}
+
 /*
  * freemap blocks - whichblock is a block number within the free block
  * bitmap.
@@ -266,6 +328,40 @@ sfs_writeindirect(uint32_t blocknum, uint32_t *entries)
 	swapindir(entries);
 }
 
+/*
+ * directory index blocks - blocknum is a disk block number.
+ */
+
+void
+sfs_readdirindex(uint32_t blocknum, struct sfs_dirindex_header *dh)
+{
+	diskread(dh, blocknum);
+	swapdirindex(dh);
+}
+
+void
+sfs_writedirindex(uint32_t blocknum, struct sfs_dirindex_header *dh)
+{
+	swapdirindex(dh);
+	diskwrite(dh, blocknum);
+	swapdirindex(dh);
+}
+
+void
+sfs_readdirindextable(uint32_t blocknum, struct sfs_dirindex_entry *de)
+{
+	diskread(de, blocknum);
+	swapdirindextable(de);
+}
+
+void
+sfs_writedirindextable(uint32_t blocknum, struct sfs_dirindex_entry *de)
+{
+	swapdirindextable(de);
+	diskwrite(de, blocknum);
+	swapdirindextable(de);
+}
+
 ////////////////////////////////////////////////////////////
 // directory I/O
 
@@ -444,6 +540,22 @@ sfsdir_sort(struct sfs_direntry *d, unsigned nd, int *vector)
 	qsort(vector, nd, sizeof(int), dirsortfunc);
 }
 
+/*
+ * Hash a name for the directory index. This must match the kernel's
+ * sfs_dirhash().
+ */
+uint32_t
+sfsdir_hash(const char *name)
+{
+	uint32_t hash = SFS_DIRINDEX_FNVBASIS;
+
+	while (*name != 0) {
+		hash ^= (unsigned char)*name++;
+		hash *= SFS_DIRINDEX_FNVPRIME;
+	}
+	return hash;
+}
+
 /*
  * Try to add an entry NAME/INO to D (which has ND entries) by
  * finding an empty slot. Cannot allocate new space.
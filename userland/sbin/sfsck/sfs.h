@@ -39,8 +39,11 @@
 #include <stdint.h>
 
 struct sfs_superblock;
+struct sfs_jdevheader;
 struct sfs_dinode;
 struct sfs_direntry;
+struct sfs_dirindex_header;
+struct sfs_dirindex_entry;
 
 /* Call this before anything else in this module */
 void sfs_setup(void);
@@ -53,6 +56,9 @@ void sfs_setup(void);
 void sfs_readsb(uint32_t blocknum, struct sfs_superblock *sb);
 void sfs_writesb(uint32_t blocknum, struct sfs_superblock *sb);
 
+/* external journal device header (journal device must be open) */
+void sfs_readjdevheader(struct sfs_jdevheader *jd);
+
 /* freemap blocks; whichblock is the freemap block number (starts at 0) */
 void sfs_readfreemapblock(uint32_t whichblock, uint8_t *bits);
 void sfs_writefreemapblock(uint32_t whichblock, uint8_t *bits);
@@ -70,6 +76,15 @@ void sfs_readdir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd);
 void sfs_writedir(const struct sfs_dinode *sfi,
 		  struct sfs_direntry *d, unsigned nd);
 
+/* directory index header and table blocks */
+void sfs_readdirindex(uint32_t blocknum, struct sfs_dirindex_header *dh);
+void sfs_writedirindex(uint32_t blocknum, struct sfs_dirindex_header *dh);
+void sfs_readdirindextable(uint32_t blocknum, struct sfs_dirindex_entry *de);
+void sfs_writedirindextable(uint32_t blocknum, struct sfs_dirindex_entry *de);
+
+/* Hash a name the way the directory index does. */
+uint32_t sfsdir_hash(const char *name);
+
 /* Try to add an entry to a directory. */
 int sfsdir_tryadd(struct sfs_direntry *d, int nd,
 		  const char *name, uint32_t ino);